@@ -287,6 +287,24 @@ static uint64_t getmicro_time() {
     return micros;
 }
 
+static int clone_bm(int argc, char **argv) {
+    uint64_t start_time = getmicro_time();
+    pid_t pid = sos_process_clone();
+    if (pid == 0) {
+        /* The clone, it only has to show that it runs */
+        printf("clone: child pid = %d\n", sos_my_id());
+        exit(0);
+    }
+    uint64_t end_time = getmicro_time();
+    if (pid < 0) {
+        printf("clone failed\n");
+        return 1;
+    }
+    printf("clone time taken = %llu microseconds\n", end_time - start_time);
+    sos_process_wait(pid);
+    return 0;
+}
+
 static int whoami(int argc, char **argv) {
     pid_t pid;
 
@@ -304,7 +322,7 @@ struct command commands[] = { { "dir", dir }, { "ls", dir }, { "cat", cat },
     { "cp", cp }, { "ps", ps }, { "exec", exec }, {"sleep",second_sleep},
     {"msleep",milli_sleep}, {"time", second_time}, {"mtime", micro_time},
     {"kill", kill}, {"bm", benchmark}, {"bm2", benchmark2}, {"thrash", thrash},
-    {"whoami", whoami} };
+    {"whoami", whoami}, {"clone", clone_bm} };
 
 static void test_file_syscalls(void) {
     printf("Start file syscalls test...\n");
@@ -561,6 +579,7 @@ int thrash(int argc, char *argv[]) {
 
     int mod = 'z' - 'a';
 
+    uint64_t start_time = getmicro_time();
     for(int i = 0; i < nbyte; i++){
         if (i % 1024 == 0) {
             printf("filling kbyte #%d\n", i >> 10);
@@ -569,7 +588,11 @@ int thrash(int argc, char *argv[]) {
         ch = (ch + 1) % mod + 'a';
     }
 
+    uint64_t end_time = getmicro_time();
+    printf("filling time taken: %lu\n", (long unsigned)(end_time - start_time));
+
     ch = argv[2][0];
+    start_time = getmicro_time();
     for (int i=0; i<nbyte; i++) {
         if (i % 1024 == 0) {
             printf("testing kbyte #%d\n", i >> 10);
@@ -577,6 +600,8 @@ int thrash(int argc, char *argv[]) {
         assert(big_buf[i] == ch);
         ch = (ch + 1) % mod + 'a';
     }
+    end_time = getmicro_time();
+    printf("testing time taken: %lu\n", (long unsigned)(end_time - start_time));
 
     //free(big_buf);
     return 0;
@@ -9,6 +9,7 @@
 
 #include "tool/utility.h"
 #include "dev/console.h"
+#include "dev/serial_tx.h"
 #include "vfs/vnode.h"
 #include "vm/copyinout.h"
 #include "proc/proc.h"
@@ -17,7 +18,6 @@
 #include <sys/debug.h>
 
 #define MAX_IO_BUF 0x1000
-#define MAX_SERIAL_SEND 100
 
 
 static int _con_eachopen(struct vnode *file, int flags);
@@ -62,10 +62,11 @@ con_init(struct vnode *con_vn) {
     con_vn->vn_ops->vop_lastclose = _con_lastclose;
     con_vn->vn_ops->vop_read      = _con_read;
     con_vn->vn_ops->vop_write     = _con_write;
+    con_vn->vn_ops->vop_flush     = NULL;
     con_vn->vn_ops->vop_getdirent = NULL;
     con_vn->vn_ops->vop_stat      = NULL;
 
-    con_vn->sattr.st_type = ST_FILE;
+    con_vn->sattr.st_type = ST_SPECIAL;
     con_vn->sattr.st_mode = S_IWUSR | S_IRUSR;
     con_vn->sattr.st_size = 0;
     con_vn->sattr.st_mtime.seconds = 0;
@@ -196,14 +197,9 @@ _con_write(struct vnode *file, const char* buf, size_t nbytes, size_t offset,
         callback(token, EFAULT, 0);
         return;
     }
-    struct serial* serial = console.serial;
 
-    size_t tot_sent = 0;
-    int tries = 0;
-    while (tot_sent < nbytes && tries < MAX_SERIAL_SEND) {
-        tot_sent += serial_send(serial, (char*)buf+tot_sent, nbytes-tot_sent);
-        tries++;
-    }
+    /* Through the same queue as sos_write's, so that they stay in order */
+    size_t tot_sent = serial_tx_write(buf, nbytes);
 
     callback(token, 0, tot_sent);
 }
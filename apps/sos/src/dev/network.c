@@ -52,6 +52,12 @@
 #  endif
 #endif
 
+#ifdef CONFIG_SOS_NFS_TCP
+#  define SOS_NFS_MOUNT_FLAGS NFS_MOUNT_TCP
+#else
+#  define SOS_NFS_MOUNT_FLAGS 0
+#endif
+
 #define ARP_PRIME_TIMEOUT_MS     1000
 #define ARP_PRIME_RETRY_DELAY_MS   10
 
@@ -233,7 +239,7 @@ network_init(seL4_CPtr interrupt_ep) {
         if(!(err = nfs_init(&gw))){
             /* Print out the exports on this server */
             nfs_print_exports();
-            if ((err = nfs_mount(SOS_NFS_DIR, &mnt_point))){
+            if ((err = nfs_mount_flags(SOS_NFS_DIR, &mnt_point, SOS_NFS_MOUNT_FLAGS))){
                 dprintf(3, "Error mounting path '%s'!\n", SOS_NFS_DIR);
             }else{
                 dprintf(3, "\nSuccessfully mounted '%s'\n", SOS_NFS_DIR);
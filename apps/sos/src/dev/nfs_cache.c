@@ -0,0 +1,222 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <autoconf.h>
+
+#include <nfs/nfs.h>
+
+#include "tool/utility.h"
+#include "dev/nfs_cache.h"
+#include "dev/clock.h"
+
+#define verbose 0
+#include <sys/debug.h>
+
+#ifndef CONFIG_SOS_NFS_ATTR_TIMEOUT
+#define CONFIG_SOS_NFS_ATTR_TIMEOUT 3000
+#endif
+
+#define NFS_CACHE_BUCKETS   (64)
+#define NFS_CACHE_MAX       (256)   // entries, more names are just not cached
+#define NFS_CACHE_TTL       ((timestamp_t)CONFIG_SOS_NFS_ATTR_TIMEOUT * 1000)
+
+extern fhandle_t mnt_point;
+
+typedef struct nfs_cache_entry nfs_cache_entry_t;
+struct nfs_cache_entry {
+    char *name;
+    enum nfs_stat status;       // NFS_OK or NFSERR_NOENT for a negative entry
+    fhandle_t fh;
+    fattr_t fattr;
+    timestamp_t expires;
+    nfs_cache_entry_t *next;
+};
+
+static nfs_cache_entry_t *_buckets[NFS_CACHE_BUCKETS];
+static int _nentries;
+static uint32_t _generation;    // bumped on every change, lookups in flight don't cache stale replies
+
+/**********************************************************************
+ * Cache Helpers
+ **********************************************************************/
+
+static uint32_t
+_hash(const char *name) {
+    return fnv1a(FNV1A_INIT, name, strlen(name)) % NFS_CACHE_BUCKETS;
+}
+
+static nfs_cache_entry_t**
+_find(const char *name) {
+    nfs_cache_entry_t **pp = &_buckets[_hash(name)];
+    for (; *pp != NULL; pp = &(*pp)->next) {
+        if (strcmp((*pp)->name, name) == 0) {
+            return pp;
+        }
+    }
+    return NULL;
+}
+
+static void
+_remove(nfs_cache_entry_t **pp) {
+    nfs_cache_entry_t *e = *pp;
+    *pp = e->next;
+    free(e->name);
+    free(e);
+    _nentries--;
+}
+
+static void
+_remove_expired(timestamp_t now) {
+    for (int i = 0; i < NFS_CACHE_BUCKETS; i++) {
+        nfs_cache_entry_t **pp = &_buckets[i];
+        while (*pp != NULL) {
+            if ((*pp)->expires <= now) {
+                _remove(pp);
+            } else {
+                pp = &(*pp)->next;
+            }
+        }
+    }
+}
+
+static void
+_insert(const char *name, enum nfs_stat status, const fhandle_t *fh, const fattr_t *fattr) {
+    timestamp_t now = time_stamp();
+
+    nfs_cache_entry_t **pp = _find(name);
+    nfs_cache_entry_t *e = (pp != NULL) ? *pp : NULL;
+    if (e == NULL) {
+        if (_nentries >= NFS_CACHE_MAX) {
+            _remove_expired(now);
+            if (_nentries >= NFS_CACHE_MAX) {
+                return;
+            }
+        }
+        e = malloc(sizeof(nfs_cache_entry_t));
+        if (e == NULL) {
+            return;
+        }
+        e->name = malloc(strlen(name) + 1);
+        if (e->name == NULL) {
+            free(e);
+            return;
+        }
+        strcpy(e->name, name);
+
+        uint32_t bucket = _hash(name);
+        e->next = _buckets[bucket];
+        _buckets[bucket] = e;
+        _nentries++;
+    }
+
+    e->status  = status;
+    e->expires = now + NFS_CACHE_TTL;
+    if (status == NFS_OK) {
+        memcpy(e->fh.data, fh->data, sizeof(fh->data));
+        e->fattr = *fattr;
+    }
+}
+
+/**********************************************************************
+ * NFS Cache Lookup
+ **********************************************************************/
+
+typedef struct {
+    char *name;
+    nfs_lookup_cb_t callback;
+    uintptr_t token;
+    uint32_t generation;
+} nfs_cache_lookup_cont_t;
+
+static void _nfs_cache_lookup_cb(uintptr_t token, enum nfs_stat status, fhandle_t *fh, fattr_t *fattr);
+
+enum rpc_stat
+nfs_cache_lookup(const char *name, nfs_lookup_cb_t callback, uintptr_t token) {
+    nfs_cache_entry_t **pp = _find(name);
+    if (pp != NULL) {
+        nfs_cache_entry_t *e = *pp;
+        if (e->expires > time_stamp()) {
+            dprintf(3, "nfs_cache_lookup: hit %s\n", name);
+            /* Copies, the callback may change the cache */
+            enum nfs_stat status = e->status;
+            fhandle_t fh = e->fh;
+            fattr_t fattr = e->fattr;
+            if (status == NFS_OK) {
+                callback(token, status, &fh, &fattr);
+            } else {
+                callback(token, status, NULL, NULL);
+            }
+            return RPC_OK;
+        }
+        _remove(pp);
+    }
+
+    nfs_cache_lookup_cont_t *cont = malloc(sizeof(nfs_cache_lookup_cont_t));
+    if (cont == NULL) {
+        return RPCERR_NOMEM;
+    }
+    cont->name = malloc(strlen(name) + 1);
+    if (cont->name == NULL) {
+        free(cont);
+        return RPCERR_NOMEM;
+    }
+    strcpy(cont->name, name);
+    cont->callback   = callback;
+    cont->token      = token;
+    cont->generation = _generation;
+
+    enum rpc_stat status = nfs_lookup(&mnt_point, name, _nfs_cache_lookup_cb, (uintptr_t)cont);
+    if (status != RPC_OK) {
+        free(cont->name);
+        free(cont);
+    }
+    return status;
+}
+
+static void
+_nfs_cache_lookup_cb(uintptr_t token, enum nfs_stat status, fhandle_t *fh, fattr_t *fattr) {
+    nfs_cache_lookup_cont_t *cont = (nfs_cache_lookup_cont_t*)token;
+    assert(cont != NULL);
+
+    /* Only cache answers that nothing changed since we asked */
+    if (cont->generation == _generation &&
+            (status == NFS_OK || status == NFSERR_NOENT)) {
+        _insert(cont->name, status, fh, fattr);
+    }
+
+    cont->callback(cont->token, status, fh, fattr);
+    free(cont->name);
+    free(cont);
+}
+
+/**********************************************************************
+ * NFS Cache Update & Invalidate
+ **********************************************************************/
+
+void
+nfs_cache_update(const char *name, const fhandle_t *fh, const fattr_t *fattr) {
+    _generation++;
+    _insert(name, NFS_OK, fh, fattr);
+}
+
+uint32_t
+nfs_cache_generation(void) {
+    return _generation;
+}
+
+void
+nfs_cache_fill(const char *name, const fhandle_t *fh, const fattr_t *fattr,
+               uint32_t generation) {
+    if (generation == _generation) {
+        _insert(name, NFS_OK, fh, fattr);
+    }
+}
+
+void
+nfs_cache_invalidate(const char *name) {
+    _generation++;
+    nfs_cache_entry_t **pp = _find(name);
+    if (pp != NULL) {
+        _remove(pp);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _SOS_NFS_CACHE_H_
+#define _SOS_NFS_CACHE_H_
+
+#include <nfs/nfs.h>
+
+/*
+ * Lookup and attribute cache of the mount point. A name maps to the file
+ * handle and attributes the server last gave for it, or to the fact that it
+ * doesn't exist. Entries are trusted for CONFIG_SOS_NFS_ATTR_TIMEOUT ms.
+ */
+
+/*
+ * Same as nfs_lookup of NAME in the mount point, but answered from the cache
+ * (before returning) while the entry is fresh
+ */
+enum rpc_stat nfs_cache_lookup(const char *name, nfs_lookup_cb_t callback, uintptr_t token);
+
+/* NAME now has the handle FH and the attributes FATTR, e.g. it was created */
+void nfs_cache_update(const char *name, const fhandle_t *fh, const fattr_t *fattr);
+
+/*
+ * What the server said NAME is, in the reply to a request sent when the cache
+ * was at GENERATION (nfs_cache_generation). It is only kept if nothing
+ * changed in the cache since, the reply may be older than our changes
+ */
+uint32_t nfs_cache_generation(void);
+void nfs_cache_fill(const char *name, const fhandle_t *fh, const fattr_t *fattr,
+                    uint32_t generation);
+
+/* Forget what we know about NAME, e.g. it was written to */
+void nfs_cache_invalidate(const char *name);
+
+#endif /* _SOS_NFS_CACHE_H_ */
@@ -11,10 +11,16 @@
 #include <time.h>
 
 #include "dev/nfs_dev.h"
+#include "dev/nfs_cache.h"
 
 #include "tool/utility.h"
+#include "tool/slab.h"
 #include "vfs/vnode.h"
+#include "vfs/vfs.h"
+#include "vm/vm.h"
 #include "vm/copyinout.h"
+#include "vm/pagecache.h"
+#include "vm/sharedpage.h"
 #include "dev/clock.h"
 #include "proc/proc.h"
 
@@ -28,6 +34,7 @@ static void _nfs_dev_read(struct vnode *file, char* buf, size_t nbytes, size_t o
                               vop_read_cb_t callback, void *token);
 static void _nfs_dev_write(struct vnode *file, const char* buf, size_t nbytes, size_t offset,
                               vop_write_cb_t callback, void *token);
+static void _nfs_dev_flush(struct vnode *file, vop_flush_cb_t callback, void *token);
 static void _nfs_dev_getdirent(struct vnode *dir, char *buf, size_t nbyte,
                       int pos, vop_getdirent_cb_t callback, void *token);
 static int _nfs_dev_stat(struct vnode *file, sos_stat_t *buf, vop_stat_cb_t callback, void *token);
@@ -35,6 +42,17 @@ static int _nfs_dev_stat(struct vnode *file, sos_stat_t *buf, vop_stat_cb_t call
 #define MAX_IO_BUF 0x1000
 #define MAX_SERIAL_SEND 100
 
+/* # of pages read ahead of a sequential reader */
+#define NFS_READAHEAD_PAGES 8
+
+/* Write behind: a file keeps up to NFS_WB_SIZE bytes of adjacent writes and
+ * sends them NFS_WB_DELAY us later at most. Past NFS_WB_TOTAL bytes buffered
+ * or on the way in all files, writes are sent as soon as they are buffered
+ * and the writer only hears back once enough of them are on the server */
+#define NFS_WB_SIZE         (4 * PAGE_SIZE)
+#define NFS_WB_DELAY        (200000)
+#define NFS_WB_TOTAL        (64 * PAGE_SIZE)
+
 extern fhandle_t mnt_point;
 extern bool starting_first_process;
 
@@ -42,11 +60,55 @@ extern bool starting_first_process;
  * NFS Utility Functions
  **********************************************************************/
  
+ typedef struct nfs_flush_waiter nfs_flush_waiter_t;
+ struct nfs_flush_waiter {
+    vop_flush_cb_t callback;
+    void *token;
+    bool take_err;          // the error is reported to this one, don't keep it
+    nfs_flush_waiter_t *next;
+};
+
  struct nfs_data{
     fhandle_t *fh;
     fattr_t   *fattr;
+    char      *name;        // for the lookup cache, the vnode may go before this
+    size_t    ra_next;      // where the next read starts if reads are sequential
+
+    /* Write behind */
+    char      *wb_buf;      // writes not sent yet, NULL if there are none
+    size_t    wb_offset;    // file offset of wb_buf
+    size_t    wb_len;
+    uint32_t  wb_timer;     // timer sending wb_buf, 0 if none
+    int       wb_inflight;  // # of buffers being sent
+    int       wb_err;       // first error sending a buffer, reported by the next flush
+    nfs_flush_waiter_t *wb_waiters; // flushes waiting for wb_inflight to drop to 0
+    bool      wb_closed;    // the vnode is gone, free this once everything is sent
+};
+
+static size_t _wb_total;    // # of bytes buffered or being sent in all files
+
+/* A write that is buffered but held back until _wb_total drops */
+typedef struct nfs_wb_throttled nfs_wb_throttled_t;
+struct nfs_wb_throttled {
+    vop_write_cb_t callback;
+    void *token;
+    size_t nbytes;
+    nfs_wb_throttled_t *next;
 };
 
+static SLAB_CACHE(_nfs_wb_throttled_slab, nfs_wb_throttled_t);
+
+static nfs_wb_throttled_t *_wb_throttled;         // oldest first
+static nfs_wb_throttled_t **_wb_throttled_tail = &_wb_throttled;
+
+static void _nfs_wb_timeout(uint32_t id, void *data);
+static void _nfs_wb_send(struct nfs_data *data);
+static void _nfs_wb_drop(struct nfs_data *data);
+static void _nfs_wb_unthrottle(void);
+static void _nfs_wb_wait(struct nfs_data *data, bool take_err, vop_flush_cb_t callback, void *token);
+static void _nfs_data_free(struct nfs_data *data);
+static void _dir_cache_invalidate(void);
+
 /*
  * Common function between nfs_dev_init & nfs_dev_init_mntpoint
  */
@@ -68,10 +130,28 @@ _init_helper(struct vnode *vn, fhandle_t *fh, fattr_t *fattr) {
     }
     memcpy(data->fh->data, fh->data, sizeof(fh->data));
 
+    data->name = malloc(strlen(vn->vn_name) + 1);
+    if (data->name == NULL) {
+        free(data->fh);
+        free(data);
+        return ENOMEM;
+    }
+    strcpy(data->name, vn->vn_name);
+
+    data->ra_next     = 0;
+    data->wb_buf      = NULL;
+    data->wb_offset   = 0;
+    data->wb_len      = 0;
+    data->wb_timer    = 0;
+    data->wb_inflight = 0;
+    data->wb_err      = 0;
+    data->wb_waiters  = NULL;
+    data->wb_closed   = false;
     data->fattr = NULL;
     if (fattr != NULL) {
         data->fattr = malloc(sizeof(fattr_t));
         if(data->fattr == NULL){
+            free(data->name);
             free(data->fh);
             free(data);
             return ENOMEM;
@@ -92,6 +172,7 @@ _init_helper(struct vnode *vn, fhandle_t *fh, fattr_t *fattr) {
     vn->vn_ops->vop_lastclose = _nfs_dev_lastclose;
     vn->vn_ops->vop_read      = _nfs_dev_read;
     vn->vn_ops->vop_write     = _nfs_dev_write;
+    vn->vn_ops->vop_flush     = _nfs_dev_flush;
     vn->vn_ops->vop_getdirent = _nfs_dev_getdirent;
     vn->vn_ops->vop_stat      = _nfs_dev_stat;
 
@@ -151,6 +232,15 @@ _nfs_dev_create_handler(uintptr_t token, enum nfs_stat status, fhandle_t *fh, fa
     if(status == NFS_OK){
         int err = 0;
 
+        /* There is a new entry in the directory */
+        _dir_cache_invalidate();
+        nfs_cache_update(cont->file->vn_name, fh, fattr);
+
+        /* The server may hand out the handle of a file that is gone again,
+         * nothing we have cached for it is this file */
+        page_cache_invalidate(fh, 0, UINT_MAX);
+        shared_page_invalidate(fh, 0, UINT_MAX);
+
         /* place fhandle_t into vnode and add vnode into mapping*/
         err = _init_helper(cont->file, fh, fattr);
         if (err) {
@@ -211,7 +301,7 @@ nfs_dev_init(struct vnode* vn, nfs_dev_init_cb_t callback, void *token) {
     cont->token           = token;
     cont->pid             = proc_get_id();
 
-    enum rpc_stat status = nfs_lookup(&mnt_point, vn->vn_name, nfs_dev_lookup_handler, (uintptr_t)cont);
+    enum rpc_stat status = nfs_cache_lookup(vn->vn_name, nfs_dev_lookup_handler, (uintptr_t)cont);
     if (status != RPC_OK) {
         free(cont);
         callback(token, EFAULT);
@@ -237,75 +327,437 @@ static int _nfs_dev_eachclose(struct vnode *file, uint32_t flags){
 
 static int _nfs_dev_lastclose(struct vnode *vn) {
     struct nfs_data *data = (struct nfs_data*)vn->vn_data;
+
+    /* Whatever is still buffered is sent without the vnode, errors can't be
+     * reported anymore */
+    if (data->wb_buf != NULL) {
+        _nfs_wb_send(data);
+    }
+    if (data->wb_buf != NULL) {
+        _nfs_wb_drop(data);
+    }
+    if (data->wb_inflight > 0) {
+        data->wb_closed = true;
+        return 0;
+    }
+    _nfs_data_free(data);
+    return 0;
+}
+
+static void _nfs_data_free(struct nfs_data *data) {
+    assert(data->wb_buf == NULL && data->wb_inflight == 0);
+    if (data->wb_err) {
+        dprintf(0, "nfs_dev: lost a write behind error %d\n", data->wb_err);
+    }
     if (data->fh != NULL) {
         free(data->fh);
     }
     if (data->fattr != NULL) {
         free(data->fattr);
     }
+    free(data->name);
     free(data);
-    return 0;
 }
 
 /**********************************************************************
  * NFS Write
  **********************************************************************/
- 
- typedef struct nfs_write_state{
-    vop_write_cb_t callback;
-    void* token;
-    struct vnode *file;
-    pid_t pid;
-} nfs_write_state;
-
-static void _nfs_dev_write_handler(uintptr_t token, enum nfs_stat status, fattr_t *fattr, int count);
 
+/*
+ * Writes are copied into the file's write behind buffer and return right
+ * away. Adjacent writes are merged so that the buffer goes out in as few
+ * RPCs as the packet size allows. It is sent when a write doesn't follow it
+ * or doesn't fit, on a timer, when too much is buffered, and on flush
+ */
 static void _nfs_dev_write(struct vnode *file, const char* buf, size_t nbytes, size_t offset,
                               vop_write_cb_t callback, void *token){
     dprintf(3, "_nfs_dev_write offset = %d, proc = %d\n", offset, proc_get_id());
-    nfs_write_state *cont = malloc(sizeof(nfs_write_state));
-    if (cont == NULL) {
-        callback(token, ENOMEM, 0);
+    struct nfs_data *data = (struct nfs_data *)file->vn_data;
+    if (data->fattr == NULL) {
+        callback(token, EFAULT, 0);
         return;
     }
-    cont->callback  = callback;
-    cont->token     = token;
-    cont->file      = file;
-    cont->pid       = proc_get_id();
 
-    struct nfs_data *data = (struct nfs_data *)file->vn_data;
-    enum rpc_stat status = nfs_write(data->fh, offset, nbytes, buf, _nfs_dev_write_handler, (uintptr_t)cont);
-    if (status != RPC_OK) {
-        free(cont);
-        callback(token, EFAULT, 0);
+    /* An earlier write failed, let the writer know */
+    if (data->wb_err) {
+        int err = data->wb_err;
+        data->wb_err = 0;
+        callback(token, err, 0);
+        return;
+    }
+
+    nbytes = MIN(nbytes, NFS_WB_SIZE);
+    if (nbytes == 0) {
+        callback(token, 0, 0);
         return;
     }
+
+    if (data->wb_buf != NULL &&
+            (offset != data->wb_offset + data->wb_len || data->wb_len + nbytes > NFS_WB_SIZE)) {
+        _nfs_wb_send(data);
+        if (data->wb_buf != NULL) {
+            callback(token, ENOMEM, 0);
+            return;
+        }
+    }
+
+    if (data->wb_buf == NULL) {
+        data->wb_buf = malloc(NFS_WB_SIZE);
+        if (data->wb_buf == NULL) {
+            callback(token, ENOMEM, 0);
+            return;
+        }
+        data->wb_offset = offset;
+        data->wb_len    = 0;
+    }
+    memcpy(data->wb_buf + data->wb_len, buf, nbytes);
+    data->wb_len += nbytes;
+    _wb_total    += nbytes;
+    nfs_cache_invalidate(data->name);
+
+    /* The cached pages are out of date, including a partial last page if the
+     * file grows */
+    size_t start = MIN(offset, data->fattr->size);
+    page_cache_invalidate(data->fh, start, offset + nbytes - start);
+    shared_page_invalidate(data->fh, start, offset + nbytes - start);
+    data->fattr->size = MAX(data->fattr->size, offset + nbytes);
+
+    if (data->wb_len == NFS_WB_SIZE || _wb_total > NFS_WB_TOTAL || !frame_has_free()) {
+        _nfs_wb_send(data);
+    } else if (data->wb_timer == 0) {
+        data->wb_timer = register_timer(NFS_WB_DELAY, _nfs_wb_timeout, (void*)data);
+    }
+
+    /* Too much on the way, slow the writer down until some of it is on the
+     * server. If we can't keep track of it, let it go on */
+    if (_wb_total > NFS_WB_TOTAL) {
+        nfs_wb_throttled_t *t = slab_alloc(&_nfs_wb_throttled_slab);
+        if (t != NULL) {
+            dprintf(3, "_nfs_dev_write: throttled, %u bytes on the way\n", _wb_total);
+            t->callback = callback;
+            t->token    = token;
+            t->nbytes   = nbytes;
+            t->next     = NULL;
+            *_wb_throttled_tail = t;
+            _wb_throttled_tail  = &t->next;
+            return;
+        }
+    }
+
+    callback(token, 0, nbytes);
 }
 
-static void _nfs_dev_write_handler(uintptr_t token, enum nfs_stat status, fattr_t *fattr, int count){
+typedef struct {
+    struct nfs_data *data;
+    vop_flush_cb_t callback;
+    void *token;
+    int err;
+} nfs_flush_state_t;
+
+static void _nfs_dev_flush_2_commit(void *token, int err);
+static void _nfs_dev_flush_3_committed(uintptr_t token, enum nfs_stat status);
 
-    int err = 0;
-    nfs_write_state *cont = (nfs_write_state*)token;
+/*
+ * Make sure everything written to FILE is on the server's disk. The callback
+ * gets the first error of the writes that were sent in the background.
+ * Background writes are unstable (NFSv3), the server may hold them in memory
+ * until the commit here
+ */
+static void _nfs_dev_flush(struct vnode *file, vop_flush_cb_t callback, void *token){
+    dprintf(3, "_nfs_dev_flush, proc = %d\n", proc_get_id());
+    nfs_flush_state_t *cont = malloc(sizeof(nfs_flush_state_t));
+    if (cont == NULL) {
+        callback(token, ENOMEM);
+        return;
+    }
+    cont->data     = (struct nfs_data*)file->vn_data;
+    cont->callback = callback;
+    cont->token    = token;
+    cont->err      = 0;
+    _nfs_wb_wait(cont->data, true, _nfs_dev_flush_2_commit, (void*)cont);
+}
+
+static void
+_nfs_dev_flush_2_commit(void *token, int err) {
+    nfs_flush_state_t *cont = (nfs_flush_state_t*)token;
     assert(cont != NULL);
 
-    if (starting_first_process || is_proc_alive(cont->pid)) {
-        set_cur_proc(cont->pid);
-        dprintf(3, "_nfs_dev_write_handler count = %d, proc = %d\n", count, proc_get_id());
+    /* The data is still alive while its waiters are called, not after */
+    cont->err = err;
+    if (nfs_commit(cont->data->fh, _nfs_dev_flush_3_committed, (uintptr_t)cont) != RPC_OK) {
+        _nfs_dev_flush_3_committed((uintptr_t)cont, NFSERR_COMM);
+    }
+}
 
-        struct nfs_data *data = (struct nfs_data*)cont->file->vn_data;
-        assert(data != NULL);
-        *(data->fattr) = *fattr;
+static void
+_nfs_dev_flush_3_committed(uintptr_t token, enum nfs_stat status) {
+    nfs_flush_state_t *cont = (nfs_flush_state_t*)token;
+    assert(cont != NULL);
+    dprintf(3, "_nfs_dev_flush_3_committed, status = %d\n", status);
+
+    int err = cont->err;
+    if (err == 0 && status != NFS_OK) {
+        /* NFSERR_VERF: the server restarted and lost some of the writes */
+        err = (status == NFSERR_VERF) ? EIO : EFAULT;
+    }
+    cont->callback(cont->token, err);
+    free(cont);
+}
+
+/**********************************************************************
+ * NFS Write Behind
+ **********************************************************************/
+
+/* A buffer goes out in chunks, VFS_IO_WINDOW of them at the same time */
+typedef struct nfs_wb_state nfs_wb_state_t;
+
+typedef struct {
+    nfs_wb_state_t *cont;
+    size_t offset;      // in the buffer
+    size_t len;         // not acknowledged yet
+} nfs_wb_chunk_t;
+
+struct nfs_wb_state {
+    struct nfs_data *data;
+    char *buf;
+    size_t offset;
+    size_t len;
+    size_t next;        // what no chunk has taken yet
+    int inflight;       // chunks on the wire
+    int err;
+    nfs_wb_chunk_t chunks[VFS_IO_WINDOW];
+};
+
+static SLAB_CACHE(_nfs_wb_slab, nfs_wb_state_t);
+
+static int _nfs_wb_send_chunk(nfs_wb_chunk_t *chunk);
+static void _nfs_wb_write_handler(uintptr_t token, enum nfs_stat status, fattr_t *fattr, int count);
+static void _nfs_wb_send_end(nfs_wb_state_t *cont, int err);
 
-        if(status != NFS_OK){
-            err = EFAULT;
+static void
+_nfs_wb_timeout(uint32_t id, void *data) {
+    (void)id;
+    struct nfs_data *nfs_data = (struct nfs_data*)data;
+    nfs_data->wb_timer = 0;
+    if (nfs_data->wb_buf != NULL) {
+        _nfs_wb_send(nfs_data);
+    }
+}
+
+/*
+ * Send the buffer, the file can buffer new writes meanwhile. If we can't,
+ * the buffer stays and the timer tries again
+ */
+static void
+_nfs_wb_send(struct nfs_data *data) {
+    assert(data->wb_buf != NULL);
+    dprintf(3, "_nfs_wb_send offset = %u, len = %u\n", data->wb_offset, data->wb_len);
+
+    if (data->wb_timer != 0) {
+        remove_timer(data->wb_timer);
+        data->wb_timer = 0;
+    }
+
+    nfs_wb_state_t *cont = slab_alloc(&_nfs_wb_slab);
+    if (cont == NULL) {
+        data->wb_timer = register_timer(NFS_WB_DELAY, _nfs_wb_timeout, (void*)data);
+        return;
+    }
+    cont->data     = data;
+    cont->buf      = data->wb_buf;
+    cont->offset   = data->wb_offset;
+    cont->len      = data->wb_len;
+    cont->next     = 0;
+    cont->inflight = 0;
+    cont->err      = 0;
+
+    data->wb_buf = NULL;
+    data->wb_len = 0;
+    data->wb_inflight++;
+
+    for (int i = 0; i < VFS_IO_WINDOW && cont->next < cont->len; i++) {
+        nfs_wb_chunk_t *chunk = &cont->chunks[i];
+        chunk->cont   = cont;
+        chunk->offset = cont->next;
+        chunk->len    = MIN(NFS_WRITE_SIZE, cont->len - cont->next);
+        cont->next   += chunk->len;
+        if (_nfs_wb_send_chunk(chunk)) {
+            cont->err = EFAULT;
+            break;
         }
-        
+        cont->inflight++;
+    }
+
+    /* If nothing made it out, no reply will ever come back to finish this */
+    if (cont->inflight == 0) {
+        _nfs_wb_send_end(cont, EFAULT);
+    }
+}
+
+static int
+_nfs_wb_send_chunk(nfs_wb_chunk_t *chunk) {
+    nfs_wb_state_t *cont = chunk->cont;
+    /* The buffer is ours until the write is acknowledged, send it from where it is */
+    /* Unstable, the flush commits them */
+    enum rpc_stat status = nfs_write_flags(cont->data->fh, cont->offset + chunk->offset,
+                                           chunk->len, cont->buf + chunk->offset,
+                                           NFS_WRITE_REF | NFS_WRITE_UNSTABLE,
+                                           _nfs_wb_write_handler, (uintptr_t)chunk);
+    return (status == RPC_OK) ? 0 : EFAULT;
+}
+
+/* A chunk is acknowledged, it carries on with the rest of the buffer */
+static void
+_nfs_wb_write_handler(uintptr_t token, enum nfs_stat status, fattr_t *fattr, int count) {
+    nfs_wb_chunk_t *chunk = (nfs_wb_chunk_t*)token;
+    assert(chunk != NULL);
+    nfs_wb_state_t *cont = chunk->cont;
+    struct nfs_data *data = cont->data;
+    dprintf(3, "_nfs_wb_write_handler count = %d\n", count);
+
+    if (status != NFS_OK || count <= 0 || (size_t)count > chunk->len) {
+        cont->err = EFAULT;
     } else {
-        err = EFAULT;
+        /* Keep the size of what is still buffered or on the way, NFSv3
+         * servers may leave the attributes out */
+        if (fattr->type != NFNON) {
+            size_t size = data->fattr->size;
+            *(data->fattr) = *fattr;
+            data->fattr->size = MAX(size, fattr->size);
+        }
+
+        chunk->offset += (size_t)count;
+        chunk->len    -= (size_t)count;
+        if (chunk->len == 0 && cont->next < cont->len) {
+            chunk->offset = cont->next;
+            chunk->len    = MIN(NFS_WRITE_SIZE, cont->len - cont->next);
+            cont->next   += chunk->len;
+        }
+        if (!cont->err && chunk->len > 0) {
+            if (_nfs_wb_send_chunk(chunk) == 0) {
+                return;
+            }
+            cont->err = EFAULT;
+        }
     }
 
-    cont->callback(cont->token, err, count);
-    free(cont);
+    if (--cont->inflight > 0) {
+        return;
+    }
+    /* Nothing newer is buffered, the server's attributes are right */
+    if (!cont->err && data->wb_buf == NULL && data->wb_inflight == 1) {
+        nfs_cache_update(data->name, data->fh, data->fattr);
+    }
+    _nfs_wb_send_end(cont, cont->err);
+}
+
+static void
+_nfs_wb_send_end(nfs_wb_state_t *cont, int err) {
+    struct nfs_data *data = cont->data;
+    if (err && data->wb_err == 0) {
+        data->wb_err = err;
+    }
+    _wb_total -= cont->len;
+    free(cont->buf);
+    slab_free(&_nfs_wb_slab, cont);
+
+    /* May buffer more writes of this file, we are done with cont though */
+    _nfs_wb_unthrottle();
+
+    if (--data->wb_inflight > 0) {
+        return;
+    }
+
+    /* Everything is out, the flushes waiting get the error if there was one */
+    nfs_flush_waiter_t *waiters = data->wb_waiters;
+    int wb_err = data->wb_err;
+    data->wb_waiters = NULL;
+    for (nfs_flush_waiter_t *w = waiters; w != NULL; w = w->next) {
+        if (w->take_err) {
+            data->wb_err = 0;
+        }
+    }
+    while (waiters != NULL) {
+        nfs_flush_waiter_t *w = waiters;
+        waiters = w->next;
+        w->callback(w->token, wb_err);
+        free(w);
+    }
+
+    if (data->wb_closed && data->wb_inflight == 0) {
+        if (data->wb_buf != NULL) {
+            _nfs_wb_drop(data);
+        }
+        _nfs_data_free(data);
+    }
+}
+
+/* Throw the buffer away, we can't send it */
+static void
+_nfs_wb_drop(struct nfs_data *data) {
+    dprintf(0, "nfs_dev: dropping %u bytes of writes at offset %u\n", data->wb_len, data->wb_offset);
+    if (data->wb_timer != 0) {
+        remove_timer(data->wb_timer);
+        data->wb_timer = 0;
+    }
+    _wb_total -= data->wb_len;
+    free(data->wb_buf);
+    data->wb_buf = NULL;
+    data->wb_len = 0;
+    _nfs_wb_unthrottle();
+}
+
+/* Let the writers held back go on, oldest first, while there is room */
+static void
+_nfs_wb_unthrottle(void) {
+    while (_wb_throttled != NULL && _wb_total <= NFS_WB_TOTAL) {
+        nfs_wb_throttled_t *t = _wb_throttled;
+        _wb_throttled = t->next;
+        if (_wb_throttled == NULL) {
+            _wb_throttled_tail = &_wb_throttled;
+        }
+        vop_write_cb_t callback = t->callback;
+        void *token   = t->token;
+        size_t nbytes = t->nbytes;
+        slab_free(&_nfs_wb_throttled_slab, t);
+        callback(token, 0, nbytes);
+    }
+}
+
+/*
+ * Send the buffer and call back once all the writes of the file are on the
+ * server. If TAKE_ERR, the error is reported to the caller only and
+ * forgotten, otherwise it's kept for the next flush
+ */
+static void
+_nfs_wb_wait(struct nfs_data *data, bool take_err, vop_flush_cb_t callback, void *token) {
+    if (data->wb_buf != NULL) {
+        _nfs_wb_send(data);
+        if (data->wb_buf != NULL) {
+            callback(token, ENOMEM);
+            return;
+        }
+    }
+
+    if (data->wb_inflight == 0) {
+        int err = data->wb_err;
+        if (take_err) {
+            data->wb_err = 0;
+        }
+        callback(token, err);
+        return;
+    }
+
+    nfs_flush_waiter_t *w = malloc(sizeof(nfs_flush_waiter_t));
+    if (w == NULL) {
+        callback(token, ENOMEM);
+        return;
+    }
+    w->callback = callback;
+    w->token    = token;
+    w->take_err = take_err;
+    w->next     = data->wb_waiters;
+    data->wb_waiters = w;
 }
 
 /**********************************************************************
@@ -315,122 +767,217 @@ static void _nfs_dev_write_handler(uintptr_t token, enum nfs_stat status, fattr_
 typedef struct nfs_read_state{
     struct vnode *file;
     char* app_buf;
+    size_t nbytes;
+    size_t offset;
     size_t count;
     vop_read_cb_t callback;
     void* token;
-    void* data_backup;
+    void* page;         // the cached page, held while copying out of it
     pid_t pid;
 } nfs_read_state;
 
-static void _nfs_dev_read_handler(uintptr_t token, enum nfs_stat status, fattr_t *fattr, int count, void* data);
+static SLAB_CACHE(_nfs_read_slab, nfs_read_state);
+
+static void _nfs_dev_read_2_cache(void *token, int err);
+static void _nfs_dev_read_page_cb(void *token, int err, seL4_Word kvaddr, size_t len);
 static void _nfs_dev_read_end(void* token, int err);
 
+/*
+ * Reads go through the page cache, one page at most at a time. The caller
+ * loops until it has everything or we return 0 bytes
+ */
 static void _nfs_dev_read(struct vnode *file, char* buf, size_t nbytes, size_t offset,
                               vop_read_cb_t callback, void *token){
     assert(file != NULL);
     dprintf(3, "_nfs_dev_read called, proc = %d\n", proc_get_id());
-    nfs_read_state *cont = malloc(sizeof(nfs_read_state));
+
+    struct nfs_data *data = (struct nfs_data*)(file->vn_data);
+    if (data->fattr == NULL) {
+        callback(token, EFAULT, 0, false);
+        return;
+    }
+
+    nfs_read_state *cont = slab_alloc(&_nfs_read_slab);
     if (cont == NULL) {
         callback(token, ENOMEM, 0, false);
         return;
     }
+    cont->file      = file;
     cont->app_buf   = buf;
+    cont->nbytes    = nbytes;
+    cont->offset    = offset;
     cont->count     = 0;
     cont->callback  = callback;
     cont->token     = token;
-    cont->file      = file;
-    cont->data_backup = NULL;
+    cont->page      = NULL;
     cont->pid       = proc_get_id();
 
-    struct nfs_data *data = (struct nfs_data*)(file->vn_data);
-    enum rpc_stat status = nfs_read(data->fh, offset, nbytes, _nfs_dev_read_handler, (uintptr_t)cont);
-    if (status != RPC_OK) {
-        free(cont);
-        callback(token, EFAULT, 0, false);
+    /* What was written has to be on the server before we read it back */
+    if (data->wb_buf != NULL || data->wb_inflight > 0) {
+        _nfs_wb_wait(data, false, _nfs_dev_read_2_cache, (void*)cont);
+        return;
     }
-    return;
-
-    //dprintf(3, "_nfs_dev_read finish\n");
+    _nfs_dev_read_2_cache((void*)cont, 0);
 }
 
-static void _nfs_dev_read_handler(uintptr_t token, enum nfs_stat status, fattr_t *fattr, int count, void* data){
-    //dprintf(3, "count = %d\n", count);
-    int err;
+static void _nfs_dev_read_2_cache(void *token, int err){
     nfs_read_state *cont = (nfs_read_state*)token;
     assert(cont != NULL);
 
     if (!starting_first_process && !is_proc_alive(cont->pid)) {
-        _nfs_dev_read_end((void*)token, EFAULT);
+        _nfs_dev_read_end((void*)cont, EFAULT);
         return;
     }
-
     set_cur_proc(cont->pid);
-    dprintf(3, "_nfs_dev_read_handler called, proc = %d\n", proc_get_id());
-    //dprintf(3, "nfs read status = %d\n", status);
-    if(status == NFS_OK){
-        struct nfs_data *nfs_data = (struct nfs_data*)cont->file->vn_data;
-        assert(nfs_data != NULL);
-        *(nfs_data->fattr) = *fattr;
 
-        void * data_backup = malloc((size_t)count);
-        if (data_backup == NULL) {
-            _nfs_dev_read_end((void*)token, ENOMEM);
-            return;
-        }
-        cont->data_backup = data_backup;
+    /* A write error is for the writer, it's kept for the next flush */
+    if (err == ENOMEM) {
+        _nfs_dev_read_end((void*)cont, err);
+        return;
+    }
 
-        memcpy(data_backup, data, (size_t)count);
+    struct nfs_data *data = (struct nfs_data*)(cont->file->vn_data);
+    size_t size = data->fattr->size;
+    if (cont->offset >= size || cont->nbytes == 0) {
+        _nfs_dev_read_end((void*)cont, 0);
+        return;
+    }
+    cont->nbytes = MIN(cont->nbytes, MIN(size - cont->offset, PAGE_SIZE - PAGE_OFFSET(cont->offset)));
 
-        cont->count = count;
-        err = copyout((seL4_Word)cont->app_buf, (seL4_Word)data_backup, count, _nfs_dev_read_end, (void*)cont);
-        if(err){
-            _nfs_dev_read_end((void*)token, err);
-        }
+    bool sequential = (cont->offset == data->ra_next);
+    data->ra_next = cont->offset + cont->nbytes;
+
+    seL4_Word page = PAGE_ALIGN(cont->offset);
+    err = page_cache_read(data->fh, size, page, _nfs_dev_read_page_cb, (void*)cont);
+    if (err) {
+        _nfs_dev_read_end((void*)cont, err);
         return;
-    } else {
-        _nfs_dev_read_end((void*)token, EFAULT);
+    }
+
+    /* After the page we need, so that it goes out first */
+    if (sequential) {
+        page_cache_readahead(data->fh, size, page + PAGE_SIZE, NFS_READAHEAD_PAGES);
+    }
+}
+
+static void _nfs_dev_read_page_cb(void *token, int err, seL4_Word kvaddr, size_t len){
+    nfs_read_state *cont = (nfs_read_state*)token;
+    assert(cont != NULL);
+
+    if (!starting_first_process && !is_proc_alive(cont->pid)) {
+        _nfs_dev_read_end((void*)cont, EFAULT);
         return;
     }
+
+    set_cur_proc(cont->pid);
+    dprintf(3, "_nfs_dev_read_page_cb called, proc = %d\n", proc_get_id());
+    if (err) {
+        _nfs_dev_read_end((void*)cont, err);
+        return;
+    }
+
+    size_t pos = PAGE_OFFSET(cont->offset);
+    if (pos >= len) {
+        _nfs_dev_read_end((void*)cont, 0);
+        return;
+    }
+    size_t count = MIN(cont->nbytes, len - pos);
+
+    /* Copy straight out of the cached page, copyout may have to wait for
+     * the user's page so keep ours until it's done */
+    cont->page = page_cache_hold();
+    assert(cont->page != NULL);
+
+    cont->count = count;
+    err = copyout((seL4_Word)cont->app_buf, kvaddr + pos, count, _nfs_dev_read_end, (void*)cont);
+    if(err){
+        _nfs_dev_read_end((void*)cont, err);
+    }
 }
 
 static void _nfs_dev_read_end(void* token, int err){
     nfs_read_state *cont = (nfs_read_state*)token;
     assert(cont != NULL);
 
-    if (cont->data_backup != NULL) {
-        free(cont->data_backup);
+    if (cont->page != NULL) {
+        page_cache_release(cont->page);
     }
 
     if (err) {
         cont->callback(cont->token, err, 0, false);
-        free(cont);
+        slab_free(&_nfs_read_slab, cont);
         return;
     }
 
     cont->callback(cont->token, 0, cont->count, cont->count != 0);
-    free(cont);
+    slab_free(&_nfs_read_slab, cont);
 }
 
 /**********************************************************************
  * NFS GetDirent
  **********************************************************************/
- 
- typedef struct nfs_getdirent_state_t{
+
+/*
+ * Entries of the mount point, name i is what getdirent(i) returns. It is
+ * filled by one READDIRPLUS sweep and tagged with the mtime of the directory,
+ * which is checked again when a listing starts (pos 0). The handles and
+ * attributes of the sweep also go to the lookup cache
+ */
+typedef struct nfs_getdirent_state_t nfs_getdirent_state_t;
+
+static struct {
+    char **names;
+    int nnames;
+    int size;                       // # of slots in names
+    bool valid;
+    timeval_t mtime;
+    bool busy;                      // being checked or filled
+    uint32_t generation;            // of the lookup cache when the last readdir was sent
+    nfs_getdirent_state_t *waiters; // getdirents waiting for it
+} _dir_cache;
+
+ struct nfs_getdirent_state_t{
     int pos;
     size_t nbyte;
     size_t size;
     char* name;
     char* app_buf;
-    nfscookie_t cookie;
     vop_getdirent_cb_t callback;
     void* token;
     pid_t pid;
-} nfs_getdirent_state_t;
+    nfs_getdirent_state_t *next;
+};
 
-static void _nfs_dev_getdirent_handler(uintptr_t token, enum nfs_stat status, int num_files,
-        char* file_names[], nfscookie_t nfscookie);
+static void _dir_cache_revalidate(void);
+static void _dir_cache_getattr_handler(uintptr_t token, enum nfs_stat status, fattr_t *fattr);
+static void _dir_cache_readdir(nfscookie_t nfscookie);
+static void _dir_cache_readdir_handler(uintptr_t token, enum nfs_stat status, int num_files,
+        char* file_names[], fhandle_t* fhs[], fattr_t* fattrs[], nfscookie_t nfscookie);
+static void _dir_cache_done(int err);
+static void _nfs_dev_getdirent_serve(nfs_getdirent_state_t *cont, int err);
 static void _nfs_dev_getdirent_done_copyout(void* token, int err);
 
+static void
+_dir_cache_clear(void) {
+    for (int i = 0; i < _dir_cache.nnames; i++) {
+        free(_dir_cache.names[i]);
+    }
+    _dir_cache.nnames = 0;
+    _dir_cache.valid  = false;
+}
+
+/* The directory changed under us, e.g. we created a file in it */
+static void
+_dir_cache_invalidate(void) {
+    if (!_dir_cache.busy) {
+        _dir_cache_clear();
+    } else {
+        /* Checked again as soon as the current sweep is done */
+        _dir_cache.mtime.seconds  = 0;
+        _dir_cache.mtime.useconds = 0;
+    }
+}
+
 static void 
 _nfs_dev_getdirent(struct vnode *dir, char *buf, size_t nbyte, int pos,
                               vop_getdirent_cb_t callback, void *token){
@@ -443,24 +990,126 @@ _nfs_dev_getdirent(struct vnode *dir, char *buf, size_t nbyte, int pos,
     cont->app_buf   = buf;
     cont->nbyte     = nbyte;
     cont->pos       = pos;
+    cont->name      = NULL;
     cont->callback  = callback;
     cont->token     = token;
     cont->pid       = proc_get_id();
-    enum rpc_stat status = nfs_readdir(&mnt_point, 0, _nfs_dev_getdirent_handler, (uintptr_t)cont);
+    cont->next      = NULL;
+
+    if (_dir_cache.valid && pos != 0 && !_dir_cache.busy) {
+        _nfs_dev_getdirent_serve(cont, 0);
+        return;
+    }
+
+    cont->next = _dir_cache.waiters;
+    _dir_cache.waiters = cont;
+    if (!_dir_cache.busy) {
+        _dir_cache_revalidate();
+    }
+}
+
+/* Check the mtime of the directory, then sweep it if it's not what we have */
+static void
+_dir_cache_revalidate(void) {
+    _dir_cache.busy = true;
+    enum rpc_stat status = nfs_getattr(&mnt_point, _dir_cache_getattr_handler, 0);
     if (status != RPC_OK) {
-        cont->callback(cont->token, EFAULT, 0);
-        free(cont);
+        _dir_cache_done(EFAULT);
+    }
+}
+
+static void
+_dir_cache_getattr_handler(uintptr_t token, enum nfs_stat status, fattr_t *fattr) {
+    (void)token;
+    if (status != NFS_OK) {
+        _dir_cache_done(EFAULT);
+        return;
+    }
+
+    if (_dir_cache.valid &&
+            _dir_cache.mtime.seconds == fattr->mtime.seconds &&
+            _dir_cache.mtime.useconds == fattr->mtime.useconds) {
+        _dir_cache_done(0);
+        return;
+    }
+
+    dprintf(3, "_dir_cache_getattr_handler: refilling the directory cache\n");
+    _dir_cache_clear();
+    _dir_cache.mtime = fattr->mtime;
+    _dir_cache_readdir(0);
+}
+
+static void
+_dir_cache_readdir(nfscookie_t nfscookie) {
+    _dir_cache.generation = nfs_cache_generation();
+    enum rpc_stat rpc_status = nfs_readdirplus(&mnt_point, nfscookie,
+            _dir_cache_readdir_handler, 0);
+    if (rpc_status != RPC_OK) {
+        _dir_cache_done(EFAULT);
+    }
+}
+
+static void
+_dir_cache_readdir_handler(uintptr_t token, enum nfs_stat status, int num_files,
+        char* file_names[], fhandle_t* fhs[], fattr_t* fattrs[], nfscookie_t nfscookie){
+    (void)token;
+    if (status != NFS_OK) {
+        _dir_cache_done(EFAULT);
+        return;
+    }
+
+    if (_dir_cache.nnames + num_files > _dir_cache.size) {
+        int size = MAX(2 * _dir_cache.size, _dir_cache.nnames + num_files);
+        char **names = realloc(_dir_cache.names, size * sizeof(char*));
+        if (names == NULL) {
+            _dir_cache_done(ENOMEM);
+            return;
+        }
+        _dir_cache.names = names;
+        _dir_cache.size  = size;
+    }
+    for (int i = 0; i < num_files; i++) {
+        char *name = malloc(strlen(file_names[i]) + 1);
+        if (name == NULL) {
+            _dir_cache_done(ENOMEM);
+            return;
+        }
+        strcpy(name, file_names[i]);
+        _dir_cache.names[_dir_cache.nnames++] = name;
+        if (fhs[i] != NULL && fattrs[i] != NULL) {
+            nfs_cache_fill(name, fhs[i], fattrs[i], _dir_cache.generation);
+        }
+    }
+
+    if (nfscookie == 0) {   /* No more entry */
+        _dir_cache.valid = true;
+        _dir_cache_done(0);
+        return;
+    }
+
+    _dir_cache_readdir(nfscookie);
+}
+
+static void
+_dir_cache_done(int err) {
+    if (err) {
+        _dir_cache_clear();
+    }
+    _dir_cache.busy = false;
+
+    nfs_getdirent_state_t *waiters = _dir_cache.waiters;
+    _dir_cache.waiters = NULL;
+    while (waiters != NULL) {
+        nfs_getdirent_state_t *cont = waiters;
+        waiters = cont->next;
+        _nfs_dev_getdirent_serve(cont, err);
     }
 }
 
+/* Copy entry pos out of the cache */
 static void
-_nfs_dev_getdirent_handler(uintptr_t token, enum nfs_stat status, int num_files,
-        char* file_names[], nfscookie_t nfscookie){
-    int err = 0;
+_nfs_dev_getdirent_serve(nfs_getdirent_state_t *cont, int err){
     size_t size = 0;
-    bool finish = false;
-    nfs_getdirent_state_t *cont = (nfs_getdirent_state_t*) token;
-    assert(cont != NULL);
     if (!starting_first_process && !is_proc_alive(cont->pid)) {
         cont->callback(cont->token, EFAULT, 0);
         free(cont);
@@ -468,58 +1117,42 @@ _nfs_dev_getdirent_handler(uintptr_t token, enum nfs_stat status, int num_files,
     }
     set_cur_proc(cont->pid);
 
-    if(status == NFS_OK){
-        cont->cookie = nfscookie;
-
-        /* We have the file we want */
-        if(num_files > cont->pos){
-            /* pos is valid entry */
-
-            while(file_names[cont->pos][size] != '\0' && size < cont->nbyte-1){
-                size++;
-            }
-            char* name = malloc(size+1);
-            if (name == NULL) {
-                err = ENOMEM;
-                finish = true;
-            } else {
-                strncpy(name, file_names[cont->pos], size);
-                name[size++] = '\0';
-                cont->size = size;
-                cont->name = name;
-                err = copyout((seL4_Word)cont->app_buf, (seL4_Word)name, size,
-                        _nfs_dev_getdirent_done_copyout, (void*)cont);
-
-                //set callback when there is an error, otherwise wait till copyout returns
-                finish = (bool)err;
-            }
-        } else {
-            if(nfscookie == 0){  /* No more entry*/
-                //pos is next free entry
-                if(cont->pos == num_files + 1){
-                    size = 0;
-                } else {
-                    err = EINVAL;
-                }
-                finish = true;
-            } else {             /* Read more */
-                cont->pos -= num_files;
-                assert(cont->pos >= 0);
-                enum rpc_stat rpc_status = nfs_readdir(&mnt_point, nfscookie,
-                        _nfs_dev_getdirent_handler, (uintptr_t)cont);
-                if (rpc_status != RPC_OK) {
-                    finish = true;
-                }
-            }
-        }
+    if (err) {
+        cont->callback(cont->token, err, 0);
+        free(cont);
+        return;
+    }
 
-    } else {
-        finish = true;
-        err = EFAULT;
+    if (cont->pos < 0 || cont->pos > _dir_cache.nnames || cont->nbyte == 0) {
+        cont->callback(cont->token, EINVAL, 0);
+        free(cont);
+        return;
+    }
+    if (cont->pos == _dir_cache.nnames) {   /* pos is next free entry */
+        cont->callback(cont->token, 0, 0);
+        free(cont);
+        return;
     }
 
-    if(finish){
-        cont->callback(cont->token, err, size);
+    const char *entry = _dir_cache.names[cont->pos];
+    while(entry[size] != '\0' && size < cont->nbyte-1){
+        size++;
+    }
+    char* name = malloc(size+1);
+    if (name == NULL) {
+        cont->callback(cont->token, ENOMEM, 0);
+        free(cont);
+        return;
+    }
+    strncpy(name, entry, size);
+    name[size++] = '\0';
+    cont->size = size;
+    cont->name = name;
+    err = copyout((seL4_Word)cont->app_buf, (seL4_Word)name, size,
+            _nfs_dev_getdirent_done_copyout, (void*)cont);
+    if (err) {
+        free(name);
+        cont->callback(cont->token, err, 0);
         free(cont);
     }
 }
@@ -589,7 +1222,7 @@ void nfs_dev_getstat(char *path, size_t path_len, sos_stat_t *buf,
     cont->stat = NULL;
     cont->pid  = proc_get_id();
 
-    enum rpc_stat status = nfs_lookup(&mnt_point, path, _nfs_dev_getstat_lookup_cb, (uintptr_t)cont);
+    enum rpc_stat status = nfs_cache_lookup(path, _nfs_dev_getstat_lookup_cb, (uintptr_t)cont);
     if (status != RPC_OK) {
         _nfs_dev_getstat_lookup_cb((uintptr_t)cont, status, NULL, NULL);
         return;
@@ -728,6 +1361,7 @@ _nfs_dev_timeout_handler(uint32_t id, void *data){
 }
 
 void nfs_dev_setup_timeout(void){
+    nfs_set_clock(time_stamp);
     register_timer(100000, _nfs_dev_timeout_handler, NULL); //100ms
 }
 
@@ -0,0 +1,111 @@
+#include <string.h>
+#include <stdbool.h>
+
+#include <serial/serial.h>
+
+#include "tool/utility.h"
+#include "dev/clock.h"
+#include "dev/serial_tx.h"
+
+#define verbose 0
+#include <sys/debug.h>
+
+#define SERIAL_TX_BUF       (0x1000)
+#define SERIAL_TX_PACKET    (500)       // the payload of one serial_send packet
+#define SERIAL_TX_DELAY_US  (2000)      // how long queued bytes wait for company
+
+static struct {
+    char buf[SERIAL_TX_BUF];
+    size_t start;
+    size_t size;
+    bool timer;                 // a flush is on its way
+    struct serial *serial;
+} _tx;
+
+static void _serial_tx_timeout(uint32_t id, void *data);
+
+/*
+ * Send what's queued, as much of it as the serial port takes. Unless ALL,
+ * what doesn't make a whole packet stays for later
+ */
+static void
+_serial_tx_send(bool all) {
+    if (_tx.serial == NULL) {
+        return;
+    }
+    while (_tx.size > 0 && (all || _tx.size >= SERIAL_TX_PACKET)) {
+        size_t len = MIN(_tx.size, SERIAL_TX_BUF - _tx.start);
+        if (!all) {
+            len = MIN(len, _tx.size - _tx.size % SERIAL_TX_PACKET);
+        }
+        int sent = serial_send(_tx.serial, _tx.buf + _tx.start, len);
+        if (sent <= 0) {
+            dprintf(3, "_serial_tx_send: serial_send took nothing\n");
+            break;
+        }
+        _tx.start = (_tx.start + sent) % SERIAL_TX_BUF;
+        _tx.size -= sent;
+        if ((size_t)sent < len) {
+            break;
+        }
+    }
+}
+
+void
+serial_tx_flush(void) {
+    _serial_tx_send(true);
+}
+
+/* Flush a little later, more may come to share the packets */
+static void
+_serial_tx_schedule(void) {
+    if (_tx.timer || _tx.size == 0) {
+        return;
+    }
+    if (register_timer(SERIAL_TX_DELAY_US, _serial_tx_timeout, NULL) == 0) {
+        serial_tx_flush();
+        return;
+    }
+    _tx.timer = true;
+}
+
+static void
+_serial_tx_timeout(uint32_t id, void *data) {
+    (void)id;
+    (void)data;
+    _tx.timer = false;
+    serial_tx_flush();
+    /* Whatever the serial port didn't take goes again later */
+    _serial_tx_schedule();
+}
+
+size_t
+serial_tx_write(const char *data, size_t len) {
+    if (_tx.serial == NULL) {
+        _tx.serial = serial_init();     // serial_init does the caching
+        if (_tx.serial == NULL) {
+            return 0;
+        }
+    }
+
+    size_t queued = 0;
+    while (queued < len) {
+        if (_tx.size == SERIAL_TX_BUF) {
+            serial_tx_flush();
+            if (_tx.size == SERIAL_TX_BUF) {
+                break;
+            }
+        }
+        size_t end = (_tx.start + _tx.size) % SERIAL_TX_BUF;
+        size_t room = (end >= _tx.start) ? SERIAL_TX_BUF - end : _tx.start - end;
+        size_t n = MIN(room, len - queued);
+        memcpy(_tx.buf + end, data + queued, n);
+        _tx.size += n;
+        queued += n;
+    }
+
+    /* Whole packets don't get any bigger by waiting */
+    _serial_tx_send(false);
+    _serial_tx_schedule();
+    return queued;
+}
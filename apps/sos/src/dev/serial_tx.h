@@ -0,0 +1,26 @@
+#ifndef _SOS_SERIAL_TX_H_
+#define _SOS_SERIAL_TX_H_
+
+#include <stddef.h>
+
+/*
+ * Transmit queue in front of the serial port. Every serial_send is a UDP
+ * packet with a busy wait after it, so output is queued and sent in packets
+ * as large as the serial library allows, either once a packet's worth is
+ * there or a moment after the first byte was queued.
+ */
+
+/*
+ * Queue LEN bytes of DATA for the serial port. Sends what is queued first
+ * if there is no room.
+ * Returns the number of bytes queued, less than LEN only if the serial port
+ * is not there or takes nothing
+ */
+size_t serial_tx_write(const char *data, size_t len);
+
+/*
+ * Send everything queued now
+ */
+void serial_tx_flush(void);
+
+#endif /* _SOS_SERIAL_TX_H_ */
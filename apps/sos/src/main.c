@@ -71,6 +71,27 @@ bool starting_first_process;
  */
 extern fhandle_t mnt_point;
 
+/*
+ * Syscalls that always reply before their handler returns. They reply to
+ * REPLY_CALLER from the syscall loop and never save a reply cap
+ */
+static bool
+syscall_replies_now(seL4_Word syscall_number) {
+    switch (syscall_number) {
+    case SOS_SYSCALL_PRINT:
+    case SOS_SYSCALL_PRINT_BUF:
+    case SOS_SYSCALL_SYSBRK:
+    case SOS_SYSCALL_TIMESTAMP:
+    case SOS_SYSCALL_PROC_GET_ID:
+    case SOS_SYSCALL_RING_ENTER:
+    case SOS_SYSCALL_VM_STAT:
+    case SOS_SYSCALL_SLAB_STAT:
+        return true;
+    default:
+        return false;
+    }
+}
+
 void handle_syscall(seL4_Word badge, int num_args) {
 
     seL4_Word syscall_number;
@@ -78,25 +99,42 @@ void handle_syscall(seL4_Word badge, int num_args) {
 
     syscall_number = seL4_GetMR(0);
 
-    /* Save the caller */
-    reply_cap = cspace_save_reply_cap(cur_cspace);
-    assert(reply_cap != CSPACE_NULL);
+    /* Save the caller, only if the reply has to wait */
+    if (syscall_replies_now(syscall_number)) {
+        reply_cap = REPLY_CALLER;
+    } else {
+        reply_cap = reply_cap_save();
+    }
 
     /* Process system call */
     switch (syscall_number) {
     case SOS_SYSCALL_PRINT:
     {
         dprintf(3, "\n---sos print called---\n");
-        size_t msg_len = num_args;
-        char data[seL4_MsgMaxLength];
-        for (size_t i=0; i<msg_len; i++) {
-            data[i] = (char)seL4_GetMR(i+1);
+        char data[SOS_PRINT_MAX];
+        size_t msg_len = MIN((size_t)seL4_GetMR(1), SOS_PRINT_MAX);
+        size_t nwords = (msg_len + sizeof(seL4_Word) - 1) / sizeof(seL4_Word);
+        if (num_args < 1 || (size_t)num_args < nwords + 1) {
+            msg_len = 0;
+            nwords  = 0;
+        }
+        for (size_t i=0; i<nwords; i++) {
+            seL4_Word word = seL4_GetMR(i+2);
+            memcpy(data + i * sizeof(seL4_Word), &word, sizeof(seL4_Word));
         }
 
         serv_sys_print(reply_cap, data, msg_len);
 
         break;
     }
+    case SOS_SYSCALL_PRINT_BUF:
+    {
+        dprintf(3, "\n---sos print buf called---\n");
+        size_t offset = (size_t)seL4_GetMR(1);
+        size_t nbyte  = (size_t)seL4_GetMR(2);
+        serv_sys_print_buf(reply_cap, offset, nbyte);
+        break;
+    }
     case SOS_SYSCALL_SYSBRK:
     {
         dprintf(3, "\n---sos sbrk called---\n");
@@ -139,6 +177,54 @@ void handle_syscall(seL4_Word badge, int num_args) {
         serv_sys_write(reply_cap, fd, buf, nbyte);
         break;
     }
+    case SOS_SYSCALL_IO_BUFFER:
+    {
+        dprintf(3, "\n---sos io buffer called---\n");
+        serv_sys_io_buffer(reply_cap);
+        break;
+    }
+    case SOS_SYSCALL_READ_BUF:
+    {
+        dprintf(3, "\n---sos read buf called at %lu---\n", (long unsigned)time_stamp());
+        int fd          = (int)seL4_GetMR(1);
+        size_t offset   = (size_t)seL4_GetMR(2);
+        size_t nbyte    = (size_t)seL4_GetMR(3);
+        serv_sys_read_buf(reply_cap, fd, offset, nbyte);
+        break;
+    }
+    case SOS_SYSCALL_WRITE_BUF:
+    {
+        dprintf(3, "\n---sos write buf called at %lu---\n", (long unsigned)time_stamp());
+        int fd          = (int)seL4_GetMR(1);
+        size_t offset   = (size_t)seL4_GetMR(2);
+        size_t nbyte    = (size_t)seL4_GetMR(3);
+        serv_sys_write_buf(reply_cap, fd, offset, nbyte);
+        break;
+    }
+    case SOS_SYSCALL_RING_SETUP:
+    {
+        dprintf(3, "\n---sos ring setup called---\n");
+        serv_sys_ring_setup(reply_cap);
+        break;
+    }
+    case SOS_SYSCALL_RING_ENTER:
+    {
+        dprintf(3, "\n---sos ring enter called at %lu---\n", (long unsigned)time_stamp());
+        serv_sys_ring_enter(reply_cap);
+        break;
+    }
+    case SOS_SYSCALL_VM_STAT:
+    {
+        dprintf(3, "\n---sos vm stat called---\n");
+        serv_sys_vm_stat(reply_cap);
+        break;
+    }
+    case SOS_SYSCALL_SLAB_STAT:
+    {
+        dprintf(3, "\n---sos slab stat called---\n");
+        serv_sys_slab_stat(reply_cap);
+        break;
+    }
     case SOS_SYSCALL_SLEEP:
     {
         serv_sys_sleep(reply_cap, seL4_GetMR(1));
@@ -201,9 +287,16 @@ void handle_syscall(seL4_Word badge, int num_args) {
         serv_proc_status(buf, max, reply_cap);
         break;
     }
+    case SOS_SYSCALL_PROC_CLONE:
+    {
+        dprintf(3, "\n---sos proc clone called at %lu---\n", (long unsigned)time_stamp());
+        serv_proc_clone(_sos_ipc_ep_cap, reply_cap);
+        break;
+    }
     default:
         dprintf(3, "Unknown syscall %d\n", syscall_number);
         /* we don't want to reply to an unknown syscall */
+        reply_cap_free(reply_cap);
     }
 
 }
@@ -219,8 +312,7 @@ void handle_pagefault(void) {
     seL4_CPtr reply_cap;
 
     /* Save the caller */
-    reply_cap = cspace_save_reply_cap(cur_cspace);
-    assert(reply_cap != CSPACE_NULL);
+    reply_cap = reply_cap_save();
     dprintf(3, "handle_pagefault: reply_cap = %d\n", (int)reply_cap);
     sos_VMFaultHandler(reply_cap, fault_addr, fsr, ifault);
 }
@@ -232,8 +324,14 @@ void syscall_loop(seL4_CPtr ep) {
         seL4_Word badge;
         seL4_Word label;
         seL4_MessageInfo_t message;
+        seL4_MessageInfo_t reply;
 
-        message = seL4_Wait(ep, &badge);
+        /* Answer the last syscall if it's done and wait in one go */
+        if (reply_pending(&reply)) {
+            message = seL4_ReplyWait(ep, reply, &badge);
+        } else {
+            message = seL4_Wait(ep, &badge);
+        }
         //dprintf(3, "badge=0x%x\n", badge);
         label = seL4_MessageInfo_get_label(message);
         if(badge & IRQ_EP_BADGE){
@@ -389,6 +487,10 @@ static void _sos_init(seL4_CPtr* ipc_ep, seL4_CPtr* async_ep){
                                      malloc, free);
     conditional_panic(err, "Failed to initialise the c space\n");
 
+    /* Keep slots for saving reply caps */
+    err = reply_init();
+    conditional_panic(err, "Failed to initialise the reply cap pool\n");
+
     /* Initialise DMA memory */
     err = dma_init(dma_addr, DMA_SIZE_BITS);
     conditional_panic(err, "Failed to intiialise DMA memory\n");
@@ -500,16 +602,9 @@ static void
 _filesystem_init(void) {
     int err;
 
-    struct vnode* vn = malloc(sizeof(struct vnode));
+    struct vnode* vn = vfs_vnode_alloc(ROOT_PATH);
     conditional_panic(vn == NULL, "Failed to allocate mountpoint vnode memory\n");
 
-    vn->vn_name = (char*)malloc(strlen(ROOT_PATH));
-    conditional_panic(vn->vn_name == NULL, "Failed to allocate mountpoint vnode memory\n");
-    strcpy(vn->vn_name, ROOT_PATH);
-
-    vn->vn_ops = malloc(sizeof(struct vnode_ops));
-    conditional_panic(vn->vn_ops == NULL, "Failed to allocate mountpoint vnode memory\n");
-
     err = nfs_dev_init_mntpoint_vnode(vn, &mnt_point);
     conditional_panic(err, "Failed to initialise mountpoint vnode\n");
 
@@ -558,6 +653,9 @@ int main(void) {
 
     /* Init file system */
     _filesystem_init();
+
+    /* Swapping is possible from here on, keep some frames free in advance */
+    frame_cleaner_start();
     //frametable_test(TEST_1 | TEST_2);
 
     /* Start the user application */
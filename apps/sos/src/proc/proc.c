@@ -12,6 +12,8 @@
 #include "syscall/file.h"
 #include "vm/addrspace.h"
 #include "vm/elf.h"
+#include "vm/iobuf.h"
+#include "syscall/ring.h"
 #include "dev/clock.h"
 
 #define verbose 0
@@ -218,6 +220,14 @@ _free_proc_data(process_t *proc) {
         ut_free(proc->ipc_buffer_addr, seL4_PageBits);
     }
 
+    /* Free the ring's async endpoint, the page goes with the addrspace */
+    if (proc->ring_aep_cap) {
+        cspace_delete_cap(cur_cspace, proc->ring_aep_cap);
+    }
+    if (proc->ring_aep_addr) {
+        ut_free(proc->ring_aep_addr, seL4_EndpointBits);
+    }
+
     dprintf(3, "_free_proc_data: freeing vspace\n");
     /* Free VSpace */
     if (proc->vroot) {
@@ -239,43 +249,21 @@ _free_proc_data(process_t *proc) {
  * Process Create
  ***************************************************************/
 
-typedef struct{
-    seL4_Word elf_entry;
-    process_t* proc;
-    proc_create_cb_t callback;
-    void* token;
-} process_create_cont_t;
-
-static void _proc_create_part2(void *token, addrspace_t *as);
-static void _proc_create_part3(void *token, int err, seL4_Word elf_entry);
-static void _proc_create_part4(void *token, int err);
-static void _proc_create_end(void* token, int err);
-
-void proc_create(char* path, size_t len, seL4_CPtr fault_ep, proc_create_cb_t callback, void* token) {
-    dprintf(3, "process_create\n");
-    dprintf(3, "creating process at %s\n", path);
+/*
+ * Allocate a process slot and the kernel objects of a new process called
+ * NAME, talking to sos through FAULT_EP. *PROC_RET is set as soon as the
+ * process exists, so that the caller can clean up if this fails
+ */
+static int
+_proc_init(const char *name, size_t len, seL4_CPtr fault_ep, process_t **proc_ret) {
     int err;
-
     seL4_CPtr user_ep_cap;
 
-    /* These required for loading program sections */
-    dprintf(3, "creating process cont\n");
-    process_create_cont_t *cont = malloc(sizeof(process_create_cont_t));
-    if (cont == NULL) {
-        callback(token, ENOMEM, -1);
-        return;
-    }
-    cont->elf_entry = 0;
-    cont->proc      = NULL;
-    cont->callback  = callback;
-    cont->token     = token;
-
     dprintf(3, "creating process\n");
     process_t* new_proc = malloc(sizeof(process_t));
     if(new_proc == NULL){
         dprintf(3, "No memory to create new process\n");
-        _proc_create_end((void*)cont, ENOMEM);
-        return;
+        return ENOMEM;
     }
 
     new_proc->tcb_addr          = 0;
@@ -284,6 +272,12 @@ void proc_create(char* path, size_t len, seL4_CPtr fault_ep, proc_create_cb_t ca
     new_proc->vroot             = 0;
     new_proc->ipc_buffer_addr   = 0;
     new_proc->ipc_buffer_cap    = 0;
+    memset(new_proc->io_buffer, 0, sizeof(new_proc->io_buffer));
+    new_proc->ring              = 0;
+    new_proc->ring_aep_addr     = 0;
+    new_proc->ring_aep_cap      = 0;
+    new_proc->ring_user_aep     = 0;
+    new_proc->ring_pending      = 0;
     new_proc->croot             = NULL;
     new_proc->as                = NULL;
     new_proc->p_filetable       = NULL;
@@ -295,13 +289,12 @@ void proc_create(char* path, size_t len, seL4_CPtr fault_ep, proc_create_cb_t ca
     new_proc->p_wait_queue      = NULL;
     new_proc->p_initialised     = false;
 
-    cont->proc = new_proc;
+    *proc_ret = new_proc;
     //try to insert new proc into list
     if(first_free_pslot == -1){
         // Can't find a free process slot
         dprintf(3, "sos_process_create, No free slot for new active process\n");
-        _proc_create_end((void*)cont, EFAULT);
-        return;
+        return EFAULT;
     }
     int i = first_free_pslot;
     processes[i] = new_proc;
@@ -313,19 +306,17 @@ void proc_create(char* path, size_t len, seL4_CPtr fault_ep, proc_create_cb_t ca
     new_proc->name = malloc(len+1);
     if (new_proc->name == NULL) {
         dprintf(3, "sos_process_create, No memory for name\n");
-        _proc_create_end((void*)cont, ENOMEM);
-        return;
+        return ENOMEM;
     }
     new_proc->name_len          = len;
-    strncpy(new_proc->name, path, len);
+    strncpy(new_proc->name, name, len);
     new_proc->name[len]         = '\0';
 
     /* Create a VSpace */
     new_proc->vroot_addr = ut_alloc(seL4_PageDirBits);
     if(!new_proc->vroot_addr){
         dprintf(3, "sos_process_create, No memory for new Page Directory\n");
-        _proc_create_end((void*)cont, ENOMEM);
-        return;
+        return ENOMEM;
     }
 
     err = cspace_ut_retype_addr(new_proc->vroot_addr,
@@ -335,24 +326,21 @@ void proc_create(char* path, size_t len, seL4_CPtr fault_ep, proc_create_cb_t ca
                                 &new_proc->vroot);
     if(err){
         dprintf(3, "sos_process_create, Failed to allocate page directory cap for client\n");
-        _proc_create_end((void*)cont, EFAULT);
-        return;
+        return EFAULT;
     }
 
     /* Create a simple 1 level CSpace */
     new_proc->croot = cspace_create(1);
     if(new_proc->croot == NULL){
         dprintf(3, "sos_process_create, Failed to create CSpace\n");
-        _proc_create_end((void*)cont, EFAULT);
-        return;
+        return EFAULT;
     }
 
     /* Create an IPC buffer */
     new_proc->ipc_buffer_addr = ut_alloc(seL4_PageBits);
     if(!new_proc->ipc_buffer_addr){
         dprintf(3, "sos_process_create, No memory for ipc buffer\n");
-        _proc_create_end((void*)cont, ENOMEM);
-        return;
+        return ENOMEM;
     }
     err =  cspace_ut_retype_addr(new_proc->ipc_buffer_addr,
                                  seL4_ARM_SmallPageObject,
@@ -361,8 +349,7 @@ void proc_create(char* path, size_t len, seL4_CPtr fault_ep, proc_create_cb_t ca
                                  &new_proc->ipc_buffer_cap);
     if(err){
         dprintf(3, "sos_process_create, Unable to allocate page for IPC buffer\n");
-        _proc_create_end((void*)cont, EFAULT);
-        return;
+        return EFAULT;
     }
 
 
@@ -382,8 +369,7 @@ void proc_create(char* path, size_t len, seL4_CPtr fault_ep, proc_create_cb_t ca
     new_proc->tcb_addr = ut_alloc(seL4_TCBBits);
     if(!new_proc->tcb_addr){
         dprintf(3, "sos_process_create, No memory for new TCB\n");
-        _proc_create_end((void*)cont, ENOMEM);
-        return;
+        return ENOMEM;
     }
     err =  cspace_ut_retype_addr(new_proc->tcb_addr,
                                  seL4_TCBObject,
@@ -392,8 +378,7 @@ void proc_create(char* path, size_t len, seL4_CPtr fault_ep, proc_create_cb_t ca
                                  &new_proc->tcb_cap);
     if(err){
         dprintf(3, "sos_process_create, Failed to create TCB\n");
-        _proc_create_end((void*)cont, EFAULT);
-        return;
+        return EFAULT;
     }
 
     /* Configure the TCB */
@@ -403,14 +388,53 @@ void proc_create(char* path, size_t len, seL4_CPtr fault_ep, proc_create_cb_t ca
                              new_proc->ipc_buffer_cap);
     if(err){
         dprintf(3, "sos_process_create, Unable to configure new TCB\n");
-        _proc_create_end((void*)cont, EFAULT);
+        return EFAULT;
+    }
+
+    return 0;
+}
+
+typedef struct{
+    seL4_Word elf_entry;
+    process_t* proc;
+    pid_t parent;           // the process being cloned, proc_clone only
+    proc_create_cb_t callback;
+    void* token;
+} process_create_cont_t;
+
+static void _proc_create_part2(void *token, addrspace_t *as);
+static void _proc_create_part3(void *token, int err, seL4_Word elf_entry);
+static void _proc_create_part4(void *token, int err);
+static void _proc_create_end(void* token, int err);
+
+void proc_create(char* path, size_t len, seL4_CPtr fault_ep, proc_create_cb_t callback, void* token) {
+    dprintf(3, "process_create\n");
+    dprintf(3, "creating process at %s\n", path);
+    int err;
+
+    /* These required for loading program sections */
+    dprintf(3, "creating process cont\n");
+    process_create_cont_t *cont = malloc(sizeof(process_create_cont_t));
+    if (cont == NULL) {
+        callback(token, ENOMEM, -1);
+        return;
+    }
+    cont->elf_entry = 0;
+    cont->proc      = NULL;
+    cont->parent    = PROC_NULL;
+    cont->callback  = callback;
+    cont->token     = token;
+
+    err = _proc_init(path, len, fault_ep, &cont->proc);
+    if (err) {
+        _proc_create_end((void*)cont, err);
         return;
     }
 
     dprintf(3, "\nStarting \"%s\"...\n", path);
 
     /* initialise address space */
-    as_create(new_proc->vroot, _proc_create_part2, (void*)cont);
+    as_create(cont->proc->vroot, _proc_create_part2, (void*)cont);
 }
 
 static void
@@ -535,6 +559,170 @@ _proc_create_end(void* token, int err){
 }
 
 
+/****************************************************************
+ * Process Clone
+ ***************************************************************/
+
+static void _proc_clone_part2(void *token, addrspace_t *as);
+static void _proc_clone_part3(void *token, int err);
+static void _proc_clone_part4(void *token, int err);
+
+void proc_clone(pid_t pid, seL4_CPtr fault_ep, proc_create_cb_t callback, void* token) {
+    dprintf(3, "proc_clone, pid = %d\n", pid);
+    int err;
+
+    process_t *parent = proc_getproc(pid);
+    if (parent == NULL || !parent->p_initialised) {
+        callback(token, EINVAL, -1);
+        return;
+    }
+
+    process_create_cont_t *cont = malloc(sizeof(process_create_cont_t));
+    if (cont == NULL) {
+        callback(token, ENOMEM, -1);
+        return;
+    }
+    cont->elf_entry = 0;
+    cont->proc      = NULL;
+    cont->parent    = pid;
+    cont->callback  = callback;
+    cont->token     = token;
+
+    err = _proc_init(parent->name, parent->name_len, fault_ep, &cont->proc);
+    if (err) {
+        _proc_create_end((void*)cont, err);
+        return;
+    }
+
+    err = as_create(cont->proc->vroot, _proc_clone_part2, (void*)cont);
+    if (err) {
+        _proc_create_end((void*)cont, err);
+        return;
+    }
+}
+
+static void
+_proc_clone_part2(void *token, addrspace_t *as) {
+    dprintf(3, "proc_clone part2\n");
+    process_create_cont_t* cont = (process_create_cont_t*)token;
+
+    if (as == NULL) {
+        dprintf(3, "proc_clone_part2, Failed to initialise address space\n");
+        _proc_create_end(token, EFAULT);
+        return;
+    }
+    cont->proc->as = as;
+
+    process_t *parent = proc_getproc(cont->parent);
+    if (parent == NULL) {
+        _proc_create_end(token, EFAULT);
+        return;
+    }
+
+    /* No ELF loading, the clone shares the parent's frames until it writes */
+    int err = as_clone(parent->pid, parent->as, cont->proc->pid, as,
+                       _proc_clone_part3, token);
+    if (err) {
+        _proc_create_end(token, err);
+        return;
+    }
+}
+
+static void
+_proc_clone_part3(void *token, int err) {
+    dprintf(3, "proc_clone part3\n");
+    process_create_cont_t* cont = (process_create_cont_t*)token;
+
+    process_t *parent = proc_getproc(cont->parent);
+    if (!err && parent == NULL) {
+        err = EFAULT;
+    }
+    if (err) {
+        dprintf(3, "proc_clone_part3, Failed to clone address space\n");
+        _proc_create_end(token, err);
+        return;
+    }
+
+    err = map_page(cont->proc->ipc_buffer_cap, cont->proc->vroot,
+                   PROCESS_IPC_BUFFER,
+                   seL4_AllRights, seL4_ARM_Default_VMAttributes);
+    if (err) {
+        dprintf(3, "proc_clone_part3, Unable to map IPC buffer for user app\n");
+        _proc_create_end(token, EFAULT);
+        return;
+    }
+    inc_proc_size_proc(cont->proc);
+
+    cont->proc->p_filetable = malloc(sizeof(struct filetable));
+    if (cont->proc->p_filetable == NULL) {
+        dprintf(3, "proc_clone_part3, No memory for filetable\n");
+        _proc_create_end(token, ENOMEM);
+        return;
+    }
+    filetable_copy(parent->p_filetable, cont->proc->p_filetable);
+
+    /* as_clone left the I/O buffer out, the child gets one of its own */
+    if (parent->io_buffer[0] != 0) {
+        err = iobuf_create(cont->proc->pid, _proc_clone_part4, token);
+        if (err) {
+            _proc_create_end(token, err);
+        }
+        return;
+    }
+    _proc_clone_part4(token, 0);
+}
+
+static void
+_proc_clone_part4(void *token, int err) {
+    dprintf(3, "proc_clone part4\n");
+    process_create_cont_t* cont = (process_create_cont_t*)token;
+
+    process_t *parent = proc_getproc(cont->parent);
+    if (!err && parent == NULL) {
+        err = EFAULT;
+    }
+    if (err) {
+        dprintf(3, "proc_clone_part4, Failed to create the I/O buffer or the ring\n");
+        _proc_create_end(token, err);
+        return;
+    }
+
+    /* The same for the syscall ring, this comes back here once it's there */
+    if (parent->ring != 0 && cont->proc->ring == 0) {
+        err = ring_create(cont->proc->pid, _proc_clone_part4, token);
+        if (err) {
+            _proc_create_end(token, err);
+        }
+        return;
+    }
+
+    /*
+     * The parent is blocked in its clone syscall. The child picks up right
+     * after it, as if sos had replied 0 to it: pc points at the swi, the
+     * reply's message info goes in r1 and its first message register in r2
+     */
+    seL4_UserContext context;
+    size_t nregs = sizeof(context) / sizeof(seL4_Word);
+    err = seL4_TCB_ReadRegisters(parent->tcb_cap, false, 0, nregs, &context);
+    if (err) {
+        dprintf(3, "proc_clone_part4, Unable to read the parent's registers\n");
+        _proc_create_end(token, EFAULT);
+        return;
+    }
+    context.pc += 4;
+    context.r0  = 0;
+    context.r1  = seL4_MessageInfo_new(0, 0, 0, 1).words[0];
+    context.r2  = 0;
+    err = seL4_TCB_WriteRegisters(cont->proc->tcb_cap, true, 0, nregs, &context);
+    if (err) {
+        dprintf(3, "proc_clone_part4, Unable to start the child\n");
+        _proc_create_end(token, EFAULT);
+        return;
+    }
+
+    _proc_create_end(token, 0);
+}
+
 /****************************************************************
  *  Process Destroy
  ***************************************************************/
@@ -33,6 +33,14 @@ struct process {
     seL4_Word ipc_buffer_addr;
     seL4_CPtr ipc_buffer_cap;
 
+    seL4_Word io_buffer[PROCESS_IO_BUFFER_PAGES];   // sos addresses of the I/O buffer pages, 0 if none
+
+    seL4_Word ring;             // sos address of the syscall ring, 0 if none
+    seL4_Word ring_aep_addr;
+    seL4_CPtr ring_aep_cap;     // to notify the process of completions
+    seL4_CPtr ring_user_aep;    // the same in the process's cspace
+    int ring_pending;           // entries taken and not completed yet
+
     cspace_t *croot;
 
     addrspace_t *as;
@@ -80,6 +88,11 @@ process_t *proc_getproc(pid_t pid);
  * communicate with sos through the *fault_ep* */
 void proc_create(char* path, size_t len, seL4_CPtr fault_ep, proc_create_cb_t callback, void* token);
 
+/* Create a copy of the process *pid*, sharing its memory copy on write and
+ * its open files. The copy resumes from pid's pending syscall, which
+ * returns 0 in it. The callback gets the new process's pid */
+void proc_clone(pid_t pid, seL4_CPtr fault_ep, proc_create_cb_t callback, void* token);
+
 /* Destroy a process with this pid, clean up process data and return the back
  * to seL4*/
 int proc_destroy(pid_t pid);
@@ -233,6 +233,22 @@ filetable_init(struct filetable *filetable, filetable_init_cb_t callback, void *
     return 0;
 }
 
+void
+filetable_copy(struct filetable *src, struct filetable *dst)
+{
+    int fd;
+
+    assert(src != NULL && dst != NULL);
+
+    for (fd = 0; fd < PROCESS_MAX_FILES; fd++) {
+        struct openfile *file = src->ft_openfiles[fd];
+        if (file != NULL) {
+            file->of_refcount++;
+        }
+        dst->ft_openfiles[fd] = file;
+    }
+}
+
 int
 filetable_findfile(int fd, struct openfile **file)
 {
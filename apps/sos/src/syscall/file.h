@@ -70,6 +70,12 @@ int filetable_init(struct filetable *filetable, filetable_init_cb_t callback, vo
  */
 void filetable_destroy(struct filetable *ft);
 
+/*
+ * filetable_copy
+ * makes DST share every open file of SRC, as in fork.
+ */
+void filetable_copy(struct filetable *src, struct filetable *dst);
+
 /*
  * filetable_findfile
  * verifies that the file descriptor is valid and actually references an
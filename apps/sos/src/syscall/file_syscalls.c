@@ -4,44 +4,70 @@
 #include <errno.h>
 #include <limits.h>
 #include <sel4/sel4.h>
-#include <serial/serial.h>
 #include <fcntl.h>
 
 #include "tool/utility.h"
+#include "tool/slab.h"
 #include "vm/addrspace.h"
 #include "vfs/vfs.h"
 #include "proc/proc.h"
 #include "syscall/syscall.h"
 #include "vm/copyinout.h"
+#include "vm/iobuf.h"
 #include "vm/vm.h"
 #include "vm/swap.h"
 #include "syscall/file.h"
+#include "dev/serial_tx.h"
 
 #define verbose 0
 #include <sys/debug.h>
 
-#define MAX_SERIAL_TRY  0x100
 #define MAX_IO_BUF      0x1000
 
 /**********************************************************************
  * Server Print
  **********************************************************************/
 
+static void
+serv_sys_buf_reply_inval(seL4_CPtr reply_cap) {
+    set_cur_proc(PROC_NULL);
+    seL4_MessageInfo_t reply = seL4_MessageInfo_new(EINVAL, 0, 0, 1);
+    seL4_SetMR(0, (seL4_Word)0);
+    reply_send(reply_cap, reply);
+}
+
 void serv_sys_print(seL4_CPtr reply_cap, char* message, size_t len) {
-    struct serial* serial = serial_init(); //serial_init does the cacheing
+    /* Queued, the serial port gets it with whatever else comes soon */
+    size_t sent = serial_tx_write(message, len);
+
+    set_cur_proc(PROC_NULL);
+    seL4_MessageInfo_t reply = seL4_MessageInfo_new(0, 0, 0, 1);
+    seL4_SetMR(0, (seL4_Word)sent);
+    reply_send(reply_cap, reply);
+}
+
+void serv_sys_print_buf(seL4_CPtr reply_cap, size_t offset, size_t nbyte) {
+    process_t *proc = cur_proc();
+    seL4_Word buf = PROCESS_IO_BUFFER + offset;
+    if (offset > IOBUF_SIZE || !iobuf_contains(proc, buf, nbyte)) {
+        serv_sys_buf_reply_inval(reply_cap);
+        return;
+    }
 
     size_t sent = 0;
-    int tries = 0;
-    while (sent < len && tries < MAX_SERIAL_TRY) {
-        sent += serial_send(serial, message+sent, len-sent);
-        tries++;
+    while (sent < nbyte) {
+        size_t len = MIN(PAGE_SIZE - PAGE_OFFSET(buf + sent), nbyte - sent);
+        size_t queued = serial_tx_write((char*)iobuf_kvaddr(proc, buf + sent), len);
+        sent += queued;
+        if (queued < len) {
+            break;
+        }
     }
 
     set_cur_proc(PROC_NULL);
     seL4_MessageInfo_t reply = seL4_MessageInfo_new(0, 0, 0, 1);
     seL4_SetMR(0, (seL4_Word)sent);
-    seL4_Send(reply_cap, reply);
-    cspace_free_slot(cur_cspace, reply_cap);
+    reply_send(reply_cap, reply);
 }
 
 /**********************************************************************
@@ -56,19 +82,20 @@ typedef struct {
     pid_t pid;
 } cont_open_t;
 
+static SLAB_CACHE(_open_slab, cont_open_t);
+
 static void serv_sys_open_copyin_cb(void *token, int err);
 static void serv_sys_open_end(void *token, int err, int fd);
 
 void serv_sys_open(seL4_CPtr reply_cap, seL4_Word path, size_t nbyte, uint32_t flags){
     dprintf(3, "serv_sys_open called\n");
-    cont_open_t *cont = malloc(sizeof(cont_open_t));
+    cont_open_t *cont = slab_alloc(&_open_slab);
     //dprintf(3, "--serv_cont = %p, size = %u\n", cont, sizeof(cont_open_t));
     if (cont == NULL) {
         set_cur_proc(PROC_NULL);
         seL4_MessageInfo_t reply = seL4_MessageInfo_new(ENOMEM, 0, 0, 1);
         seL4_SetMR(0, (seL4_Word)-1);
-        seL4_Send(reply_cap, reply);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_send(reply_cap, reply);
         return;
     }
     cont->reply_cap = reply_cap;
@@ -126,8 +153,8 @@ serv_sys_open_end(void *token, int err, int fd) {
 
     if (!is_proc_alive(cont->pid)) {
         dprintf(3, "serv_sys_open_end: proc is killed\n");
-        cspace_free_slot(cur_cspace, cont->reply_cap);
-        free(cont);
+        reply_cap_free(cont->reply_cap);
+        slab_free(&_open_slab, cont);
         return;
     }
     set_cur_proc(PROC_NULL);
@@ -142,132 +169,342 @@ serv_sys_open_end(void *token, int err, int fd) {
     seL4_MessageInfo_t reply;
     reply = seL4_MessageInfo_new(err, 0, 0, 1);
     seL4_SetMR(0, (seL4_Word)fd);
-    seL4_Send(cont->reply_cap, reply);
-    cspace_free_slot(cur_cspace, cont->reply_cap);
+    reply_send(cont->reply_cap, reply);
     dprintf(3, "--serv_cont_end = %p\n", cont);
 
-    free(cont);
+    slab_free(&_open_slab, cont);
 }
 
 /**********************************************************************
  * Server File Close
  **********************************************************************/
 
+typedef struct {
+    seL4_CPtr reply_cap;
+    int fd;
+    pid_t pid;
+} cont_close_t;
+
+static SLAB_CACHE(_close_slab, cont_close_t);
+
+static void serv_sys_close_end(void *token, int err);
+
+/* Writes are flushed before closing, their errors are reported here */
 void serv_sys_close(seL4_CPtr reply_cap, int fd){
     int err = 0;
     //dprintf(3, "fd = %d\n", fd);
+    struct openfile *file = NULL;
     if (fd < 0 || fd >= PROCESS_MAX_FILES) {
         err = EINVAL;
     }
 
-    err = err || file_close(fd);
+    err = err || filetable_findfile(fd, &file);
+
+    cont_close_t *cont = NULL;
+    if (!err) {
+        cont = slab_alloc(&_close_slab);
+        err = (cont == NULL) ? ENOMEM : 0;
+    }
+    if (err) {
+        set_cur_proc(PROC_NULL);
+        seL4_MessageInfo_t reply = seL4_MessageInfo_new(err, 0, 0, 0);
+        reply_send(reply_cap, reply);
+        return;
+    }
+    cont->reply_cap = reply_cap;
+    cont->fd        = fd;
+    cont->pid       = proc_get_id();
+
+    vfs_flush(file->of_vnode, serv_sys_close_end, (void*)cont);
+}
+
+static void serv_sys_close_end(void *token, int err){
+    cont_close_t *cont = (cont_close_t*)token;
+    assert(cont != NULL);
+
+    if (!is_proc_alive(cont->pid)) {
+        dprintf(3, "serv_sys_close_end: proc is killed\n");
+        reply_cap_free(cont->reply_cap);
+        slab_free(&_close_slab, cont);
+        return;
+    }
+    set_cur_proc(cont->pid);
+
+    /* The file is closed anyway, the flush error is only reported */
+    int close_err = file_close(cont->fd);
+    err = err ? err : close_err;
 
     set_cur_proc(PROC_NULL);
     seL4_MessageInfo_t reply = seL4_MessageInfo_new(err, 0, 0, 0);
-    seL4_Send(reply_cap, reply);
-    cspace_free_slot(cur_cspace, reply_cap);
+    reply_send(cont->reply_cap, reply);
+    slab_free(&_close_slab, cont);
 }
 
 /**********************************************************************
  * Server File Read
  **********************************************************************/
 
+/*
+ * A read of a plain file is split into pieces that don't cross a page of the
+ * file, up to VFS_IO_WINDOW of them are read at the same time. They are put
+ * back together in order and the reply goes out once. Other files (the
+ * console) are read one piece after the other
+ */
+typedef struct {
+    size_t offset;      // in the request
+    size_t len;
+    size_t size;        // what we got
+    int err;
+    bool more;
+    bool done;
+} read_piece_t;
+
 typedef struct {
     seL4_CPtr reply_cap;
+    serv_io_cb_t callback;  // if set, called instead of replying on reply_cap
+    void *token;
     struct openfile *file;
-    size_t bytes_read;
+    size_t start;           // the file offset when we started
+    size_t bytes_read;      // the pieces put back together so far
+    size_t bytes_issued;    // the pieces asked for so far
     size_t bytes_wanted;
     char* buf;
     pid_t pid;
+    int err;
+    bool stop;              // end of the file, an error or the process died
+    bool dead;
+    bool busy;              // in serv_sys_read_progress, don't go in again
+    int window;             // max pieces in flight
+    int head;               // oldest piece in pieces[]
+    int npieces;
+    int inflight;
+    read_piece_t pieces[VFS_IO_WINDOW];
 } cont_read_t;
 
-void serv_sys_read_end(void *token, int err, size_t size, bool more_to_read);
+static SLAB_CACHE(_read_slab, cont_read_t);
 
-void serv_sys_read(seL4_CPtr reply_cap, int fd, seL4_Word buf, size_t nbyte){
+typedef struct {
+    cont_read_t *cont;
+    int index;
+} read_piece_token_t;
+
+static SLAB_CACHE(_read_piece_slab, read_piece_token_t);
+
+static void serv_sys_read_progress(cont_read_t *cont);
+static void serv_sys_read_piece_cb(void *token, int err, size_t size, bool more_to_read);
+static void serv_sys_read_end(cont_read_t *cont, int err);
+
+static void
+serv_sys_read_start(seL4_CPtr reply_cap, serv_io_cb_t callback, void *token,
+                    int fd, seL4_Word buf, size_t nbyte){
     //dprintf(3, "serv read\n");
     int err;
-    cont_read_t *cont = malloc(sizeof(cont_read_t));
+    cont_read_t *cont = slab_alloc(&_read_slab);
     if (cont == NULL) {
+        if (callback != NULL) {
+            callback(token, ENOMEM, 0);
+            return;
+        }
         set_cur_proc(PROC_NULL);
         seL4_MessageInfo_t reply = seL4_MessageInfo_new(ENOMEM, 0, 0, 1);
         seL4_SetMR(0, (seL4_Word)0);
-        seL4_Send(reply_cap, reply);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_send(reply_cap, reply);
         return;
     }
-    cont->reply_cap = reply_cap;
-    cont->file = NULL;
-    cont->buf = (char*)buf;
-    cont->bytes_read = 0;
+    cont->reply_cap    = reply_cap;
+    cont->callback     = callback;
+    cont->token        = token;
+    cont->file         = NULL;
+    cont->buf          = (char*)buf;
+    cont->start        = 0;
+    cont->bytes_read   = 0;
+    cont->bytes_issued = 0;
     cont->bytes_wanted = nbyte;
-    cont->pid = proc_get_id();
+    cont->pid          = proc_get_id();
+    cont->err          = 0;
+    cont->stop         = false;
+    cont->dead         = false;
+    cont->busy         = false;
+    cont->window       = 1;
+    cont->head         = 0;
+    cont->npieces      = 0;
+    cont->inflight     = 0;
 
-    //have to read multiple times if nbyte >= MAX_IO_BUF
-    bool is_inval = (fd < 0) || (fd >= PROCESS_MAX_FILES);// || (nbyte >= MAX_IO_BUF);
+    bool is_inval = (fd < 0) || (fd >= PROCESS_MAX_FILES);
 
     uint32_t permissions = 0;
     is_inval = is_inval || (!as_is_valid_memory(proc_getas(), buf, nbyte, &permissions));
     is_inval = is_inval || (!(permissions & seL4_CanWrite));
     if(is_inval){
-        serv_sys_read_end((void*)cont, EINVAL, 0, false);
+        serv_sys_read_end(cont, EINVAL);
         return;
     }
 
     struct openfile *file;
     err = filetable_findfile(fd, &file);
     if (err) {
-        serv_sys_read_end((void*)cont, EINVAL, 0, false);
+        serv_sys_read_end(cont, EINVAL);
         return;
     }
-    cont->file = file;
+    cont->file  = file;
+    cont->start = file->of_offset;
 
     //check read permissions
     if(file->of_accmode != O_RDWR &&
         file->of_accmode != O_RDONLY){
-        serv_sys_read_end((void*)cont, EACCES, 0, false);
+        serv_sys_read_end(cont, EACCES);
         return;
     }
 
-    VOP_READ(file->of_vnode, (char*)buf, MIN(nbyte, MAX_IO_BUF),
-            file->of_offset, serv_sys_read_end, (void*)cont);
+    if (file->of_vnode->sattr.st_type == ST_FILE) {
+        cont->window = VFS_IO_WINDOW;
+    }
+    serv_sys_read_progress(cont);
     //dprintf(3, "serv read finish\n");
 }
 
-void serv_sys_read_end(void *token, int err, size_t size, bool more_to_read){
-    //dprintf(3, "serv_read_end called\n");
-    //dprintf(3, "serv_read_end size = %u\n", size);
-    cont_read_t *cont = (cont_read_t*)token;
+void serv_sys_read(seL4_CPtr reply_cap, int fd, seL4_Word buf, size_t nbyte){
+    serv_sys_read_start(reply_cap, NULL, NULL, fd, buf, nbyte);
+}
 
-    if (!is_proc_alive(cont->pid)) {
-        dprintf(3, "serv_sys_read_end: proc is killed\n");
-        cspace_free_slot(cur_cspace, cont->reply_cap);
-        free(cont);
-        return;
+void serv_read(int fd, seL4_Word buf, size_t nbyte, serv_io_cb_t callback, void *token){
+    serv_sys_read_start(0, callback, token, fd, buf, nbyte);
+}
+
+/* Put the pieces that came back in order together */
+static void
+serv_sys_read_reassemble(cont_read_t *cont) {
+    while (cont->npieces > 0 && cont->pieces[cont->head].done) {
+        read_piece_t *piece = &cont->pieces[cont->head];
+        cont->head = (cont->head + 1) % VFS_IO_WINDOW;
+        cont->npieces--;
+        if (cont->stop) {
+            /* What comes after the end is thrown away */
+            continue;
+        }
+
+        cont->bytes_read += piece->size;
+        if (piece->err) {
+            cont->err  = piece->err;
+            cont->stop = true;
+        } else if (!piece->more || (piece->size < piece->len && cont->npieces > 0)) {
+            /* Short with pieces after it, what they got doesn't follow on */
+            cont->stop = true;
+        } else if (piece->size < piece->len) {
+            /* Short but nothing after it, carry on from there */
+            cont->bytes_issued = cont->bytes_read;
+        }
+    }
+}
+
+static void
+serv_sys_read_progress(cont_read_t *cont) {
+    cont->busy = true;
+    for (;;) {
+        serv_sys_read_reassemble(cont);
+        if (cont->stop || cont->bytes_issued >= cont->bytes_wanted ||
+                cont->npieces >= cont->window) {
+            break;
+        }
+
+        read_piece_token_t *t = slab_alloc(&_read_piece_slab);
+        if (t == NULL) {
+            if (cont->npieces == 0) {
+                cont->err = ENOMEM;
+            }
+            cont->stop = true;
+            break;
+        }
+        int index = (cont->head + cont->npieces) % VFS_IO_WINDOW;
+        read_piece_t *piece = &cont->pieces[index];
+        size_t offset = cont->start + cont->bytes_issued;
+        piece->offset = cont->bytes_issued;
+        piece->len    = (cont->window > 1) ? PAGE_SIZE - PAGE_OFFSET(offset) : MAX_IO_BUF;
+        piece->len    = MIN(piece->len, cont->bytes_wanted - cont->bytes_issued);
+        piece->size   = 0;
+        piece->err    = 0;
+        piece->more   = false;
+        piece->done   = false;
+        t->cont  = cont;
+        t->index = index;
+
+        cont->bytes_issued += piece->len;
+        cont->npieces++;
+        cont->inflight++;
+        /* May come back before it returns, we only take note of it then */
+        VOP_READ(cont->file->of_vnode, cont->buf + piece->offset, piece->len,
+                 offset, serv_sys_read_piece_cb, (void*)t);
+        set_cur_proc(cont->pid);
+    }
+    cont->busy = false;
+
+    if (cont->inflight == 0) {
+        serv_sys_read_end(cont, cont->err);
     }
+}
+
+static void
+serv_sys_read_piece_cb(void *token, int err, size_t size, bool more_to_read){
+    read_piece_token_t *t = (read_piece_token_t*)token;
+    cont_read_t *cont = t->cont;
+    read_piece_t *piece = &cont->pieces[t->index];
+    slab_free(&_read_piece_slab, t);
 
-    /* Update file offset */
-    if(!err){
-        cont->file->of_offset += size;
-        cont->bytes_read += size;
+    piece->size = err ? 0 : size;
+    piece->err  = err;
+    piece->more = more_to_read;
+    piece->done = true;
+    cont->inflight--;
+
+    if (!cont->dead && !is_proc_alive(cont->pid)) {
+        dprintf(3, "serv_sys_read_piece_cb: proc is killed\n");
+        cont->dead = true;
+        cont->stop = true;
+    }
+    if (cont->busy) {
+        return;
+    }
+    if (cont->dead) {
+        if (cont->inflight == 0) {
+            serv_sys_read_end(cont, EFAULT);
+        }
+        return;
     }
+    set_cur_proc(cont->pid);
+    serv_sys_read_progress(cont);
+}
 
+static void
+serv_sys_read_end(cont_read_t *cont, int err){
     //dprintf(3, "serv_read_end bytes_read = %u, bytes_wanted = %u\n", cont->bytes_read, cont->bytes_wanted);
-    if(err || !more_to_read || cont->bytes_read >= cont->bytes_wanted){
-        /* Reply app*/
-        set_cur_proc(PROC_NULL);
-        seL4_MessageInfo_t reply = seL4_MessageInfo_new(err, 0, 0, 1);
-        seL4_SetMR(0, (seL4_Word)cont->bytes_read);
-        seL4_Send(cont->reply_cap, reply);
-        cspace_free_slot(cur_cspace, cont->reply_cap);
+    if (cont->dead || !is_proc_alive(cont->pid)) {
+        dprintf(3, "serv_sys_read_end: proc is killed\n");
+        if (cont->callback != NULL) {
+            cont->callback(cont->token, EFAULT, 0);
+        } else {
+            reply_cap_free(cont->reply_cap);
+        }
+        slab_free(&_read_slab, cont);
+        return;
+    }
 
-        free(cont);
-    } else {
-        /* Theres more stuff to read */
-        VOP_READ(cont->file->of_vnode, cont->buf + cont->bytes_read,
-                 MIN(cont->bytes_wanted - cont->bytes_read, MAX_IO_BUF),
-                 cont->file->of_offset, serv_sys_read_end, (void*)cont);
+    if (cont->file != NULL) {
+        cont->file->of_offset = cont->start + cont->bytes_read;
     }
-    //dprintf(3, "serv_read_end out\n");
+
+    if (cont->callback != NULL) {
+        cont->callback(cont->token, err, cont->bytes_read);
+        slab_free(&_read_slab, cont);
+        return;
+    }
+
+    /* Reply app*/
+    set_cur_proc(PROC_NULL);
+    seL4_MessageInfo_t reply = seL4_MessageInfo_new(err, 0, 0, 1);
+    seL4_SetMR(0, (seL4_Word)cont->bytes_read);
+    reply_send(cont->reply_cap, reply);
+
+    slab_free(&_read_slab, cont);
 }
 
 /**********************************************************************
@@ -276,6 +513,8 @@ void serv_sys_read_end(void *token, int err, size_t size, bool more_to_read){
 
 typedef struct {
     seL4_CPtr reply_cap;
+    serv_io_cb_t callback;  // if set, called instead of replying on reply_cap
+    void *token;
     struct openfile *file;
     char *buf;
     char *kbuf;
@@ -283,28 +522,38 @@ typedef struct {
     size_t byte_written;
     size_t wanna_send;
     pid_t pid;
+    bool shared;            // buf is in the I/O buffer, written from where it is
 } cont_write_t;
 
+static SLAB_CACHE(_write_slab, cont_write_t);
+
 static void serv_sys_write_get_kbuf(void *token, seL4_Word kvaddr);
 static void serv_sys_write_copyin(void *token, int err, size_t size);
 static void serv_sys_write_do_write(void *token, int err);
 static void serv_sys_write_end(cont_write_t* cont, int err);
 
-void serv_sys_write(seL4_CPtr reply_cap, int fd, seL4_Word buf, size_t nbyte) {
+static void
+serv_sys_write_start(seL4_CPtr reply_cap, serv_io_cb_t callback, void *token,
+                     int fd, seL4_Word buf, size_t nbyte) {
 
     dprintf(3, "serv_sys_write called\n");
     int err;
 
-    cont_write_t *cont = malloc(sizeof(cont_write_t));
+    cont_write_t *cont = slab_alloc(&_write_slab);
     if (cont == NULL) {
+        if (callback != NULL) {
+            callback(token, ENOMEM, 0);
+            return;
+        }
         set_cur_proc(PROC_NULL);
         seL4_MessageInfo_t reply = seL4_MessageInfo_new(ENOMEM, 0, 0, 1);
         seL4_SetMR(0, (seL4_Word)0);
-        seL4_Send(reply_cap, reply);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_send(reply_cap, reply);
         return;
     }
     cont->reply_cap  = reply_cap;
+    cont->callback   = callback;
+    cont->token      = token;
     cont->file       = NULL;
     cont->buf        = (char*)buf;
     cont->kbuf       = NULL;
@@ -312,6 +561,7 @@ void serv_sys_write(seL4_CPtr reply_cap, int fd, seL4_Word buf, size_t nbyte) {
     cont->byte_written  = 0;
     cont->wanna_send = 0;
     cont->pid        = proc_get_id();
+    cont->shared     = false;
 
     addrspace_t *as = proc_getas();
     bool is_inval = (fd < 0) || (fd >= PROCESS_MAX_FILES);
@@ -336,6 +586,13 @@ void serv_sys_write(seL4_CPtr reply_cap, int fd, seL4_Word buf, size_t nbyte) {
         return;
     }
 
+    /* Nothing to copy in, the driver takes it out of the I/O buffer */
+    if (iobuf_contains(cur_proc(), buf, nbyte)) {
+        cont->shared = true;
+        serv_sys_write_copyin((void*)cont, 0, 0);
+        return;
+    }
+
     err = frame_alloc(0, NULL, PROC_NULL, true, serv_sys_write_get_kbuf, (void*)cont);
     if (err) {
         serv_sys_write_end(cont, EFAULT);
@@ -343,6 +600,14 @@ void serv_sys_write(seL4_CPtr reply_cap, int fd, seL4_Word buf, size_t nbyte) {
     }
 }
 
+void serv_sys_write(seL4_CPtr reply_cap, int fd, seL4_Word buf, size_t nbyte) {
+    serv_sys_write_start(reply_cap, NULL, NULL, fd, buf, nbyte);
+}
+
+void serv_write(int fd, seL4_Word buf, size_t nbyte, serv_io_cb_t callback, void *token) {
+    serv_sys_write_start(0, callback, token, fd, buf, nbyte);
+}
+
 static void
 serv_sys_write_get_kbuf(void *token, seL4_Word kvaddr) {
     cont_write_t *cont = (cont_write_t*)token;
@@ -378,6 +643,17 @@ serv_sys_write_copyin(void *token, int err, size_t size) {
         cont->wanna_send = MIN(cont->wanna_send, cont->nbyte - cont->byte_written);
         dprintf(3, "wanna_send = %u\n", cont->wanna_send);
 
+        if (cont->shared) {
+            process_t *proc = proc_getproc(cont->pid);
+            if (proc == NULL) {
+                serv_sys_write_end(cont, EFAULT);
+                return;
+            }
+            VOP_WRITE(cont->file->of_vnode, (char*)iobuf_kvaddr(proc, vaddr), cont->wanna_send,
+                    cont->file->of_offset, serv_sys_write_copyin, (void*)cont);
+            return;
+        }
+
         err = copyin((seL4_Word)cont->kbuf, (seL4_Word)vaddr, cont->wanna_send,
                 serv_sys_write_do_write, (void*)cont);
         if (err) {
@@ -417,8 +693,21 @@ void serv_sys_write_end(cont_write_t* cont, int err) {
             frame_free((seL4_Word)cont->kbuf);
         }
 
-        cspace_free_slot(cur_cspace, cont->reply_cap);
-        free(cont);
+        if (cont->callback != NULL) {
+            cont->callback(cont->token, EFAULT, 0);
+        } else {
+            reply_cap_free(cont->reply_cap);
+        }
+        slab_free(&_write_slab, cont);
+        return;
+    }
+
+    if (cont->callback != NULL) {
+        if (cont->kbuf != NULL) {
+            frame_free((seL4_Word)cont->kbuf);
+        }
+        cont->callback(cont->token, err, cont->byte_written);
+        slab_free(&_write_slab, cont);
         return;
     }
 
@@ -427,13 +716,35 @@ void serv_sys_write_end(cont_write_t* cont, int err) {
     /* Reply app*/
     seL4_MessageInfo_t reply = seL4_MessageInfo_new(err, 0, 0, 1);
     seL4_SetMR(0, (seL4_Word)cont->byte_written);
-    seL4_Send(cont->reply_cap, reply);
-    cspace_free_slot(cur_cspace, cont->reply_cap);
+    reply_send(cont->reply_cap, reply);
 
     if (cont->kbuf != NULL) {
         frame_free((seL4_Word)cont->kbuf);
     }
-    free(cont);
+    slab_free(&_write_slab, cont);
+}
+
+/**********************************************************************
+ * Server File Read & Write Through The I/O Buffer
+ **********************************************************************/
+
+void serv_sys_read_buf(seL4_CPtr reply_cap, int fd, size_t offset, size_t nbyte) {
+    seL4_Word buf = PROCESS_IO_BUFFER + offset;
+    if (offset > IOBUF_SIZE || !iobuf_contains(cur_proc(), buf, nbyte)) {
+        serv_sys_buf_reply_inval(reply_cap);
+        return;
+    }
+    /* The drivers' copyout goes straight into the buffer */
+    serv_sys_read(reply_cap, fd, buf, nbyte);
+}
+
+void serv_sys_write_buf(seL4_CPtr reply_cap, int fd, size_t offset, size_t nbyte) {
+    seL4_Word buf = PROCESS_IO_BUFFER + offset;
+    if (offset > IOBUF_SIZE || !iobuf_contains(cur_proc(), buf, nbyte)) {
+        serv_sys_buf_reply_inval(reply_cap);
+        return;
+    }
+    serv_sys_write(reply_cap, fd, buf, nbyte);
 }
 
 /**********************************************************************
@@ -455,8 +766,7 @@ void serv_sys_getdirent(seL4_CPtr reply_cap, int pos, char* name, size_t nbyte){
         set_cur_proc(PROC_NULL);
         seL4_MessageInfo_t reply = seL4_MessageInfo_new(ENOMEM, 0, 0, 1);
         seL4_SetMR(0, (seL4_Word)0);
-        seL4_Send(reply_cap, reply);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_send(reply_cap, reply);
         return;
     }
     cont->reply_cap = reply_cap;
@@ -484,7 +794,7 @@ static void serv_sys_getdirent_end(void *token, int err, size_t size) {
 
     if (!is_proc_alive(cont->pid)) {
         dprintf(3, "serv_sys_getdirent_end: proc is killed\n");
-        cspace_free_slot(cur_cspace, cont->reply_cap);
+        reply_cap_free(cont->reply_cap);
         free(cont);
         return;
     }
@@ -492,8 +802,7 @@ static void serv_sys_getdirent_end(void *token, int err, size_t size) {
     set_cur_proc(PROC_NULL);
     seL4_MessageInfo_t reply = seL4_MessageInfo_new(err, 0, 0, 1);
     seL4_SetMR(0, (seL4_Word)size);
-    seL4_Send(cont->reply_cap, reply);
-    cspace_free_slot(cur_cspace, cont->reply_cap);
+    reply_send(cont->reply_cap, reply);
 
     free(cont);
 }
@@ -522,8 +831,7 @@ void serv_sys_stat(seL4_CPtr reply_cap, char *path, size_t path_len, sos_stat_t
     if(cont == NULL){
         set_cur_proc(PROC_NULL);
         seL4_MessageInfo_t reply = seL4_MessageInfo_new(ENOMEM, 0, 0, 0);
-        seL4_Send(reply_cap, reply);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_send(reply_cap, reply);
         return;
     }
     cont->reply_cap = reply_cap;
@@ -583,7 +891,7 @@ static void serv_sys_stat_end(void *token, int err){
 
     if (!is_proc_alive(cont->pid)) {
         dprintf(3, "serv_sys_stat_end: proc is killed\n");
-        cspace_free_slot(cur_cspace, cont->reply_cap);
+        reply_cap_free(cont->reply_cap);
         free(cont);
         return;
     }
@@ -597,8 +905,7 @@ static void serv_sys_stat_end(void *token, int err){
 
     /* reply sosh*/
     seL4_MessageInfo_t reply = seL4_MessageInfo_new(err, 0, 0, 0);
-    seL4_Send(cont->reply_cap, reply);
-    cspace_free_slot(cur_cspace, cont->reply_cap);
+    reply_send(cont->reply_cap, reply);
 
     free(cont);
 }
@@ -35,8 +35,7 @@ void serv_proc_create(char* path, size_t len, seL4_CPtr fault_ep, seL4_CPtr repl
         seL4_MessageInfo_t reply;
         reply = seL4_MessageInfo_new(ENOMEM, 0, 0, 1);
         seL4_SetMR(0, -1);
-        seL4_Send(reply_cap, reply);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_send(reply_cap, reply);
         return;
     }
     cont->kpath     = NULL;
@@ -90,13 +89,57 @@ serv_proc_create_end(void* token, int err, pid_t pid){
     seL4_MessageInfo_t reply;
     reply = seL4_MessageInfo_new(err, 0, 0, 1);
     seL4_SetMR(0, pid);
-    seL4_Send(cont->reply_cap, reply);
-    cspace_free_slot(cur_cspace, cont->reply_cap);
+    reply_send(cont->reply_cap, reply);
 
     if (cont->kpath) free(cont->kpath);
     free(cont);
 }
 
+/**********************************************************************
+ * Server Process Clone
+ **********************************************************************/
+
+typedef struct{
+    seL4_CPtr reply_cap;
+    pid_t pid;
+} serv_proc_clone_cont_t;
+
+static void serv_proc_clone_end(void* token, int err, pid_t pid);
+
+void serv_proc_clone(seL4_CPtr fault_ep, seL4_CPtr reply_cap){
+    dprintf(3, "serv_proc_clone entered\n");
+    serv_proc_clone_cont_t* cont = malloc(sizeof(serv_proc_clone_cont_t));
+    if(cont == NULL){
+        set_cur_proc(PROC_NULL);
+        seL4_MessageInfo_t reply;
+        reply = seL4_MessageInfo_new(ENOMEM, 0, 0, 1);
+        seL4_SetMR(0, -1);
+        reply_send(reply_cap, reply);
+        return;
+    }
+    cont->reply_cap = reply_cap;
+    cont->pid       = proc_get_id();
+
+    proc_clone(cont->pid, fault_ep, serv_proc_clone_end, (void*)cont);
+}
+
+static void
+serv_proc_clone_end(void* token, int err, pid_t pid){
+    dprintf(3, "serv_proc_clone_end, err = %d\n", err);
+    serv_proc_clone_cont_t* cont = (serv_proc_clone_cont_t*)token;
+
+    set_cur_proc(PROC_NULL);
+    if (is_proc_alive(cont->pid)) {
+        seL4_MessageInfo_t reply;
+        reply = seL4_MessageInfo_new(err, 0, 0, 1);
+        seL4_SetMR(0, pid);
+        reply_send(cont->reply_cap, reply);
+    } else {
+        reply_cap_free(cont->reply_cap);
+    }
+    free(cont);
+}
+
 /**********************************************************************
  * Server Process Destroy
  **********************************************************************/
@@ -113,8 +156,7 @@ void serv_proc_destroy(pid_t pid, seL4_CPtr reply_cap){
         seL4_MessageInfo_t reply;
         reply = seL4_MessageInfo_new(err, 0, 0, 1);
         seL4_SetMR(0, (seL4_Word)err);
-        seL4_Send(reply_cap, reply);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_send(reply_cap, reply);
     }
 
     set_cur_proc(PROC_NULL);
@@ -133,8 +175,7 @@ void serv_proc_get_id(seL4_CPtr reply_cap){
     seL4_MessageInfo_t reply;
     reply = seL4_MessageInfo_new(0, 0, 0, 1);
     seL4_SetMR(0, id);
-    seL4_Send(reply_cap, reply);
-    cspace_free_slot(cur_cspace, reply_cap);
+    reply_send(reply_cap, reply);
     return;
 }
 
@@ -158,8 +199,7 @@ void serv_proc_wait(pid_t pid, seL4_CPtr reply_cap){
         seL4_MessageInfo_t reply;
         reply = seL4_MessageInfo_new(0, 0, 0, 1);
         seL4_SetMR(0, -1);
-        seL4_Send(reply_cap, reply);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_send(reply_cap, reply);
 
         set_cur_proc(PROC_NULL);
         return;
@@ -186,9 +226,10 @@ serv_proc_wait_cb(void *token, pid_t pid) {
         seL4_MessageInfo_t reply;
         reply = seL4_MessageInfo_new(0, 0, 0, 1);
         seL4_SetMR(0, (seL4_Word)pid);
-        seL4_Send(cont->reply_cap, reply);
+        reply_send(cont->reply_cap, reply);
+    } else {
+        reply_cap_free(cont->reply_cap);
     }
-    cspace_free_slot(cur_cspace, cont->reply_cap);
     free(cont);
 
     dprintf(3, "serv_proc_wait_cb ended\n");
@@ -219,8 +260,7 @@ void serv_proc_status(seL4_Word buf, unsigned max, seL4_CPtr reply_cap){
         //send message back
         seL4_MessageInfo_t reply;
         reply = seL4_MessageInfo_new(ENOMEM, 0, 0, 0);
-        seL4_Send(reply_cap, reply);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_send(reply_cap, reply);
         return;
     }
     cont->reply_cap = reply_cap;
@@ -281,9 +321,10 @@ void serv_proc_status_end(void* token, int err){
         seL4_MessageInfo_t reply;
         reply = seL4_MessageInfo_new(err, 0, 0, 1);
         seL4_SetMR(0, cont->num);
-        seL4_Send(cont->reply_cap, reply);
+        reply_send(cont->reply_cap, reply);
+    } else {
+        reply_cap_free(cont->reply_cap);
     }
-    cspace_free_slot(cur_cspace, cont->reply_cap);
     free(cont);
 }
 
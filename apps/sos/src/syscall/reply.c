@@ -0,0 +1,95 @@
+#include <assert.h>
+#include <errno.h>
+#include <sel4/sel4.h>
+#include <cspace/cspace.h>
+
+#include "syscall/reply.h"
+
+#define verbose 0
+#include <sys/debug.h>
+
+/* Slots kept around for reply caps, enough for every process to be blocked
+ * in a syscall and a fault at the same time */
+#define REPLY_POOL_SIZE     (64)
+
+static struct {
+    seL4_CPtr slots[REPLY_POOL_SIZE];
+    int nfree;
+    bool pending;               // a reply for REPLY_CALLER is recorded
+    seL4_MessageInfo_t msg;
+} _reply;
+
+int
+reply_init(void) {
+    for (int i = 0; i < REPLY_POOL_SIZE; i++) {
+        seL4_CPtr slot = cspace_alloc_slot(cur_cspace);
+        if (slot == CSPACE_NULL) {
+            return ENOMEM;
+        }
+        _reply.slots[_reply.nfree++] = slot;
+    }
+    _reply.pending = false;
+    return 0;
+}
+
+seL4_CPtr
+reply_cap_save(void) {
+    seL4_CPtr slot;
+    if (_reply.nfree > 0) {
+        slot = _reply.slots[--_reply.nfree];
+    } else {
+        /* More callers blocked than we planned for */
+        slot = cspace_alloc_slot(cur_cspace);
+        assert(slot != CSPACE_NULL);
+    }
+
+    seL4_Error err = seL4_CNode_SaveCaller(cur_cspace->root_cnode, slot, CSPACE_DEPTH);
+    assert(err == seL4_NoError);
+    return slot;
+}
+
+/* The slot is empty again, keep it for the next caller */
+static void
+_reply_slot_put(seL4_CPtr slot) {
+    if (_reply.nfree < REPLY_POOL_SIZE) {
+        _reply.slots[_reply.nfree++] = slot;
+    } else {
+        cspace_free_slot(cur_cspace, slot);
+    }
+}
+
+void
+reply_cap_free(seL4_CPtr reply_cap) {
+    if (reply_cap == REPLY_CALLER) {
+        return;
+    }
+    /* The reply cap was never used so it is still in the slot */
+    seL4_Error err = seL4_CNode_Delete(cur_cspace->root_cnode, reply_cap, CSPACE_DEPTH);
+    if (err != seL4_NoError) {
+        dprintf(3, "reply_cap_free: failed to delete reply cap %d\n", (int)reply_cap);
+    }
+    _reply_slot_put(reply_cap);
+}
+
+void
+reply_send(seL4_CPtr reply_cap, seL4_MessageInfo_t msg) {
+    if (reply_cap == REPLY_CALLER) {
+        assert(!_reply.pending);
+        _reply.pending = true;
+        _reply.msg     = msg;
+        return;
+    }
+    /* Sending on a reply cap deletes it */
+    seL4_Send(reply_cap, msg);
+    _reply_slot_put(reply_cap);
+}
+
+bool
+reply_pending(seL4_MessageInfo_t *msg) {
+    if (!_reply.pending) {
+        return false;
+    }
+    _reply.pending = false;
+    *msg = _reply.msg;
+    return true;
+}
@@ -0,0 +1,50 @@
+#ifndef _SOS_REPLY_H_
+#define _SOS_REPLY_H_
+
+#include <stdbool.h>
+#include <sel4/sel4.h>
+
+/*
+ * Replying to syscalls and faults.
+ * Syscalls that are answered before their handler returns are given
+ * REPLY_CALLER instead of a reply cap, their reply goes out with the
+ * seL4_ReplyWait that waits for the next message and the CSpace is never
+ * touched. Everything else saves its caller into one of a pool of slots
+ * that is allocated once and reused.
+ */
+
+/* The caller of the syscall being handled, it's replied to from the syscall
+ * loop */
+#define REPLY_CALLER        (seL4_CapNull)
+
+/*
+ * Allocate the pool of reply cap slots
+ * Returns 0 on success
+ */
+int reply_init(void);
+
+/*
+ * Save the caller into a slot of the pool
+ * Returns the reply cap
+ */
+seL4_CPtr reply_cap_save(void);
+
+/*
+ * Give back REPLY_CAP without replying on it, e.g. the caller is killed
+ */
+void reply_cap_free(seL4_CPtr reply_cap);
+
+/*
+ * Reply with MSG and whatever is in the message registers, then give back
+ * REPLY_CAP. For REPLY_CALLER the reply is only recorded, the syscall loop
+ * sends it and nothing may touch the message registers in between
+ */
+void reply_send(seL4_CPtr reply_cap, seL4_MessageInfo_t msg);
+
+/*
+ * Take the reply recorded for REPLY_CALLER if there is one
+ * Returns true if MSG is to be sent
+ */
+bool reply_pending(seL4_MessageInfo_t *msg);
+
+#endif /* _SOS_REPLY_H_ */
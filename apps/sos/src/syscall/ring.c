@@ -0,0 +1,423 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <cspace/cspace.h>
+#include <ut_manager/ut.h>
+#include <sel4/sel4.h>
+
+#include "tool/utility.h"
+#include "tool/slab.h"
+#include "syscall/syscall.h"
+#include "syscall/ring.h"
+#include "vm/addrspace.h"
+#include "dev/clock.h"
+#include "proc/proc.h"
+
+#define verbose 0
+#include <sys/debug.h>
+
+/* sos and the processes run on the one core, the compiler just must not
+ * move the entries past the index that publishes them */
+#define RING_BARRIER()  asm volatile("" ::: "memory")
+
+/* An entry taken off the submission queue */
+typedef struct ring_op ring_op_t;
+struct ring_op {
+    pid_t pid;
+    sos_sqe_t sqe;          // a copy, the process may reuse the slot
+    ring_op_t *link;        // the rest of the chain, started after this one
+};
+
+static SLAB_CACHE(_ring_op_slab, ring_op_t);
+
+static void _ring_op_start(ring_op_t *op);
+
+/**********************************************************************
+ * Ring Create
+ **********************************************************************/
+
+typedef struct {
+    pid_t pid;
+    ring_create_cb_t callback;
+    void *token;
+} ring_create_cont_t;
+
+static SLAB_CACHE(_ring_create_slab, ring_create_cont_t);
+
+static void _ring_create_mapped(void *token, int err);
+
+static int
+_ring_create_aep(process_t *proc) {
+    proc->ring_aep_addr = ut_alloc(seL4_EndpointBits);
+    if (!proc->ring_aep_addr) {
+        return ENOMEM;
+    }
+    int err = cspace_ut_retype_addr(proc->ring_aep_addr,
+                                    seL4_AsyncEndpointObject,
+                                    seL4_EndpointBits,
+                                    cur_cspace,
+                                    &proc->ring_aep_cap);
+    if (err) {
+        ut_free(proc->ring_aep_addr, seL4_EndpointBits);
+        proc->ring_aep_addr = 0;
+        return EFAULT;
+    }
+
+    /* The process only waits on it */
+    proc->ring_user_aep = cspace_copy_cap(proc->croot, cur_cspace,
+                                          proc->ring_aep_cap, seL4_AllRights);
+    if (proc->ring_user_aep == CSPACE_NULL) {
+        proc->ring_user_aep = 0;
+        return EFAULT;
+    }
+    return 0;
+}
+
+int
+ring_create(pid_t pid, ring_create_cb_t callback, void *token) {
+    dprintf(3, "ring_create pid = %d\n", pid);
+    assert(sizeof(sos_ring_t) <= PAGE_SIZE);
+    int err;
+
+    process_t *proc = proc_getproc(pid);
+    if (proc == NULL || proc->as == NULL) {
+        return EINVAL;
+    }
+    if (proc->ring != 0) {
+        callback(token, 0);
+        return 0;
+    }
+
+    if (proc->ring_user_aep == 0) {
+        /* Anything half made is freed with the process */
+        err = _ring_create_aep(proc);
+        if (err) {
+            return err;
+        }
+    }
+
+    /* A clone has the region but not the page */
+    if (region_probe(proc->as, PROCESS_RING) == NULL) {
+        err = as_define_region(proc->as, PROCESS_RING, PAGE_SIZE, seL4_AllRights);
+        if (err) {
+            return err;
+        }
+    }
+
+    ring_create_cont_t *cont = slab_alloc(&_ring_create_slab);
+    if (cont == NULL) {
+        return ENOMEM;
+    }
+    cont->pid      = pid;
+    cont->callback = callback;
+    cont->token    = token;
+
+    if (sos_page_is_inuse(proc->as, PROCESS_RING)) {
+        _ring_create_mapped((void*)cont, 0);
+        return 0;
+    }
+    /* Never swapped, sos writes it whenever something completes */
+    err = sos_page_map(pid, proc->as, PROCESS_RING, seL4_AllRights,
+                       _ring_create_mapped, (void*)cont, true);
+    if (err) {
+        slab_free(&_ring_create_slab, cont);
+        return err;
+    }
+    inc_proc_size_proc(proc);
+    return 0;
+}
+
+static void
+_ring_create_mapped(void *token, int err) {
+    ring_create_cont_t *cont = (ring_create_cont_t*)token;
+    assert(cont != NULL);
+
+    process_t *proc = proc_getproc(cont->pid);
+    if (!err && proc == NULL) {
+        err = EFAULT;
+    }
+    if (!err) {
+        err = sos_get_kvaddr(proc->as, PROCESS_RING, &proc->ring);
+    }
+    if (!err) {
+        /* The frame came zeroed, the queues are empty */
+        proc->ring_pending = 0;
+    }
+
+    dprintf(3, "ring_create end, err = %d\n", err);
+    cont->callback(cont->token, err);
+    slab_free(&_ring_create_slab, cont);
+}
+
+/**********************************************************************
+ * Ring Completion
+ **********************************************************************/
+
+static void
+_ring_post(process_t *proc, uint32_t user_data, int32_t res, uint64_t value) {
+    sos_ring_t *ring = (sos_ring_t*)proc->ring;
+    uint32_t tail = ring->cq_tail;
+
+    if (tail - ring->cq_head >= SOS_RING_CQ_ENTRIES) {
+        /* Only if the process moved cq_head past what it was given */
+        ring->cq_overflow++;
+    } else {
+        sos_cqe_t *cqe = &ring->cq[tail % SOS_RING_CQ_ENTRIES];
+        cqe->user_data = user_data;
+        cqe->res       = res;
+        cqe->value     = value;
+        RING_BARRIER();
+        ring->cq_tail = tail + 1;
+    }
+    seL4_Notify(proc->ring_aep_cap, 1);
+}
+
+/*
+ * Post the completion of OP and go on with its chain. RES is negative
+ * errno on failure
+ */
+static void
+_ring_op_complete(ring_op_t *op, int32_t res, uint64_t value) {
+    dprintf(3, "ring op %d of pid %d completes with %d\n", op->sqe.op, op->pid, res);
+    ring_op_t *next = op->link;
+    bool ok = (res >= 0);
+    if (op->sqe.op == SOS_RING_READ || op->sqe.op == SOS_RING_WRITE) {
+        ok = ok && ((uint32_t)res == op->sqe.len);
+    }
+
+    bool alive = is_proc_alive(op->pid);
+    if (alive) {
+        process_t *proc = proc_getproc(op->pid);
+        _ring_post(proc, op->sqe.user_data, res, value);
+        proc->ring_pending--;
+    }
+    slab_free(&_ring_op_slab, op);
+
+    if (next == NULL) {
+        return;
+    }
+    if (!alive || !ok) {
+        _ring_op_complete(next, -ECANCELED, 0);
+        return;
+    }
+
+    /* We may be in the middle of something else for another process */
+    pid_t cur = proc_get_id();
+    set_cur_proc(next->pid);
+    _ring_op_start(next);
+    set_cur_proc(cur);
+}
+
+/**********************************************************************
+ * Ring Operations
+ **********************************************************************/
+
+static void
+_ring_op_io_cb(void *token, int err, size_t size) {
+    ring_op_t *op = (ring_op_t*)token;
+    _ring_op_complete(op, err ? -err : (int32_t)size, 0);
+}
+
+static void
+_ring_op_timer_cb(uint32_t id, void *data) {
+    ring_op_t *op = (ring_op_t*)data;
+    _ring_op_complete(op, 0, 0);
+}
+
+static void
+_ring_op_wait_cb(void *token, pid_t pid) {
+    ring_op_t *op = (ring_op_t*)token;
+    _ring_op_complete(op, pid, 0);
+}
+
+static void
+_ring_op_start(ring_op_t *op) {
+    sos_sqe_t *sqe = &op->sqe;
+    int err;
+
+    switch (sqe->op) {
+    case SOS_RING_NOP:
+        _ring_op_complete(op, 0, 0);
+        break;
+    case SOS_RING_READ:
+        serv_read(sqe->fd, sqe->addr, sqe->len, _ring_op_io_cb, (void*)op);
+        break;
+    case SOS_RING_WRITE:
+        serv_write(sqe->fd, sqe->addr, sqe->len, _ring_op_io_cb, (void*)op);
+        break;
+    case SOS_RING_SLEEP:
+        if (register_timer((uint64_t)sqe->len * 1000, _ring_op_timer_cb, (void*)op) == 0) {
+            _ring_op_complete(op, -EFAULT, 0);
+        }
+        break;
+    case SOS_RING_TIMESTAMP:
+        _ring_op_complete(op, 0, time_stamp());
+        break;
+    case SOS_RING_WAIT:
+        err = proc_wait(sqe->fd, _ring_op_wait_cb, (void*)op);
+        if (err) {
+            _ring_op_complete(op, -err, 0);
+        }
+        break;
+    default:
+        _ring_op_complete(op, -EINVAL, 0);
+        break;
+    }
+}
+
+/**********************************************************************
+ * Server Ring Setup
+ **********************************************************************/
+
+typedef struct {
+    seL4_CPtr reply_cap;
+    pid_t pid;
+} cont_ring_setup_t;
+
+static SLAB_CACHE(_ring_setup_slab, cont_ring_setup_t);
+
+static void serv_sys_ring_setup_end(void *token, int err);
+
+void serv_sys_ring_setup(seL4_CPtr reply_cap) {
+    cont_ring_setup_t *cont = slab_alloc(&_ring_setup_slab);
+    if (cont == NULL) {
+        set_cur_proc(PROC_NULL);
+        seL4_MessageInfo_t reply = seL4_MessageInfo_new(ENOMEM, 0, 0, 2);
+        seL4_SetMR(0, 0);
+        seL4_SetMR(1, 0);
+        reply_send(reply_cap, reply);
+        return;
+    }
+    cont->reply_cap = reply_cap;
+    cont->pid       = proc_get_id();
+
+    int err = ring_create(cont->pid, serv_sys_ring_setup_end, (void*)cont);
+    if (err) {
+        serv_sys_ring_setup_end((void*)cont, err);
+        return;
+    }
+}
+
+static void
+serv_sys_ring_setup_end(void *token, int err) {
+    cont_ring_setup_t *cont = (cont_ring_setup_t*)token;
+    dprintf(3, "serv_sys_ring_setup_end err = %d\n", err);
+
+    process_t *proc = proc_getproc(cont->pid);
+    if (proc == NULL) {
+        dprintf(3, "serv_sys_ring_setup_end: proc is killed\n");
+        reply_cap_free(cont->reply_cap);
+        slab_free(&_ring_setup_slab, cont);
+        return;
+    }
+
+    set_cur_proc(PROC_NULL);
+    seL4_MessageInfo_t reply = seL4_MessageInfo_new(err, 0, 0, 2);
+    seL4_SetMR(0, err ? 0 : PROCESS_RING);
+    seL4_SetMR(1, err ? 0 : proc->ring_user_aep);
+    reply_send(cont->reply_cap, reply);
+    slab_free(&_ring_setup_slab, cont);
+}
+
+/**********************************************************************
+ * Server Ring Enter
+ **********************************************************************/
+
+/* The entries from HEAD that go together, a chain ends where TAIL is */
+static int
+_ring_chain_len(sos_ring_t *ring, uint32_t head, uint32_t tail) {
+    int len = 1;
+    while (head + len != tail &&
+            (ring->sq[(head + len - 1) % SOS_RING_SQ_ENTRIES].flags & SOS_RING_LINK)) {
+        len++;
+    }
+    return len;
+}
+
+static void
+_ring_free_chain(ring_op_t *op) {
+    while (op != NULL) {
+        ring_op_t *next = op->link;
+        slab_free(&_ring_op_slab, op);
+        op = next;
+    }
+}
+
+static void
+serv_sys_ring_enter_reply(seL4_CPtr reply_cap, int err, int taken) {
+    dprintf(3, "serv_sys_ring_enter took %d, err = %d\n", taken, err);
+    set_cur_proc(PROC_NULL);
+    seL4_MessageInfo_t reply = seL4_MessageInfo_new(err, 0, 0, 1);
+    seL4_SetMR(0, (seL4_Word)taken);
+    reply_send(reply_cap, reply);
+}
+
+void serv_sys_ring_enter(seL4_CPtr reply_cap) {
+    process_t *proc = cur_proc();
+    if (proc == NULL || proc->ring == 0) {
+        serv_sys_ring_enter_reply(reply_cap, EINVAL, 0);
+        return;
+    }
+
+    sos_ring_t *ring = (sos_ring_t*)proc->ring;
+    uint32_t head = ring->sq_head;
+    uint32_t tail = ring->sq_tail;
+    RING_BARRIER();
+    if (tail - head > SOS_RING_SQ_ENTRIES) {
+        serv_sys_ring_enter_reply(reply_cap, EINVAL, 0);
+        return;
+    }
+
+    /* Leave room in the completion queue for everything in flight */
+    int room = SOS_RING_CQ_ENTRIES - (int)(ring->cq_tail - ring->cq_head) - proc->ring_pending;
+    pid_t pid = proc->pid;
+    int taken = 0;
+    int err = 0;
+
+    while (head != tail) {
+        int len = _ring_chain_len(ring, head, tail);
+        if (taken + len > room) {
+            break;
+        }
+
+        /* Copy the whole chain out before any of it can complete */
+        ring_op_t *chain = NULL;
+        ring_op_t **last = &chain;
+        int n;
+        for (n = 0; n < len; n++) {
+            ring_op_t *op = slab_alloc(&_ring_op_slab);
+            if (op == NULL) {
+                break;
+            }
+            op->pid  = pid;
+            op->sqe  = ring->sq[(head + n) % SOS_RING_SQ_ENTRIES];
+            op->link = NULL;
+            *last = op;
+            last = &op->link;
+        }
+        if (n < len) {
+            /* Out of memory, the rest waits for the next call */
+            _ring_free_chain(chain);
+            if (taken == 0) {
+                err = ENOMEM;
+            }
+            break;
+        }
+
+        head  += len;
+        taken += len;
+        ring->sq_head = head;
+        proc->ring_pending += len;
+
+        _ring_op_start(chain);
+        set_cur_proc(pid);
+        if (!is_proc_alive(pid)) {
+            /* Nothing to reply to anymore */
+            reply_cap_free(reply_cap);
+            return;
+        }
+    }
+
+    serv_sys_ring_enter_reply(reply_cap, err, taken);
+}
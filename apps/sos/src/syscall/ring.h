@@ -0,0 +1,27 @@
+#ifndef _SOS_RING_H_
+#define _SOS_RING_H_
+
+#include <sel4/sel4.h>
+#include <sos.h>
+
+#include "proc/proc.h"
+
+/*
+ * Syscall ring shared between sos and a process (sos_ring_t in sos.h). The
+ * process fills in submission entries and hands a batch of them over with
+ * one syscall, sos starts them all and posts a completion for each one as
+ * it finishes, then notifies the process's async endpoint.
+ */
+
+typedef void (*ring_create_cb_t)(void *token, int err);
+
+/*
+ * Give the process PID its ring page at PROCESS_RING and its async
+ * endpoint, does nothing if it has them already
+ * This is an asynchronous function and will return by calling the call back
+ * function
+ * Returns 0 if succesfully register callback
+ */
+int ring_create(pid_t pid, ring_create_cb_t callback, void *token);
+
+#endif /* _SOS_RING_H_ */
@@ -7,6 +7,7 @@
 
 #include <sos.h>
 #include "dev/clock.h"
+#include "syscall/reply.h"
 
 #define PROCESS_MAX_FILES       16
 
@@ -25,6 +26,19 @@
 #define SOS_SYSCALL_PROC_GET_ID       12
 #define SOS_SYSCALL_PROC_WAIT         13
 #define SOS_SYSCALL_PROC_STATUS       14
+#define SOS_SYSCALL_PROC_CLONE        15
+#define SOS_SYSCALL_IO_BUFFER         16
+#define SOS_SYSCALL_READ_BUF          17
+#define SOS_SYSCALL_WRITE_BUF         18
+#define SOS_SYSCALL_RING_SETUP        19
+#define SOS_SYSCALL_RING_ENTER        20
+#define SOS_SYSCALL_PRINT_BUF         21
+#define SOS_SYSCALL_VM_STAT           22
+#define SOS_SYSCALL_SLAB_STAT         23
+
+/* Bytes of a print syscall, packed four to a message register after the
+ * syscall number and the length */
+#define SOS_PRINT_MAX           ((seL4_MsgMaxLength - 2) * sizeof(seL4_Word))
 
 #define MAX_NAME_LEN            255
 /* File syscalls */
@@ -38,6 +52,11 @@
  */
 void serv_sys_print(seL4_CPtr reply_cap, char* message, size_t len);
 
+/*
+ * Print out *nbyte* bytes at *offset* in the process's I/O buffer
+ */
+void serv_sys_print_buf(seL4_CPtr reply_cap, size_t offset, size_t nbyte);
+
 /*
  * Open a file
  * @param path - pointer to string in user addresspace
@@ -70,6 +89,35 @@ void serv_sys_read(seL4_CPtr reply_cap, int fd, seL4_Word buf, size_t nbyte);
  */
 void serv_sys_write(seL4_CPtr reply_cap, int fd, seL4_Word buf, size_t nbyte);
 
+/*
+ * Read and write for sos itself (the syscall ring), the callback gets what
+ * the reply would have carried instead. The current process is the one
+ * whose file and buffer these are
+ */
+typedef void (*serv_io_cb_t)(void *token, int err, size_t size);
+void serv_read(int fd, seL4_Word buf, size_t nbyte, serv_io_cb_t callback, void *token);
+void serv_write(int fd, seL4_Word buf, size_t nbyte, serv_io_cb_t callback, void *token);
+
+/*
+ * Read and write through the process's I/O buffer (see vm/iobuf.h)
+ * @param fd - the file descriptor, as for serv_sys_read and serv_sys_write
+ * @param offset - where the data starts in the I/O buffer
+ * @param nbyte - the size of the data, it must be inside the I/O buffer
+ */
+void serv_sys_read_buf(seL4_CPtr reply_cap, int fd, size_t offset, size_t nbyte);
+void serv_sys_write_buf(seL4_CPtr reply_cap, int fd, size_t offset, size_t nbyte);
+
+/*
+ * Set up the syscall ring (see syscall/ring.h), replies with its address
+ * and the async endpoint completions are notified on
+ */
+void serv_sys_ring_setup(seL4_CPtr reply_cap);
+
+/*
+ * Start the entries submitted to the ring, replies with how many it took
+ */
+void serv_sys_ring_enter(seL4_CPtr reply_cap);
+
 /*
  * Syscall timestamp handler
  * @param ts - the timestamp returned
@@ -87,6 +135,22 @@ void serv_sys_sleep(seL4_CPtr reply_cap, const int msec);
  */
 void serv_sys_sbrk(seL4_CPtr reply_cap, seL4_Word newbrk);
 
+/*
+ * Map the I/O buffer into the process, replies with its address and size
+ */
+void serv_sys_io_buffer(seL4_CPtr reply_cap);
+
+/*
+ * Reply with the frame table statistics (see frame_get_stats). The
+ * watermarks are global, processes only get to look at them
+ */
+void serv_sys_vm_stat(seL4_CPtr reply_cap);
+
+/*
+ * Print the slab cache statistics on sos's console
+ */
+void serv_sys_slab_stat(seL4_CPtr reply_cap);
+
 void serv_sys_getdirent(seL4_CPtr reply_cap, int pos, char* name, size_t nbyte);
 
 void serv_sys_stat(seL4_CPtr reply_cap, char *path, size_t path_len, sos_stat_t *buf);
@@ -97,5 +161,6 @@ void serv_proc_destroy(int id, seL4_CPtr reply_cap);
 void serv_proc_get_id(seL4_CPtr reply_cap);
 void serv_proc_wait(int id, seL4_CPtr reply_cap);
 void serv_proc_status(seL4_Word buf, unsigned max, seL4_CPtr reply_cap);
+void serv_proc_clone(seL4_CPtr fault_ep, seL4_CPtr reply_cap);
 
 #endif /* _SOS_SYSCALL_H_ */
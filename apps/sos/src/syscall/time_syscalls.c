@@ -30,9 +30,7 @@ serv_sys_timestamp(seL4_CPtr reply_cap) {
     reply = seL4_MessageInfo_new(0, 0, 0, 2);
     seL4_SetMR(0, (uint32_t)(ts & TIMESTAMP_LOW_MASK));
     seL4_SetMR(1, (uint32_t)((ts & TIMESTAMP_HIGH_MASK)>>32));
-    seL4_Send(reply_cap, reply);
-
-    cspace_free_slot(cur_cspace, reply_cap);
+    reply_send(reply_cap, reply);
 }
 
 /**********************************************************************
@@ -50,8 +48,7 @@ serv_sys_sleep(seL4_CPtr reply_cap, const int msec) {
     if (err) {
         set_cur_proc(PROC_NULL);
         reply = seL4_MessageInfo_new(err, 0, 0, 0);
-        seL4_Send(reply_cap, reply);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_send(reply_cap, reply);
     }
 }
 
@@ -63,14 +60,13 @@ sleep_callback(uint32_t id, void *data) {
     state = (struct sleep_state*)data;
 
     if (!is_proc_alive(state->pid)) {
-        cspace_free_slot(cur_cspace, state->reply_cap);
+        reply_cap_free(state->reply_cap);
         free(state);
         return;
     }
     set_cur_proc(PROC_NULL);
     reply = seL4_MessageInfo_new(0, 0, 0, 0);
-    seL4_Send(state->reply_cap, reply);
-    cspace_free_slot(cur_cspace, state->reply_cap);
+    reply_send(state->reply_cap, reply);
     free(state);
     return;
 }
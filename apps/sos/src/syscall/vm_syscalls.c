@@ -1,8 +1,16 @@
+#include <stdlib.h>
+#include <errno.h>
 #include <sel4/sel4.h>
 
+#include "tool/slab.h"
 #include "proc/proc.h"
 #include "syscall/syscall.h"
 #include "vm/addrspace.h"
+#include "vm/iobuf.h"
+#include "vm/vm.h"
+
+#define verbose 0
+#include <sys/debug.h>
 
 /**********************************************************************
  * Server System SBRK
@@ -15,7 +23,92 @@ void serv_sys_sbrk(seL4_CPtr reply_cap, seL4_Word newbrk) {
 
     set_cur_proc(PROC_NULL);
     reply = seL4_MessageInfo_new(newbrk, 0, 0, 0);
-    seL4_Send(reply_cap, reply);
+    reply_send(reply_cap, reply);
+}
+
+/**********************************************************************
+ * Server System VM Stat
+ **********************************************************************/
+
+void serv_sys_vm_stat(seL4_CPtr reply_cap) {
+    frame_stats_t stats;
 
-    cspace_free_slot(cur_cspace, reply_cap);
+    frame_get_stats(&stats);
+
+    set_cur_proc(PROC_NULL);
+    seL4_MessageInfo_t reply = seL4_MessageInfo_new(0, 0, 0, 8);
+    seL4_SetMR(0, stats.nfree);
+    seL4_SetMR(1, stats.low_watermark);
+    seL4_SetMR(2, stats.high_watermark);
+    seL4_SetMR(3, stats.alloc_hits);
+    seL4_SetMR(4, stats.alloc_misses);
+    seL4_SetMR(5, stats.cleaned);
+    seL4_SetMR(6, stats.inflight);
+    seL4_SetMR(7, stats.ncow);
+    reply_send(reply_cap, reply);
+}
+
+/**********************************************************************
+ * Server System Slab Stat
+ **********************************************************************/
+
+void serv_sys_slab_stat(seL4_CPtr reply_cap) {
+    slab_print_stats();
+
+    set_cur_proc(PROC_NULL);
+    seL4_MessageInfo_t reply = seL4_MessageInfo_new(0, 0, 0, 0);
+    reply_send(reply_cap, reply);
+}
+
+/**********************************************************************
+ * Server System I/O Buffer
+ **********************************************************************/
+
+typedef struct {
+    seL4_CPtr reply_cap;
+    pid_t pid;
+} cont_io_buffer_t;
+
+static SLAB_CACHE(_io_buffer_slab, cont_io_buffer_t);
+
+static void serv_sys_io_buffer_end(void *token, int err);
+
+void serv_sys_io_buffer(seL4_CPtr reply_cap) {
+    cont_io_buffer_t *cont = slab_alloc(&_io_buffer_slab);
+    if (cont == NULL) {
+        set_cur_proc(PROC_NULL);
+        seL4_MessageInfo_t reply = seL4_MessageInfo_new(ENOMEM, 0, 0, 2);
+        seL4_SetMR(0, 0);
+        seL4_SetMR(1, 0);
+        reply_send(reply_cap, reply);
+        return;
+    }
+    cont->reply_cap = reply_cap;
+    cont->pid       = proc_get_id();
+
+    int err = iobuf_create(cont->pid, serv_sys_io_buffer_end, (void*)cont);
+    if (err) {
+        serv_sys_io_buffer_end((void*)cont, err);
+        return;
+    }
+}
+
+static void
+serv_sys_io_buffer_end(void *token, int err) {
+    cont_io_buffer_t *cont = (cont_io_buffer_t*)token;
+    dprintf(3, "serv_sys_io_buffer_end err = %d\n", err);
+
+    if (!is_proc_alive(cont->pid)) {
+        dprintf(3, "serv_sys_io_buffer_end: proc is killed\n");
+        reply_cap_free(cont->reply_cap);
+        slab_free(&_io_buffer_slab, cont);
+        return;
+    }
+
+    set_cur_proc(PROC_NULL);
+    seL4_MessageInfo_t reply = seL4_MessageInfo_new(err, 0, 0, 2);
+    seL4_SetMR(0, err ? 0 : PROCESS_IO_BUFFER);
+    seL4_SetMR(1, err ? 0 : IOBUF_SIZE);
+    reply_send(cont->reply_cap, reply);
+    slab_free(&_io_buffer_slab, cont);
 }
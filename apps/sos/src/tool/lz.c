@@ -0,0 +1,196 @@
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#include "tool/lz.h"
+#include "tool/utility.h"
+
+/*
+ * Each sequence is:
+ *   token      high nibble: # of literals, low nibble: match length - LZ_MIN_MATCH
+ *              a nibble of 15 is followed by extra length bytes, 255 meaning
+ *              that another one follows
+ *   literals
+ *   offset     2 bytes little endian, how far back the match starts
+ * The last sequence only has literals, it ends where the input ends.
+ */
+
+#define LZ_MIN_MATCH    (4)
+#define LZ_HASH_BITS    (10)
+#define LZ_MAX_INPUT    (0xffff)
+#define LZ_NIBBLE_MAX   (15)
+
+/* Last position (from the start of the input) each hashed 4 bytes were seen at */
+static uint16_t _lz_table[1 << LZ_HASH_BITS];
+
+static uint32_t
+_lz_read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t
+_lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t*
+_lz_put_len(uint8_t *op, uint8_t *oend, size_t len) {
+    while (len >= 255) {
+        if (op >= oend) {
+            return NULL;
+        }
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/* Emit one sequence, a match length of 0 means this is the last one */
+static uint8_t*
+_lz_put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t nlit,
+            size_t offset, size_t mlen) {
+    size_t mcode = mlen ? mlen - LZ_MIN_MATCH : 0;
+
+    if (op >= oend) {
+        return NULL;
+    }
+    *op++ = (uint8_t)((MIN(nlit, LZ_NIBBLE_MAX) << 4) | MIN(mcode, LZ_NIBBLE_MAX));
+
+    if (nlit >= LZ_NIBBLE_MAX && (op = _lz_put_len(op, oend, nlit - LZ_NIBBLE_MAX)) == NULL) {
+        return NULL;
+    }
+    if ((size_t)(oend - op) < nlit) {
+        return NULL;
+    }
+    memcpy(op, lit, nlit);
+    op += nlit;
+
+    if (mlen == 0) {
+        return op;
+    }
+    if (oend - op < 2) {
+        return NULL;
+    }
+    *op++ = (uint8_t)(offset & 0xff);
+    *op++ = (uint8_t)(offset >> 8);
+    if (mcode >= LZ_NIBBLE_MAX) {
+        return _lz_put_len(op, oend, mcode - LZ_NIBBLE_MAX);
+    }
+    return op;
+}
+
+size_t
+lz_compress(const void *src, size_t len, void *dst, size_t cap) {
+    assert(len <= LZ_MAX_INPUT);
+
+    const uint8_t *base   = (const uint8_t*)src;
+    const uint8_t *ip     = base;
+    const uint8_t *anchor = base;
+    const uint8_t *iend   = base + len;
+    uint8_t *op   = (uint8_t*)dst;
+    uint8_t *oend = op + cap;
+
+    memset(_lz_table, 0, sizeof(_lz_table));
+
+    while (len >= LZ_MIN_MATCH && ip <= iend - LZ_MIN_MATCH) {
+        uint32_t seq = _lz_read32(ip);
+        uint32_t h = _lz_hash(seq);
+        const uint8_t *ref = base + _lz_table[h];
+        _lz_table[h] = (uint16_t)(ip - base);
+
+        if (ref >= ip || _lz_read32(ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        /* Extend the match as far as it goes */
+        const uint8_t *m = ip + LZ_MIN_MATCH;
+        const uint8_t *r = ref + LZ_MIN_MATCH;
+        while (m < iend && *m == *r) {
+            m++;
+            r++;
+        }
+
+        op = _lz_put_seq(op, oend, anchor, ip - anchor, ip - ref, m - ip);
+        if (op == NULL) {
+            return 0;
+        }
+        ip = anchor = m;
+    }
+
+    op = _lz_put_seq(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+    return op - (uint8_t*)dst;
+}
+
+/* Read the extra length bytes following a nibble of 15 */
+static int
+_lz_get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 0;
+}
+
+int
+lz_decompress(const void *src, size_t len, void *dst, size_t cap) {
+    const uint8_t *ip   = (const uint8_t*)src;
+    const uint8_t *iend = ip + len;
+    uint8_t *base = (uint8_t*)dst;
+    uint8_t *op   = base;
+    uint8_t *oend = base + cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        size_t nlit = token >> 4;
+        if (nlit == LZ_NIBBLE_MAX && _lz_get_len(&ip, iend, &nlit)) {
+            return -1;
+        }
+        if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit) {
+            return -1;
+        }
+        memcpy(op, ip, nlit);
+        ip += nlit;
+        op += nlit;
+
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        size_t mlen = token & LZ_NIBBLE_MAX;
+        if (mlen == LZ_NIBBLE_MAX && _lz_get_len(&ip, iend, &mlen)) {
+            return -1;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t)(op - base) || (size_t)(oend - op) < mlen) {
+            return -1;
+        }
+
+        /* Byte by byte, the match may overlap what it is producing */
+        const uint8_t *r = op - offset;
+        while (mlen--) {
+            *op++ = *r++;
+        }
+    }
+
+    return op - base;
+}
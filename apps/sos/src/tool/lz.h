@@ -0,0 +1,25 @@
+#ifndef _LIBOS_LZ_H_
+#define _LIBOS_LZ_H_
+
+#include <stddef.h>
+
+/*
+ * A small LZ77 codec for compressing pages, in the spirit of LZ4: the
+ * output is a list of (literal run, back reference) sequences, there is no
+ * entropy coding so both ways only cost a few cycles per byte.
+ * Inputs are limited to 64KB.
+ */
+
+/*
+ * Compress LEN bytes of SRC into DST which can hold CAP bytes
+ * Returns the compressed size or 0 if it doesn't fit in CAP
+ */
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/*
+ * Decompress LEN bytes of SRC into DST which can hold CAP bytes
+ * Returns the decompressed size or -1 if SRC is corrupted
+ */
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* _LIBOS_LZ_H_ */
@@ -0,0 +1,85 @@
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "tool/utility.h"
+#include "tool/slab.h"
+
+#define verbose 0
+#include <sys/debug.h>
+
+#define SLAB_ALIGN          (sizeof(uint64_t))
+#define SLAB_CHUNK_SIZE     (0x1000)    // bytes malloced when a cache runs dry
+#define SLAB_CHUNK_MIN      (8)         // objects in a chunk at the least
+
+/* Every free object starts with the link to the next one */
+typedef struct slab_obj {
+    struct slab_obj *next;
+} slab_obj_t;
+
+static slab_cache_t *_caches = NULL;
+
+static size_t
+_slab_obj_size(slab_cache_t *cache) {
+    size_t size = MAX(cache->size, sizeof(slab_obj_t));
+    return (size + SLAB_ALIGN - 1) & ~(SLAB_ALIGN - 1);
+}
+
+/* Fill the free list of CACHE with a new chunk of objects */
+static int
+_slab_grow(slab_cache_t *cache) {
+    size_t size = _slab_obj_size(cache);
+    size_t n = MAX(SLAB_CHUNK_SIZE / size, SLAB_CHUNK_MIN);
+
+    char *chunk = malloc(n * size);
+    if (chunk == NULL) {
+        return -1;
+    }
+    if (cache->chunks == 0) {
+        cache->next = _caches;
+        _caches = cache;
+    }
+    cache->chunks++;
+
+    for (size_t i = 0; i < n; i++) {
+        slab_obj_t *obj = (slab_obj_t*)(chunk + i * size);
+        obj->next = cache->free;
+        cache->free = obj;
+    }
+    dprintf(3, "slab: %s grew by %u objects\n", cache->name, (unsigned)n);
+    return 0;
+}
+
+void *
+slab_alloc(slab_cache_t *cache) {
+    if (cache->free == NULL && _slab_grow(cache)) {
+        return NULL;
+    }
+    slab_obj_t *obj = cache->free;
+    cache->free = obj->next;
+
+    cache->allocs++;
+    cache->in_use++;
+    cache->peak = MAX(cache->peak, cache->in_use);
+    return obj;
+}
+
+void
+slab_free(slab_cache_t *cache, void *obj) {
+    if (obj == NULL) {
+        return;
+    }
+    slab_obj_t *o = (slab_obj_t*)obj;
+    o->next = cache->free;
+    cache->free = o;
+    cache->in_use--;
+}
+
+void
+slab_print_stats(void) {
+    dprintf(0, "%-24s %6s %10s %6s %6s %6s\n",
+            "cache", "size", "allocs", "in use", "peak", "chunks");
+    for (slab_cache_t *c = _caches; c != NULL; c = c->next) {
+        dprintf(0, "%-24s %6u %10u %6u %6u %6u\n", c->name, (unsigned)c->size,
+                c->allocs, c->in_use, c->peak, c->chunks);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef _LIBOS_SLAB_H_
+#define _LIBOS_SLAB_H_
+
+#include <stddef.h>
+
+/*
+ * Typed slab allocator for the small structs that come and go all the time,
+ * mostly continuations. Every type has its own cache with a free list, so
+ * after warming up an alloc or free is a couple of pointer moves instead of
+ * a trip through malloc. Freed objects stay in their cache, the memory is
+ * never given back to the heap.
+ */
+
+typedef struct slab_cache {
+    const char *name;
+    size_t size;                    // object size, rounded up for alignment
+    void *free;                     // free list threaded through the objects
+    struct slab_cache *next;        // all caches that have been used
+
+    /* Statistics */
+    unsigned allocs;                // total number of slab_alloc
+    unsigned in_use;
+    unsigned peak;
+    unsigned chunks;                // malloced chunks of objects
+} slab_cache_t;
+
+/*
+ * Define a cache CACHE for objects of TYPE
+ */
+#define SLAB_CACHE(cache, type) \
+    slab_cache_t cache = { .name = #type, .size = sizeof(type) }
+
+/*
+ * Allocate an object from CACHE, its content is undefined
+ * Returns NULL if out of memory
+ */
+void *slab_alloc(slab_cache_t *cache);
+
+/*
+ * Give OBJ back to CACHE, NULL is ignored
+ */
+void slab_free(slab_cache_t *cache, void *obj);
+
+/*
+ * Print the statistics of every cache that has been used
+ */
+void slab_print_stats(void);
+
+#endif /* _LIBOS_SLAB_H_ */
@@ -2,12 +2,19 @@
 #define _LIBOS_UTILITY_H_
 
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
 
-/* Maximum size to send to NFS */
+/* Size of one NFS read/write. NFS_SEND_SIZE is small enough for any
+ * transport, NFS_READ_SIZE/NFS_WRITE_SIZE are what the server and the
+ * transport take (nfs_max_read/nfs_max_write, need <nfs/nfs.h>) */
 #define NFS_SEND_SIZE   1024 //This needs to be less than UDP package size
+#define NFS_READ_SIZE   ((size_t)MAX(NFS_SEND_SIZE, nfs_max_read()))
+#define NFS_WRITE_SIZE  ((size_t)MAX(NFS_SEND_SIZE, nfs_max_write()))
 
-/* Minimum of two values. */
+/* Minimum/maximum of two values. */
 #define MIN(a,b) (((a)<(b))?(a):(b))
+#define MAX(a,b) (((a)>(b))?(a):(b))
 
 /* Page size and stuffs */
 #define PAGE_OFFSET_MASK        ((PAGESIZE) - 1)
@@ -15,4 +22,16 @@
 #define PAGE_OFFSET(addr)       ((addr) & (PAGE_OFFSET_MASK))
 #define IS_PAGESIZE_ALIGNED(addr) !((addr) &  (PAGE_OFFSET_MASK))
 
+/* FNV-1a hash of LEN bytes at DATA, continuing from H. Start with FNV1A_INIT */
+#define FNV1A_INIT      (2166136261u)
+
+static inline uint32_t
+fnv1a(uint32_t h, const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
 #endif /* _LIBOS_UTILITY_H_ */
@@ -1,7 +1,10 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <assert.h>
 
+#include "tool/utility.h"
+#include "tool/slab.h"
 #include "vfs/vfs.h"
 #include "dev/nfs_dev.h"
 #include "dev/console.h"
@@ -48,36 +51,17 @@ _vfs_open_2_create_vnode(char *path, int openflags, vfs_open_cb_t callback, void
     dprintf(3, "vfs_open_2 called\n");
     int err;
 
-    struct vnode *vn = malloc(sizeof(struct vnode));
+    struct vnode *vn = vfs_vnode_alloc(path);
     if (vn == NULL) {
         callback(token, ENOMEM, NULL);
         return;
     }
 
-    int path_len = strlen(path);    // use strlen as path is a trustworthy string
-    vn->vn_name = (char*)malloc(path_len+1);
-    if (vn->vn_name == NULL) {
-        free(vn);
-        callback(token, ENOMEM, NULL);
-        return;
-    }
-    strcpy(vn->vn_name, path);
-
-    vn->vn_ops = malloc(sizeof(struct vnode_ops));
-    if (vn->vn_ops == NULL) {
-        free(vn->vn_name);
-        free(vn);
-        callback(token, ENOMEM, NULL);
-        return;
-    }
-
     vn->initialised = false;
 
     cont_vfs_open_t *cont = malloc(sizeof(cont_vfs_open_t));
     if (cont == NULL) {
-        free(vn->vn_name);
-        free(vn->vn_ops);
-        free(vn);
+        vfs_vnode_free(vn);
         callback(token, ENOMEM, NULL);
         return;
     }
@@ -89,9 +73,7 @@ _vfs_open_2_create_vnode(char *path, int openflags, vfs_open_cb_t callback, void
     if (strcmp(path, "console") == 0) {
         err = con_init(vn);
         if (err) {
-            free(vn->vn_name);
-            free(vn->vn_ops);
-            free(vn);
+            vfs_vnode_free(vn);
             vn = NULL;
         }
         _vfs_open_3_end_create((void*)cont, 0);
@@ -109,20 +91,32 @@ _vfs_open_3_end_create(void* vfs_open_token, int err) {
     cont_vfs_open_t *cont = (cont_vfs_open_t*)vfs_open_token;
 
     if (err || VOP_EACHOPEN(cont->vn, cont->openflags)) {
-        free(cont->vn->vn_name);
-        free(cont->vn->vn_ops);
-        free(cont->vn);
+        vfs_vnode_free(cont->vn);
         cont->callback(cont->token, err, NULL);
         free(cont);
         return;
     }
 
+    /* Someone opened the same file while we were setting ours up, the table
+     * only takes one vnode per path so we use theirs */
+    struct vnode *vn = vfs_vnt_lookup(cont->vn->vn_name);
+    if (vn != NULL) {
+        VOP_EACHCLOSE(cont->vn, cont->openflags);
+        VOP_LASTCLOSE(cont->vn);
+        vfs_vnode_free(cont->vn);
+        err = VOP_EACHOPEN(vn, cont->openflags);
+        if (!err) {
+            VOP_INCOPEN(vn);
+        }
+        cont->callback(cont->token, err, err ? NULL : vn);
+        free(cont);
+        return;
+    }
+
     err = vfs_vnt_insert(cont->vn);
     if (err) {
         VOP_LASTCLOSE(cont->vn);
-        free(cont->vn->vn_name);
-        free(cont->vn->vn_ops);
-        free(cont->vn);
+        vfs_vnode_free(cont->vn);
         cont->callback(cont->token, err, NULL);
         free(cont);
         return;
@@ -142,6 +136,18 @@ void vfs_close(struct vnode *vn, uint32_t flags) {
     VOP_DECOPEN(vn);
 }
 
+/****************************************************************
+ * VFS Flush
+ ***************************************************************/
+
+void vfs_flush(struct vnode *vn, vop_flush_cb_t callback, void *token) {
+    if (vn->vn_ops->vop_flush == NULL) {
+        callback(token, 0);
+        return;
+    }
+    VOP_FLUSH(vn, callback, token);
+}
+
 /****************************************************************
  * VFS Stat
  ***************************************************************/
@@ -191,68 +197,167 @@ _vfs_stat_end(void *token, int err) {
 }
 
 /****************************************************************
- * VFS Vnode table functions
+ * VFS Vnode allocation
  ***************************************************************/
 
-struct vnode* vfs_vnt_lookup(const char *path) {
-    if (path == NULL) {
+/*
+ * A vnode, its vnode_ops and its name come in one object from a slab, names
+ * that don't fit in vo_name are the only extra allocation
+ */
+#define VNODE_NAME_INLINE   (48)
+
+typedef struct vnode_obj {
+    struct vnode vo_vn;             // first, a vnode is its object
+    struct vnode_ops vo_ops;
+    uint32_t vo_hash;               // of vn_name, computed once
+    char vo_name[VNODE_NAME_INLINE];
+} vnode_obj_t;
+
+static SLAB_CACHE(_vnode_slab, vnode_obj_t);
+
+static uint32_t
+_vfs_hash(const char *path) {
+    return fnv1a(FNV1A_INIT, path, strlen(path));
+}
+
+struct vnode* vfs_vnode_alloc(const char *path) {
+    assert(path != NULL);
+    vnode_obj_t *obj = slab_alloc(&_vnode_slab);
+    if (obj == NULL) {
         return NULL;
     }
-    //dprintf(3, "vfs_vnt_lookup path = %s\n", path);
-    //dprintf(3, "vnode_table_head = %p\n", vnode_table_head);
-    struct vnode_table_entry *vte = vnode_table_head;
-    while (vte != NULL) {
-        //dprintf(3, "vte->vte_vn->vn_name = %s\n", vte->vte_vn->vn_name);
-        if (strcmp(path, vte->vte_vn->vn_name) == 0) {
+
+    size_t len = strlen(path);
+    char *name = obj->vo_name;
+    if (len >= VNODE_NAME_INLINE) {
+        name = malloc(len + 1);
+        if (name == NULL) {
+            slab_free(&_vnode_slab, obj);
+            return NULL;
+        }
+    }
+
+    memset(&obj->vo_vn, 0, sizeof(obj->vo_vn));
+    memset(&obj->vo_ops, 0, sizeof(obj->vo_ops));
+    memcpy(name, path, len + 1);
+    obj->vo_hash          = _vfs_hash(path);
+    obj->vo_vn.vn_name    = name;
+    obj->vo_vn.vn_ops     = &obj->vo_ops;
+    return &obj->vo_vn;
+}
+
+void vfs_vnode_free(struct vnode *vn) {
+    assert(vn != NULL);
+    vnode_obj_t *obj = (vnode_obj_t*)vn;
+    if (vn->vn_name != obj->vo_name) {
+        free(vn->vn_name);
+    }
+    vn->vn_name = NULL;
+    slab_free(&_vnode_slab, obj);
+}
+
+/****************************************************************
+ * VFS Vnode table functions
+ ***************************************************************/
+
+/*
+ * Open addressing with linear probing, keyed by the hash of the path kept in
+ * the vnode object. Deleting shifts the following entries back, so there
+ * are no tombstones
+ */
+#define VNT_INIT_SIZE       (64)
+
+static struct vnode **_vnt;
+static size_t _vnt_size;        // always a power of 2
+static size_t _vnt_count;
+
+static inline uint32_t
+_vnt_hash(struct vnode *vn) {
+    return ((vnode_obj_t*)vn)->vo_hash;
+}
+
+/* Slot of PATH, or the empty slot where it would go */
+static size_t
+_vnt_find(const char *path, uint32_t hash) {
+    size_t mask = _vnt_size - 1;
+    size_t i = hash & mask;
+    while (_vnt[i] != NULL) {
+        if (_vnt_hash(_vnt[i]) == hash && strcmp(_vnt[i]->vn_name, path) == 0) {
             break;
         }
-        vte = vte->next;
+        i = (i + 1) & mask;
     }
-    //dprintf(3, "vfs_vnt_lookup %s\n", vte == NULL ? "failed" : "succeed");
-    return (vte == NULL) ? NULL : vte->vte_vn;
+    return i;
+}
+
+static int
+_vnt_resize(size_t size) {
+    struct vnode **old = _vnt;
+    size_t old_size = _vnt_size;
+
+    struct vnode **vnt = calloc(size, sizeof(struct vnode*));
+    if (vnt == NULL) {
+        return ENOMEM;
+    }
+    _vnt = vnt;
+    _vnt_size = size;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i] != NULL) {
+            _vnt[_vnt_find(old[i]->vn_name, _vnt_hash(old[i]))] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+struct vnode* vfs_vnt_lookup(const char *path) {
+    if (path == NULL || _vnt_count == 0) {
+        return NULL;
+    }
+    return _vnt[_vnt_find(path, _vfs_hash(path))];
 }
 
 int vfs_vnt_insert(struct vnode *vn) {
     if (vn == NULL || vn->vn_name == NULL) {
         return EINVAL;
     }
-    struct vnode_table_entry *vte = malloc(sizeof(struct vnode_table_entry));
-    if (vte == NULL) {
-        return ENOMEM;
+    /* Keep the load under 3/4 */
+    if ((_vnt_count + 1) * 4 > _vnt_size * 3) {
+        int err = _vnt_resize(_vnt_size ? 2 * _vnt_size : VNT_INIT_SIZE);
+        if (err) {
+            return err;
+        }
+    }
+
+    size_t i = _vnt_find(vn->vn_name, _vnt_hash(vn));
+    if (_vnt[i] != NULL) {
+        return EEXIST;
     }
-    vte->vte_vn = vn;
-    vte->next = vnode_table_head;
-    vnode_table_head = vte;
+    _vnt[i] = vn;
+    _vnt_count++;
     return 0;
 }
 
 void vfs_vnt_delete(const char *path) {
-    if (path == NULL) {
-        return;
-    }
-    if (vnode_table_head == NULL) {
+    if (path == NULL || _vnt_count == 0) {
         return;
     }
-    if (strcmp(vnode_table_head->vte_vn->vn_name, path) == 0) {
-        struct vnode_table_entry *next_vte = vnode_table_head->next;
-        free(vnode_table_head);
-        vnode_table_head = next_vte;
+    size_t mask = _vnt_size - 1;
+    size_t i = _vnt_find(path, _vfs_hash(path));
+    if (_vnt[i] == NULL) {
         return;
     }
-
-    struct vnode_table_entry *vte = vnode_table_head->next;
-    struct vnode_table_entry *prev = vnode_table_head;;
-    while (vte != NULL) {
-        if (strcmp(vte->vte_vn->vn_name, path) == 0) {
-            break;
+    _vnt[i] = NULL;
+    _vnt_count--;
+
+    /* Move back the entries that probed past the hole */
+    for (size_t j = (i + 1) & mask; _vnt[j] != NULL; j = (j + 1) & mask) {
+        size_t home = _vnt_hash(_vnt[j]) & mask;
+        bool in_between = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (!in_between) {
+            _vnt[i] = _vnt[j];
+            _vnt[j] = NULL;
+            i = j;
         }
-        prev = vte;
-        vte = vte->next;
-    }
-
-    /* Remove this vnode from the list */
-    if (vte != NULL) {
-        prev->next = vte->next;
-        free(vte);
     }
 }
@@ -1,8 +1,17 @@
 #ifndef _SOS_VFS_H_
 #define _SOS_VFS_H_
 
+#include <autoconf.h>
+
 #include "vfs/vnode.h"
 
+#ifndef CONFIG_SOS_IO_WINDOW
+#define CONFIG_SOS_IO_WINDOW 8
+#endif
+
+/* Requests a read or write of a plain file keeps in flight at most */
+#define VFS_IO_WINDOW   CONFIG_SOS_IO_WINDOW
+
 /******************************************************************************
  * VFS functions
  *****************************************************************************/
@@ -11,17 +20,28 @@ typedef void (*vfs_open_cb_t)(void *token, int err, struct vnode *vn);
 typedef void (*vfs_stat_cb_t)(void *token, int err);
 void vfs_open(char *path, int openflags, vfs_open_cb_t callback, void *token);
 void vfs_close(struct vnode *vn, uint32_t flags);
+/* Wait for the writes of VN to reach the file, the callback gets any error
+ * they had on the way */
+void vfs_flush(struct vnode *vn, vop_flush_cb_t callback, void *token);
 void vfs_stat(char* path, size_t path_len, sos_stat_t *buf, vfs_stat_cb_t callback, void *token);
 
 /******************************************************************************
- * Vnode table entry part
+ * Vnode allocation
  *****************************************************************************/
-struct vnode_table_entry {
-    struct vnode *vte_vn;
-    struct vnode_table_entry *next;
-};
 
-struct vnode_table_entry *vnode_table_head;
+/*
+ * Allocate a zeroed vnode with its vnode_ops, vn_name is a copy of PATH.
+ * They come in one object from the vnode slab
+ * Returns NULL if there is no memory
+ */
+struct vnode* vfs_vnode_alloc(const char *path);
+
+/* Give back a vnode from vfs_vnode_alloc */
+void vfs_vnode_free(struct vnode *vn);
+
+/******************************************************************************
+ * Vnode table part
+ *****************************************************************************/
 
 /*
  * Performs a lookup in vnode table.
@@ -30,7 +50,8 @@ struct vnode_table_entry *vnode_table_head;
 struct vnode* vfs_vnt_lookup(const char *path);
 
 /*
- * Create & insert new vnode to the vnode table
+ * Create & insert new vnode to the vnode table, VN must come from
+ * vfs_vnode_alloc
  * It is the caller's responsibility to ensure that a vnode of this path does
  * not already exists in the table (by calling vfs_vnt_lookup()
  */
@@ -28,8 +28,6 @@ void vnode_decopen(struct vnode *vn) {
 
         VOP_LASTCLOSE(vn);
         vfs_vnt_delete(vn->vn_name);
-        free(vn->vn_name);
-        free(vn->vn_ops);
-        free(vn);
+        vfs_vnode_free(vn);
     }
 }
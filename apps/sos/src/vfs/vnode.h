@@ -18,6 +18,7 @@ typedef void (*vop_read_cb_t)(void *token, int err, size_t size, bool more_to_re
 typedef void (*vop_write_cb_t)(void *token, int err, size_t size);
 typedef void (*vop_getdirent_cb_t)(void *token, int err, size_t size);
 typedef void (*vop_stat_cb_t)(void *token, int err);
+typedef void (*vop_flush_cb_t)(void *token, int err);
 
 struct vnode_ops {
     int (*vop_eachopen)(struct vnode *file, int flags);
@@ -27,6 +28,7 @@ struct vnode_ops {
                             vop_read_cb_t callback, void *token);
     void (*vop_write)(struct vnode *file, const char* buf, size_t nbytes, size_t offset,
                             vop_write_cb_t callback, void *token);
+    void (*vop_flush)(struct vnode *file, vop_flush_cb_t callback, void *token);   // optional
     void (*vop_getdirent)(struct vnode *dir, char *buf, size_t nbyte,
                           int pos, vop_getdirent_cb_t callback, void *token);
     int (*vop_stat)(struct vnode *file, sos_stat_t *buf, vop_stat_cb_t callback, void *token);
@@ -39,6 +41,7 @@ struct vnode_ops {
 
 #define VOP_READ(vn, buf, nbytes, offset, callback, token)      (__VOP(vn, read)(vn, buf, nbytes, offset, callback, token))
 #define VOP_WRITE(vn, buf, nbyte, offset, callback, token)      (__VOP(vn, write)(vn, buf, nbyte, offset, callback, token))
+#define VOP_FLUSH(vn, callback, token)                           (__VOP(vn, flush)(vn, callback, token))
 #define VOP_GETDIRENT(vn, buf, nbyte, pos, callback, token)     (__VOP(vn, getdirent)(vn, buf, nbyte, pos, callback, token))
 #define VOP_STAT(vn, buf, callback, token)                      (__VOP(vn, stat)(vn, buf, callback, token))
 
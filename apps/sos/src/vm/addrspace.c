@@ -1,5 +1,6 @@
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <limits.h>
 #include <sel4/sel4.h>
@@ -45,6 +46,7 @@ as_create(seL4_ARM_PageDirectory sel4_pd, as_create_cb_t callback, void *token)
     as->as_heap    = NULL;
     as->as_sel4_pd = sel4_pd;
     as->as_pt_head = NULL;
+    as->as_busy    = NULL;
 
     as_create_cont_t *cont = malloc(sizeof(as_create_cont_t));
     if (cont == NULL) {
@@ -144,6 +146,9 @@ as_destroy(addrspace_t *as) {
         return;
     }
 
+    /* Whoever is still paging in for us must not touch us anymore */
+    sos_page_busy_orphan(as);
+
     //Free page directory
     assert(as->as_pd_regs != NULL && as->as_pd_caps != NULL);
     for(int i = 0; i < N_PAGETABLES; i++){
@@ -174,6 +179,7 @@ as_destroy(addrspace_t *as) {
     region_t* prev_r = cur_r;
     while(cur_r != NULL){
         cur_r = cur_r->next;
+        free(prev_r->fh);
         free(prev_r);
         prev_r = cur_r;
     }
@@ -197,6 +203,233 @@ as_destroy(addrspace_t *as) {
     free(as);
 }
 
+/***********************************************************************
+ * as_clone
+ ***********************************************************************/
+typedef struct {
+    pid_t src_pid;
+    addrspace_t *src;
+    pid_t dst_pid;
+    addrspace_t *dst;
+    int x, y;               // the next page to look at
+    page_busy_t *busy;      // the src page being swapped in
+    as_clone_cb_t callback;
+    void *token;
+} as_clone_cont_t;
+
+static void _as_clone_walk(as_clone_cont_t *cont);
+static void _as_clone_resume(void *token, int err);
+
+static region_t*
+_region_copy(const region_t *reg) {
+    region_t *copy = malloc(sizeof(region_t));
+    if (copy == NULL) {
+        return NULL;
+    }
+    *copy = *reg;
+    copy->next = NULL;
+    if (reg->fh != NULL) {
+        copy->fh = malloc(sizeof(fhandle_t));
+        if (copy->fh == NULL) {
+            free(copy);
+            return NULL;
+        }
+        memcpy(copy->fh->data, reg->fh->data, sizeof(reg->fh->data));
+    }
+    return copy;
+}
+
+static int
+_as_clone_regions(addrspace_t *src, addrspace_t *dst) {
+    region_t **tail = &dst->as_rhead;
+    for (region_t *r = src->as_rhead; r != NULL; r = r->next) {
+        *tail = _region_copy(r);
+        if (*tail == NULL) {
+            return ENOMEM;
+        }
+        tail = &(*tail)->next;
+    }
+    if (src->as_stack != NULL && (dst->as_stack = _region_copy(src->as_stack)) == NULL) {
+        return ENOMEM;
+    }
+    if (src->as_heap != NULL && (dst->as_heap = _region_copy(src->as_heap)) == NULL) {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+int
+as_clone(pid_t src_pid, addrspace_t *src, pid_t dst_pid, addrspace_t *dst,
+         as_clone_cb_t callback, void *token) {
+    dprintf(3, "as_clone called\n");
+    if (src == NULL || dst == NULL || dst->as_rhead != NULL) {
+        return EINVAL;
+    }
+
+    int err = _as_clone_regions(src, dst);
+    if (err) {
+        return err;
+    }
+
+    as_clone_cont_t *cont = malloc(sizeof(as_clone_cont_t));
+    if (cont == NULL) {
+        return ENOMEM;
+    }
+    cont->src_pid  = src_pid;
+    cont->src      = src;
+    cont->dst_pid  = dst_pid;
+    cont->dst      = dst;
+    cont->x        = 0;
+    cont->y        = 0;
+    cont->busy     = NULL;
+    cont->callback = callback;
+    cont->token    = token;
+
+    _as_clone_walk(cont);
+    return 0;
+}
+
+static void
+_as_clone_end(as_clone_cont_t *cont, int err) {
+    dprintf(3, "as_clone end, err = %d\n", err);
+    cont->callback(cont->token, err);
+    free(cont);
+}
+
+static void
+_as_clone_resume(void *token, int err) {
+    as_clone_cont_t *cont = (as_clone_cont_t*)token;
+    if (cont->busy != NULL) {
+        int gone = sos_page_unbusy(cont->busy);
+        cont->busy = NULL;
+        err = err ? err : gone;
+    }
+    if (!err && (!is_proc_alive(cont->src_pid) || !is_proc_alive(cont->dst_pid))) {
+        err = EFAULT;
+    }
+    if (err) {
+        _as_clone_end(cont, err);
+        return;
+    }
+    _as_clone_walk(cont);
+}
+
+/*
+ * Share every page of src with dst, one pagetable at a time. Only swapping
+ * in and creating dst's pagetables leave the loop, the walk carries on from
+ * where it stopped when they are done
+ */
+static void
+_as_clone_walk(as_clone_cont_t *cont) {
+    addrspace_t *src = cont->src;
+    addrspace_t *dst = cont->dst;
+    int err;
+
+    for (; cont->x < N_PAGETABLES; cont->x++, cont->y = 0) {
+        int x = cont->x;
+        if (src->as_pd_regs[x] == NULL) {
+            continue;
+        }
+        if (dst->as_pd_regs[x] == NULL) {
+            err = sos_page_prepare(dst, PT_ID_TO_VPAGE(x, 0), _as_clone_resume, (void*)cont);
+            if (err) {
+                _as_clone_end(cont, err);
+            }
+            return;
+        }
+
+        for (; cont->y < N_PAGETABLES_ENTRIES; cont->y++) {
+            int y = cont->y;
+            seL4_Word pte = src->as_pd_regs[x][y];
+            seL4_Word vpage = PT_ID_TO_VPAGE(x, y);
+            if (!(pte & PTE_IN_USE_BIT)) {
+                continue;
+            }
+            if ((vpage >= PROCESS_IO_BUFFER &&
+                    vpage < PROCESS_IO_BUFFER + PROCESS_IO_BUFFER_PAGES * PAGE_SIZE) ||
+                    vpage == PROCESS_RING) {
+                /* sos writes the I/O buffer and the syscall ring behind the
+                 * process's back, never share them. The clone is given its
+                 * own (see iobuf_create and ring_create) */
+                continue;
+            }
+
+            if (sos_page_is_busy(src, vpage)) {
+                /* Being paged in or swapped out, look again once it's done */
+                err = sos_page_wait(src, vpage, _as_clone_resume, (void*)cont);
+                if (err) {
+                    _as_clone_end(cont, err);
+                }
+                return;
+            }
+
+            if (pte & PTE_SWAPPED) {
+                if (((pte & PTE_SWAP_MASK) >> PTE_SWAP_OFFSET) == PTE_ZERO_SLOT) {
+                    /* Nothing is stored for it, both can have it */
+                    dst->as_pd_regs[x][y] = pte;
+                    inc_proc_size(cont->dst_pid);
+                    continue;
+                }
+                /* Bring it back so that the frame can be shared, the walk
+                 * looks at this page again once it's in */
+                region_t *reg = region_probe(src, vpage);
+                cont->busy = sos_page_busy(src, vpage);
+                if (cont->busy == NULL) {
+                    _as_clone_end(cont, ENOMEM);
+                    return;
+                }
+                set_cur_proc(cont->src_pid);
+                err = swap_in(src, reg ? reg->rights : seL4_AllRights, vpage,
+                              false, _as_clone_resume, (void*)cont);
+                if (err) {
+                    sos_page_unbusy(cont->busy);
+                    cont->busy = NULL;
+                    _as_clone_end(cont, err);
+                }
+                return;
+            }
+
+            seL4_Word kvaddr = pte & PTE_KVADDR_MASK;
+            if (kvaddr == frame_zero_kvaddr()) {
+                dst->as_pd_regs[x][y] = pte;
+                inc_proc_size(cont->dst_pid);
+                continue;
+            }
+            if (frame_is_shared(kvaddr)) {
+                /* dst gets it from the shared page cache on its first touch */
+                continue;
+            }
+
+            /* A locked page is always busy too, it was waited for above */
+            bool is_locked;
+            frame_is_locked(kvaddr, &is_locked);
+            if (is_locked) {
+                _as_clone_end(cont, EFAULT);
+                return;
+            }
+
+            /* src has to fault on its next write too */
+            err = sos_page_unmap(src, vpage);
+            if (!err) {
+                err = frame_set_cow(kvaddr);
+            }
+            if (!err) {
+                err = frame_cow_map(kvaddr, dst, vpage, cont->dst_pid);
+            }
+            if (err) {
+                _as_clone_end(cont, err);
+                return;
+            }
+
+            /* Not mapped in sel4, the first touch maps it read only */
+            dst->as_pd_regs[x][y] = pte;
+            inc_proc_size(cont->dst_pid);
+        }
+    }
+
+    _as_clone_end(cont, 0);
+}
+
 /**********************************************************************
  * Region related functions
  * - region_probe
@@ -229,6 +462,10 @@ _region_init(addrspace_t *as, seL4_Word vaddr, size_t sz,
     nregion->vbase = vaddr;
     nregion->vtop = vaddr + sz;
     nregion->rights = rights;
+    nregion->fh = NULL;
+    nregion->file_vaddr = 0;
+    nregion->file_offset = 0;
+    nregion->file_size = 0;
     nregion->next = NULL;
 
     /*
@@ -267,8 +504,9 @@ region_probe(struct addrspace* as, seL4_Word addr) {
     return NULL;
 }
 
-int
-as_define_region(addrspace_t *as, seL4_Word vaddr, size_t sz, int32_t rights) {
+static int
+_as_define_region(addrspace_t *as, seL4_Word vaddr, size_t sz, int32_t rights,
+                  region_t **reg_ret) {
     dprintf(3, "as define region\n");
     assert(as != NULL);
 
@@ -278,14 +516,16 @@ as_define_region(addrspace_t *as, seL4_Word vaddr, size_t sz, int32_t rights) {
         return ENOMEM;
     }
 
-    /* Page align the page and the size */
+    /* Page align the page and the size, the region must still cover the
+     * end of [vaddr, vaddr + sz) */
+    sz = DIVROUNDUP(vaddr + sz, PAGE_SIZE) * PAGE_SIZE - PAGE_ALIGN(vaddr);
     vaddr = PAGE_ALIGN(vaddr);
-    sz = DIVROUNDUP(sz, PAGE_SIZE) * PAGE_SIZE;
 
     /* Check region overlap */
     int err = _region_init(as, vaddr, sz, rights, nregion);
     if (err) {
         dprintf(3, "as define region init failed\n");
+        free(nregion);
         return err;
     }
 
@@ -293,10 +533,67 @@ as_define_region(addrspace_t *as, seL4_Word vaddr, size_t sz, int32_t rights) {
     nregion->next = as->as_rhead;
     as->as_rhead = nregion;
 
+    if (reg_ret != NULL) {
+        *reg_ret = nregion;
+    }
+
     dprintf(3, "as define region end\n");
     return 0;
 }
 
+void
+region_file_range(region_t *reg, seL4_Word vpage, seL4_Word *file_offset,
+                  size_t *page_offset, size_t *len) {
+    assert(reg != NULL);
+    vpage = PAGE_ALIGN(vpage);
+
+    seL4_Word start = MAX(vpage, reg->file_vaddr);
+    seL4_Word end   = MIN(vpage + PAGE_SIZE, reg->file_vaddr + reg->file_size);
+    if (reg->fh == NULL || start >= end) {
+        *file_offset = 0;
+        *page_offset = 0;
+        *len         = 0;
+        return;
+    }
+
+    *file_offset = reg->file_offset + (start - reg->file_vaddr);
+    *page_offset = start - vpage;
+    *len         = end - start;
+}
+
+int
+as_define_region(addrspace_t *as, seL4_Word vaddr, size_t sz, int32_t rights) {
+    return _as_define_region(as, vaddr, sz, rights, NULL);
+}
+
+int
+as_define_file_region(addrspace_t *as, seL4_Word vaddr, size_t sz,
+                      int32_t rights, const fhandle_t *fh,
+                      seL4_Word file_offset, size_t file_size) {
+    if (fh == NULL || file_size > sz) {
+        return EINVAL;
+    }
+
+    fhandle_t *reg_fh = malloc(sizeof(fhandle_t));
+    if (reg_fh == NULL) {
+        return ENOMEM;
+    }
+    memcpy(reg_fh->data, fh->data, sizeof(fh->data));
+
+    region_t *reg;
+    int err = _as_define_region(as, vaddr, sz, rights, &reg);
+    if (err) {
+        free(reg_fh);
+        return err;
+    }
+
+    reg->fh          = reg_fh;
+    reg->file_vaddr  = vaddr;
+    reg->file_offset = file_offset;
+    reg->file_size   = file_size;
+    return 0;
+}
+
 int
 as_define_stack(addrspace_t *as, seL4_Word stack_top, int size) {
     if (as == NULL)
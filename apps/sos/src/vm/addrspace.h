@@ -3,6 +3,7 @@
 
 #include <sel4/sel4.h>
 #include <cspace/cspace.h>
+#include <nfs/nfs.h>
 
 #define SEL4_N_PAGETABLES       (1<<12)
 
@@ -17,6 +18,8 @@
 #define PTE_SWAP_OFFSET         (2)
 #define PTE_SWAP_MASK           (0xfffffffc)
 #define PTE_KVADDR_MASK         (0xfffff000)
+/* A swapped out page that was all zeros has this slot, nothing is stored for it */
+#define PTE_ZERO_SLOT           (PTE_SWAP_MASK >> PTE_SWAP_OFFSET)
 
 /* Pagetable related defs */
 typedef seL4_Word* pagetable_t;
@@ -27,6 +30,13 @@ typedef struct region region_t;
 struct region {
     seL4_Word vbase, vtop;  // valid addr in this region [vabase, vtop)
     uint32_t rights;        // same format as seL4's seL4_CapRights for frame caps
+    /* File backing, the pages are read from the file on first touch.
+     * [file_vaddr, file_vaddr + file_size) holds the file content starting at
+     * file_offset, the rest of the region is zero filled */
+    fhandle_t *fh;          // NULL if this region is anonymous memory
+    seL4_Word file_vaddr;
+    seL4_Word file_offset;
+    size_t file_size;
     region_t *next;         // link to the next region
 };
 
@@ -38,6 +48,9 @@ struct sel4_pt_node {
     sel4_pt_node_t *next;
 };
 
+/* A page being paged in, see sos_page_busy */
+typedef struct page_busy page_busy_t;
+
 /* The address space used in every user process */
 typedef
 struct addrspace {
@@ -48,6 +61,7 @@ struct addrspace {
     region_t *as_heap;
     seL4_ARM_PageDirectory as_sel4_pd;
     sel4_pt_node_t* as_pt_head;
+    page_busy_t *as_busy;   // pages being paged in
 } addrspace_t;
 
 /***********************************************************************
@@ -59,6 +73,14 @@ struct addrspace {
 /* Find and return the region that this address is in */
 region_t* region_probe(struct addrspace* as, seL4_Word addr);
 
+/*
+ * Work out which part of the page at VPAGE comes from the file backing
+ * region REG: *len* bytes at *file_offset* go to *page_offset* in the page,
+ * the rest of the page is zero. *len* is 0 if nothing comes from the file
+ */
+void region_file_range(region_t *reg, seL4_Word vpage, seL4_Word *file_offset,
+                       size_t *page_offset, size_t *len);
+
 /* Callback for as_create function, to be called when as_create finished and
  * want to reply to the caller */
 typedef void (*as_create_cb_t)(void *token, addrspace_t *as);
@@ -71,6 +93,21 @@ typedef void (*as_create_cb_t)(void *token, addrspace_t *as);
  */
 int as_create(seL4_ARM_PageDirectory sel4_pd, as_create_cb_t callback, void *token);
 
+/* Callback for as_clone */
+typedef void (*as_clone_cb_t)(void *token, int err);
+
+/*
+ * Turn DST, a new address space from as_create, into a copy of SRC. They
+ * share every frame read only, a page gets a copy of its own on its first
+ * write (see sos_page_uncow). The swapped out pages of SRC are swapped in
+ * first. SRC_PID and DST_PID own the address spaces, the clone fails if
+ * either of them goes away meanwhile. On failure, DST still needs as_destroy
+ * This function is asynchronous.
+ * RETURN: 0 if the callback is registered, it then gets 0 iff successful
+ */
+int as_clone(int src_pid, addrspace_t *src, int dst_pid, addrspace_t *dst,
+             as_clone_cb_t callback, void *token);
+
 /*
  * Dispose of an address space.
  */
@@ -82,6 +119,15 @@ void as_destroy(addrspace_t *as);
 int as_define_region(addrspace_t *as, seL4_Word vaddr,
                               size_t sz, int32_t rights);
 
+/*
+ * set up a region whose first *file_size* bytes are backed by the file *fh*
+ * starting at *file_offset*. Pages are loaded from the file when they are
+ * first touched. The file handle is copied.
+ */
+int as_define_file_region(addrspace_t *as, seL4_Word vaddr, size_t sz,
+                          int32_t rights, const fhandle_t *fh,
+                          seL4_Word file_offset, size_t file_size);
+
 /*
  * set up the stack region in the address space.
  * Hands back the initial stack pointer for the new process.
@@ -121,10 +167,59 @@ typedef void (*sos_page_map_cb_t)(void *token, int err);
 int sos_page_map(int pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
                  sos_page_map_cb_t callback, void* token, bool noswap);
 
+/*
+ * Make sure the shadow pagetables covering VADDR exist, so that
+ * sos_page_map_frame can be used on it.
+ * This is an asynchronous function and will return by calling the call back
+ * function
+ * Returns 0 if succesfully register callback
+ */
+int sos_page_prepare(addrspace_t *as, seL4_Word vaddr, sos_page_map_cb_t callback, void *token);
+
+/*
+ * Map the existing frame KVADDR at VADDR, the shadow pagetables must
+ * already be there (see sos_page_prepare). This does not allocate memory
+ * and is synchronous
+ * Returns 0 if successful
+ */
+int sos_page_map_frame(addrspace_t *as, seL4_Word vaddr, uint32_t permissions, seL4_Word kvaddr);
+
+/*
+ * Map the zero frame read only at VADDR, for anonymous memory that is read
+ * before it is ever written
+ * This is an asynchronous function and will return by calling the call back
+ * function
+ * Returns 0 if succesfully register callback
+ */
+int sos_page_map_zero(int pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
+                      sos_page_map_cb_t callback, void *token);
+
+/*
+ * Give the page at VADDR, currently mapping the zero frame, a zero filled
+ * frame of its own so that it can be written to (copy on write)
+ * This is an asynchronous function and will return by calling the call back
+ * function
+ * Returns 0 if succesfully register callback
+ */
+int sos_page_unzero(int pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
+                    sos_page_map_cb_t callback, void *token);
+
+/*
+ * Give the page at VADDR, currently mapping a copy on write frame, a copy of
+ * the frame of its own so that it can be written to. If nobody else maps the
+ * frame anymore, the page just takes it over
+ * This is an asynchronous function and will return by calling the call back
+ * function
+ * Returns 0 if succesfully register callback
+ */
+int sos_page_uncow(int pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
+                   sos_page_map_cb_t callback, void *token);
+
 /*
  * Unmap a page in the pagetable.
  * Note that this does not actually free the page in user pagetable, it only
- * unmaps the page from sel4 and free the frame_cap
+ * unmaps the page from sel4 and free the frame_cap. Does nothing if the page
+ * is not mapped in sel4 at the moment
  * Returns 0 if successful
  */
 int sos_page_unmap(addrspace_t *as, seL4_Word vaddr);
@@ -136,15 +231,55 @@ int sos_page_unmap(addrspace_t *as, seL4_Word vaddr);
 void sos_page_free(addrspace_t *as, seL4_Word vaddr);
 
 /*
+ * Bringing a page in can wait for a frame or the network. Meanwhile the
+ * process itself, its other syscalls and its ring can all want the same
+ * page, so whoever starts paging it in marks it busy with sos_page_busy and
+ * the others sos_page_wait for it, then look at the page again. swap_out
+ * marks the pages it is writing out the same way.
+ */
+
+/*
+ * Mark the page at VADDR busy
+ * Returns the mark to give to sos_page_unbusy or NULL if out of memory
+ */
+page_busy_t *sos_page_busy(addrspace_t *as, seL4_Word vaddr);
+
+/*
+ * Paging in is done, CALLBACK of everyone waiting for the page is called.
+ * BUSY can be NULL
+ * Returns EFAULT if the address space was destroyed meanwhile, 0 otherwise
+ */
+int sos_page_unbusy(page_busy_t *busy);
+
+/*
+ * Call CALLBACK once the page at VADDR is not busy anymore, with EFAULT if
+ * the address space was destroyed meanwhile
+ * Returns 0 if succesfully register callback
+ */
+int sos_page_wait(addrspace_t *as, seL4_Word vaddr, sos_page_map_cb_t callback, void *token);
+
+/*
+ * The address space is going away, the pages still busy are left to their
+ * owners who only unbusy them
+ */
+void sos_page_busy_orphan(addrspace_t *as);
+
+/*
+ * sos_page_is_busy     - Check if page at address VADDR is being paged in
  * sos_page_is_inuse    - Check if page at address VADDR currently in use
  * sos_page_is_swapped  - Check if page at address VADDR is swapped
  * sos_page_is_locked   - Check if the underlying frame is locked
+ * sos_page_is_zero     - Check if page at address VADDR maps the zero frame
+ * sos_page_is_cow      - Check if page at address VADDR maps a copy on write frame
  * sos_get_kvaddr       - Get the SOS's vaddr from the given application's ADDR in AS
  * sos_get_kframe_cap   - Get the kframe_cap from the given ADDR in AS
  */
+bool sos_page_is_busy(addrspace_t *as, seL4_Word vaddr);
 bool sos_page_is_inuse(addrspace_t *as, seL4_Word vaddr);
 bool sos_page_is_swapped(addrspace_t *as, seL4_Word vaddr);
 bool sos_page_is_locked(addrspace_t *as, seL4_Word vaddr);
+bool sos_page_is_zero(addrspace_t *as, seL4_Word vaddr);
+bool sos_page_is_cow(addrspace_t *as, seL4_Word vaddr);
 int sos_get_kvaddr(addrspace_t *as, seL4_Word vaddr, seL4_Word *kvaddr);
 int sos_get_kframe_cap(addrspace_t *as, seL4_Word vaddr, seL4_CPtr *kframe_cap);
 
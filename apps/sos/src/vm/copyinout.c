@@ -4,14 +4,76 @@
 #include <sel4/sel4.h>
 
 #include "tool/utility.h"
+#include "tool/slab.h"
 #include "proc/proc.h"
 #include "vm/copyinout.h"
+#include "vm/iobuf.h"
 #include "vm/addrspace.h"
 #include "vm/swap.h"
+#include "vm/vm.h"
 
 #define verbose 0
 #include <sys/debug.h>
 
+/***********************************************************************
+ * Paging in the user buffer
+ **********************************************************************/
+
+/*
+ * Bring the page at VPAGE in, to be written to if WRITE or only read.
+ * *BUSY is the page's busy mark while it's paged in, the caller unbusies it
+ * once called back. Several copies into the same page can be on their way
+ * at once (e.g. the pieces of one read), so if the page is busy already
+ * this only waits for it
+ * Returns EALREADY if the page can be used right away, 0 if CALLBACK will
+ * be called once it's worth looking at the page again or an error
+ */
+static int
+_copy_page_in(addrspace_t *as, region_t *reg, seL4_Word vpage, bool write,
+              page_busy_t **busy, sos_page_map_cb_t callback, void *token) {
+    if (sos_page_is_busy(as, vpage)) {
+        dprintf(3, "_copy_page_in: waiting for the page\n");
+        return sos_page_wait(as, vpage, callback, token);
+    }
+
+    bool inuse = sos_page_is_inuse(as, vpage);
+    bool swapped = sos_page_is_swapped(as, vpage);
+    bool zero = sos_page_is_zero(as, vpage);
+    bool cow = sos_page_is_cow(as, vpage);
+    if (inuse && !swapped && !(write && (zero || cow))) {
+        return EALREADY;
+    }
+
+    *busy = sos_page_busy(as, vpage);
+    if (*busy == NULL) {
+        return ENOMEM;
+    }
+
+    int err;
+    if (!inuse) {
+        dprintf(3, "_copy_page_in: mapping page in\n");
+        err = sos_page_map_region(proc_get_id(), as, reg, vpage, write, callback, token);
+        if (!err) {
+            inc_proc_size_proc(cur_proc());
+        }
+    } else if (swapped) {
+        dprintf(3, "_copy_page_in: swapping page in\n");
+        err = swap_in(as, reg->rights, vpage, false, callback, token);
+    } else if (zero) {
+        dprintf(3, "_copy_page_in: page only had the zero frame\n");
+        err = sos_page_unzero(proc_get_id(), as, vpage, reg->rights, callback, token);
+    } else {
+        dprintf(3, "_copy_page_in: page is shared with a cloned process\n");
+        err = sos_page_uncow(proc_get_id(), as, vpage, reg->rights, callback, token);
+    }
+    if (err) {
+        /* Nothing is on its way, so it's still ours */
+        sos_page_unbusy(*busy);
+        *busy = NULL;
+    }
+    return err;
+}
+
 /***********************************************************************
  * Copyin
  **********************************************************************/
@@ -24,8 +86,11 @@ typedef struct {
     unsigned long pos;
     addrspace_t *as;
     region_t *reg;
+    page_busy_t *busy;      // the page we are paging in
 } copyin_cont_t;
 
+static SLAB_CACHE(_copyin_slab, copyin_cont_t);
+
 static void _copyin_do_copy(void *token, int err);
 static void _copyin_end(copyin_cont_t *cont, int err);
 
@@ -34,13 +99,20 @@ copyin(seL4_Word kbuf, seL4_Word buf, size_t nbyte, copyin_cb_t callback, void *
     dprintf(3, "copyin called, kbuf=0x%08x, buf=0x%08x, nbyte=%u\n", kbuf, buf, nbyte);
     uint32_t permissions = 0;
 
+    /* The I/O buffer is always there, no need to walk it */
+    if (iobuf_contains(cur_proc(), buf, nbyte)) {
+        iobuf_copyin(cur_proc(), kbuf, buf, nbyte);
+        callback(token, 0);
+        return 0;
+    }
+
     addrspace_t *as = proc_getas();
     /* Ensure that the user buffer range is valid */
     if (!as_is_valid_memory(as, buf, nbyte, &permissions)) {
         return EINVAL;
     }
 
-    copyin_cont_t *cont = malloc(sizeof(copyin_cont_t));
+    copyin_cont_t *cont = slab_alloc(&_copyin_slab);
     if (cont == NULL) {
         return ENOMEM;
     }
@@ -52,6 +124,7 @@ copyin(seL4_Word kbuf, seL4_Word buf, size_t nbyte, copyin_cb_t callback, void *
     cont->pos      = 0;
     cont->as       = as;
     cont->reg      = region_probe(cont->as, buf);
+    cont->busy     = NULL;
 
     assert(cont->reg != NULL); // This address need to be valid, read precond in copyinout.h
 
@@ -64,6 +137,12 @@ _copyin_do_copy(void *token, int err){
     dprintf(3, "_copyin_do_copy\n");
     copyin_cont_t *cont = (copyin_cont_t*)token;
 
+    /* Back from paging in, let the others at the page */
+    if (cont->busy != NULL) {
+        int gone = sos_page_unbusy(cont->busy);
+        cont->busy = NULL;
+        err = err ? err : gone;
+    }
     if (err) {
         _copyin_end(cont, err);
         return;
@@ -71,22 +150,11 @@ _copyin_do_copy(void *token, int err){
 
     /* Check if we need to either map the page or swap in */
     seL4_Word vpage = PAGE_ALIGN(cont->buf);
-    if (!sos_page_is_inuse(cont->as, vpage)) {
-        dprintf(3, "_copyin_do_copy: mapping page in\n");
-        err = sos_page_map(proc_get_id(), cont->as, vpage, cont->reg->rights, _copyin_do_copy, (void*)cont, false);
-        if (err) {
-            _copyin_end(cont, err);
-            return;
-        }
-        inc_proc_size_proc(cur_proc());
-        return;
-    } else if (sos_page_is_swapped(cont->as, vpage)) {
-        dprintf(3, "_copyin_do_copy: swapping page in\n");
-        err = swap_in(cont->as, cont->reg->rights, vpage,
-                false, _copyin_do_copy, cont);
+    err = _copy_page_in(cont->as, cont->reg, vpage, false, &cont->busy,
+                        _copyin_do_copy, (void*)cont);
+    if (err != EALREADY) {
         if (err) {
             _copyin_end(cont, err);
-            return;
         }
         return;
     }
@@ -129,12 +197,12 @@ _copyin_end(copyin_cont_t *cont, int err) {
     assert(cont != NULL);
     if (err) {
         cont->callback(cont->token, err);
-        free(cont);
+        slab_free(&_copyin_slab, cont);
         return;
     }
     dprintf(3, "copyin call back up\n");
     cont->callback(cont->token, 0);
-    free(cont);
+    slab_free(&_copyin_slab, cont);
 }
 
 /***********************************************************************
@@ -148,10 +216,13 @@ typedef struct {
     unsigned long pos;
     addrspace_t *as;
     region_t *reg;
+    page_busy_t *busy;      // the page we are paging in
     copyout_cb_t callback;
     void *token;
 } copyout_cont_t;
 
+static SLAB_CACHE(_copyout_slab, copyout_cont_t);
+
 static void _copyout_end(void *token, int err);
 static void _copyout_do_copy(void *token, int err);
 
@@ -162,6 +233,13 @@ copyout(seL4_Word buf, seL4_Word kbuf, size_t nbyte, copyout_cb_t callback, void
 
     //dprintf(3, "copyout buf = 0x%08x\n", buf);
 
+    /* The I/O buffer is always there and never swapped, just write it */
+    if (iobuf_contains(cur_proc(), buf, nbyte)) {
+        iobuf_copyout(cur_proc(), buf, kbuf, nbyte);
+        callback(token, 0);
+        return 0;
+    }
+
     addrspace_t *as = proc_getas();
     assert(as != NULL);
 
@@ -170,7 +248,7 @@ copyout(seL4_Word buf, seL4_Word kbuf, size_t nbyte, copyout_cb_t callback, void
         return EINVAL;
     }
 
-    copyout_cont_t *cont = malloc(sizeof(copyout_cont_t));
+    copyout_cont_t *cont = slab_alloc(&_copyout_slab);
     if(cont == NULL){
         return ENOMEM;
     }
@@ -181,6 +259,7 @@ copyout(seL4_Word buf, seL4_Word kbuf, size_t nbyte, copyout_cb_t callback, void
     cont->pos       = 0;
     cont->as        = as;
     cont->reg       = region_probe(as, buf);
+    cont->busy      = NULL;
     cont->callback  = callback;
     cont->token     = token;
 
@@ -192,32 +271,27 @@ copyout(seL4_Word buf, seL4_Word kbuf, size_t nbyte, copyout_cb_t callback, void
 static void
 _copyout_do_copy(void *token, int err){
     dprintf(3, "_copyout_do_copy\n");
+    copyout_cont_t *cont = (copyout_cont_t*)token;
+    assert(cont != NULL);
+
+    /* Back from paging in, let the others at the page */
+    if (cont->busy != NULL) {
+        int gone = sos_page_unbusy(cont->busy);
+        cont->busy = NULL;
+        err = err ? err : gone;
+    }
     if (err) {
         _copyout_end(token, err);
         return;
     }
 
-    copyout_cont_t *cont = (copyout_cont_t*)token;
-    assert(cont != NULL);
-
-    /* Check if we need to either map the page or swap in */
+    /* Check if we need to either map the page, swap in or copy the frame */
     seL4_Word vpage = PAGE_ALIGN(cont->buf);
-    if (!sos_page_is_inuse(cont->as, vpage)) {
-        dprintf(3, "_copyout_do_copy: mapping page in\n");
-        err = sos_page_map(proc_get_id(), cont->as, vpage, cont->reg->rights, _copyout_do_copy, (void*)cont, false);
+    err = _copy_page_in(cont->as, cont->reg, vpage, true, &cont->busy,
+                        _copyout_do_copy, (void*)cont);
+    if (err != EALREADY) {
         if (err) {
             _copyout_end(token, err);
-            return;
-        }
-        inc_proc_size_proc(cur_proc());
-        return;
-    } else if (sos_page_is_swapped(cont->as, vpage)) {
-        dprintf(3, "_copyout_do_copy: swapping page in\n");
-        err = swap_in(cont->as, cont->reg->rights, vpage,
-                false, _copyout_do_copy, cont);
-        if (err) {
-            _copyout_end(token, err);
-            return;
         }
         return;
     }
@@ -241,6 +315,8 @@ _copyout_do_copy(void *token, int err){
         cpy_sz = MIN(cpy_sz, cont->nbyte - cont->pos);
         dprintf(3, "cpy_sz = %u\n", cpy_sz);
         memcpy((void*)kdst, (void*)cont->kbuf, cpy_sz);
+        /* The copy in swap (if any) is out of date now */
+        frame_set_dirty(PAGE_ALIGN(kdst));
         dprintf(3, "copyout from kbuf=0x%08x to (ubuf=0x%08x, kdst=0x%08x)\n", cont->kbuf, cont->buf, kdst);
 
         cont->pos  += cpy_sz;
@@ -261,12 +337,12 @@ _copyout_end(void *token, int err){
 
     if(err){
         cont->callback(cont->token, err);
-        free(cont);
+        slab_free(&_copyout_slab, cont);
         return;
     }
 
     dprintf(3, "copyout calls back up\n");
     cont->callback(cont->token, 0);
-    free(cont);
+    slab_free(&_copyout_slab, cont);
     return;
 }
@@ -23,12 +23,11 @@
 #include "vm/elf.h"
 #include "vm/vmem_layout.h"
 #include "vm/vm.h"
+#include "dev/nfs_cache.h"
 
 #define verbose 0
 #include <sys/debug.h>
 
-extern fhandle_t mnt_point;
-
 /*
  * Convert ELF permissions into seL4 permissions.
  */
@@ -45,167 +44,6 @@ static inline unsigned long get_sel4_rights_from_elf(unsigned long permissions)
     return result;
 }
 
-/**********************************************************************
- * load_segment - loads the segment into the process's vspace
- * This is a helper function for elf_load
- *********************************************************************/
-
-typedef void (*load_segment_cb_t)(void *token, int err);
-
-typedef struct {
-    pid_t pid;
-    addrspace_t *as;
-    unsigned long file_offset;
-    unsigned long segment_size;
-    unsigned long file_size;
-    unsigned long dst;
-    unsigned long permissions;
-    unsigned long pos;
-    unsigned long wanna_read;
-    process_t *proc;
-    fhandle_t *fh;
-    load_segment_cb_t callback;
-    void *token;
-} load_segment_cont_t;
-
-static void _load_segment2(void *token, int err);
-static void _load_segment3(uintptr_t token, enum nfs_stat status, fattr_t *fattr, int count, void *data);
-static void _load_segment_end(load_segment_cont_t *cont, int err);
-
-static int _load_segment(pid_t pid, addrspace_t *as,
-                         unsigned long file_offset,
-                         unsigned long segment_size,
-                         unsigned long file_size, unsigned long dst,
-                         unsigned long permissions,
-                         process_t *proc, fhandle_t *fh,
-                         load_segment_cb_t callback, void *token) {
-    dprintf(3, "load segment into vspace\n");
-    //assert(file_size <= segment_size);
-
-    load_segment_cont_t *cont = malloc(sizeof(load_segment_cont_t));
-    if(cont == NULL){
-        return ENOMEM;
-    }
-    cont->pid = pid;
-    cont->as = as;
-    cont->file_offset = file_offset;
-    cont->segment_size = segment_size;
-    cont->file_size = file_size;
-    cont->dst = dst;
-    cont->permissions = permissions;
-    cont->pos = 0;
-    cont->wanna_read = 0;
-    cont->proc = proc;
-    cont->fh = fh;
-    cont->callback = callback;
-    cont->token = token;
-
-    _load_segment2((void*)cont, 0);
-
-    return 0;
-}
-
-static void _load_segment2(void *token, int err){
-    dprintf(3, "load segment into vspace2\n");
-
-    load_segment_cont_t *cont = (load_segment_cont_t*)token;
-
-    if (err) {
-        _load_segment_end(cont, err);
-        return;
-    }
-    /* We copy chunk by chunk to the destination vspace. */
-    if(cont->pos < cont->file_size){
-        seL4_Word vpage;
-        vpage = PAGE_ALIGN(cont->dst);
-
-        //dprintf(3, "load segment into vspace2 page map\n");
-        if (!sos_page_is_inuse(cont->as, vpage)) {
-            inc_proc_size_proc(cont->proc);
-            sos_page_map(cont->pid, cont->as, vpage, cont->permissions, _load_segment2, token, false);
-        } else {
-            seL4_Word kdst;
-            err = sos_get_kvaddr(cont->as, cont->dst, &kdst);
-            if (err) {
-                _load_segment_end(cont, err);
-                return;
-            }
-            frame_lock_frame(kdst);
-
-            /* Reset the wanna_read and read from nfs */
-            cont->wanna_read = MIN(NFS_SEND_SIZE, cont->file_size - cont->pos);
-            cont->wanna_read = MIN(cont->wanna_read, PAGE_SIZE - PAGE_OFFSET(cont->dst));
-            dprintf(3, "_load_segment2: wanna_read = %lu\n", cont->wanna_read);
-
-            /* Attemp to read from nfs */
-            enum rpc_stat rpc_status = nfs_read(cont->fh, cont->file_offset + cont->pos,
-                    cont->wanna_read, _load_segment3, (uintptr_t)cont);
-            if (rpc_status != RPC_OK) {
-                _load_segment_end(cont, EFAULT);
-            }
-        }
-        return;
-    }
-
-    //dprintf(3, "load segment into vspace2 out\n");
-    _load_segment_end(cont, 0);
-}
-
-/* This function actually copy data into the user vspace */
-static void
-_load_segment3(uintptr_t token, enum nfs_stat status,
-              fattr_t *fattr, int count, void *data) {
-    dprintf(3, "_load_segment3 called\n");
-    load_segment_cont_t *cont = (load_segment_cont_t*)token;
-
-    if (status != NFS_OK) {
-        _load_segment_end(cont, EFAULT);
-        return;
-    }
-
-    int err;
-    seL4_Word kdst;
-    seL4_CPtr sos_cap;
-
-    err = sos_get_kvaddr(cont->as, cont->dst, &kdst);
-    if (err) {
-        _load_segment_end(cont, err);
-        return;
-    }
-
-    /* Now copy our data into the destination vspace. */
-    if (cont->pos < cont->file_size){
-        memcpy((void*)kdst, (void*)data, count);
-    }
-
-    /* Check if this is the last copy in this frame */
-    if (PAGE_ALIGN(kdst) != PAGE_ALIGN(kdst + count) || cont->dst + cont->pos >= cont->file_size) {
-        frame_unlock_frame(kdst);
-
-        /* Not observable to I-cache yet so flush the frame */
-        err = sos_get_kframe_cap(cont->as, PAGE_ALIGN(cont->dst), &sos_cap);
-        if (err) {
-            _load_segment_end(cont, err);
-            return;
-        }
-
-        seL4_ARM_Page_Unify_Instruction(sos_cap, 0, PAGESIZE);
-    }
-
-    cont->pos += count;
-    cont->dst += count;
-
-    _load_segment2((void*)cont, err);
-}
-
-static void
-_load_segment_end(load_segment_cont_t *cont, int err) {
-    // We don't need to free anything, including as mapped page as they'll be
-    // cleaned up by the caller (proc_create)
-    cont->callback(cont->token, err);
-    free(cont);
-}
-
 /**********************************************************************
  * Elf_load - Read and load elf file into the address space
  *********************************************************************/
@@ -258,7 +96,7 @@ void elf_load(pid_t pid, addrspace_t *as, char *file_name,
     cont->callback      = callback;
     cont->token         = token;
 
-    enum rpc_stat status = nfs_lookup(&mnt_point, file_name, _elf_load_lookup_cb, (uintptr_t)cont);
+    enum rpc_stat status = nfs_cache_lookup(file_name, _elf_load_lookup_cb, (uintptr_t)cont);
     if (status != RPC_OK) {
         dprintf(3, "elf_load nfs_lookup err\n");
         _elf_load_end((void*)cont, EFAULT);
@@ -380,24 +218,25 @@ _elf_load_load_segments(void* token, int err){
         flags           = cont->prog_hdrs[cont->i].p_flags;
         rights          = get_sel4_rights_from_elf(flags) & seL4_AllRights;
 
-        /* Define the region */
+        /*
+         * Define the region. Nothing is loaded here, the pages are read
+         * from the executable by the VM fault handler when first touched
+         */
         dprintf(1, " * Loading segment %08x-->%08x\n", (int)vaddr, (int)(vaddr + segment_size));
 
-        err = as_define_region(cont->as, vaddr, segment_size, rights);
-        if (err) {
-            _elf_load_end((void*)cont, err);
-            return;
+        if (file_size > 0) {
+            err = as_define_file_region(cont->as, vaddr, segment_size, rights,
+                                        cont->fh, file_offset, file_size);
+        } else {
+            err = as_define_region(cont->as, vaddr, segment_size, rights);
         }
-        cont->i++;
-
-        /* Copy it across into the vspace. */
-        err = _load_segment(cont->pid, cont->as, file_offset, segment_size, file_size,
-                           vaddr, rights, cont->proc, cont->fh, _elf_load_load_segments, (void*)cont);
         if (err) {
             _elf_load_end((void*)cont, err);
             return;
         }
+        cont->i++;
 
+        _elf_load_load_segments(token, 0);
         return;
     }
 
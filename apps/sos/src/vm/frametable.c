@@ -1,3 +1,4 @@
+#include <autoconf.h>
 #include <stdio.h>
 #include <assert.h>
 #include <strings.h>
@@ -11,7 +12,12 @@
 #include "vm/mapping.h"
 #include "vm/vmem_layout.h"
 #include "vm/swap.h"
+#include "vm/sharedpage.h"
+#include "vm/pagecache.h"
+#include "proc/proc.h"
+#include "dev/clock.h"
 #include "tool/utility.h"
+#include "tool/slab.h"
 
 #define verbose 0
 #include <sys/debug.h>
@@ -27,6 +33,27 @@
 #define ID_TO_KVADDR(id)     ((id)*PAGE_SIZE + FRAME_VSTART)
 #define KVADDR_TO_ID(kvaddr)  (((kvaddr) - FRAME_VSTART) / PAGE_SIZE)
 
+/*
+ * The page cleaner starts evicting in the background once the number of free
+ * frames drops below the low watermark and keeps going until it reaches the
+ * high watermark again. Both come from Kconfig, sos itself can change them
+ * with frame_set_watermarks()
+ */
+#if defined(CONFIG_SOS_FRAME_LOW_WATERMARK) && CONFIG_SOS_FRAME_LOW_WATERMARK > 0
+#define FRAME_LOW_WATERMARK      (CONFIG_SOS_FRAME_LOW_WATERMARK)
+#endif
+#if defined(CONFIG_SOS_FRAME_HIGH_WATERMARK) && CONFIG_SOS_FRAME_HIGH_WATERMARK > 0
+#define FRAME_HIGH_WATERMARK     (CONFIG_SOS_FRAME_HIGH_WATERMARK)
+#endif
+#ifndef FRAME_LOW_WATERMARK
+#define FRAME_LOW_WATERMARK      ((NFRAMES) / 16 + 1)
+#endif
+#ifndef FRAME_HIGH_WATERMARK
+#define FRAME_HIGH_WATERMARK     (2 * (FRAME_LOW_WATERMARK))
+#endif
+#define FRAME_CLEANER_PERIOD_US  (100000)   //100ms
+#define FRAME_CLEANER_BATCH      (4)        // Max # of evictions started per run
+
 /* Frame table entry structure */
 typedef struct {
     int fte_status;
@@ -41,6 +68,13 @@ typedef struct {
     bool fte_locked;
     bool fte_noswap;
     bool fte_referenced;
+    bool fte_dirty;         // content differs from the copy in fte_swap_slot
+    int fte_swap_slot;      // swap slot still holding a copy of this frame or -1
+    bool fte_shared;        // in the shared page cache, fte_as/fte_pid are unused
+    bool fte_cow;           // copy on write between cloned address spaces, fte_as/fte_pid are unused
+    bool fte_cached;        // in the file page cache, fte_as/fte_pid are unused
+    int fte_refcount;       // # of address spaces mapping a shared or copy on write frame
+    frame_mapping_t *fte_mappings;  // who maps a copy on write frame
 } frame_entry_t;
 
 
@@ -48,6 +82,25 @@ static frame_entry_t *_frametable;
 static int _first_free;                     // Index of the first free/untyped frame
 static bool _frame_initialised;
 static size_t _frametable_reserved;           // # of frames the _frametable consumes
+static size_t _nfree;                         // # of frames on the free list
+static seL4_Word _zero_frame;                 // read only, shared by all untouched anonymous pages
+static size_t _ncow;                          // # of copy on write frames
+
+static SLAB_CACHE(_frame_mapping_slab, frame_mapping_t);
+
+static void _frame_cow_forget(int id);
+
+/* Page cleaner state and statistics */
+static bool _cleaner_running;
+static bool _cleaner_ticking;                 // the next tick is registered
+static size_t _cleaner_inflight;              // # of evictions waiting on swap_out
+static size_t _low_watermark  = FRAME_LOW_WATERMARK;
+static size_t _high_watermark = FRAME_HIGH_WATERMARK;
+static uint32_t _alloc_hits;                  // frame_alloc found a free frame
+static uint32_t _alloc_misses;                // frame_alloc had to swap out first
+static uint32_t _cleaned;                     // frames freed by the cleaner
+
+static void _frame_cleaner_run(void);
 
 /*
  * This function allocate a frame cap and then map it to the indicated KVADDR
@@ -114,13 +167,47 @@ frame_init(void){
         _frametable[i].fte_locked        = false;
         _frametable[i].fte_noswap        = true;
         _frametable[i].fte_referenced    = true;
+        _frametable[i].fte_dirty         = true;
+        _frametable[i].fte_swap_slot     = -1;
+        _frametable[i].fte_shared        = false;
+        _frametable[i].fte_cow           = false;
+        _frametable[i].fte_cached        = false;
+        _frametable[i].fte_refcount      = 0;
+        _frametable[i].fte_mappings      = NULL;
     }
 
     /* Mark the number of frames occupied by the _frametable */
     _frametable_reserved = i;
 
+    /* The frame right after it is the zero frame, it is never freed */
+    _zero_frame = (seL4_Word)ID_TO_KVADDR(i);
+    int err = _map_to_sel4(seL4_CapInitThreadPD, _zero_frame,
+                           &_frametable[i].fte_paddr, &_frametable[i].fte_cap);
+    if (err) {
+        return err;
+    }
+    bzero((void*)_zero_frame, PAGE_SIZE);
+    _frametable[i].fte_status        = FRAME_STATUS_ALLOCATED;
+    _frametable[i].fte_kvaddr        = _zero_frame;
+    _frametable[i].fte_vaddr         = 0;
+    _frametable[i].fte_as            = NULL;
+    _frametable[i].fte_pid           = PROC_NULL;
+    _frametable[i].fte_next_free     = FRAME_INVALID;
+    _frametable[i].fte_locked        = false;
+    _frametable[i].fte_noswap        = true;
+    _frametable[i].fte_referenced    = true;
+    _frametable[i].fte_dirty         = false;  // so it is always mapped read only
+    _frametable[i].fte_swap_slot     = -1;
+    _frametable[i].fte_shared        = false;
+    _frametable[i].fte_cow           = false;
+    _frametable[i].fte_cached        = false;
+    _frametable[i].fte_refcount      = 0;
+    _frametable[i].fte_mappings      = NULL;
+    i++;
+
     /* The ith frame is the first free frame */
     _first_free = i;
+    _nfree = NFRAMES - i;
 
     /* Initialise the remaining frames */
     for (; i<NFRAMES; i++) {
@@ -159,6 +246,22 @@ _rand_swap_victim(){
 
 int victim = 0;
 
+/* Is a process page of this frame being paged in? swap_out leaves it be */
+static bool
+_frame_page_is_busy(int id) {
+    frame_entry_t *fte = &_frametable[id];
+    if (fte->fte_cow) {
+        for (frame_mapping_t *m = fte->fte_mappings; m != NULL; m = m->next) {
+            if (sos_page_is_busy(m->as, m->vpage)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    return !fte->fte_shared && !fte->fte_cached && fte->fte_as != NULL &&
+           sos_page_is_busy(fte->fte_as, fte->fte_vaddr);
+}
+
 /*
  * This function assumes that all frames are currently allocated
  */
@@ -169,14 +272,30 @@ _second_chance_swap_victim(){
     while(!found && cnt < 3*NFRAMES){
     //while(!found){
         cnt++;
-        if(_frametable[victim].fte_noswap || _frametable[victim].fte_locked){
+        if(_frametable[victim].fte_noswap || _frametable[victim].fte_locked ||
+                _frame_page_is_busy(victim)){
             victim++;
             victim = victim % NFRAMES;
         } else if(_frametable[victim].fte_referenced){
             addrspace_t* as = _frametable[victim].fte_as;
-    dprintf(3, "assssssssssssssssssss2 as->as_pd_regs = %p\n", as->as_pd_regs);
             seL4_Word vaddr = _frametable[victim].fte_vaddr;
-            int err = sos_page_unmap(as, vaddr);
+            int err;
+            if (_frametable[victim].fte_shared) {
+                err = shared_page_unmap_all(ID_TO_KVADDR(victim));
+            } else if (_frametable[victim].fte_cow) {
+                /* Every page mapping it has to fault for it to be referenced again */
+                err = 0;
+                for (frame_mapping_t *m = _frametable[victim].fte_mappings; m != NULL; m = m->next) {
+                    if (sos_page_unmap(m->as, m->vpage)) {
+                        err = EFAULT;
+                    }
+                }
+            } else if (_frametable[victim].fte_cached) {
+                /* Only the page cache uses it, nothing maps it */
+                err = 0;
+            } else {
+                err = sos_page_unmap(as, vaddr);
+            }
             if (err) {
                 dprintf(3, "second_chance_swap failed to unmap page\n");
             }
@@ -212,8 +331,28 @@ typedef struct {
    bool noswap;
 } frame_alloc_cont_t;
 
+static SLAB_CACHE(_frame_alloc_slab, frame_alloc_cont_t);
+
 static void _frame_alloc_end(void* token, int err);
 
+/*
+ * Evict the victim frame. Shared and cached frames are always clean and can be
+ * dropped right away, the others go through swap_out on behalf of *pid*
+ */
+static void
+_frame_evict(seL4_Word kvaddr, pid_t pid, swap_out_cb_t callback, void *token) {
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (_frametable[id].fte_shared) {
+        callback(token, shared_page_evict(kvaddr));
+        return;
+    }
+    if (_frametable[id].fte_cached) {
+        callback(token, page_cache_evict(kvaddr));
+        return;
+    }
+    swap_out(kvaddr, pid, callback, token);
+}
+
 int
 frame_alloc(seL4_Word vaddr, addrspace_t* as, pid_t pid, bool noswap,
                 frame_alloc_cb_t callback, void* token){
@@ -228,7 +367,7 @@ frame_alloc(seL4_Word vaddr, addrspace_t* as, pid_t pid, bool noswap,
         return EINVAL;
     }
 
-    frame_alloc_cont_t *cont = malloc(sizeof(frame_alloc_cont_t));
+    frame_alloc_cont_t *cont = slab_alloc(&_frame_alloc_slab);
     if(cont == NULL){
         return ENOMEM;
     }
@@ -242,19 +381,21 @@ frame_alloc(seL4_Word vaddr, addrspace_t* as, pid_t pid, bool noswap,
     /* If we do not have enough memory, start swapping frames out */
     if(_first_free == FRAME_INVALID) {
         dprintf(3, "frame alloc no memory\n");
+        _alloc_misses++;
         //seL4_Word kvaddr = _rand_swap_victim();
         seL4_Word kvaddr = _second_chance_swap_victim();
         // the frame returned is not locked
         if (kvaddr == 0) {
-            free(cont);
+            slab_free(&_frame_alloc_slab, cont);
             return ENOMEM;
         }
 
-        swap_out(kvaddr, _frame_alloc_end, (void*)cont);
+        _frame_evict(kvaddr, proc_get_id(), _frame_alloc_end, (void*)cont);
         return 0;
     }
 
     /* Else we have free frames to allocate */
+    _alloc_hits++;
     _frame_alloc_end((void*)cont, 0);
     return 0;
 }
@@ -266,7 +407,7 @@ _frame_alloc_end(void* token, int err){
     frame_alloc_cont_t* cont = (frame_alloc_cont_t*)token;
     if(err){
         cont->callback(cont->token, 0);
-        free(cont);
+        slab_free(&_frame_alloc_slab, cont);
         return;
     }
 
@@ -275,7 +416,7 @@ _frame_alloc_end(void* token, int err){
         // This should not happen though because of swapping
         dprintf(3, "warning: _frame_alloc_end: failed in getting a free frame\n");
         cont->callback(cont->token, 0);
-        free(cont);
+        slab_free(&_frame_alloc_slab, cont);
         return;
     }
 
@@ -292,7 +433,7 @@ _frame_alloc_end(void* token, int err){
                            &_frametable[ind].fte_paddr, &_frametable[ind].fte_cap);
         if (err) {
             cont->callback(cont->token, 0);
-            free(cont);
+            slab_free(&_frame_alloc_slab, cont);
             return;
         }
     }
@@ -304,6 +445,13 @@ _frame_alloc_end(void* token, int err){
     _frametable[ind].fte_noswap     = cont->noswap;
     _frametable[ind].fte_referenced = true;
     _frametable[ind].fte_locked     = false;
+    _frametable[ind].fte_dirty      = true;
+    _frametable[ind].fte_swap_slot  = -1;
+    _frametable[ind].fte_shared     = false;
+    _frametable[ind].fte_cow        = false;
+    _frametable[ind].fte_cached     = false;
+    _frametable[ind].fte_refcount   = 0;
+    _frametable[ind].fte_mappings   = NULL;
 
     /* Zero fill memory */
     bzero((void *)(kvaddr), (size_t)PAGE_SIZE);
@@ -312,9 +460,13 @@ _frame_alloc_end(void* token, int err){
 
     /* Update free frame list */
     _first_free = _frametable[ind].fte_next_free;
+    _nfree--;
 
     cont->callback(cont->token, kvaddr);
-    free(cont);
+    slab_free(&_frame_alloc_slab, cont);
+
+    /* Don't wait for the next tick if we just went under the low watermark */
+    _frame_cleaner_run();
 }
 
 int frame_free(seL4_Word kvaddr){
@@ -336,6 +488,11 @@ int frame_free(seL4_Word kvaddr){
         return EINVAL;
     }
 
+    if (kvaddr == _zero_frame) {
+        dprintf(3, "frame_free: the zero frame is never freed\n");
+        return EINVAL;
+    }
+
     //frame to be freed should not be locked
     if(_frametable[id].fte_locked) {
         dprintf(3, "frame_free err3\n");
@@ -343,6 +500,12 @@ int frame_free(seL4_Word kvaddr){
         return EFAULT;
     }
 
+    if (_frametable[id].fte_cow) {
+        _frame_cow_forget(id);
+        _frametable[id].fte_cow = false;
+        _ncow--;
+    }
+
 
     /* Optimization: we only actually untype the memory sometimes
      * Other times, we only reset the status of the frame to FREE */
@@ -371,12 +534,19 @@ int frame_free(seL4_Word kvaddr){
         ut_free(paddr, seL4_PageBits);
     }
 
+    /* The copy in the swap file is of no use anymore */
+    if (_frametable[id].fte_swap_slot >= 0) {
+        swap_free_slot(_frametable[id].fte_swap_slot);
+        _frametable[id].fte_swap_slot = -1;
+    }
+
     /* Clear other fields */
     _frametable[id].fte_locked = false;
 
     /* Update free frame list */
     _frametable[id].fte_next_free = _first_free;
     _first_free = id;
+    _nfree++;
 
     return 0;
 }
@@ -498,6 +668,10 @@ seL4_Word frame_get_vaddr(seL4_Word kvaddr){
     return _frametable[id].fte_vaddr;
 }
 
+seL4_Word frame_zero_kvaddr(void){
+    return _zero_frame;
+}
+
 int frame_set_referenced(seL4_Word kvaddr){
     int id = (int)KVADDR_TO_ID(kvaddr);
     if (id < _frametable_reserved || id >= NFRAMES) {
@@ -508,6 +682,16 @@ int frame_set_referenced(seL4_Word kvaddr){
     return 0;
 }
 
+int frame_set_unreferenced(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return EINVAL;
+    }
+
+    _frametable[id].fte_referenced = false;
+    return 0;
+}
+
 bool is_frame_referenced(seL4_Word kvaddr){
     int id = (int)KVADDR_TO_ID(kvaddr);
     if (id < _frametable_reserved || id >= NFRAMES) {
@@ -516,3 +700,394 @@ bool is_frame_referenced(seL4_Word kvaddr){
 
     return _frametable[id].fte_referenced;
 }
+
+int frame_set_dirty(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return EINVAL;
+    }
+
+    _frametable[id].fte_dirty = true;
+    return 0;
+}
+
+int frame_set_clean(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return EINVAL;
+    }
+
+    _frametable[id].fte_dirty = false;
+    return 0;
+}
+
+bool frame_is_dirty(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return true;
+    }
+
+    return _frametable[id].fte_dirty;
+}
+
+int frame_set_swap_slot(seL4_Word kvaddr, int slot){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return EINVAL;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED) {
+        return EINVAL;
+    }
+
+    _frametable[id].fte_swap_slot = slot;
+    return 0;
+}
+
+int frame_set_shared(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return EINVAL;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED) {
+        return EINVAL;
+    }
+
+    /* Nobody owns it alone anymore, it is reclaimed through the page cache */
+    _frametable[id].fte_shared   = true;
+    _frametable[id].fte_noswap   = false;
+    _frametable[id].fte_as       = NULL;
+    _frametable[id].fte_pid      = PROC_NULL;
+    _frametable[id].fte_vaddr    = 0;
+    _frametable[id].fte_refcount = 0;
+    return 0;
+}
+
+bool frame_is_shared(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return false;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED) {
+        return false;
+    }
+
+    return _frametable[id].fte_shared;
+}
+
+int frame_set_cached(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return EINVAL;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED ||
+            _frametable[id].fte_shared || _frametable[id].fte_cow) {
+        return EINVAL;
+    }
+
+    /* It's a copy of the file, eviction just drops it */
+    _frametable[id].fte_cached   = true;
+    _frametable[id].fte_noswap   = false;
+    _frametable[id].fte_dirty    = false;
+    _frametable[id].fte_as       = NULL;
+    _frametable[id].fte_pid      = PROC_NULL;
+    _frametable[id].fte_vaddr    = 0;
+    return 0;
+}
+
+bool frame_is_cached(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return false;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED) {
+        return false;
+    }
+
+    return _frametable[id].fte_cached;
+}
+
+/* Record a page mapping the copy on write frame *id* */
+static int
+_frame_cow_add(int id, addrspace_t *as, seL4_Word vaddr, pid_t pid) {
+    frame_mapping_t *m = slab_alloc(&_frame_mapping_slab);
+    if (m == NULL) {
+        return ENOMEM;
+    }
+    m->pid   = pid;
+    m->as    = as;
+    m->vpage = PAGE_ALIGN(vaddr);
+    m->next  = _frametable[id].fte_mappings;
+    _frametable[id].fte_mappings = m;
+    _frametable[id].fte_refcount++;
+    return 0;
+}
+
+static void
+_frame_cow_forget(int id) {
+    frame_mapping_t *m = _frametable[id].fte_mappings;
+    while (m != NULL) {
+        frame_mapping_t *next = m->next;
+        slab_free(&_frame_mapping_slab, m);
+        m = next;
+    }
+    _frametable[id].fte_mappings = NULL;
+    _frametable[id].fte_refcount = 0;
+}
+
+int frame_set_cow(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return EINVAL;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED || _frametable[id].fte_shared) {
+        return EINVAL;
+    }
+    if (_frametable[id].fte_cow) {
+        return 0;
+    }
+
+    /* The owner keeps its mapping, it's the first one */
+    _frametable[id].fte_refcount = 0;
+    int err = _frame_cow_add(id, _frametable[id].fte_as, _frametable[id].fte_vaddr,
+                             _frametable[id].fte_pid);
+    if (err) {
+        return err;
+    }
+    _ncow++;
+    _frametable[id].fte_cow      = true;
+    _frametable[id].fte_as       = NULL;
+    _frametable[id].fte_pid      = PROC_NULL;
+    _frametable[id].fte_vaddr    = 0;
+    return 0;
+}
+
+int frame_cow_map(seL4_Word kvaddr, addrspace_t *as, seL4_Word vaddr, pid_t pid){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return EINVAL;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED || !_frametable[id].fte_cow) {
+        return EINVAL;
+    }
+
+    return _frame_cow_add(id, as, vaddr, pid);
+}
+
+int frame_cow_unmap(seL4_Word kvaddr, addrspace_t *as, seL4_Word vaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return -1;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED || !_frametable[id].fte_cow) {
+        return -1;
+    }
+
+    seL4_Word vpage = PAGE_ALIGN(vaddr);
+    frame_mapping_t **mp = &_frametable[id].fte_mappings;
+    while (*mp != NULL) {
+        frame_mapping_t *m = *mp;
+        if (m->as == as && m->vpage == vpage) {
+            *mp = m->next;
+            slab_free(&_frame_mapping_slab, m);
+            assert(_frametable[id].fte_refcount > 0);
+            _frametable[id].fte_refcount--;
+            break;
+        }
+        mp = &m->next;
+    }
+    return _frametable[id].fte_refcount;
+}
+
+frame_mapping_t *frame_cow_mappings(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return NULL;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED || !_frametable[id].fte_cow) {
+        return NULL;
+    }
+
+    return _frametable[id].fte_mappings;
+}
+
+int frame_clear_cow(seL4_Word kvaddr, addrspace_t *as, seL4_Word vaddr, pid_t pid){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return EINVAL;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED || !_frametable[id].fte_cow) {
+        return EINVAL;
+    }
+
+    _ncow--;
+    _frame_cow_forget(id);
+    _frametable[id].fte_cow      = false;
+    _frametable[id].fte_as       = as;
+    _frametable[id].fte_pid      = pid;
+    _frametable[id].fte_vaddr    = vaddr;
+    return 0;
+}
+
+bool frame_is_cow(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return false;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED) {
+        return false;
+    }
+
+    return _frametable[id].fte_cow;
+}
+
+int frame_get_refcount(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return -1;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED) {
+        return -1;
+    }
+
+    return _frametable[id].fte_refcount;
+}
+
+int frame_inc_refcount(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return -1;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED) {
+        return -1;
+    }
+
+    return ++_frametable[id].fte_refcount;
+}
+
+int frame_dec_refcount(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return -1;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED) {
+        return -1;
+    }
+
+    assert(_frametable[id].fte_refcount > 0);
+    return --_frametable[id].fte_refcount;
+}
+
+int frame_get_swap_slot(seL4_Word kvaddr){
+    int id = (int)KVADDR_TO_ID(kvaddr);
+    if (id < _frametable_reserved || id >= NFRAMES) {
+        return -1;
+    }
+    if(_frametable[id].fte_status != FRAME_STATUS_ALLOCATED) {
+        return -1;
+    }
+
+    return _frametable[id].fte_swap_slot;
+}
+
+/***********************************************************************
+ * Background page cleaner
+ ***********************************************************************/
+
+static void
+_frame_cleaner_swap_out_cb(void *token, int err) {
+    (void)token;
+    assert(_cleaner_inflight > 0);
+    _cleaner_inflight--;
+    if (err) {
+        dprintf(3, "frame cleaner: swap out failed, err = %d\n", err);
+        return;
+    }
+    _cleaned++;
+}
+
+/*
+ * Start evicting clock victims if we are under the low watermark. The
+ * evictions are only started here, the frames are put back on the free list
+ * by swap_out when they complete.
+ */
+static void _frame_cleaner_arm(void);
+
+static void
+_frame_cleaner_run(void) {
+    if (!_cleaner_running) {
+        return;
+    }
+    /* The last tick couldn't be registered, try again now */
+    if (!_cleaner_ticking) {
+        _frame_cleaner_arm();
+    }
+    if (_nfree >= _low_watermark) {
+        return;
+    }
+
+    for (int i = 0; i < FRAME_CLEANER_BATCH; i++) {
+        if (_nfree + _cleaner_inflight >= _high_watermark) {
+            break;
+        }
+        seL4_Word kvaddr = _second_chance_swap_victim();
+        if (kvaddr == 0) {
+            break;
+        }
+        dprintf(3, "frame cleaner: evicting kvaddr = 0x%08x\n", kvaddr);
+        _cleaner_inflight++;
+        _frame_evict(kvaddr, PROC_NULL, _frame_cleaner_swap_out_cb, NULL);
+    }
+}
+
+static void
+_frame_cleaner_tick(uint32_t id, void *data) {
+    (void)id;
+    (void)data;
+    _cleaner_ticking = false;
+    _frame_cleaner_run();
+}
+
+/*
+ * Register the next tick. If the timer can't take it, the cleaner only runs
+ * from frame_alloc until it can be registered again
+ */
+static void
+_frame_cleaner_arm(void) {
+    if (register_timer(FRAME_CLEANER_PERIOD_US, _frame_cleaner_tick, NULL) == 0) {
+        dprintf(0, "frame cleaner: failed to register timer\n");
+        return;
+    }
+    _cleaner_ticking = true;
+}
+
+void
+frame_cleaner_start(void) {
+    if (_cleaner_running) {
+        return;
+    }
+    _cleaner_running = true;
+    _frame_cleaner_arm();
+}
+
+int
+frame_set_watermarks(size_t low, size_t high) {
+    if (low > high || high > NFRAMES - _frametable_reserved) {
+        return EINVAL;
+    }
+    _low_watermark  = low;
+    _high_watermark = high;
+    return 0;
+}
+
+void
+frame_get_stats(frame_stats_t *stats) {
+    assert(stats != NULL);
+    stats->nfree          = _nfree;
+    stats->low_watermark  = _low_watermark;
+    stats->high_watermark = _high_watermark;
+    stats->alloc_hits     = _alloc_hits;
+    stats->alloc_misses   = _alloc_misses;
+    stats->cleaned        = _cleaned;
+    stats->inflight       = _cleaner_inflight;
+    stats->ncow           = _ncow;
+}
@@ -0,0 +1,146 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <sel4/sel4.h>
+
+#include "tool/utility.h"
+#include "tool/slab.h"
+#include "vm/vm.h"
+#include "vm/addrspace.h"
+#include "vm/iobuf.h"
+#include "proc/proc.h"
+
+#define verbose 0
+#include <sys/debug.h>
+
+/***********************************************************************
+ * I/O Buffer Create
+ **********************************************************************/
+
+typedef struct {
+    pid_t pid;
+    int page;               // the page being mapped
+    iobuf_create_cb_t callback;
+    void *token;
+} iobuf_create_cont_t;
+
+static SLAB_CACHE(_iobuf_create_slab, iobuf_create_cont_t);
+
+static void _iobuf_create_map(void *token, int err);
+
+int
+iobuf_create(pid_t pid, iobuf_create_cb_t callback, void *token) {
+    dprintf(3, "iobuf_create pid = %d\n", pid);
+    if (IOBUF_PAGES <= 0) {
+        return ENOSYS;
+    }
+
+    process_t *proc = proc_getproc(pid);
+    if (proc == NULL || proc->as == NULL) {
+        return EINVAL;
+    }
+    if (proc->io_buffer[IOBUF_PAGES - 1] != 0) {
+        /* All there already */
+        callback(token, 0);
+        return 0;
+    }
+
+    /* A clone has the region but not the pages */
+    if (region_probe(proc->as, PROCESS_IO_BUFFER) == NULL) {
+        int err = as_define_region(proc->as, PROCESS_IO_BUFFER, IOBUF_SIZE, seL4_AllRights);
+        if (err) {
+            return err;
+        }
+    }
+
+    iobuf_create_cont_t *cont = slab_alloc(&_iobuf_create_slab);
+    if (cont == NULL) {
+        return ENOMEM;
+    }
+    cont->pid      = pid;
+    cont->page     = 0;
+    cont->callback = callback;
+    cont->token    = token;
+
+    _iobuf_create_map((void*)cont, 0);
+    return 0;
+}
+
+static void
+_iobuf_create_map(void *token, int err) {
+    iobuf_create_cont_t *cont = (iobuf_create_cont_t*)token;
+    assert(cont != NULL);
+
+    process_t *proc = proc_getproc(cont->pid);
+    if (!err && proc == NULL) {
+        err = EFAULT;
+    }
+
+    for (; !err && cont->page < IOBUF_PAGES; cont->page++) {
+        seL4_Word vpage = PROCESS_IO_BUFFER + cont->page * PAGE_SIZE;
+        if (proc->io_buffer[cont->page] != 0) {
+            continue;
+        }
+        if (sos_page_is_inuse(proc->as, vpage)) {
+            /* Just mapped by us, the frame is not swappable */
+            err = sos_get_kvaddr(proc->as, vpage, &proc->io_buffer[cont->page]);
+            continue;
+        }
+
+        /* Comes back here to pick it up */
+        err = sos_page_map(cont->pid, proc->as, vpage, seL4_AllRights,
+                           _iobuf_create_map, (void*)cont, true);
+        if (!err) {
+            inc_proc_size_proc(proc);
+            return;
+        }
+    }
+
+    dprintf(3, "iobuf_create end, err = %d\n", err);
+    cont->callback(cont->token, err);
+    slab_free(&_iobuf_create_slab, cont);
+}
+
+/***********************************************************************
+ * I/O Buffer Access
+ **********************************************************************/
+
+bool
+iobuf_contains(process_t *proc, seL4_Word vaddr, size_t nbyte) {
+    if (proc == NULL || IOBUF_PAGES <= 0 || proc->io_buffer[IOBUF_PAGES - 1] == 0) {
+        return false;
+    }
+    return vaddr >= PROCESS_IO_BUFFER &&
+           vaddr - PROCESS_IO_BUFFER <= IOBUF_SIZE &&
+           nbyte <= IOBUF_SIZE - (vaddr - PROCESS_IO_BUFFER);
+}
+
+seL4_Word
+iobuf_kvaddr(process_t *proc, seL4_Word vaddr) {
+    assert(iobuf_contains(proc, vaddr, 0));
+    seL4_Word offset = vaddr - PROCESS_IO_BUFFER;
+    return proc->io_buffer[offset / PAGE_SIZE] + PAGE_OFFSET(offset);
+}
+
+void
+iobuf_copyin(process_t *proc, seL4_Word kbuf, seL4_Word vaddr, size_t nbyte) {
+    while (nbyte > 0) {
+        size_t cpy_sz = MIN(PAGE_SIZE - PAGE_OFFSET(vaddr), nbyte);
+        memcpy((void*)kbuf, (void*)iobuf_kvaddr(proc, vaddr), cpy_sz);
+        kbuf  += cpy_sz;
+        vaddr += cpy_sz;
+        nbyte -= cpy_sz;
+    }
+}
+
+void
+iobuf_copyout(process_t *proc, seL4_Word vaddr, seL4_Word kbuf, size_t nbyte) {
+    while (nbyte > 0) {
+        size_t cpy_sz = MIN(PAGE_SIZE - PAGE_OFFSET(vaddr), nbyte);
+        memcpy((void*)iobuf_kvaddr(proc, vaddr), (void*)kbuf, cpy_sz);
+        kbuf  += cpy_sz;
+        vaddr += cpy_sz;
+        nbyte -= cpy_sz;
+    }
+}
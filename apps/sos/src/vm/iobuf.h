@@ -0,0 +1,58 @@
+#ifndef _LIBOS_IOBUF_H_
+#define _LIBOS_IOBUF_H_
+
+#include <sel4/sel4.h>
+#include <autoconf.h>
+
+#include "vm/vmem_layout.h"
+#include "proc/proc.h"
+
+/*
+ * I/O buffer shared between sos and a process. It sits at PROCESS_IO_BUFFER
+ * in the process and its frames are never swapped out, so sos keeps their
+ * kernel addresses and reads and writes go in and out of it without looking
+ * anything up. Processes ask for it with the io buffer syscall, read and
+ * write then only pass offsets into it.
+ */
+
+#ifndef CONFIG_SOS_IO_BUFFER_PAGES
+#define CONFIG_SOS_IO_BUFFER_PAGES 2
+#endif
+
+#if CONFIG_SOS_IO_BUFFER_PAGES > PROCESS_IO_BUFFER_PAGES
+#define IOBUF_PAGES     PROCESS_IO_BUFFER_PAGES
+#else
+#define IOBUF_PAGES     CONFIG_SOS_IO_BUFFER_PAGES
+#endif
+
+#define IOBUF_SIZE      (IOBUF_PAGES * PAGE_SIZE)
+
+typedef void (*iobuf_create_cb_t)(void *token, int err);
+
+/*
+ * Give the process PID its I/O buffer, does nothing if it has one already
+ * This is an asynchronous function and will return by calling the call back
+ * function
+ * Returns 0 if succesfully register callback
+ */
+int iobuf_create(pid_t pid, iobuf_create_cb_t callback, void *token);
+
+/*
+ * Check if [vaddr, vaddr + nbyte) is inside the I/O buffer of PROC
+ */
+bool iobuf_contains(process_t *proc, seL4_Word vaddr, size_t nbyte);
+
+/*
+ * Get the sos address of VADDR in the I/O buffer of PROC. The bytes from
+ * there up to the end of the page are contiguous in sos too
+ */
+seL4_Word iobuf_kvaddr(process_t *proc, seL4_Word vaddr);
+
+/*
+ * Copy between sos and the I/O buffer of PROC, the range must be inside it
+ * (see iobuf_contains). These don't fault anything in and are synchronous
+ */
+void iobuf_copyin(process_t *proc, seL4_Word kbuf, seL4_Word vaddr, size_t nbyte);
+void iobuf_copyout(process_t *proc, seL4_Word vaddr, seL4_Word kbuf, size_t nbyte);
+
+#endif /* _LIBOS_IOBUF_H_ */
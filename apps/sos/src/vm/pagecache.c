@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <sel4/sel4.h>
+#include <nfs/nfs.h>
+
+#include "tool/utility.h"
+#include "vm/vm.h"
+#include "vm/pagecache.h"
+#include "proc/proc.h"
+
+#define verbose 0
+#include <sys/debug.h>
+
+#define PAGE_CACHE_BUCKETS      (256)
+
+/* A read waiting for the page to be read in */
+typedef struct page_cache_req page_cache_req_t;
+struct page_cache_req {
+    page_cache_read_cb_t callback;
+    void *token;
+    page_cache_req_t *next;
+};
+
+typedef struct cached_page cached_page_t;
+struct cached_page {
+    fhandle_t fh;
+    seL4_Word offset;           // page aligned offset in the file
+    size_t len;                 // # of bytes of the page that are in the file
+
+    seL4_Word kvaddr;           // 0 while the page is being read in
+    seL4_Word loading_kvaddr;   // the frame being read into
+    int pins;                   // # of callbacks using the page, its frame is locked meanwhile
+    bool stale;                 // invalidated while it was being read or used
+    page_cache_req_t *waiters;  // reads waiting for it to be read in
+
+    cached_page_t *next;        // hash chain by file handle and offset
+    cached_page_t *kv_next;     // hash chain by frame, only once it's read in
+};
+
+static cached_page_t *_buckets[PAGE_CACHE_BUCKETS];
+static cached_page_t *_kv_buckets[PAGE_CACHE_BUCKETS];
+static cached_page_t *_serving;     // the page given to the running read callback
+
+/***********************************************************************
+ * Cache lookup helpers
+ ***********************************************************************/
+
+static uint32_t
+_hash(const fhandle_t *fh, seL4_Word offset) {
+    /* Over the file handle, then mix in the page number */
+    seL4_Word page = offset >> 12;
+    uint32_t h = fnv1a(FNV1A_INIT, fh->data, sizeof(fh->data));
+    h = fnv1a(h, &page, sizeof(page));
+    return h % PAGE_CACHE_BUCKETS;
+}
+
+static uint32_t
+_kv_hash(seL4_Word kvaddr) {
+    return (kvaddr >> 12) % PAGE_CACHE_BUCKETS;
+}
+
+static cached_page_t*
+_lookup(const fhandle_t *fh, seL4_Word offset) {
+    cached_page_t *page = _buckets[_hash(fh, offset)];
+    for (; page != NULL; page = page->next) {
+        if (page->offset == offset &&
+                memcmp(page->fh.data, fh->data, sizeof(fh->data)) == 0) {
+            return page;
+        }
+    }
+    return NULL;
+}
+
+static cached_page_t*
+_lookup_kvaddr(seL4_Word kvaddr) {
+    kvaddr = PAGE_ALIGN(kvaddr);
+    cached_page_t *page = _kv_buckets[_kv_hash(kvaddr)];
+    for (; page != NULL; page = page->kv_next) {
+        if (page->kvaddr == kvaddr) {
+            return page;
+        }
+    }
+    return NULL;
+}
+
+/* Take the page out of the cache, new reads of it start from scratch */
+static void
+_remove(cached_page_t *page) {
+    cached_page_t **pp = &_buckets[_hash(&page->fh, page->offset)];
+    for (; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == page) {
+            *pp = page->next;
+            break;
+        }
+    }
+    if (page->kvaddr == 0) {
+        return;
+    }
+    pp = &_kv_buckets[_kv_hash(page->kvaddr)];
+    for (; *pp != NULL; pp = &(*pp)->kv_next) {
+        if (*pp == page) {
+            *pp = page->kv_next;
+            break;
+        }
+    }
+}
+
+/* Free a page that is out of the cache and that no one uses anymore */
+static void
+_destroy(cached_page_t *page) {
+    assert(page->pins == 0 && page->waiters == NULL);
+    seL4_Word kvaddr = page->kvaddr ? page->kvaddr : page->loading_kvaddr;
+    if (kvaddr) {
+        frame_free(kvaddr);
+    }
+    free(page);
+}
+
+/* Drop a pin, the last one unlocks the frame */
+static void
+_unpin(cached_page_t *page) {
+    if (--page->pins == 0) {
+        frame_unlock_frame(page->kvaddr);
+        if (page->stale) {
+            _destroy(page);
+        }
+    }
+}
+
+/*
+ * Hand the page to a reader. The frame stays locked while the callback runs,
+ * so that it can't be evicted under it
+ */
+static void
+_serve(cached_page_t *page, int err, page_cache_read_cb_t callback, void *token) {
+    if (err) {
+        callback(token, err, 0, 0);
+        return;
+    }
+
+    if (page->pins++ == 0) {
+        frame_lock_frame(page->kvaddr);
+    }
+    frame_set_referenced(page->kvaddr);
+    cached_page_t *prev = _serving;
+    _serving = page;
+    callback(token, 0, page->kvaddr, page->len);
+    _serving = prev;
+    _unpin(page);
+}
+
+/***********************************************************************
+ * Reading pages in
+ ***********************************************************************/
+
+static void _page_cache_load_2_frame(void *token, seL4_Word kvaddr);
+static void _page_cache_load_3_read(void *token, int err);
+static void _page_cache_load_end(cached_page_t *page, int err);
+
+/* Create the page and start reading it, REQ (may be NULL) waits for it */
+static int
+_page_cache_load(const fhandle_t *fh, size_t file_size, seL4_Word offset,
+                 page_cache_req_t *req) {
+    cached_page_t *page = malloc(sizeof(cached_page_t));
+    if (page == NULL) {
+        return ENOMEM;
+    }
+    memcpy(page->fh.data, fh->data, sizeof(fh->data));
+    page->offset         = offset;
+    page->len            = (offset < file_size) ? MIN(PAGE_SIZE, file_size - offset) : 0;
+    page->kvaddr         = 0;
+    page->loading_kvaddr = 0;
+    page->pins           = 0;
+    page->stale          = false;
+    page->waiters        = req;
+    page->kv_next        = NULL;
+
+    uint32_t bucket = _hash(&page->fh, offset);
+    page->next = _buckets[bucket];
+    _buckets[bucket] = page;
+
+    /* Noswap until the data is in */
+    int err = frame_alloc(0, NULL, PROC_NULL, true, _page_cache_load_2_frame, (void*)page);
+    if (err) {
+        _remove(page);
+        free(page);
+        return err;
+    }
+    return 0;
+}
+
+static void
+_page_cache_load_2_frame(void *token, seL4_Word kvaddr) {
+    dprintf(3, "_page_cache_load_2_frame\n");
+    cached_page_t *page = (cached_page_t*)token;
+
+    if (kvaddr == 0) {
+        _page_cache_load_end(page, ENOMEM);
+        return;
+    }
+    page->loading_kvaddr = kvaddr;
+
+    int err = sos_page_read_file(&page->fh, page->offset, 0, page->len, kvaddr,
+                                 _page_cache_load_3_read, (void*)page);
+    if (err) {
+        _page_cache_load_end(page, err);
+        return;
+    }
+}
+
+static void
+_page_cache_load_3_read(void *token, int err) {
+    _page_cache_load_end((cached_page_t*)token, err);
+}
+
+static void
+_page_cache_load_end(cached_page_t *page, int err) {
+    dprintf(3, "_page_cache_load_end, offset = %u, err = %d\n", page->offset, err);
+
+    if (err) {
+        if (!page->stale) {
+            _remove(page);
+        }
+        page->stale = true;
+    } else {
+        page->kvaddr = page->loading_kvaddr;
+        page->loading_kvaddr = 0;
+        if (!page->stale) {
+            uint32_t bucket = _kv_hash(page->kvaddr);
+            page->kv_next = _kv_buckets[bucket];
+            _kv_buckets[bucket] = page;
+        }
+    }
+
+    /* Now serve everyone who asked for it, stale pages are served too as
+     * they asked before the page was invalidated. Our pin keeps the page
+     * until they all had it */
+    if (err) {
+        page->pins++;
+    } else if (page->pins++ == 0) {
+        frame_lock_frame(page->kvaddr);
+    }
+    while (page->waiters != NULL) {
+        page_cache_req_t *req = page->waiters;
+        page->waiters = req->next;
+        _serve(page, err, req->callback, req->token);
+        free(req);
+    }
+
+    if (err) {
+        page->pins--;
+        _destroy(page);
+        return;
+    }
+    /* The frame was noswap while being read and served, from now on the
+     * page replacement may take it back, once no reader holds it */
+    if (!page->stale) {
+        frame_set_cached(page->kvaddr);
+    }
+    _unpin(page);
+}
+
+/***********************************************************************
+ * page_cache_read, page_cache_readahead & holding pages
+ ***********************************************************************/
+
+int
+page_cache_read(const fhandle_t *fh, size_t file_size, seL4_Word offset,
+                page_cache_read_cb_t callback, void *token) {
+    dprintf(3, "page_cache_read, offset = %u\n", offset);
+    if (fh == NULL || PAGE_OFFSET(offset) != 0) {
+        return EINVAL;
+    }
+
+    cached_page_t *page = _lookup(fh, offset);
+    if (page != NULL && page->kvaddr != 0) {
+        _serve(page, 0, callback, token);
+        return 0;
+    }
+
+    page_cache_req_t *req = malloc(sizeof(page_cache_req_t));
+    if (req == NULL) {
+        return ENOMEM;
+    }
+    req->callback = callback;
+    req->token    = token;
+    req->next     = NULL;
+
+    if (page != NULL) {
+        /* Someone else is reading it in, wait for them */
+        req->next = page->waiters;
+        page->waiters = req;
+        return 0;
+    }
+
+    int err = _page_cache_load(fh, file_size, offset, req);
+    if (err) {
+        free(req);
+        return err;
+    }
+    return 0;
+}
+
+void
+page_cache_readahead(const fhandle_t *fh, size_t file_size, seL4_Word offset,
+                     int npages) {
+    if (fh == NULL || PAGE_OFFSET(offset) != 0) {
+        return;
+    }
+
+    for (int i = 0; i < npages && offset < file_size; i++, offset += PAGE_SIZE) {
+        if (_lookup(fh, offset) != NULL) {
+            continue;
+        }
+        /* Don't push anything out for data that may not be needed */
+        if (!frame_has_free() || _page_cache_load(fh, file_size, offset, NULL)) {
+            return;
+        }
+    }
+}
+
+void*
+page_cache_hold(void) {
+    cached_page_t *page = _serving;
+    if (page != NULL) {
+        page->pins++;
+    }
+    return page;
+}
+
+void
+page_cache_release(void *handle) {
+    cached_page_t *page = (cached_page_t*)handle;
+    assert(page != NULL && page->pins > 0);
+    _unpin(page);
+}
+
+/***********************************************************************
+ * Invalidation and eviction
+ ***********************************************************************/
+
+static void
+_invalidate(cached_page_t *page) {
+    _remove(page);
+    page->stale = true;
+    /* In use or being read in, the last one using it frees it */
+    if (page->pins == 0 && page->kvaddr != 0) {
+        _destroy(page);
+    }
+}
+
+void
+page_cache_invalidate(const fhandle_t *fh, seL4_Word offset, size_t len) {
+    if (fh == NULL || len == 0) {
+        return;
+    }
+    seL4_Word first = PAGE_ALIGN(offset);
+    seL4_Word last  = PAGE_ALIGN(offset + len - 1);
+
+    if ((last - first) / PAGE_SIZE < PAGE_CACHE_BUCKETS) {
+        for (seL4_Word off = first; off <= last; off += PAGE_SIZE) {
+            cached_page_t *page = _lookup(fh, off);
+            if (page != NULL) {
+                _invalidate(page);
+            }
+        }
+        return;
+    }
+
+    /* A big range, going through the whole cache is cheaper */
+    for (int i = 0; i < PAGE_CACHE_BUCKETS; i++) {
+        cached_page_t *page = _buckets[i];
+        while (page != NULL) {
+            cached_page_t *next = page->next;
+            if (page->offset >= first && page->offset <= last &&
+                    memcmp(page->fh.data, fh->data, sizeof(fh->data)) == 0) {
+                _invalidate(page);
+            }
+            page = next;
+        }
+    }
+}
+
+int
+page_cache_evict(seL4_Word kvaddr) {
+    dprintf(3, "page_cache_evict, kvaddr = 0x%08x\n", kvaddr);
+    cached_page_t *page = _lookup_kvaddr(kvaddr);
+    if (page == NULL) {
+        return EINVAL;
+    }
+    /* The frame is locked while it's in use, the page replacement skips it */
+    assert(page->pins == 0);
+
+    _remove(page);
+    _destroy(page);
+    return 0;
+}
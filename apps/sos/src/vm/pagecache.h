@@ -0,0 +1,60 @@
+#ifndef _LIBOS_PAGECACHE_H_
+#define _LIBOS_PAGECACHE_H_
+
+#include <sel4/sel4.h>
+#include <nfs/nfs.h>
+
+/*
+ * Page cache for file data read through the vnode interface. Pages are keyed
+ * by the file handle and their offset in the file, so they outlive the vnode
+ * and a file that is opened again is still in memory. The frames come from
+ * the frame table and are reclaimed by the page replacement like any other
+ * frame, see page_cache_evict.
+ */
+
+/*
+ * Callback for page_cache_read. *len* bytes of the page at *kvaddr* are in the
+ * file. The page can only be used until the callback returns
+ */
+typedef void (*page_cache_read_cb_t)(void *token, int err, seL4_Word kvaddr, size_t len);
+
+/*
+ * Get the page at OFFSET (page aligned) of the file FH, FILE_SIZE bytes long,
+ * reading it from the file if it's not in the cache
+ * This is an asynchronous function and will return by calling the call back
+ * function
+ * Returns 0 if succesfully register callback
+ */
+int page_cache_read(const fhandle_t *fh, size_t file_size, seL4_Word offset,
+                    page_cache_read_cb_t callback, void *token);
+
+/*
+ * Start reading up to NPAGES pages of FH from OFFSET (page aligned) into the
+ * cache, without waiting for them. Only free frames are used for that
+ */
+void page_cache_readahead(const fhandle_t *fh, size_t file_size, seL4_Word offset,
+                          int npages);
+
+/*
+ * Keep the page given to the running page_cache_read callback after the
+ * callback returns, e.g. to copy out of it asynchronously. Its frame stays
+ * locked until page_cache_release. Returns a handle for page_cache_release,
+ * NULL if not called from a callback
+ */
+void* page_cache_hold(void);
+void page_cache_release(void *handle);
+
+/*
+ * Drop the cached pages of FH covering [OFFSET, OFFSET + LEN), they are out
+ * of date
+ */
+void page_cache_invalidate(const fhandle_t *fh, seL4_Word offset, size_t len);
+
+/*
+ * Drop the cached frame KVADDR and free it, used by the page replacement.
+ * Cached pages are never dirty so there is nothing to write back
+ * Returns 0 if successful
+ */
+int page_cache_evict(seL4_Word kvaddr);
+
+#endif /* _LIBOS_PAGECACHE_H_ */
@@ -10,11 +10,15 @@
 #include "vm/swap.h"
 #include "vm/addrspace.h"
 #include "vm/mapping.h"
+#include "vm/sharedpage.h"
 #include "tool/utility.h"
+#include "tool/slab.h"
 
 #define verbose 0
 #include <sys/debug.h>
 
+extern bool starting_first_process;
+
 #define STATUS_USED     0
 #define STATUS_FREE     1
 
@@ -33,18 +37,37 @@ typedef struct {
     seL4_Word vpage;
     uint32_t permissions;
     bool noswap;
+    bool tables_only;   // only make sure the shadow pagetables exist
+    seL4_Word pt_regs;  // the new 2nd level pagetable for regs
 } sos_page_map_cont_t;
 
+static SLAB_CACHE(_page_map_slab, sos_page_map_cont_t);
+
 static void _sos_page_map_2_alloc_cap_pt(void* token, seL4_Word kvaddr);
 static void _sos_page_map_3(void* token, seL4_Word kvaddr);
 static void _sos_page_map_4_alloc_frame(void* token);
 static void _sos_page_map_5(void* token, seL4_Word kvaddr);
 static int _map_sel4_page(addrspace_t *as, seL4_CPtr frame_cap, seL4_Word vpage,
           seL4_CapRights rights, seL4_ARM_VMAttributes attr);
+static int _sos_page_map(pid_t pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
+                         sos_page_map_cb_t callback, void* token, bool noswap,
+                         bool tables_only);
 
 int
 sos_page_map(pid_t pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
              sos_page_map_cb_t callback, void* token, bool noswap) {
+    return _sos_page_map(pid, as, vaddr, permissions, callback, token, noswap, false);
+}
+
+int
+sos_page_prepare(addrspace_t *as, seL4_Word vaddr, sos_page_map_cb_t callback, void *token) {
+    return _sos_page_map(PROC_NULL, as, vaddr, 0, callback, token, true, true);
+}
+
+static int
+_sos_page_map(pid_t pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
+              sos_page_map_cb_t callback, void* token, bool noswap,
+              bool tables_only) {
     dprintf(3, "sos_page_map\n");
     if (as == NULL) {
         return EINVAL;
@@ -58,7 +81,7 @@ sos_page_map(pid_t pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
 
     seL4_Word vpage = PAGE_ALIGN(vaddr);
 
-    sos_page_map_cont_t* cont = malloc(sizeof(sos_page_map_cont_t));
+    sos_page_map_cont_t* cont = slab_alloc(&_page_map_slab);
     if(cont == NULL){
         dprintf(3, "sos_page_map err nomem\n");
         return ENOMEM;
@@ -70,6 +93,8 @@ sos_page_map(pid_t pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
     cont->callback = callback;
     cont->token = token;
     cont->noswap = noswap;
+    cont->tables_only = tables_only;
+    cont->pt_regs = 0;
 
     int x, err;
 
@@ -83,7 +108,7 @@ sos_page_map(pid_t pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
         /* Allocate memory for the 2nd level pagetable for regs */
         err = frame_alloc(0, NULL, PROC_NULL, true, _sos_page_map_2_alloc_cap_pt, (void*)cont);
         if (err) {
-            free(cont);
+            slab_free(&_page_map_slab, cont);
             return EFAULT;
         }
         return 0;
@@ -101,20 +126,20 @@ _sos_page_map_2_alloc_cap_pt(void* token, seL4_Word kvaddr){
     if (kvaddr == 0) {
         dprintf(3, "warning: _sos_page_map_2_alloc_cap_pt not enough memory for lvl2 pagetable\n");
         cont->callback(cont->token, ENOMEM);
-        free(cont);
+        slab_free(&_page_map_slab, cont);
         return;
     }
 
-    seL4_Word vpage = PAGE_ALIGN(cont->vpage);
-    int x = PT_L1_INDEX(vpage);
-    cont->as->as_pd_regs[x] = (pagetable_t)kvaddr;
+    /* Only installed together with the one for caps, until then others
+     * mapping in the same range must not see half a pagetable */
+    cont->pt_regs = kvaddr;
 
     /* Allocate memory for the 2nd level pagetable for caps */
     int err = frame_alloc(0, NULL, PROC_NULL, true, _sos_page_map_3, token);
     if (err) {
         frame_free(kvaddr);
         cont->callback(cont->token, EFAULT);
-        free(cont);
+        slab_free(&_page_map_slab, cont);
         return;
     }
 }
@@ -127,13 +152,20 @@ _sos_page_map_3(void* token, seL4_Word kvaddr){
     int x = PT_L1_INDEX(cont->vpage);
     if (kvaddr == 0) {
         dprintf(3, "warning: _sos_page_map_3 not enough memory for lvl2 pagetable\n");
-        frame_free((seL4_Word)(cont->as->as_pd_regs[x]));
+        frame_free(cont->pt_regs);
         cont->callback(cont->token, ENOMEM);
-        free(cont);
+        slab_free(&_page_map_slab, cont);
         return;
     }
 
-    cont->as->as_pd_caps[x] = (pagetable_t)kvaddr;
+    if (cont->as->as_pd_regs[x] != NULL) {
+        /* Someone else mapping in this range got there first */
+        frame_free(cont->pt_regs);
+        frame_free(kvaddr);
+    } else {
+        cont->as->as_pd_regs[x] = (pagetable_t)cont->pt_regs;
+        cont->as->as_pd_caps[x] = (pagetable_t)kvaddr;
+    }
 
      _sos_page_map_4_alloc_frame(token);
 }
@@ -146,11 +178,17 @@ _sos_page_map_4_alloc_frame(void* token){
     int x = PT_L1_INDEX(cont->vpage);
     int y = PT_L2_INDEX(cont->vpage);
 
+    if (cont->tables_only) {
+        cont->callback(cont->token, 0);
+        slab_free(&_page_map_slab, cont);
+        return;
+    }
+
     if ((cont->as->as_pd_regs[x][y] & PTE_IN_USE_BIT) &&
             !(cont->as->as_pd_regs[x][y] & PTE_SWAPPED)) {
         /* page already mapped */
         cont->callback(cont->token, EINVAL);
-        free(cont);
+        slab_free(&_page_map_slab, cont);
         return;
     }
 
@@ -159,7 +197,7 @@ _sos_page_map_4_alloc_frame(void* token){
     if (err) {
         dprintf(3, "_sos_page_map_4_alloc_frame: failed to allocate frame\n");
         cont->callback(cont->token, EINVAL);
-        free(cont);
+        slab_free(&_page_map_slab, cont);
         return;
     }
 }
@@ -170,52 +208,66 @@ _sos_page_map_5(void* token, seL4_Word kvaddr){
 
     sos_page_map_cont_t* cont = (sos_page_map_cont_t*)token;
 
-    seL4_CPtr kframe_cap, frame_cap;
-
     if (!kvaddr) {
         dprintf(3, "_sos_page_map_5 failed to allocate memory for frame\n");
         cont->callback((void*)(cont->token), ENOMEM);
-        free(cont);
+        slab_free(&_page_map_slab, cont);
+        return;
+    }
+
+    int err = sos_page_map_frame(cont->as, cont->vpage, cont->permissions, kvaddr);
+    if (err) {
+        frame_free(kvaddr);
+        cont->callback((void*)(cont->token), err);
+        slab_free(&_page_map_slab, cont);
         return;
     }
 
+    dprintf(3, "_sos_page_map_5 called back up\n");
+    /* Calling back up */
+    cont->callback((void*)(cont->token), 0);
+    slab_free(&_page_map_slab, cont);
+    return;
+}
+
+int
+sos_page_map_frame(addrspace_t *as, seL4_Word vaddr, uint32_t permissions, seL4_Word kvaddr) {
+    seL4_CPtr kframe_cap, frame_cap;
+    seL4_Word vpage = PAGE_ALIGN(vaddr);
+    int x = PT_L1_INDEX(vpage);
+    int y = PT_L2_INDEX(vpage);
+
+    if (as == NULL || as->as_pd_regs == NULL || as->as_pd_regs[x] == NULL) {
+        /* sos_page_prepare hasn't been called for this page */
+        return EINVAL;
+    }
+
     int err = frame_get_cap(kvaddr, &kframe_cap);
-    assert(!err); // There should be no error
+    if (err) {
+        return err;
+    }
 
     /* Copy the frame cap as we need to map it into 2 address spaces */
-    frame_cap = cspace_copy_cap(cur_cspace, cur_cspace, kframe_cap, cont->permissions);
+    frame_cap = cspace_copy_cap(cur_cspace, cur_cspace, kframe_cap, permissions);
     if (frame_cap == CSPACE_NULL) {
-        frame_free(kvaddr);
-        cont->callback((void*)(cont->token), EFAULT);
-        free(cont);
-        return;
+        return EFAULT;
     }
 
     /* Map the frame into application's address space */
-    err = _map_sel4_page(cont->as, frame_cap, cont->vpage, cont->permissions,
+    err = _map_sel4_page(as, frame_cap, vpage, permissions,
                          seL4_ARM_Default_VMAttributes);
     if (err) {
-        frame_free(kvaddr);
         cspace_delete_cap(cur_cspace, frame_cap);
-        cont->callback((void*)(cont->token), err);
-        free(cont);
-        return;
+        return err;
     }
 
     //set frame referenced
     frame_set_referenced(kvaddr);
 
     /* Insert PTE into application's pagetable */
-    int x = PT_L1_INDEX(cont->vpage);
-    int y = PT_L2_INDEX(cont->vpage);
-    cont->as->as_pd_regs[x][y] = (kvaddr | PTE_IN_USE_BIT) & (~PTE_SWAPPED);
-    cont->as->as_pd_caps[x][y] = frame_cap;
-
-    dprintf(3, "_sos_page_map_5 called back up\n");
-    /* Calling back up */
-    cont->callback((void*)(cont->token), 0);
-    free(cont);
-    return;
+    as->as_pd_regs[x][y] = (kvaddr | PTE_IN_USE_BIT) & (~PTE_SWAPPED);
+    as->as_pd_caps[x][y] = frame_cap;
+    return 0;
 }
 
 static void
@@ -283,6 +335,184 @@ _map_sel4_page(addrspace_t *as, seL4_CPtr frame_cap, seL4_Word vpage,
     return err ? EFAULT : 0;
 }
 
+/***********************************************************************
+ * sos_page_map_zero & sos_page_unzero
+ ***********************************************************************/
+
+typedef struct {
+    sos_page_map_cb_t callback;
+    void *token;
+    pid_t pid;
+    addrspace_t *as;
+    seL4_Word vpage;
+    uint32_t permissions;
+} zero_map_cont_t;
+
+static SLAB_CACHE(_zero_map_slab, zero_map_cont_t);
+
+static void
+_sos_page_map_zero_2(void *token, int err) {
+    zero_map_cont_t *cont = (zero_map_cont_t*)token;
+
+    if (!err && !starting_first_process && !is_proc_alive(cont->pid)) {
+        err = EFAULT;
+    }
+    if (!err) {
+        set_cur_proc(cont->pid);
+        /* Never writable, the first write faults and gets its own frame */
+        uint32_t permissions = cont->permissions & ~seL4_CanWrite;
+        err = sos_page_map_frame(cont->as, cont->vpage, permissions, frame_zero_kvaddr());
+    }
+    cont->callback(cont->token, err);
+    slab_free(&_zero_map_slab, cont);
+}
+
+int
+sos_page_map_zero(pid_t pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
+                  sos_page_map_cb_t callback, void *token) {
+    zero_map_cont_t *cont = slab_alloc(&_zero_map_slab);
+    if (cont == NULL) {
+        return ENOMEM;
+    }
+    cont->callback    = callback;
+    cont->token       = token;
+    cont->pid         = pid;
+    cont->as          = as;
+    cont->vpage       = PAGE_ALIGN(vaddr);
+    cont->permissions = permissions;
+
+    int err = sos_page_prepare(as, cont->vpage, _sos_page_map_zero_2, (void*)cont);
+    if (err) {
+        slab_free(&_zero_map_slab, cont);
+        return err;
+    }
+    return 0;
+}
+
+int
+sos_page_unzero(pid_t pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
+                sos_page_map_cb_t callback, void *token) {
+    seL4_Word vpage = PAGE_ALIGN(vaddr);
+    int x = PT_L1_INDEX(vpage);
+    int y = PT_L2_INDEX(vpage);
+
+    if (!sos_page_is_zero(as, vpage)) {
+        return EINVAL;
+    }
+    int err = sos_page_unmap(as, vpage);
+    if (err) {
+        return err;
+    }
+
+    /* frame_alloc zero fills, there is nothing to copy */
+    as->as_pd_regs[x][y] = 0;
+    err = sos_page_map(pid, as, vpage, permissions, callback, token, false);
+    if (err) {
+        /* Back to the zero frame, it'll be mapped again on the next fault */
+        as->as_pd_regs[x][y] = frame_zero_kvaddr() | PTE_IN_USE_BIT;
+    }
+    return err;
+}
+
+/***********************************************************************
+ * sos_page_uncow
+ ***********************************************************************/
+
+typedef struct {
+    sos_page_map_cb_t callback;
+    void *token;
+    pid_t pid;
+    addrspace_t *as;
+    seL4_Word vpage;
+    uint32_t permissions;
+} uncow_cont_t;
+
+static SLAB_CACHE(_uncow_slab, uncow_cont_t);
+
+static void
+_sos_page_uncow_2(void *token, seL4_Word kvaddr) {
+    uncow_cont_t *cont = (uncow_cont_t*)token;
+    int x = PT_L1_INDEX(cont->vpage);
+    int y = PT_L2_INDEX(cont->vpage);
+    int err = 0;
+
+    if (kvaddr == 0) {
+        err = ENOMEM;
+    } else if (!starting_first_process && !is_proc_alive(cont->pid)) {
+        /* Its reference went away with its address space */
+        frame_free(kvaddr);
+        err = EFAULT;
+    }
+    if (err) {
+        cont->callback(cont->token, err);
+        slab_free(&_uncow_slab, cont);
+        return;
+    }
+    set_cur_proc(cont->pid);
+
+    /* The process is blocked, the page still maps the shared frame */
+    seL4_Word old_kvaddr = cont->as->as_pd_regs[x][y] & PTE_KVADDR_MASK;
+    memcpy((void*)kvaddr, (void*)old_kvaddr, PAGE_SIZE);
+
+    err = sos_page_map_frame(cont->as, cont->vpage, cont->permissions, kvaddr);
+    if (err) {
+        frame_free(kvaddr);
+    } else if (frame_cow_unmap(old_kvaddr, cont->as, cont->vpage) == 0) {
+        /* Everyone else let go of it while we were waiting for memory */
+        frame_free(old_kvaddr);
+    }
+    cont->callback(cont->token, err);
+    slab_free(&_uncow_slab, cont);
+}
+
+int
+sos_page_uncow(pid_t pid, addrspace_t *as, seL4_Word vaddr, uint32_t permissions,
+               sos_page_map_cb_t callback, void *token) {
+    seL4_Word vpage = PAGE_ALIGN(vaddr);
+
+    if (!sos_page_is_cow(as, vpage)) {
+        return EINVAL;
+    }
+    int err = sos_page_unmap(as, vpage);
+    if (err) {
+        return err;
+    }
+
+    int x = PT_L1_INDEX(vpage);
+    int y = PT_L2_INDEX(vpage);
+    seL4_Word kvaddr = as->as_pd_regs[x][y] & PTE_KVADDR_MASK;
+    if (frame_get_refcount(kvaddr) == 1) {
+        /* Nobody else maps it anymore, no need to copy */
+        frame_clear_cow(kvaddr, as, vpage, pid);
+        frame_set_dirty(kvaddr);
+        err = sos_page_map_frame(as, vpage, permissions, kvaddr);
+        if (err) {
+            return err;
+        }
+        callback(token, 0);
+        return 0;
+    }
+
+    uncow_cont_t *cont = slab_alloc(&_uncow_slab);
+    if (cont == NULL) {
+        return ENOMEM;
+    }
+    cont->callback    = callback;
+    cont->token       = token;
+    cont->pid         = pid;
+    cont->as          = as;
+    cont->vpage       = vpage;
+    cont->permissions = permissions;
+
+    /* The page is busy, eviction leaves the shared frame alone meanwhile */
+    err = frame_alloc(vpage, as, pid, false, _sos_page_uncow_2, (void*)cont);
+    if (err) {
+        slab_free(&_uncow_slab, cont);
+        return err;
+    }
+    return 0;
+}
+
 /***********************************************************************
  * sos_page_unmap
  ***********************************************************************/
@@ -300,7 +530,11 @@ sos_page_unmap(addrspace_t *as, seL4_Word vaddr){
         return EINVAL;
     }
 
-    assert(as->as_pd_caps[x][y] != 0);
+    /* Not mapped into sel4 at the moment, nothing to do */
+    if (as->as_pd_caps[x][y] == 0) {
+        return 0;
+    }
+
     int err;
     err = seL4_ARM_Page_Unmap(as->as_pd_caps[x][y]);
     if (err) {
@@ -308,6 +542,7 @@ sos_page_unmap(addrspace_t *as, seL4_Word vaddr){
         return EFAULT;
     }
     cspace_delete_cap(cur_cspace, as->as_pd_caps[x][y]);
+    as->as_pd_caps[x][y] = 0;
 
     return 0;
 }
@@ -335,13 +570,36 @@ sos_page_free(addrspace_t *as, seL4_Word vaddr) {
     } else {
         int err;
         seL4_Word kvaddr = as->as_pd_regs[x][y] & PTE_KVADDR_MASK;
-        //check if page to be destroy is second map paged out
-        if(is_frame_referenced(kvaddr)){
-            err = sos_page_unmap(as, vpage);
-            if (err) {
-                return;
+        //unmap it unless it's been unmapped by second chance
+        err = sos_page_unmap(as, vpage);
+        if (err) {
+            return;
+        }
+
+        if (kvaddr == frame_zero_kvaddr()) {
+            as->as_pd_regs[x][y] = 0;
+            return;
+        }
+
+        if (frame_is_shared(kvaddr)) {
+            /* Other processes may still be using it */
+            shared_page_unmap(kvaddr, as, vpage);
+            as->as_pd_regs[x][y] = 0;
+            return;
+        }
+
+        if (frame_is_cow(kvaddr)) {
+            /* Only the last address space mapping it frees it, unless it's
+             * being swapped, swap_out frees it then */
+            bool is_locked;
+            frame_is_locked(kvaddr, &is_locked);
+            if (frame_cow_unmap(kvaddr, as, vpage) == 0 && !is_locked) {
+                frame_free(kvaddr);
             }
+            as->as_pd_regs[x][y] = 0;
+            return;
         }
+
         bool is_locked;
         frame_is_locked(kvaddr, &is_locked);
         if (is_locked) {
@@ -354,15 +612,133 @@ sos_page_free(addrspace_t *as, seL4_Word vaddr) {
 }
 
 
+/***********************************************************************
+ * Busy pages
+ ***********************************************************************/
+
+typedef struct page_waiter {
+    sos_page_map_cb_t callback;
+    void *token;
+    struct page_waiter *next;
+} page_waiter_t;
+
+struct page_busy {
+    addrspace_t *as;            // NULL once the address space is destroyed
+    seL4_Word vpage;
+    page_waiter_t *waiters;
+    page_busy_t *next;
+};
+
+static SLAB_CACHE(_page_busy_slab, page_busy_t);
+static SLAB_CACHE(_page_waiter_slab, page_waiter_t);
+
+static page_busy_t *
+_page_busy_find(addrspace_t *as, seL4_Word vpage) {
+    for (page_busy_t *busy = as->as_busy; busy != NULL; busy = busy->next) {
+        if (busy->vpage == vpage) {
+            return busy;
+        }
+    }
+    return NULL;
+}
+
+page_busy_t *
+sos_page_busy(addrspace_t *as, seL4_Word vaddr) {
+    seL4_Word vpage = PAGE_ALIGN(vaddr);
+    assert(_page_busy_find(as, vpage) == NULL);
+
+    page_busy_t *busy = slab_alloc(&_page_busy_slab);
+    if (busy == NULL) {
+        return NULL;
+    }
+    busy->as      = as;
+    busy->vpage   = vpage;
+    busy->waiters = NULL;
+    busy->next    = as->as_busy;
+    as->as_busy   = busy;
+    return busy;
+}
+
+int
+sos_page_unbusy(page_busy_t *busy) {
+    if (busy == NULL) {
+        return 0;
+    }
+
+    int err = 0;
+    if (busy->as != NULL) {
+        page_busy_t **prev = &busy->as->as_busy;
+        while (*prev != busy) {
+            prev = &(*prev)->next;
+        }
+        *prev = busy->next;
+    } else {
+        err = EFAULT;
+    }
+
+    /* Off the list first, a waiter may start paging the page in again */
+    page_waiter_t *waiter = busy->waiters;
+    slab_free(&_page_busy_slab, busy);
+    while (waiter != NULL) {
+        page_waiter_t *next = waiter->next;
+        sos_page_map_cb_t callback = waiter->callback;
+        void *token = waiter->token;
+        slab_free(&_page_waiter_slab, waiter);
+        callback(token, err);
+        waiter = next;
+    }
+    return err;
+}
+
+int
+sos_page_wait(addrspace_t *as, seL4_Word vaddr, sos_page_map_cb_t callback, void *token) {
+    page_busy_t *busy = _page_busy_find(as, PAGE_ALIGN(vaddr));
+    if (busy == NULL) {
+        return EINVAL;
+    }
+
+    page_waiter_t *waiter = slab_alloc(&_page_waiter_slab);
+    if (waiter == NULL) {
+        return ENOMEM;
+    }
+    waiter->callback = callback;
+    waiter->token    = token;
+    waiter->next     = NULL;
+
+    /* First come first served */
+    page_waiter_t **last = &busy->waiters;
+    while (*last != NULL) {
+        last = &(*last)->next;
+    }
+    *last = waiter;
+    return 0;
+}
+
+void
+sos_page_busy_orphan(addrspace_t *as) {
+    for (page_busy_t *busy = as->as_busy; busy != NULL; busy = busy->next) {
+        busy->as = NULL;
+    }
+    as->as_busy = NULL;
+}
+
 /***********************************************************************
  * Simple setter and getter functions
+ * - sos_page_is_busy
  * - sos_page_is_swapped
  * - sos_page_is_inuse
  * - sos_page_is_locked
+ * - sos_page_is_zero
+ * - sos_page_is_cow
  * - sos_get_kvaddr
  * - sos_get_kframe_cap
  ***********************************************************************/
 
+bool
+sos_page_is_busy(addrspace_t *as, seL4_Word vaddr) {
+    return as != NULL && _page_busy_find(as, PAGE_ALIGN(vaddr)) != NULL;
+}
+
 bool
 sos_page_is_inuse(addrspace_t *as, seL4_Word vaddr) {
     dprintf(3, "sos_page_is_inuse, vaddr = 0x%08x\n", vaddr);
@@ -412,6 +788,38 @@ sos_page_is_locked(addrspace_t *as, seL4_Word vaddr) {
     return false;
 }
 
+bool
+sos_page_is_zero(addrspace_t *as, seL4_Word vaddr) {
+    if (as == NULL || as->as_pd_caps == NULL || as->as_pd_regs == NULL) {
+        return false;
+    }
+    seL4_Word vpage = PAGE_ALIGN(vaddr);
+    int x = PT_L1_INDEX(vpage);
+    int y = PT_L2_INDEX(vpage);
+    if (as->as_pd_regs[x] == NULL) {
+        return false;
+    }
+    seL4_Word pte = as->as_pd_regs[x][y];
+    return (pte & PTE_IN_USE_BIT) && !(pte & PTE_SWAPPED) &&
+           (pte & PTE_KVADDR_MASK) == frame_zero_kvaddr();
+}
+
+bool
+sos_page_is_cow(addrspace_t *as, seL4_Word vaddr) {
+    if (as == NULL || as->as_pd_caps == NULL || as->as_pd_regs == NULL) {
+        return false;
+    }
+    seL4_Word vpage = PAGE_ALIGN(vaddr);
+    int x = PT_L1_INDEX(vpage);
+    int y = PT_L2_INDEX(vpage);
+    if (as->as_pd_regs[x] == NULL) {
+        return false;
+    }
+    seL4_Word pte = as->as_pd_regs[x][y];
+    return (pte & PTE_IN_USE_BIT) && !(pte & PTE_SWAPPED) &&
+           frame_is_cow(pte & PTE_KVADDR_MASK);
+}
+
 int sos_get_kvaddr(addrspace_t *as, seL4_Word vaddr, seL4_Word *kvaddr) {
     if (as == NULL) {
         return EINVAL;
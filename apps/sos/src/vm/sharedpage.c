@@ -0,0 +1,472 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <sel4/sel4.h>
+#include <nfs/nfs.h>
+
+#include "tool/utility.h"
+#include "vm/vm.h"
+#include "vm/addrspace.h"
+#include "vm/sharedpage.h"
+#include "proc/proc.h"
+
+#define verbose 0
+#include <sys/debug.h>
+
+#define SHARED_PAGE_BUCKETS     (64)
+
+extern bool starting_first_process;
+
+/* An address space mapping a shared page */
+typedef struct shared_mapping shared_mapping_t;
+struct shared_mapping {
+    pid_t pid;
+    addrspace_t *as;
+    seL4_Word vpage;
+    shared_mapping_t *next;
+};
+
+/* A request to map a shared page, waiting for it to be read in */
+typedef struct shared_map_req shared_map_req_t;
+struct shared_map_req {
+    pid_t pid;
+    addrspace_t *as;
+    seL4_Word vpage;
+    uint32_t rights;
+    fhandle_t fh;
+    seL4_Word file_offset;
+    size_t page_offset;
+    size_t len;
+    sos_page_map_cb_t callback;
+    void *token;
+    shared_map_req_t *next;
+};
+
+typedef struct shared_page shared_page_t;
+struct shared_page {
+    /* Key: *len* bytes of *fh* at *file_offset*, placed at *page_offset* */
+    fhandle_t fh;
+    seL4_Word file_offset;
+    size_t page_offset;
+    size_t len;
+
+    seL4_Word kvaddr;               // 0 while the page is being read in
+    seL4_Word loading_kvaddr;       // the frame being read into
+    shared_mapping_t *mappings;
+    shared_map_req_t *waiters;      // requests waiting for the read to finish
+    bool stale;                     // out of the cache, the file changed
+    shared_page_t *next;            // hash chain
+    shared_page_t *kv_next;         // hash chain by frame, once it's read in
+};
+
+static shared_page_t *_buckets[SHARED_PAGE_BUCKETS];
+static shared_page_t *_kv_buckets[SHARED_PAGE_BUCKETS];
+
+/***********************************************************************
+ * Cache lookup helpers
+ ***********************************************************************/
+
+static uint32_t
+_hash(const fhandle_t *fh, seL4_Word file_offset) {
+    /* Over the file handle, then mix in the offset */
+    seL4_Word page = file_offset >> 12;
+    uint32_t h = fnv1a(FNV1A_INIT, fh->data, sizeof(fh->data));
+    h = fnv1a(h, &page, sizeof(page));
+    return h % SHARED_PAGE_BUCKETS;
+}
+
+static uint32_t
+_kv_hash(seL4_Word kvaddr) {
+    return (kvaddr >> 12) % SHARED_PAGE_BUCKETS;
+}
+
+static shared_page_t*
+_lookup(shared_map_req_t *req) {
+    shared_page_t *page = _buckets[_hash(&req->fh, req->file_offset)];
+    for (; page != NULL; page = page->next) {
+        if (page->file_offset == req->file_offset &&
+                page->page_offset == req->page_offset &&
+                page->len == req->len &&
+                memcmp(page->fh.data, req->fh.data, sizeof(req->fh.data)) == 0) {
+            return page;
+        }
+    }
+    return NULL;
+}
+
+static shared_page_t*
+_lookup_kvaddr(seL4_Word kvaddr) {
+    kvaddr = PAGE_ALIGN(kvaddr);
+    shared_page_t *page = _kv_buckets[_kv_hash(kvaddr)];
+    for (; page != NULL; page = page->kv_next) {
+        if (page->kvaddr == kvaddr) {
+            return page;
+        }
+    }
+    return NULL;
+}
+
+/* Take the page out of the cache, new mappings of it start from scratch */
+static void
+_remove(shared_page_t *page) {
+    shared_page_t **pp = &_buckets[_hash(&page->fh, page->file_offset)];
+    for (; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == page) {
+            *pp = page->next;
+            return;
+        }
+    }
+}
+
+/* Free a page that is out of the cache and that no one maps anymore */
+static void
+_destroy(shared_page_t *page) {
+    assert(page->mappings == NULL && page->waiters == NULL);
+    shared_page_t **pp = &_kv_buckets[_kv_hash(page->kvaddr)];
+    for (; *pp != NULL; pp = &(*pp)->kv_next) {
+        if (*pp == page) {
+            *pp = page->kv_next;
+            break;
+        }
+    }
+    frame_free(page->kvaddr);
+    free(page);
+}
+
+/* Map the page for REQ, the shadow pagetables are already there */
+static int
+_add_mapping(shared_page_t *page, shared_map_req_t *req) {
+    shared_mapping_t *m = malloc(sizeof(shared_mapping_t));
+    if (m == NULL) {
+        return ENOMEM;
+    }
+
+    int err = sos_page_map_frame(req->as, req->vpage, req->rights, page->kvaddr);
+    if (err) {
+        free(m);
+        return err;
+    }
+    frame_inc_refcount(page->kvaddr);
+
+    m->pid   = req->pid;
+    m->as    = req->as;
+    m->vpage = req->vpage;
+    m->next  = page->mappings;
+    page->mappings = m;
+    return 0;
+}
+
+/***********************************************************************
+ * shared_page_map
+ ***********************************************************************/
+
+static void _shared_page_map_2_prepared(void *token, int err);
+static void _shared_page_load_2_frame(void *token, seL4_Word kvaddr);
+static void _shared_page_load_3_read(void *token, int err);
+static void _shared_page_load_end(shared_page_t *page, int err);
+
+int
+shared_page_map(pid_t pid, addrspace_t *as, region_t *reg, seL4_Word vaddr,
+                sos_page_map_cb_t callback, void *token) {
+    dprintf(3, "shared_page_map, vaddr = 0x%08x\n", vaddr);
+    if (as == NULL || reg == NULL || reg->fh == NULL) {
+        return EINVAL;
+    }
+
+    shared_map_req_t *req = malloc(sizeof(shared_map_req_t));
+    if (req == NULL) {
+        return ENOMEM;
+    }
+    req->pid      = pid;
+    req->as       = as;
+    req->vpage    = PAGE_ALIGN(vaddr);
+    req->rights   = reg->rights;
+    req->callback = callback;
+    req->token    = token;
+    req->next     = NULL;
+    memcpy(req->fh.data, reg->fh->data, sizeof(reg->fh->data));
+    region_file_range(reg, req->vpage, &req->file_offset, &req->page_offset, &req->len);
+
+    /* Get the pagetables ready first so the frame can be mapped in one go */
+    int err = sos_page_prepare(as, req->vpage, _shared_page_map_2_prepared, (void*)req);
+    if (err) {
+        free(req);
+        return err;
+    }
+    return 0;
+}
+
+static void
+_shared_page_map_2_prepared(void *token, int err) {
+    dprintf(3, "_shared_page_map_2_prepared\n");
+    shared_map_req_t *req = (shared_map_req_t*)token;
+
+    if (!err && !starting_first_process && !is_proc_alive(req->pid)) {
+        err = EFAULT;
+    }
+    if (err) {
+        req->callback(req->token, err);
+        free(req);
+        return;
+    }
+    set_cur_proc(req->pid);
+
+    shared_page_t *page = _lookup(req);
+    if (page != NULL && page->kvaddr != 0) {
+        /* Someone else has it in memory already */
+        err = _add_mapping(page, req);
+        req->callback(req->token, err);
+        free(req);
+        return;
+    }
+
+    if (page != NULL) {
+        /* Someone else is reading it in, wait for them */
+        req->next = page->waiters;
+        page->waiters = req;
+        return;
+    }
+
+    /* We are the first one, read it in */
+    page = malloc(sizeof(shared_page_t));
+    if (page == NULL) {
+        req->callback(req->token, ENOMEM);
+        free(req);
+        return;
+    }
+    memcpy(page->fh.data, req->fh.data, sizeof(req->fh.data));
+    page->file_offset    = req->file_offset;
+    page->page_offset    = req->page_offset;
+    page->len            = req->len;
+    page->kvaddr         = 0;
+    page->loading_kvaddr = 0;
+    page->mappings       = NULL;
+    page->waiters        = req;
+    page->stale          = false;
+    page->kv_next        = NULL;
+
+    uint32_t bucket = _hash(&page->fh, page->file_offset);
+    page->next = _buckets[bucket];
+    _buckets[bucket] = page;
+
+    /* Noswap until the data is in */
+    err = frame_alloc(0, NULL, PROC_NULL, true, _shared_page_load_2_frame, (void*)page);
+    if (err) {
+        _shared_page_load_end(page, err);
+        return;
+    }
+}
+
+static void
+_shared_page_load_2_frame(void *token, seL4_Word kvaddr) {
+    dprintf(3, "_shared_page_load_2_frame\n");
+    shared_page_t *page = (shared_page_t*)token;
+
+    if (kvaddr == 0) {
+        _shared_page_load_end(page, ENOMEM);
+        return;
+    }
+    page->loading_kvaddr = kvaddr;
+
+    int err = sos_page_read_file(&page->fh, page->file_offset, page->page_offset,
+                                 page->len, kvaddr, _shared_page_load_3_read, (void*)page);
+    if (err) {
+        _shared_page_load_end(page, err);
+        return;
+    }
+}
+
+static void
+_shared_page_load_3_read(void *token, int err) {
+    dprintf(3, "_shared_page_load_3_read\n");
+    _shared_page_load_end((shared_page_t*)token, err);
+}
+
+static void
+_shared_page_load_end(shared_page_t *page, int err) {
+    dprintf(3, "_shared_page_load_end, err = %d\n", err);
+
+    if (err) {
+        _remove(page);
+        if (page->loading_kvaddr) {
+            frame_free(page->loading_kvaddr);
+        }
+    } else {
+        /* The page may hold code */
+        seL4_CPtr kframe_cap;
+        err = frame_get_cap(page->loading_kvaddr, &kframe_cap);
+        assert(!err);
+        seL4_ARM_Page_Unify_Instruction(kframe_cap, 0, PAGESIZE);
+
+        frame_set_shared(page->loading_kvaddr);
+        frame_set_clean(page->loading_kvaddr);
+        page->kvaddr = page->loading_kvaddr;
+
+        uint32_t bucket = _kv_hash(page->kvaddr);
+        page->kv_next = _kv_buckets[bucket];
+        _kv_buckets[bucket] = page;
+    }
+
+    /* Now serve everyone who asked for it, even if the file changed
+     * meanwhile as they asked before that */
+    shared_map_req_t *req = page->waiters;
+    page->waiters = NULL;
+    while (req != NULL) {
+        shared_map_req_t *next = req->next;
+        int req_err = err;
+        if (!req_err && !starting_first_process && !is_proc_alive(req->pid)) {
+            req_err = EFAULT;
+        }
+        if (!req_err) {
+            set_cur_proc(req->pid);
+            req_err = _add_mapping(page, req);
+        }
+        req->callback(req->token, req_err);
+        free(req);
+        req = next;
+    }
+
+    if (err) {
+        free(page);
+    } else if (page->stale && page->mappings == NULL) {
+        _destroy(page);
+    }
+}
+
+/***********************************************************************
+ * Unmapping and eviction
+ ***********************************************************************/
+
+void
+shared_page_unmap(seL4_Word kvaddr, addrspace_t *as, seL4_Word vaddr) {
+    shared_page_t *page = _lookup_kvaddr(kvaddr);
+    if (page == NULL) {
+        dprintf(3, "shared_page_unmap: 0x%08x is not a shared page\n", kvaddr);
+        return;
+    }
+
+    seL4_Word vpage = PAGE_ALIGN(vaddr);
+    shared_mapping_t **mp = &page->mappings;
+    for (; *mp != NULL; mp = &(*mp)->next) {
+        if ((*mp)->as == as && (*mp)->vpage == vpage) {
+            shared_mapping_t *m = *mp;
+            *mp = m->next;
+            free(m);
+            /* Keep the frame cached even if no one uses it for now, the
+             * next process running this file gets it for free */
+            frame_dec_refcount(page->kvaddr);
+            if (page->stale && page->mappings == NULL) {
+                _destroy(page);
+            }
+            return;
+        }
+    }
+}
+
+int
+shared_page_unmap_all(seL4_Word kvaddr) {
+    shared_page_t *page = _lookup_kvaddr(kvaddr);
+    if (page == NULL) {
+        return EINVAL;
+    }
+
+    int err = 0;
+    for (shared_mapping_t *m = page->mappings; m != NULL; m = m->next) {
+        if (sos_page_unmap(m->as, m->vpage)) {
+            err = EFAULT;
+        }
+    }
+    return err;
+}
+
+int
+shared_page_evict(seL4_Word kvaddr) {
+    dprintf(3, "shared_page_evict, kvaddr = 0x%08x\n", kvaddr);
+    shared_page_t *page = _lookup_kvaddr(kvaddr);
+    if (page == NULL) {
+        return EINVAL;
+    }
+
+    shared_mapping_t *m = page->mappings;
+    while (m != NULL) {
+        shared_mapping_t *next = m->next;
+        sos_page_unmap(m->as, m->vpage);
+
+        /* It'll be looked up in the cache/read from the file on the next fault */
+        int x = PT_L1_INDEX(m->vpage);
+        int y = PT_L2_INDEX(m->vpage);
+        m->as->as_pd_regs[x][y] = 0;
+        dec_proc_size(m->pid);
+
+        frame_dec_refcount(page->kvaddr);
+        free(m);
+        m = next;
+    }
+    page->mappings = NULL;
+
+    _remove(page);
+    _destroy(page);
+    return 0;
+}
+
+/* The file changed, no new mappings of PAGE. Those there are keep the old
+ * frame until they go away */
+static void
+_invalidate(shared_page_t *page) {
+    if (page->stale) {
+        return;
+    }
+    _remove(page);
+    page->stale = true;
+    if (page->kvaddr != 0 && page->mappings == NULL) {
+        _destroy(page);
+    }
+}
+
+static bool
+_overlaps(shared_page_t *page, const fhandle_t *fh, seL4_Word offset, size_t len) {
+    return page->file_offset < offset + len &&
+           page->file_offset + page->len > offset &&
+           memcmp(page->fh.data, fh->data, sizeof(fh->data)) == 0;
+}
+
+/* Invalidate the pages of FH overlapping [OFFSET, OFFSET + LEN) in BUCKET */
+static void
+_invalidate_bucket(int bucket, const fhandle_t *fh, seL4_Word offset, size_t len) {
+    shared_page_t *page = _buckets[bucket];
+    while (page != NULL) {
+        shared_page_t *next = page->next;
+        if (_overlaps(page, fh, offset, len)) {
+            _invalidate(page);
+        }
+        page = next;
+    }
+}
+
+void
+shared_page_invalidate(const fhandle_t *fh, seL4_Word offset, size_t len) {
+    if (fh == NULL || len == 0) {
+        return;
+    }
+    len = MIN(len, (size_t)(UINT_MAX - offset));
+
+    /* A page is hashed by where its data starts in the file, which can be
+     * up to a page before the range */
+    seL4_Word first = PAGE_ALIGN(offset);
+    first = (first >= PAGE_SIZE) ? first - PAGE_SIZE : 0;
+    seL4_Word last  = PAGE_ALIGN(offset + len - 1);
+
+    if ((last - first) / PAGE_SIZE < SHARED_PAGE_BUCKETS) {
+        for (seL4_Word n = 0; n <= (last - first) / PAGE_SIZE; n++) {
+            _invalidate_bucket(_hash(fh, first + n * PAGE_SIZE), fh, offset, len);
+        }
+        return;
+    }
+
+    /* A big range, going through the whole cache is cheaper */
+    for (int i = 0; i < SHARED_PAGE_BUCKETS; i++) {
+        _invalidate_bucket(i, fh, offset, len);
+    }
+}
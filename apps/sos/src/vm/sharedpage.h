@@ -0,0 +1,53 @@
+#ifndef _LIBOS_SHAREDPAGE_H_
+#define _LIBOS_SHAREDPAGE_H_
+
+#include <sel4/sel4.h>
+#include <nfs/nfs.h>
+
+#include "vm/addrspace.h"
+#include "proc/proc.h"
+
+/*
+ * Shared page cache for read only file backed regions (e.g. program text).
+ * Pages are keyed by the file handle and the part of the file they hold, so
+ * every process running the same executable maps the same frames.
+ */
+
+/*
+ * Map the page at VADDR of the read only file backed region REG, reading it
+ * from the file only if no one else has it in memory already
+ * This is an asynchronous function and will return by calling the call back
+ * function
+ * Returns 0 if succesfully register callback
+ */
+int shared_page_map(pid_t pid, addrspace_t *as, region_t *reg, seL4_Word vaddr,
+                    sos_page_map_cb_t callback, void *token);
+
+/*
+ * Forget the mapping of the shared frame KVADDR at VADDR in AS. The caller
+ * has already unmapped it from sel4. The frame stays in the cache
+ */
+void shared_page_unmap(seL4_Word kvaddr, addrspace_t *as, seL4_Word vaddr);
+
+/*
+ * Unmap the shared frame KVADDR from sel4 in every address space using it,
+ * used by the second chance page replacement
+ * Returns 0 if successful
+ */
+int shared_page_unmap_all(seL4_Word kvaddr);
+
+/*
+ * Drop the shared frame KVADDR from the cache and from every address space
+ * using it, then free the frame. The next access reads it from the file again
+ * Returns 0 if successful
+ */
+int shared_page_evict(seL4_Word kvaddr);
+
+/*
+ * The part [OFFSET, OFFSET + LEN) of the file FH changed. Its pages are
+ * dropped from the cache, the address spaces mapping them keep the old frame
+ * until they unmap it and new mappings read the file again
+ */
+void shared_page_invalidate(const fhandle_t *fh, seL4_Word offset, size_t len);
+
+#endif /* _LIBOS_SHAREDPAGE_H_ */
@@ -10,57 +10,270 @@
 #include <nfs/nfs.h>
 
 #include "tool/utility.h"
+#include "tool/slab.h"
 #include "vfs/vfs.h"
 #include "vm/swap.h"
 #include "dev/nfs_dev.h"
 #include "vm/addrspace.h"
 #include "vm/vm.h"
+#include "vm/zswap.h"
 #include "proc/proc.h"
 
 #define verbose 0
 #include <sys/debug.h>
 
 /*
- * Bitmap use to track free slots in our swap file
- * 1 is used
- * 0 is free
+ * A page is moved to/from the swap file in NFS_READ_SIZE/NFS_WRITE_SIZE
+ * pieces. All the pieces of a page are put on the wire at once and each one
+ * is tracked by its own swap_chunk_t, so a page costs one round trip instead
+ * of one per piece. The pieces are never smaller than NFS_SEND_SIZE, which
+ * bounds how many a page takes.
  */
-#define NUM_CHUNKS (1<<10)
-#define NUM_BITS (32)
+#define SWAP_CHUNKS_PER_PAGE  ((PAGE_SIZE + NFS_SEND_SIZE - 1) / NFS_SEND_SIZE)
+
+typedef struct {
+    void *cont;     /* the swap_in/swap_out continuation owning this chunk */
+    size_t offset;  /* offset of the remaining data from the start of the page */
+    size_t len;     /* bytes of this chunk that are not transferred yet */
+} swap_chunk_t;
+
+/*
+ * A fault on a swapped page also reads in up to SWAP_READAHEAD_PAGES of the
+ * swapped pages following it. Dirty victims are written out together with up
+ * to SWAP_CLUSTER_PAGES - 1 of their neighbours into contiguous slots, which
+ * is what makes the readahead read adjacent slots.
+ */
+#ifndef SWAP_READAHEAD_PAGES
+#define SWAP_READAHEAD_PAGES  (4)
+#endif
+#ifndef SWAP_CLUSTER_PAGES
+#define SWAP_CLUSTER_PAGES    (4)   // at most SLOTS_PER_WORD
+#endif
 
 extern bool starting_first_process;
-uint32_t free_slots[NUM_CHUNKS];
 
 fhandle_t *swap_fh;
 
-static void
-_unset_slot(int slot){
-    free_slots[slot/NUM_BITS] &= ~(1u<<(slot%NUM_BITS));
-    return;
+/***********************************************************************
+ * Swap slot allocator
+ *
+ * Slots are tracked by a 3 level bitmap where a set bit means free:
+ *  - each group covers SLOTS_PER_GROUP slots, one bit per slot, plus a
+ *    summary word telling which of its words still have a free slot
+ *  - _group_summary tells which groups still have a free slot
+ *  - _top_summary tells which words of _group_summary are non zero
+ * Finding a free slot is then a few count-leading-zeros, whatever the size
+ * of the swap file. Groups are only allocated when all the existing ones are
+ * full, which is how the swap file grows.
+ ***********************************************************************/
+
+#define SLOTS_PER_WORD      (32)
+#define WORDS_PER_GROUP     (32)
+#define SLOTS_PER_GROUP     (SLOTS_PER_WORD * WORDS_PER_GROUP)  // 4MiB of swap
+/* libnfs takes the file offset as an int, so stay under 2GiB */
+#define MAX_GROUPS          (512)
+#define GROUP_SUMMARY_WORDS (MAX_GROUPS / 32)
+
+#define SLOT_BIT(i)         (0x80000000u >> (i))
+#define FIRST_BIT(w)        (__builtin_clz(w))
+
+typedef struct {
+    uint32_t free_summary;              // bit i is set iff words[i] != 0
+    uint32_t words[WORDS_PER_GROUP];    // bit j of words[i] is set iff the slot is free
+} swap_group_t;
+
+static swap_group_t *_groups[MAX_GROUPS];
+static int _ngroups;
+static uint32_t _group_summary[GROUP_SUMMARY_WORDS];
+static uint32_t _top_summary;
+
+/* Make a new group of free slots, i.e. grow the swap file */
+static int
+_swap_grow(void) {
+    if (_ngroups == MAX_GROUPS) {
+        dprintf(3, "swap: the swap file cannot grow anymore\n");
+        return ENOMEM;
+    }
+    swap_group_t *grp = malloc(sizeof(swap_group_t));
+    if (grp == NULL) {
+        return ENOMEM;
+    }
+    memset(grp->words, 0xff, sizeof(grp->words));
+    grp->free_summary = (uint32_t)(-1);
+
+    int g = _ngroups++;
+    _groups[g] = grp;
+    _group_summary[g / 32] |= SLOT_BIT(g % 32);
+    _top_summary |= SLOT_BIT(g / 32);
+    dprintf(3, "swap: grown to %d slots\n", _ngroups * SLOTS_PER_GROUP);
+    return 0;
 }
 
+/* Mark the bits in *mask* of word w of group g as used and fix the summaries */
 static void
-_set_slot(int slot){
-    free_slots[slot/NUM_BITS] |= 1u<<(slot%NUM_BITS);
-    return;
+_swap_take(int g, int w, uint32_t mask) {
+    swap_group_t *grp = _groups[g];
+    grp->words[w] &= ~mask;
+    if (grp->words[w] == 0) {
+        grp->free_summary &= ~SLOT_BIT(w);
+        if (grp->free_summary == 0) {
+            _group_summary[g / 32] &= ~SLOT_BIT(g % 32);
+            if (_group_summary[g / 32] == 0) {
+                _top_summary &= ~SLOT_BIT(g / 32);
+            }
+        }
+    }
 }
 
 static int
-_swap_find_free_slot(void){
-    for(uint32_t i = 0; i < NUM_CHUNKS; i++){
-        if (free_slots[i] == (uint32_t)(-1)) continue;
-        for(uint32_t j = 0; j < NUM_BITS; j++) {
-            //dprintf(3, "i = %d, j = %d, free_slots[i] in decimal = %u\n", i, j, free_slots[i]);
-            if(!(free_slots[i] & (1u<<j))){
-                return i*NUM_BITS + j;
+_swap_slot_alloc(void) {
+    if (_top_summary == 0 && _swap_grow()) {
+        return -1;
+    }
+    int t = FIRST_BIT(_top_summary);
+    int g = t * 32 + FIRST_BIT(_group_summary[t]);
+    swap_group_t *grp = _groups[g];
+    int w = FIRST_BIT(grp->free_summary);
+    int b = FIRST_BIT(grp->words[w]);
+
+    _swap_take(g, w, SLOT_BIT(b));
+    return g * SLOTS_PER_GROUP + w * SLOTS_PER_WORD + b;
+}
+
+/*
+ * Allocate n (<= SLOTS_PER_WORD) contiguous slots, returns the first one or
+ * -1. Only runs within a bitmap word are considered, so this only looks at
+ * the words that still have free slots and grows the file if none has a
+ * long enough run.
+ */
+static int
+_swap_cluster_alloc(int n) {
+    assert(n > 0 && n <= SLOTS_PER_WORD);
+    if (n == 1) {
+        return _swap_slot_alloc();
+    }
+
+    for (int t = 0; t < GROUP_SUMMARY_WORDS; t++) {
+        for (uint32_t gs = _group_summary[t]; gs != 0; gs &= ~SLOT_BIT(FIRST_BIT(gs))) {
+            int g = t * 32 + FIRST_BIT(gs);
+            swap_group_t *grp = _groups[g];
+            for (uint32_t fs = grp->free_summary; fs != 0; fs &= ~SLOT_BIT(FIRST_BIT(fs))) {
+                int w = FIRST_BIT(fs);
+                /* Bit b of runs is set iff slots b..b+n-1 are all free */
+                uint32_t runs = grp->words[w];
+                for (int i = 1; i < n && runs != 0; i++) {
+                    runs &= grp->words[w] << i;
+                }
+                if (runs != 0) {
+                    int b = FIRST_BIT(runs);
+                    uint32_t mask = (n == 32) ? (uint32_t)(-1) : (((1u << n) - 1) << (32 - n - b));
+                    _swap_take(g, w, mask);
+                    return g * SLOTS_PER_GROUP + w * SLOTS_PER_WORD + b;
+                }
             }
         }
     }
-    return -1;
+
+    /* No room, a new group is all free */
+    if (_swap_grow()) {
+        return -1;
+    }
+    int g = _ngroups - 1;
+    uint32_t mask = (n == 32) ? (uint32_t)(-1) : (((1u << n) - 1) << (32 - n));
+    _swap_take(g, 0, mask);
+    return g * SLOTS_PER_GROUP;
+}
+
+/*
+ * A slot normally belongs to a single PTE or frame. An evicted copy on write
+ * frame leaves its slot to every page that mapped it, the references beyond
+ * the first are counted here and the slot is only freed with the last one.
+ */
+#define SWAP_SHARE_BUCKETS  (64)
+
+typedef struct swap_share swap_share_t;
+struct swap_share {
+    int slot;
+    int extra;              // # of references beyond the first
+    swap_share_t *next;
+};
+
+static swap_share_t *_swap_shares[SWAP_SHARE_BUCKETS];
+static SLAB_CACHE(_swap_share_slab, swap_share_t);
+
+static swap_share_t **
+_swap_share_find(int slot) {
+    swap_share_t **sp = &_swap_shares[slot % SWAP_SHARE_BUCKETS];
+    while (*sp != NULL && (*sp)->slot != slot) {
+        sp = &(*sp)->next;
+    }
+    return sp;
+}
+
+/* Give n more references to the slot */
+static int
+_swap_slot_share(int slot, int n) {
+    assert(slot >= 0 && n > 0);
+    swap_share_t **sp = _swap_share_find(slot);
+    if (*sp == NULL) {
+        swap_share_t *share = slab_alloc(&_swap_share_slab);
+        if (share == NULL) {
+            return ENOMEM;
+        }
+        share->slot  = slot;
+        share->extra = 0;
+        share->next  = NULL;
+        *sp = share;
+    }
+    (*sp)->extra += n;
+    return 0;
+}
+
+static bool
+_swap_slot_is_shared(int slot) {
+    return slot >= 0 && *_swap_share_find(slot) != NULL;
+}
+
+/* Drop a reference to a shared slot, false if it was the last one */
+static bool
+_swap_slot_unshare(int slot) {
+    swap_share_t **sp = _swap_share_find(slot);
+    swap_share_t *share = *sp;
+    if (share == NULL) {
+        return false;
+    }
+    if (--share->extra == 0) {
+        *sp = share->next;
+        slab_free(&_swap_share_slab, share);
+    }
+    return true;
+}
+
+static void
+_swap_slot_free(int slot) {
+    int g = slot / SLOTS_PER_GROUP;
+    if (slot < 0 || g >= _ngroups) {
+        return;
+    }
+    /* Other pages still have this copy */
+    if (_swap_slot_unshare(slot)) {
+        return;
+    }
+    /* Still being written back from the compressed pool, it frees it after */
+    if (zswap_invalidate(slot)) {
+        return;
+    }
+    int w = (slot % SLOTS_PER_GROUP) / SLOTS_PER_WORD;
+    int b = slot % SLOTS_PER_WORD;
+
+    _groups[g]->words[w] |= SLOT_BIT(b);
+    _groups[g]->free_summary |= SLOT_BIT(w);
+    _group_summary[g / 32] |= SLOT_BIT(g % 32);
+    _top_summary |= SLOT_BIT(g / 32);
 }
 
 void swap_free_slot(int slot){
-    _unset_slot(slot);
+    _swap_slot_free(slot);
 }
 
 /***********************************************************************
@@ -78,8 +291,6 @@ static void _swap_init_end(void *token, int err, struct vnode *vn);
 
 static void
 _swap_init(swap_init_cb_t callback, void *token){
-    bzero(free_slots, sizeof(free_slots));
-
     swap_init_cont_t *cont = malloc(sizeof(swap_init_cont_t));
     if (cont == NULL) {
         callback(token, ENOMEM);
@@ -131,22 +342,43 @@ typedef struct {
     addrspace_t *as;
     seL4_CapRights rights;
     bool is_code;
-    size_t bytes_read;
     pid_t pid;
+    int outstanding;
+    int err;
+    int pending;    // the page itself and its readahead still running
+    int ret;        // what the caller gets back
+    swap_chunk_t chunks[SWAP_CHUNKS_PER_PAGE];
 } swap_in_cont_t;
 
+static SLAB_CACHE(_swap_in_slab, swap_in_cont_t);
+
 static void _swap_in_page_map_cb(void *token, int err);
+static int _swap_in_send_chunk(swap_chunk_t *chunk);
 static void _swap_in_nfs_read_handler(uintptr_t token, enum nfs_stat status,
                                       fattr_t *fattr, int count, void* data);
 static void _swap_in_end(void* token, int err);
+static void _swap_readahead(swap_in_cont_t *parent);
+
+/*
+ * The caller is only called back once the readahead of the same burst is
+ * done too. The pages being read ahead are busy until then, whoever else
+ * wants them waits (see sos_page_wait)
+ */
+static void
+_swap_in_put(swap_in_cont_t *cont) {
+    assert(cont->pending > 0);
+    if (--cont->pending > 0) {
+        return;
+    }
+    cont->callback((void*)cont->token, cont->ret);
+    slab_free(&_swap_in_slab, cont);
+}
+
 int
 swap_in(addrspace_t *as, seL4_CapRights rights, seL4_Word vaddr,
         bool is_code, swap_in_cb_t callback, void* token){
     dprintf(3, "swap in entered, vaddr = 0x%08x\n", vaddr);
 
-    // If swap file is not created, how can we swap in? This is a bug
-    assert(swap_fh != NULL);
-
     seL4_Word vpage = PAGE_ALIGN(vaddr);
     int x = PT_L1_INDEX(vpage);
     int y = PT_L2_INDEX(vpage);
@@ -157,28 +389,53 @@ swap_in(addrspace_t *as, seL4_CapRights rights, seL4_Word vaddr,
 
     int swap_slot = (as->as_pd_regs[x][y] & PTE_SWAP_MASK)>>PTE_SWAP_OFFSET;
 
-    swap_in_cont_t *swap_cont = malloc(sizeof(swap_in_cont_t));
+    /* Nothing was stored for an all zero page, the zero frame will do until it's written */
+    if (swap_slot == PTE_ZERO_SLOT) {
+        dprintf(3, "swap_in: zero page\n");
+        return sos_page_map_zero(proc_get_id(), as, vpage, rights, callback, token);
+    }
+
+    // If swap file is not created, how can we swap in? This is a bug
+    assert(swap_fh != NULL);
+
+    swap_in_cont_t *swap_cont = slab_alloc(&_swap_in_slab);
     if(swap_cont == NULL){
         return ENOMEM;
     }
-    swap_cont->callback   = callback;
-    swap_cont->token      = token;
-    swap_cont->kvaddr     = 0;
-    swap_cont->vpage      = vpage;
-    swap_cont->swap_slot  = swap_slot;
-    swap_cont->as         = as;
-    swap_cont->rights     = rights;
-    swap_cont->is_code    = is_code;
-    swap_cont->bytes_read = 0;
-    swap_cont->pid        = proc_get_id();
+    /*
+     * Map the page read only so that we know when it gets dirty, the
+     * first write to it will fault and the fault handler gives the write
+     * permission back
+     */
+    if (rights & seL4_CanRead) {
+        rights &= ~seL4_CanWrite;
+    }
+
+    swap_cont->callback    = callback;
+    swap_cont->token       = token;
+    swap_cont->kvaddr      = 0;
+    swap_cont->vpage       = vpage;
+    swap_cont->swap_slot   = swap_slot;
+    swap_cont->as          = as;
+    swap_cont->rights      = rights;
+    swap_cont->is_code     = is_code;
+    swap_cont->pid         = proc_get_id();
+    swap_cont->outstanding = 0;
+    swap_cont->err         = 0;
+    swap_cont->pending     = 2; // the page and swap_in itself, until the readahead is sent
+    swap_cont->ret         = 0;
 
     dprintf(3, "swap_in: swap_slot = %d, pid = %d\n", swap_slot, swap_cont->pid);
     int err;
     err = sos_page_map(swap_cont->pid, as, vpage, rights, _swap_in_page_map_cb, (void*)swap_cont, false);
     if (err) {
-        free(swap_cont);
+        slab_free(&_swap_in_slab, swap_cont);
         return err;
     }
+
+    /* Get the next pages on the wire while we are at it */
+    _swap_readahead(swap_cont);
+    _swap_in_put(swap_cont);
     return 0;
 }
 
@@ -204,61 +461,86 @@ _swap_in_page_map_cb(void *token, int err) {
         return;
     }
 
+    /* Compressed pages are right here, no need to go to the network */
+    if (zswap_load(cont->swap_slot, cont->kvaddr) == 0) {
+        _swap_in_end(cont, 0);
+        return;
+    }
+
     dprintf(3, "swap in start reading\n");
-    enum rpc_stat status = nfs_read(swap_fh, cont->swap_slot * PAGE_SIZE,
-            MIN(PAGE_SIZE, NFS_SEND_SIZE), _swap_in_nfs_read_handler,
-            (uintptr_t)cont);
-    if(status != RPC_OK){
+    /* Ask for every chunk of the page at once */
+    size_t size = NFS_READ_SIZE;
+    for (int i = 0; i * size < PAGE_SIZE; i++) {
+        swap_chunk_t *chunk = &cont->chunks[i];
+        chunk->cont   = cont;
+        chunk->offset = i * size;
+        chunk->len    = MIN(size, PAGE_SIZE - chunk->offset);
+        if (_swap_in_send_chunk(chunk)) {
+            cont->err = EFAULT;
+            break;
+        }
+        cont->outstanding++;
+    }
+
+    /* If nothing made it out, no reply will ever come back to finish this */
+    if (cont->outstanding == 0) {
         _swap_in_end(cont, EFAULT);
-    } else {
-        //cont->pid = proc_get_id(); //we don't need to set it here
     }
-    return;
+}
+
+static int
+_swap_in_send_chunk(swap_chunk_t *chunk) {
+    swap_in_cont_t *cont = (swap_in_cont_t*)chunk->cont;
+    /* The reply is copied straight into the locked frame */
+    enum rpc_stat status = nfs_read_into(swap_fh, cont->swap_slot * PAGE_SIZE + chunk->offset,
+                                         chunk->len, (void*)(cont->kvaddr + chunk->offset),
+                                         _swap_in_nfs_read_handler, (uintptr_t)chunk);
+    return (status == RPC_OK) ? 0 : EFAULT;
 }
 
 static void
 _swap_in_nfs_read_handler(uintptr_t token, enum nfs_stat status,
                           fattr_t *fattr, int count, void* data){
     dprintf(3, "swap in handler entered\n");
-    swap_in_cont_t *cont = (swap_in_cont_t*)token;
+    swap_chunk_t *chunk = (swap_chunk_t*)token;
+    assert(chunk != NULL);
+    swap_in_cont_t *cont = (swap_in_cont_t*)chunk->cont;
+
+    if (status != NFS_OK || count <= 0 || (size_t)count > chunk->len) {
+        cont->err = EFAULT;
+    } else if (!cont->err) {
+        /* The data is in already, chunks may come back in any order */
+        chunk->offset += (size_t)count;
+        chunk->len    -= (size_t)count;
+
+        /* The server gave us less than we asked for, get the rest of this chunk */
+        if (chunk->len > 0) {
+            if (_swap_in_send_chunk(chunk) == 0) {
+                return;
+            }
+            cont->err = EFAULT;
+        }
+    }
 
-    if(status != NFS_OK || count < 0){
-        _swap_in_end((void*)token, EFAULT);
+    cont->outstanding--;
+    if (cont->outstanding > 0) {
+        /* Wait for the other chunks of this page */
         return;
     }
+
     if (!starting_first_process && !is_proc_alive(frame_get_pid(cont->kvaddr))) {
         dprintf(3, "_swap_in_nfs_read_handler: process is killed\n");
         frame_unlock_frame(cont->kvaddr);
         //sos_page_free(cont->as, cont->vpage);
         frame_free(cont->kvaddr);
-        _unset_slot(cont->swap_slot);
-        cont->callback((void*)cont->token, EFAULT);
-        free(cont);
+        _swap_slot_free(cont->swap_slot);
+        cont->ret = EFAULT;
+        _swap_in_put(cont);
         return;
     }
     set_cur_proc(cont->pid);
 
-
-    /* Copy data in */
-    memcpy((void*)(cont->kvaddr) + cont->bytes_read, data, count);
-
-    cont->bytes_read += (size_t)count;
-
-    //dprintf(3, "bytes read = %u, swap_slot = %d\n", cont->bytes_read, cont->swap_slot);
-    /* Check if we need to read more */
-    if(cont->bytes_read < PAGE_SIZE){
-        enum rpc_stat status = nfs_read(swap_fh, cont->swap_slot * PAGE_SIZE + cont->bytes_read,
-                                        MIN(NFS_SEND_SIZE, PAGE_SIZE - cont->bytes_read),
-                                        _swap_in_nfs_read_handler, (uintptr_t)cont);
-        if (status != RPC_OK) {
-            _swap_in_end((void*)token, EFAULT);
-        } else {
-            //cont->pid = proc_get_id(); // we don't need to do this
-        }
-        return;
-    } else {
-        _swap_in_end((void*)token, 0);
-    }
+    _swap_in_end((void*)cont, cont->err);
 }
 
 static void
@@ -272,8 +554,8 @@ _swap_in_end(void* token, int err){
         if (cont->kvaddr) {
             sos_page_free(cont->as, cont->vpage);
         }
-        cont->callback((void*)cont->token, err);
-        free(cont);
+        cont->ret = err;
+        _swap_in_put(cont);
         return;
     }
 
@@ -287,57 +569,408 @@ _swap_in_end(void* token, int err){
     }
 
     frame_unlock_frame(cont->kvaddr);
-    _unset_slot(cont->swap_slot);
+
+    /*
+     * Keep the slot while the page is clean, the frame can then be dropped
+     * without writing it back. We can't tell when a writable page gets dirty
+     */
+    if (cont->rights & seL4_CanWrite) {
+        _swap_slot_free(cont->swap_slot);
+    } else {
+        frame_set_swap_slot(cont->kvaddr, cont->swap_slot);
+        frame_set_clean(cont->kvaddr);
+    }
 
     /* We don't need to reset PTE as sos_page_map already done that for us */
 
     dprintf(3, "_swap_in_end: calling back up\n");
-    cont->callback((void*)cont->token, 0);
-    free(cont);
+    _swap_in_put(cont);
+}
+
+/***********************************************************************
+ * Swap in readahead
+ *
+ * The swapped pages following a faulting one are read into their own frames
+ * in the same burst as the faulting page. They are left present in the page
+ * table but not mapped in seL4 and unreferenced: the first access is a cheap
+ * fault that maps them, and the clock drops them first (they are clean) if
+ * they are never used.
+ *
+ * Readahead only uses free frames, it never evicts anything by itself.
+ ***********************************************************************/
+
+typedef struct {
+    swap_in_cont_t *parent;
+    addrspace_t *as;
+    seL4_Word vpage;
+    seL4_Word kvaddr;
+    int swap_slot;
+    pid_t pid;
+    page_busy_t *busy;
+    int outstanding;
+    int err;
+    swap_chunk_t chunks[SWAP_CHUNKS_PER_PAGE];
+} swap_readahead_cont_t;
+
+static SLAB_CACHE(_swap_readahead_slab, swap_readahead_cont_t);
+
+static void _swap_readahead_2(void *token, seL4_Word kvaddr);
+static int _swap_readahead_send_chunk(swap_chunk_t *chunk);
+static void _swap_readahead_nfs_read_cb(uintptr_t token, enum nfs_stat status,
+                                        fattr_t *fattr, int count, void* data);
+static void _swap_readahead_end(swap_readahead_cont_t *cont, int err);
+static void _swap_readahead_put(swap_readahead_cont_t *cont);
+
+/* Returns the slot of the swapped page at vpage or -1 */
+static int
+_swap_get_slot(addrspace_t *as, seL4_Word vpage) {
+    int x = PT_L1_INDEX(vpage);
+    int y = PT_L2_INDEX(vpage);
+
+    if (as->as_pd_regs[x] == NULL || as->as_pd_caps[x] == NULL) {
+        return -1;
+    }
+    seL4_Word pte = as->as_pd_regs[x][y];
+    if (!(pte & PTE_IN_USE_BIT) || !(pte & PTE_SWAPPED)) {
+        return -1;
+    }
+    return (pte & PTE_SWAP_MASK)>>PTE_SWAP_OFFSET;
+}
+
+static void
+_swap_readahead(swap_in_cont_t *parent) {
+    addrspace_t *as = parent->as;
+    seL4_Word vpage = parent->vpage;
+    for (int i = 1; i <= SWAP_READAHEAD_PAGES; i++) {
+        seL4_Word next = vpage + i * PAGE_SIZE;
+        if (next < vpage || !frame_has_free()) {
+            return;
+        }
+        int slot = _swap_get_slot(as, next);
+        if (slot < 0 || slot == PTE_ZERO_SLOT || zswap_has(slot)) {
+            /* Zero pages and pages in the compressed pool are cheap to fault in anyway */
+            continue;
+        }
+        if (sos_page_is_busy(as, next)) {
+            /* Someone is swapping it in already */
+            continue;
+        }
+
+        swap_readahead_cont_t *cont = slab_alloc(&_swap_readahead_slab);
+        if (cont == NULL) {
+            return;
+        }
+        cont->busy = sos_page_busy(as, next);
+        if (cont->busy == NULL) {
+            slab_free(&_swap_readahead_slab, cont);
+            return;
+        }
+        cont->parent      = parent;
+        cont->as          = as;
+        cont->vpage       = next;
+        cont->kvaddr      = 0;
+        cont->swap_slot   = -1;
+        cont->pid         = parent->pid;
+        cont->outstanding = 0;
+        cont->err         = 0;
+
+        dprintf(3, "swap readahead: vpage = 0x%08x\n", next);
+        parent->pending++;
+        if (frame_alloc(next, as, cont->pid, false, _swap_readahead_2, (void*)cont)) {
+            parent->pending--;
+            sos_page_unbusy(cont->busy);
+            slab_free(&_swap_readahead_slab, cont);
+            return;
+        }
+    }
+}
+
+static void
+_swap_readahead_2(void *token, seL4_Word kvaddr) {
+    swap_readahead_cont_t *cont = (swap_readahead_cont_t*)token;
+
+    if (kvaddr == 0) {
+        _swap_readahead_put(cont);
+        return;
+    }
+
+    /* The page may have been freed while we got the frame */
+    int slot = -1;
+    if (starting_first_process || is_proc_alive(cont->pid)) {
+        slot = _swap_get_slot(cont->as, cont->vpage);
+    }
+    if (slot < 0) {
+        frame_free(kvaddr);
+        _swap_readahead_put(cont);
+        return;
+    }
+
+    int x = PT_L1_INDEX(cont->vpage);
+    int y = PT_L2_INDEX(cont->vpage);
+    cont->kvaddr    = kvaddr;
+    cont->swap_slot = slot;
+    cont->as->as_pd_regs[x][y] = (kvaddr | PTE_IN_USE_BIT) & (~PTE_SWAPPED);
+    frame_set_unreferenced(kvaddr);
+    frame_lock_frame(kvaddr);
+
+    size_t size = NFS_READ_SIZE;
+    for (int i = 0; i * size < PAGE_SIZE; i++) {
+        swap_chunk_t *chunk = &cont->chunks[i];
+        chunk->cont   = cont;
+        chunk->offset = i * size;
+        chunk->len    = MIN(size, PAGE_SIZE - chunk->offset);
+        if (_swap_readahead_send_chunk(chunk)) {
+            cont->err = EFAULT;
+            break;
+        }
+        cont->outstanding++;
+    }
+
+    if (cont->outstanding == 0) {
+        _swap_readahead_end(cont, EFAULT);
+    }
+}
+
+static int
+_swap_readahead_send_chunk(swap_chunk_t *chunk) {
+    swap_readahead_cont_t *cont = (swap_readahead_cont_t*)chunk->cont;
+    enum rpc_stat status = nfs_read_into(swap_fh, cont->swap_slot * PAGE_SIZE + chunk->offset,
+                                         chunk->len, (void*)(cont->kvaddr + chunk->offset),
+                                         _swap_readahead_nfs_read_cb, (uintptr_t)chunk);
+    return (status == RPC_OK) ? 0 : EFAULT;
+}
+
+static void
+_swap_readahead_nfs_read_cb(uintptr_t token, enum nfs_stat status,
+                            fattr_t *fattr, int count, void* data) {
+    swap_chunk_t *chunk = (swap_chunk_t*)token;
+    assert(chunk != NULL);
+    swap_readahead_cont_t *cont = (swap_readahead_cont_t*)chunk->cont;
+
+    if (status != NFS_OK || count <= 0 || (size_t)count > chunk->len) {
+        cont->err = EFAULT;
+    } else if (!cont->err) {
+        chunk->offset += (size_t)count;
+        chunk->len    -= (size_t)count;
+
+        if (chunk->len > 0) {
+            if (_swap_readahead_send_chunk(chunk) == 0) {
+                return;
+            }
+            cont->err = EFAULT;
+        }
+    }
+
+    cont->outstanding--;
+    if (cont->outstanding > 0) {
+        return;
+    }
+
+    if (!starting_first_process && !is_proc_alive(cont->pid)) {
+        dprintf(3, "_swap_readahead_nfs_read_cb: process is killed\n");
+        frame_unlock_frame(cont->kvaddr);
+        frame_free(cont->kvaddr);
+        _swap_slot_free(cont->swap_slot);
+        _swap_readahead_put(cont);
+        return;
+    }
+
+    _swap_readahead_end(cont, cont->err);
+}
+
+static void
+_swap_readahead_end(swap_readahead_cont_t *cont, int err) {
+    int x = PT_L1_INDEX(cont->vpage);
+    int y = PT_L2_INDEX(cont->vpage);
+    seL4_Word *pte = &cont->as->as_pd_regs[x][y];
+
+    frame_unlock_frame(cont->kvaddr);
+
+    if (*pte != ((cont->kvaddr | PTE_IN_USE_BIT) & (~PTE_SWAPPED))) {
+        /* The page got freed under us, so did our frame's mapping */
+        _swap_slot_free(cont->swap_slot);
+        frame_free(cont->kvaddr);
+    } else if (err) {
+        /* Leave it in the swap file, it'll be read again when it's used */
+        *pte = (cont->swap_slot<<PTE_SWAP_OFFSET) | PTE_IN_USE_BIT | PTE_SWAPPED;
+        frame_free(cont->kvaddr);
+    } else {
+        /* Like any page coming from swap, it is clean and keeps its slot */
+        frame_set_swap_slot(cont->kvaddr, cont->swap_slot);
+        frame_set_clean(cont->kvaddr);
+    }
+    _swap_readahead_put(cont);
+}
+
+/* Done with the page, let the others at it and tell the faulting page */
+static void
+_swap_readahead_put(swap_readahead_cont_t *cont) {
+    sos_page_unbusy(cont->busy);
+    _swap_in_put(cont->parent);
+    slab_free(&_swap_readahead_slab, cont);
 }
 
 /***********************************************************************
  * swap_out
+ *
+ * All zero pages are not stored anywhere, their PTE gets PTE_ZERO_SLOT.
+ *
+ * A dirty victim without a slot is written out together with its dirty,
+ * unreferenced virtual neighbours into contiguous slots. The pages of the
+ * cluster are kept in ascending vaddr order, pages[i] going to
+ * free_slot + i, so that a later sequential scan reads adjacent slots.
+ *
+ * A copy on write victim goes out on its own. Every page mapping it is busy
+ * meanwhile and they all get its slot in the end.
  ***********************************************************************/
 
 typedef struct {
     swap_out_cb_t callback;
     void *token;
     seL4_Word kvaddr;
+    addrspace_t *as;
+    int npages;
+    seL4_Word pages[SWAP_CLUSTER_PAGES];
+    page_busy_t *busy[SWAP_CLUSTER_PAGES];  // the pages are busy until they're out
     int free_slot;
-    size_t written;
-    pid_t pid;
+    pid_t pid;      // who the frame is evicted for, PROC_NULL for the cleaner
+    bool cow;       // the victim is copy on write, it has no single owner
+    page_busy_t **cow_busy;                 // the pages mapping a copy on write victim
+    int ncow_busy;
+    int outstanding;
+    int err;
+    swap_chunk_t chunks[SWAP_CLUSTER_PAGES * SWAP_CHUNKS_PER_PAGE];
 } swap_out_cont_t;
 
+static SLAB_CACHE(_swap_out_slab, swap_out_cont_t);
+
 static void _swap_out_2_init_callback(void *token, int err);
 static void _swap_out_3(swap_out_cont_t *cont);
+static int _swap_out_send_chunk(swap_chunk_t *chunk);
 static void _swap_out_4_nfs_write_cb(uintptr_t token, enum nfs_stat status,
                                      fattr_t *fattr, int count);
 static void _swap_out_end(swap_out_cont_t *cont, int err);
+static void _swap_out_end_cow(swap_out_cont_t *cont, int err);
+static void _swap_out_finish(swap_out_cont_t *cont, int err);
+
+static bool
+_swap_page_is_zero(seL4_Word kvaddr) {
+    const uint32_t *words = (const uint32_t*)kvaddr;
+    for (int i = 0; i < PAGE_SIZE / sizeof(uint32_t); i++) {
+        if (words[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+_swap_out_unbusy_cow(page_busy_t **busy, int n) {
+    for (int i = 0; i < n; i++) {
+        sos_page_unbusy(busy[i]);
+    }
+    free(busy);
+}
+
+/* Mark every page mapping the copy on write victim busy, EBUSY if one already is */
+static int
+_swap_out_busy_cow(swap_out_cont_t *cont) {
+    int n = frame_get_refcount(cont->kvaddr);
+    frame_mapping_t *m;
+
+    assert(n > 0);
+    for (m = frame_cow_mappings(cont->kvaddr); m != NULL; m = m->next) {
+        if (sos_page_is_busy(m->as, m->vpage)) {
+            return EBUSY;
+        }
+    }
+    cont->cow_busy = malloc(n * sizeof(page_busy_t*));
+    if (cont->cow_busy == NULL) {
+        return ENOMEM;
+    }
+    for (m = frame_cow_mappings(cont->kvaddr); m != NULL; m = m->next) {
+        page_busy_t *busy = sos_page_busy(m->as, m->vpage);
+        if (busy == NULL) {
+            _swap_out_unbusy_cow(cont->cow_busy, cont->ncow_busy);
+            cont->cow_busy  = NULL;
+            cont->ncow_busy = 0;
+            return ENOMEM;
+        }
+        cont->cow_busy[cont->ncow_busy++] = busy;
+    }
+    return 0;
+}
 
 void
-swap_out(seL4_Word kvaddr, swap_out_cb_t callback, void *token) {
+swap_out(seL4_Word kvaddr, pid_t pid, swap_out_cb_t callback, void *token) {
     dprintf(3, "swap_out entered, kvaddr = 0x%08x\n", kvaddr);
     kvaddr = PAGE_ALIGN(kvaddr);
 
+    bool cow = frame_is_cow(kvaddr);
     seL4_Word vaddr = frame_get_vaddr(kvaddr);
-    assert(vaddr != 0);
+    assert(cow || vaddr != 0);
     /* Create the continuation here to be used in subsequent functions */
-    swap_out_cont_t *cont = malloc(sizeof(swap_out_cont_t));
+    swap_out_cont_t *cont = slab_alloc(&_swap_out_slab);
     if (cont == NULL) {
         callback(token, ENOMEM);
         return;
     }
-    cont->callback  = callback;
-    cont->token     = token;
-    cont->kvaddr    = kvaddr;
-    cont->written   = 0;
-    cont->pid       = proc_get_id();
+    cont->callback    = callback;
+    cont->token       = token;
+    cont->kvaddr      = kvaddr;
+    cont->as          = frame_get_as(kvaddr);
+    cont->npages      = 1;
+    cont->pages[0]    = kvaddr;
+    cont->busy[0]     = NULL;
+    cont->free_slot   = -1;
+    cont->pid         = pid;
+    cont->cow         = cow;
+    cont->cow_busy    = NULL;
+    cont->ncow_busy   = 0;
+    cont->outstanding = 0;
+    cont->err         = 0;
 
     dprintf(3, "swap out this kvaddr -> 0x%08x, this vaddr -> 0x%08x, pid = %d\n",kvaddr,vaddr, cont->pid);
 
+    /* Someone paging it in has it, it's not going anywhere. Anyone who finds
+     * the page on its way out waits for it like for a page coming in */
+    if (cow) {
+        int err = _swap_out_busy_cow(cont);
+        if (err) {
+            slab_free(&_swap_out_slab, cont);
+            callback(token, err);
+            return;
+        }
+    } else if (sos_page_is_busy(cont->as, vaddr) ||
+            (cont->busy[0] = sos_page_busy(cont->as, vaddr)) == NULL) {
+        slab_free(&_swap_out_slab, cont);
+        callback(token, EBUSY);
+        return;
+    }
     frame_lock_frame(kvaddr);
 
+    /*
+     * A clean frame still has its copy in the swap file or, if it has no
+     * slot, in the file backing its region. Just drop it. A copy on write
+     * frame has no single region to read it back from, it needs the slot
+     */
+    if (!frame_is_dirty(kvaddr) && (!cow || frame_get_swap_slot(kvaddr) >= 0)) {
+        cont->free_slot = frame_get_swap_slot(kvaddr);
+        dprintf(3, "swap_out: frame is clean, dropping it, slot = %d\n", cont->free_slot);
+        _swap_out_end(cont, 0);
+        return;
+    }
+
+    if (_swap_page_is_zero(kvaddr)) {
+        dprintf(3, "swap_out: zero page, nothing to write\n");
+        int slot = frame_get_swap_slot(kvaddr);
+        frame_set_swap_slot(kvaddr, -1);
+        _swap_slot_free(slot);
+        cont->free_slot = PTE_ZERO_SLOT;
+        _swap_out_end(cont, 0);
+        return;
+    }
+
     /* Initialise the swap file if it hasn't been there */
     if (swap_fh == NULL) {
         _swap_init(_swap_out_2_init_callback, (void*)cont);
@@ -361,103 +994,355 @@ _swap_out_2_init_callback(void *token, int err) {
     _swap_out_3(cont);
 }
 
+/*
+ * Lock and return the frame at vpage if it can go out with the victim: a
+ * dirty page without a slot that is not mapped in the process at the moment,
+ * so it can't change while it's being written. The page is marked busy
+ * through *busy
+ */
+static seL4_Word
+_swap_out_take_neighbour(addrspace_t *as, seL4_Word vpage, page_busy_t **busy) {
+    int x = PT_L1_INDEX(vpage);
+    int y = PT_L2_INDEX(vpage);
+
+    if (vpage == 0 || as->as_pd_regs[x] == NULL || as->as_pd_caps[x] == NULL) {
+        return 0;
+    }
+    seL4_Word pte = as->as_pd_regs[x][y];
+    if (!(pte & PTE_IN_USE_BIT) || (pte & PTE_SWAPPED) || as->as_pd_caps[x][y] != 0) {
+        return 0;
+    }
+
+    seL4_Word kvaddr = pte & PTE_KVADDR_MASK;
+    if (frame_get_as(kvaddr) != as || PAGE_ALIGN(frame_get_vaddr(kvaddr)) != vpage ||
+            frame_is_shared(kvaddr) || is_frame_referenced(kvaddr) ||
+            !frame_is_dirty(kvaddr) || frame_get_swap_slot(kvaddr) >= 0 ||
+            sos_page_is_busy(as, vpage)) {
+        return 0;
+    }
+
+    /* Fails if it's already being swapped */
+    if (frame_lock_frame(kvaddr)) {
+        return 0;
+    }
+    *busy = sos_page_busy(as, vpage);
+    if (*busy == NULL) {
+        frame_unlock_frame(kvaddr);
+        return 0;
+    }
+    return kvaddr;
+}
+
+/* Gather the victim's neighbours into cont->pages, in ascending vaddr order */
+static void
+_swap_out_gather(swap_out_cont_t *cont) {
+    seL4_Word vpage = PAGE_ALIGN(frame_get_vaddr(cont->kvaddr));
+    seL4_Word below[SWAP_CLUSTER_PAGES];
+    page_busy_t *below_busy[SWAP_CLUSTER_PAGES];
+    page_busy_t *victim_busy = cont->busy[0];
+    seL4_Word kvaddr;
+    int nbelow = 0;
+
+    while (nbelow < SWAP_CLUSTER_PAGES - 1 && vpage > (nbelow + 1) * PAGE_SIZE &&
+           (kvaddr = _swap_out_take_neighbour(cont->as, vpage - (nbelow + 1) * PAGE_SIZE,
+                                              &below_busy[nbelow]))) {
+        below[nbelow++] = kvaddr;
+    }
+
+    cont->npages = 0;
+    for (int i = nbelow - 1; i >= 0; i--) {
+        cont->busy[cont->npages]    = below_busy[i];
+        cont->pages[cont->npages++] = below[i];
+    }
+    cont->busy[cont->npages]    = victim_busy;
+    cont->pages[cont->npages++] = cont->kvaddr;
+
+    while (cont->npages < SWAP_CLUSTER_PAGES &&
+           (kvaddr = _swap_out_take_neighbour(cont->as, vpage + (cont->npages - nbelow) * PAGE_SIZE,
+                                              &cont->busy[cont->npages]))) {
+        cont->pages[cont->npages++] = kvaddr;
+    }
+}
+
+/* Put back the neighbours, leaving only the victim in the cluster */
+static void
+_swap_out_drop_neighbours(swap_out_cont_t *cont) {
+    page_busy_t *victim_busy = NULL;
+    for (int i = 0; i < cont->npages; i++) {
+        if (cont->pages[i] != cont->kvaddr) {
+            frame_unlock_frame(cont->pages[i]);
+            sos_page_unbusy(cont->busy[i]);
+        } else {
+            victim_busy = cont->busy[i];
+        }
+    }
+    cont->npages   = 1;
+    cont->pages[0] = cont->kvaddr;
+    cont->busy[0]  = victim_busy;
+}
+
 static void
 _swap_out_3(swap_out_cont_t *cont) {
     dprintf(3, "swap out 3 entered\n");
     assert(cont != NULL); //Kernel code is buggy if this happens
 
-    int free_slot = _swap_find_free_slot();
-    dprintf(3, "swap_out free slot = %d, pid = %d, kvaddr = 0x%08x \n", free_slot, cont->pid, cont->kvaddr);
-    if(free_slot < 0){
-        _swap_out_end(cont, EFAULT);
+    /* A dirty frame that came from swap is written back to its old slot */
+    int free_slot = frame_get_swap_slot(cont->kvaddr);
+
+    /* unless its old copy is still on its way out of the compressed pool, or
+     * other pages still have the old copy */
+    if (free_slot >= 0 && (zswap_is_busy(free_slot) || _swap_slot_is_shared(free_slot))) {
+        frame_set_swap_slot(cont->kvaddr, -1);
+        _swap_slot_free(free_slot);
+        free_slot = -1;
+    }
+
+    /* Try to keep it compressed in memory first */
+    int zslot = (free_slot >= 0) ? free_slot : _swap_slot_alloc();
+    if (zslot >= 0 && zswap_store(zslot, cont->kvaddr) == 0) {
+        cont->free_slot = zslot;
+        _swap_out_end(cont, 0);
         return;
     }
-    _set_slot(free_slot);
+    if (zslot >= 0 && zslot != free_slot) {
+        _swap_slot_free(zslot);
+    }
+
+    if (free_slot < 0) {
+        if (!cont->cow) {
+            _swap_out_gather(cont);
+        }
+        free_slot = _swap_cluster_alloc(cont->npages);
+        if (free_slot < 0 && cont->npages > 1) {
+            /* No room for the whole cluster, just evict the victim */
+            _swap_out_drop_neighbours(cont);
+            free_slot = _swap_slot_alloc();
+        }
+        if(free_slot < 0){
+            _swap_out_end(cont, EFAULT);
+            return;
+        }
+    }
+    dprintf(3, "swap_out free slot = %d, npages = %d, pid = %d, kvaddr = 0x%08x \n",
+            free_slot, cont->npages, cont->pid, cont->kvaddr);
     cont->free_slot = free_slot;
 
-    enum rpc_stat status = nfs_write(swap_fh, cont->free_slot * PAGE_SIZE,
-                        MIN(NFS_SEND_SIZE, PAGE_SIZE), (void*)cont->kvaddr,
-                        _swap_out_4_nfs_write_cb, (uintptr_t)cont);
-    if (status != RPC_OK) {
-        dprintf(3, "swapout 3 err\n");
+    /* Put every chunk of the cluster on the wire at once */
+    size_t size = NFS_WRITE_SIZE;
+    int per_page = (PAGE_SIZE + size - 1) / size;
+    for (int i = 0; i < cont->npages * per_page; i++) {
+        swap_chunk_t *chunk = &cont->chunks[i];
+        size_t page_offset = (i % per_page) * size;
+        chunk->cont   = cont;
+        chunk->offset = (i / per_page) * PAGE_SIZE + page_offset;
+        chunk->len    = MIN(size, PAGE_SIZE - page_offset);
+        if (_swap_out_send_chunk(chunk)) {
+            dprintf(3, "swapout 3 err\n");
+            cont->err = EFAULT;
+            break;
+        }
+        cont->outstanding++;
+    }
+
+    /* If nothing made it out, no reply will ever come back to finish this */
+    if (cont->outstanding == 0) {
         _swap_out_end(cont, EFAULT);
-        return;
     }
 }
 
+static int
+_swap_out_send_chunk(swap_chunk_t *chunk) {
+    swap_out_cont_t *cont = (swap_out_cont_t*)chunk->cont;
+    /* Chunks never cross a page, the offset tells which page of the cluster it's in */
+    seL4_Word src = cont->pages[chunk->offset / PAGE_SIZE] + chunk->offset % PAGE_SIZE;
+    /* Sent from the frame itself, it stays locked until the write is acknowledged.
+     * The write is stable: once the slot is written a clean frame is dropped
+     * on the strength of it, so it has to survive the server crashing */
+    enum rpc_stat status = nfs_write_flags(swap_fh, cont->free_slot * PAGE_SIZE + chunk->offset,
+                                           chunk->len, (void*)src, NFS_WRITE_REF,
+                                           _swap_out_4_nfs_write_cb, (uintptr_t)chunk);
+    return (status == RPC_OK) ? 0 : EFAULT;
+}
+
 static void
 _swap_out_4_nfs_write_cb(uintptr_t token, enum nfs_stat status, fattr_t *fattr, int count) {
     dprintf(3, "swap out 4 entered\n");
-    swap_out_cont_t *cont = (swap_out_cont_t*)token;
-    assert(cont != NULL);
+    swap_chunk_t *chunk = (swap_chunk_t*)token;
+    assert(chunk != NULL);
+    swap_out_cont_t *cont = (swap_out_cont_t*)chunk->cont;
+
+    if (status != NFS_OK || fattr == NULL || count <= 0 || (size_t)count > chunk->len) {
+        cont->err = EFAULT;
+    } else if (!cont->err) {
+        chunk->offset += (size_t)count;
+        chunk->len    -= (size_t)count;
+
+        /* Only part of this chunk got written, send the rest of it */
+        if (chunk->len > 0) {
+            if (_swap_out_send_chunk(chunk) == 0) {
+                return;
+            }
+            cont->err = EFAULT;
+        }
+    }
 
-    if (status != NFS_OK || fattr == NULL || count < 0) {
-        _swap_out_end(cont, EFAULT);
+    cont->outstanding--;
+    if (cont->outstanding > 0) {
+        /* Wait for the other chunks of the cluster */
         return;
     }
 
-    if (!starting_first_process && !is_proc_alive(frame_get_pid(cont->kvaddr))) {
+    /* A copy on write frame loses its mappings with their address spaces instead */
+    if (!cont->cow && !starting_first_process && !is_proc_alive(frame_get_pid(cont->kvaddr))) {
         dprintf(3, "_swap_out_4_nfs_write_cb: process is killed\n");
-        _unset_slot(cont->free_slot);
-        frame_unlock_frame(cont->kvaddr);
-        frame_free(cont->kvaddr);
-        cont->callback(cont->token, EFAULT);
-        free(cont);
+        for (int i = 0; i < cont->npages; i++) {
+            _swap_slot_free(cont->free_slot + i);
+            frame_unlock_frame(cont->pages[i]);
+            frame_free(cont->pages[i]);
+        }
+        _swap_out_finish(cont, EFAULT);
         return;
     }
-    set_cur_proc(cont->pid);
-
-    cont->written += (size_t)count;
-    //dprintf(3, "swap out 4 written = %u, free_slot = %d\n", cont->written, cont->free_slot);
-    /* Check if we have written the whole page */
-    if (cont->written < PAGE_SIZE) {
-        enum rpc_stat status = nfs_write(swap_fh, cont->free_slot * PAGE_SIZE + cont->written,
-                MIN(NFS_SEND_SIZE, PAGE_SIZE - cont->written),
-                (void*)(cont->kvaddr + cont->written), _swap_out_4_nfs_write_cb, (uintptr_t)cont);
-        if (status != RPC_OK) {
-            _swap_out_end(cont, EFAULT);
-            return;
-        }
-    } else {
-        _swap_out_end(cont, 0);
+    if (cont->pid != PROC_NULL) {
+        set_cur_proc(cont->pid);
     }
+
+    _swap_out_end(cont, cont->err);
 }
 
 static void
 _swap_out_end(swap_out_cont_t *cont, int err) {
     dprintf(3, "swap out end: free_slot = %d, pid = %d\n", cont->free_slot, cont->pid);
+    if (cont->cow) {
+        _swap_out_end_cow(cont, err);
+        return;
+    }
     if (err) {
         dprintf(3, "_swap_out_end err\n");
-        _unset_slot(cont->free_slot);
-        frame_unlock_frame(cont->kvaddr);
-        cont->callback(cont->token, EFAULT);
-        free(cont);
+        /* The frame's own slot is still needed, it's freed with the frame */
+        if (cont->free_slot >= 0 && cont->free_slot != frame_get_swap_slot(cont->kvaddr)) {
+            for (int i = 0; i < cont->npages; i++) {
+                _swap_slot_free(cont->free_slot + i);
+            }
+        }
+        for (int i = 0; i < cont->npages; i++) {
+            frame_unlock_frame(cont->pages[i]);
+        }
+        _swap_out_finish(cont, EFAULT);
         return;
     }
 
     /* Update the page table entries */
-    addrspace_t *as = frame_get_as(cont->kvaddr);
+    addrspace_t *as = cont->as;
     assert(as != NULL);
 
-    seL4_Word vpage = PAGE_ALIGN(frame_get_vaddr(cont->kvaddr));
-    assert(vpage != 0);
-    int x = PT_L1_INDEX(vpage);
-    int y = PT_L2_INDEX(vpage);
+    for (int i = 0; i < cont->npages; i++) {
+        seL4_Word kvaddr = cont->pages[i];
+        seL4_Word vpage = PAGE_ALIGN(frame_get_vaddr(kvaddr));
+        assert(vpage != 0);
+        int x = PT_L1_INDEX(vpage);
+        int y = PT_L2_INDEX(vpage);
 
-    as->as_pd_regs[x][y] = ((cont->free_slot)<<PTE_SWAP_OFFSET) | PTE_IN_USE_BIT | PTE_SWAPPED;
+        if (cont->free_slot >= 0) {
+            as->as_pd_regs[x][y] = ((cont->free_slot + i)<<PTE_SWAP_OFFSET) | PTE_IN_USE_BIT | PTE_SWAPPED;
+        } else {
+            /* File backed page, it'll be read from the file again on the next fault */
+            as->as_pd_regs[x][y] = 0;
+            dec_proc_size(frame_get_pid(kvaddr));
+        }
 
-    /* Update frametable data */
-    frame_unlock_frame(cont->kvaddr);
+        /* Update frametable data, the slot now belongs to the PTE */
+        frame_set_swap_slot(kvaddr, -1);
+        frame_unlock_frame(kvaddr);
+
+        seL4_CPtr kframe_cap;
+        err = frame_get_cap(kvaddr, &kframe_cap);
+        seL4_ARM_Page_Unify_Instruction(kframe_cap, 0, PAGESIZE);
+
+        err = frame_free(kvaddr);
+        if(err){
+            dprintf(3, "frame free error in swap out\n");
+        }
+    }
+
+    _swap_out_finish(cont, 0);
+}
+
+/*
+ * Every page still mapping the copy on write frame gets the slot. Those
+ * whose address space went away meanwhile are off the list already, if none
+ * is left the frame and its copy are just dropped
+ */
+static void
+_swap_out_end_cow(swap_out_cont_t *cont, int err) {
+    seL4_Word kvaddr = cont->kvaddr;
+    int slot = cont->free_slot;
+    int n = frame_get_refcount(kvaddr);
+
+    if (!err && n > 1 && slot != PTE_ZERO_SLOT) {
+        err = _swap_slot_share(slot, n - 1);
+    }
+    if (err) {
+        dprintf(3, "_swap_out_end_cow err\n");
+        /* The frame's own slot is still needed, it's freed with the frame */
+        if (slot >= 0 && slot != frame_get_swap_slot(kvaddr)) {
+            _swap_slot_free(slot);
+        }
+        frame_unlock_frame(kvaddr);
+        if (n == 0) {
+            frame_free(kvaddr);
+        }
+        _swap_out_finish(cont, EFAULT);
+        return;
+    }
+
+    for (frame_mapping_t *m = frame_cow_mappings(kvaddr); m != NULL; m = m->next) {
+        int x = PT_L1_INDEX(m->vpage);
+        int y = PT_L2_INDEX(m->vpage);
+        m->as->as_pd_regs[x][y] = (slot<<PTE_SWAP_OFFSET) | PTE_IN_USE_BIT | PTE_SWAPPED;
+    }
+
+    /* The slot now belongs to the PTEs, if there are any */
+    frame_set_swap_slot(kvaddr, -1);
+    if (n == 0) {
+        _swap_slot_free(slot);
+    }
+    frame_unlock_frame(kvaddr);
 
     seL4_CPtr kframe_cap;
-    err = frame_get_cap(cont->kvaddr, &kframe_cap);
+    err = frame_get_cap(kvaddr, &kframe_cap);
     seL4_ARM_Page_Unify_Instruction(kframe_cap, 0, PAGESIZE);
 
-    err = frame_free(cont->kvaddr);
+    err = frame_free(kvaddr);
     if(err){
         dprintf(3, "frame free error in swap out\n");
     }
 
-    cont->callback(cont->token, 0);
-    free(cont);
+    _swap_out_finish(cont, 0);
+}
+
+/*
+ * The caller is told first so that it gets the frames it waited for, only
+ * then the pages stop being busy and whoever waits on them looks again
+ */
+static void
+_swap_out_finish(swap_out_cont_t *cont, int err) {
+    page_busy_t *busy[SWAP_CLUSTER_PAGES];
+    int npages = cont->npages;
+    page_busy_t **cow_busy = cont->cow_busy;
+    int ncow_busy = cont->ncow_busy;
+    for (int i = 0; i < npages; i++) {
+        busy[i] = cont->busy[i];
+    }
+
+    cont->callback(cont->token, err);
+    slab_free(&_swap_out_slab, cont);
+
+    if (cow_busy != NULL) {
+        _swap_out_unbusy_cow(cow_busy, ncow_busy);
+        return;
+    }
+    for (int i = 0; i < npages; i++) {
+        sos_page_unbusy(busy[i]);
+    }
 }
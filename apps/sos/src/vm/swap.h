@@ -28,10 +28,13 @@ int swap_in(addrspace_t *as, seL4_CapRights rights, seL4_Word vaddr,
  * Perform a swap out for the frame pointed to by kvaddr
  * This is an asynchronous syscall
  * @param kvaddr - The frame that is going to be swapped out
+ * @param pid - the process the frame is evicted for, it is made the current
+ *              process again before the callback. PROC_NULL (e.g. the page
+ *              cleaner) leaves the current process alone
  * @param callback - the function that will be called when swap_out finished
  * @param token - this will be passed unchanged to the callback function
  */
-void swap_out(seL4_Word kvaddr, swap_out_cb_t callback, void *token);
+void swap_out(seL4_Word kvaddr, pid_t pid, swap_out_cb_t callback, void *token);
 
 /*
  * Free the slot in the swap file
@@ -7,14 +7,18 @@
 #include <ut_manager/ut.h>
 #include <strings.h>
 #include <errno.h>
+#include <nfs/nfs.h>
 
 #include "tool/utility.h"
+#include "tool/slab.h"
 #include "vm/vm.h"
 #include "vm/mapping.h"
 #include "vm/vmem_layout.h"
 #include "vm/addrspace.h"
 #include "vm/swap.h"
+#include "vm/sharedpage.h"
 #include "proc/proc.h"
+#include "syscall/reply.h"
 
 #define verbose 0
 #include <sys/debug.h>
@@ -24,6 +28,11 @@
 
 #define RW_BIT    (1<<11)
 
+/* The most a page needs, chunks are NFS_READ_SIZE which is never below NFS_SEND_SIZE */
+#define FILE_CHUNKS_PER_PAGE  ((PAGE_SIZE + NFS_SEND_SIZE - 1) / NFS_SEND_SIZE)
+
+extern bool starting_first_process;
+
 static bool
 _check_segfault(addrspace_t *as, seL4_Word fault_addr, seL4_Word fsr, region_t **reg_ret) {
     if (fault_addr == 0) {
@@ -76,6 +85,15 @@ _set_page_reference(addrspace_t *as, seL4_Word vaddr, uint32_t rights) {
     seL4_Word kvaddr = (as->as_pd_regs[x][y] & PTE_KVADDR_MASK);
     dprintf(3, "mapping back into kvaddr -> 0x%08x, vaddr = 0x%08x\n", kvaddr, vaddr);
 
+    /* Keep clean pages read only so we get to know when they become dirty */
+    if (!frame_is_dirty(kvaddr) && (rights & seL4_CanRead)) {
+        rights &= ~seL4_CanWrite;
+    }
+    /* Copy on write frames are written to only once they are copied */
+    if (frame_is_cow(kvaddr)) {
+        rights &= ~seL4_CanWrite;
+    }
+
     err = frame_get_cap(kvaddr, &kframe_cap);
     //assert(!err); // This kvaddr is ready to use, there should be no error
 
@@ -115,9 +133,20 @@ typedef struct {
     bool is_code;
     region_t* reg;
     pid_t pid;
+    page_busy_t *busy;      // the page we are paging in
 } VMF_cont_t;
 
+static SLAB_CACHE(_vmf_slab, VMF_cont_t);
+
 static void _sos_VMFaultHandler_reply(void* token, int err);
+static void _sos_VMFaultHandler_retry(void* token, int err);
+
+/* Mark the faulting page busy before paging it in */
+static int
+_vmf_busy(VMF_cont_t *cont) {
+    cont->busy = sos_page_busy(cont->as, cont->vaddr);
+    return (cont->busy == NULL) ? ENOMEM : 0;
+}
 
 void
 sos_VMFaultHandler(seL4_CPtr reply_cap, seL4_Word fault_addr, seL4_Word fsr, bool is_code){
@@ -132,7 +161,7 @@ sos_VMFaultHandler(seL4_CPtr reply_cap, seL4_Word fault_addr, seL4_Word fsr, boo
         dprintf(3, "app as is NULL\n");
         /* Kernel is probably failed when bootstraping */
         set_cur_proc(PROC_NULL);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_cap_free(reply_cap);
         return;
     }
 
@@ -143,7 +172,7 @@ sos_VMFaultHandler(seL4_CPtr reply_cap, seL4_Word fault_addr, seL4_Word fsr, boo
         dprintf(3, "vmf: segfault\n");
         proc_destroy(proc_get_id());
         set_cur_proc(PROC_NULL);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_cap_free(reply_cap);
         return;
     }
 
@@ -152,15 +181,14 @@ sos_VMFaultHandler(seL4_CPtr reply_cap, seL4_Word fault_addr, seL4_Word fsr, boo
      * either swapped out has never been mapped in
      */
 
-    VMF_cont_t *cont = malloc(sizeof(VMF_cont_t));
+    VMF_cont_t *cont = slab_alloc(&_vmf_slab);
     if (cont == NULL) {
         dprintf(3, "vmfault out of mem\n");
         /* We cannot handle the fault but the process still can run
          * There will be more faults coming though */
         set_cur_proc(PROC_NULL);
         seL4_MessageInfo_t reply = seL4_MessageInfo_new(0, 0, 0, 0);
-        seL4_Send(reply_cap, reply);
-        cspace_free_slot(cur_cspace, reply_cap);
+        reply_send(reply_cap, reply);
         return;
     }
 
@@ -170,12 +198,29 @@ sos_VMFaultHandler(seL4_CPtr reply_cap, seL4_Word fault_addr, seL4_Word fsr, boo
     cont->is_code   = is_code;
     cont->reg       = reg;
     cont->pid       = proc_get_id();
+    cont->busy      = NULL;
+
+    /* Someone else is paging this page in (e.g. a read into this buffer),
+     * once they're done the process can just fault again if it has to */
+    if (sos_page_is_busy(as, fault_addr)) {
+        dprintf(3, "vmf page is busy\n");
+        err = sos_page_wait(as, fault_addr, _sos_VMFaultHandler_retry, (void*)cont);
+        if (err) {
+            _sos_VMFaultHandler_retry((void*)cont, err);
+        }
+        return;
+    }
 
     /* Check if this page is an new, unmaped page or is it just swapped out */
     if (sos_page_is_inuse(as, fault_addr)) {
         if (sos_page_is_swapped(as, fault_addr)) {
             dprintf(3, "vmf tries to swapin\n");
             /* This page is swapped out, we need to swap it back in */
+            err = _vmf_busy(cont);
+            if (err) {
+                _sos_VMFaultHandler_reply((void*)cont, err);
+                return;
+            }
             err = swap_in(cont->as, cont->reg->rights, cont->vaddr,
                       cont->is_code, _sos_VMFaultHandler_reply, cont);
             if (err) {
@@ -190,6 +235,57 @@ sos_VMFaultHandler(seL4_CPtr reply_cap, seL4_Word fault_addr, seL4_Word fsr, boo
                 return;
             }
 
+            seL4_Word kvaddr;
+            err = sos_get_kvaddr(as, fault_addr, &kvaddr);
+            if (err) {
+                _sos_VMFaultHandler_reply((void*)cont, err);
+                return;
+            }
+            kvaddr = PAGE_ALIGN(kvaddr);
+
+            /* First write to a page that has only been read, copy on write */
+            if ((fsr & RW_BIT) && kvaddr == frame_zero_kvaddr()) {
+                dprintf(3, "vmf giving the page its own frame\n");
+                err = _vmf_busy(cont);
+                if (err) {
+                    _sos_VMFaultHandler_reply((void*)cont, err);
+                    return;
+                }
+                err = sos_page_unzero(cont->pid, as, fault_addr, cont->reg->rights,
+                                      _sos_VMFaultHandler_reply, (void*)cont);
+                if (err) {
+                    _sos_VMFaultHandler_reply((void*)cont, err);
+                }
+                return;
+            }
+
+            /* First write to a frame shared with a cloned process */
+            if ((fsr & RW_BIT) && frame_is_cow(kvaddr)) {
+                dprintf(3, "vmf copying the shared frame\n");
+                err = _vmf_busy(cont);
+                if (err) {
+                    _sos_VMFaultHandler_reply((void*)cont, err);
+                    return;
+                }
+                err = sos_page_uncow(cont->pid, as, fault_addr, cont->reg->rights,
+                                     _sos_VMFaultHandler_reply, (void*)cont);
+                if (err) {
+                    _sos_VMFaultHandler_reply((void*)cont, err);
+                }
+                return;
+            }
+
+            /* If still mapped, this is a write to a clean page we mapped read only */
+            err = sos_page_unmap(as, fault_addr);
+            if (err) {
+                _sos_VMFaultHandler_reply((void*)cont, err);
+                return;
+            }
+            if (fsr & RW_BIT) {
+                dprintf(3, "vmf page becomes dirty\n");
+                frame_set_dirty(kvaddr);
+            }
+
             dprintf(3, "vmf second chance mapping page back in\n");
             err = _set_page_reference(cont->as, cont->vaddr, cont->reg->rights);
             _sos_VMFaultHandler_reply((void*)cont, err);
@@ -198,8 +294,14 @@ sos_VMFaultHandler(seL4_CPtr reply_cap, seL4_Word fault_addr, seL4_Word fsr, boo
     } else {
         /* This page has never been mapped, so do that and return */
         dprintf(3, "vmf tries to map a page\n");
+        err = _vmf_busy(cont);
+        if (err) {
+            _sos_VMFaultHandler_reply((void*)cont, err);
+            return;
+        }
         inc_proc_size_proc(cur_proc());
-        err = sos_page_map(proc_get_id(), as, fault_addr, reg->rights, _sos_VMFaultHandler_reply, (void*)cont, false);
+        err = sos_page_map_region(proc_get_id(), as, reg, fault_addr, (fsr & RW_BIT) != 0,
+                                  _sos_VMFaultHandler_reply, (void*)cont);
         if(err){
             dec_proc_size_proc(cur_proc());
             _sos_VMFaultHandler_reply((void*)cont, err);
@@ -217,12 +319,18 @@ _sos_VMFaultHandler_reply(void* token, int err){
     dprintf(3, "sos_vmf_reply called\n");
 
     VMF_cont_t *cont= (VMF_cont_t*)token;
+    /* The page is paged in, let the others at it */
+    if (cont->busy != NULL) {
+        int gone = sos_page_unbusy(cont->busy);
+        cont->busy = NULL;
+        err = err ? err : gone;
+    }
     if(err){
         dprintf(3, "sos_vmf received an err\n");
     }
     if (!is_proc_alive(cont->pid)) {
-        cspace_free_slot(cur_cspace, cont->reply_cap);
-        free(cont);
+        reply_cap_free(cont->reply_cap);
+        slab_free(&_vmf_slab, cont);
         return;
     }
 
@@ -245,9 +353,296 @@ _sos_VMFaultHandler_reply(void* token, int err){
      * It is either the kernel running out of memory or swapping doesn't work
      */
     seL4_MessageInfo_t reply = seL4_MessageInfo_new(0, 0, 0, 0);
-    seL4_Send(cont->reply_cap, reply);
-    cspace_free_slot(cur_cspace, cont->reply_cap);
-    free(cont);
+    reply_send(cont->reply_cap, reply);
+    slab_free(&_vmf_slab, cont);
     set_cur_proc(PROC_NULL);
 }
 
+/* The page was busy, let the process run into the fault again */
+static void
+_sos_VMFaultHandler_retry(void* token, int err){
+    dprintf(3, "sos_vmf_retry called\n");
+
+    VMF_cont_t *cont= (VMF_cont_t*)token;
+    (void)err;
+    if (!is_proc_alive(cont->pid)) {
+        reply_cap_free(cont->reply_cap);
+        slab_free(&_vmf_slab, cont);
+        return;
+    }
+    seL4_MessageInfo_t reply = seL4_MessageInfo_new(0, 0, 0, 0);
+    reply_send(cont->reply_cap, reply);
+    slab_free(&_vmf_slab, cont);
+    set_cur_proc(PROC_NULL);
+}
+
+
+/**********************************************************************
+ * sos_page_read_file - read part of a file into a frame
+ *********************************************************************/
+
+typedef struct {
+    void *cont;
+    seL4_Word file_offset;  // where the remaining data is in the file
+    size_t offset;          // where the remaining data goes in the page
+    size_t len;             // bytes of this chunk that are not read yet
+} file_chunk_t;
+
+typedef struct {
+    sos_page_read_cb_t callback;
+    void *token;
+    fhandle_t fh;
+    seL4_Word kvaddr;
+    int outstanding;
+    int err;
+    file_chunk_t chunks[FILE_CHUNKS_PER_PAGE];
+} page_read_cont_t;
+
+static SLAB_CACHE(_page_read_slab, page_read_cont_t);
+
+static int _page_read_send_chunk(page_read_cont_t *cont, file_chunk_t *chunk);
+static void _page_read_nfs_read_cb(uintptr_t token, enum nfs_stat status,
+                                   fattr_t *fattr, int count, void *data);
+
+int
+sos_page_read_file(const fhandle_t *fh, seL4_Word file_offset, size_t page_offset,
+                   size_t len, seL4_Word kvaddr, sos_page_read_cb_t callback, void *token) {
+    dprintf(3, "sos_page_read_file, offset = %u, len = %u\n", file_offset, len);
+    if (fh == NULL || page_offset + len > PAGE_SIZE) {
+        return EINVAL;
+    }
+
+    /* Nothing comes from the file, the frame is already zero filled */
+    if (len == 0) {
+        callback(token, 0);
+        return 0;
+    }
+
+    page_read_cont_t *cont = slab_alloc(&_page_read_slab);
+    if (cont == NULL) {
+        return ENOMEM;
+    }
+    cont->callback    = callback;
+    cont->token       = token;
+    cont->kvaddr      = kvaddr;
+    cont->outstanding = 0;
+    cont->err         = 0;
+    /* Keep our own copy, the region could go away before we are done */
+    memcpy(cont->fh.data, fh->data, sizeof(fh->data));
+
+    /* Ask for all the chunks at once */
+    for (int i = 0; i < FILE_CHUNKS_PER_PAGE && len > 0; i++) {
+        file_chunk_t *chunk = &cont->chunks[i];
+        chunk->cont        = cont;
+        chunk->file_offset = file_offset;
+        chunk->offset      = page_offset;
+        chunk->len         = MIN(NFS_READ_SIZE, len);
+        if (_page_read_send_chunk(cont, chunk)) {
+            cont->err = EFAULT;
+            break;
+        }
+        cont->outstanding++;
+        file_offset += chunk->len;
+        page_offset += chunk->len;
+        len         -= chunk->len;
+    }
+
+    if (cont->outstanding == 0) {
+        slab_free(&_page_read_slab, cont);
+        return EFAULT;
+    }
+    return 0;
+}
+
+static int
+_page_read_send_chunk(page_read_cont_t *cont, file_chunk_t *chunk) {
+    /* The reply lands straight in the frame */
+    enum rpc_stat status = nfs_read_into(&cont->fh, chunk->file_offset, chunk->len,
+                                         (void*)(cont->kvaddr + chunk->offset),
+                                         _page_read_nfs_read_cb, (uintptr_t)chunk);
+    return (status == RPC_OK) ? 0 : EFAULT;
+}
+
+static void
+_page_read_nfs_read_cb(uintptr_t token, enum nfs_stat status,
+                       fattr_t *fattr, int count, void *data) {
+    dprintf(3, "_page_read_nfs_read_cb\n");
+    file_chunk_t *chunk = (file_chunk_t*)token;
+    assert(chunk != NULL);
+    page_read_cont_t *cont = (page_read_cont_t*)chunk->cont;
+
+    if (status != NFS_OK || count < 0 || (size_t)count > chunk->len) {
+        cont->err = EFAULT;
+    } else if (!cont->err && count > 0) {
+        chunk->file_offset += count;
+        chunk->offset      += count;
+        chunk->len         -= count;
+
+        /* Short read, get the rest of this chunk */
+        if (chunk->len > 0) {
+            if (_page_read_send_chunk(cont, chunk) == 0) {
+                return;
+            }
+            cont->err = EFAULT;
+        }
+    }
+
+    cont->outstanding--;
+    if (cont->outstanding > 0) {
+        return;
+    }
+
+    cont->callback(cont->token, cont->err);
+    slab_free(&_page_read_slab, cont);
+}
+
+/**********************************************************************
+ * sos_page_map_region - demand paging of file backed regions
+ *********************************************************************/
+
+typedef struct {
+    sos_page_map_cb_t callback;
+    void *token;
+    pid_t pid;
+    addrspace_t *as;
+    region_t *reg;
+    seL4_Word vpage;
+    seL4_Word kvaddr;
+} page_in_cont_t;
+
+static SLAB_CACHE(_page_in_slab, page_in_cont_t);
+
+static void _page_in_mapped(void *token, int err);
+static void _page_in_read_done(void *token, int err);
+static void _page_in_end(page_in_cont_t *cont, int err);
+
+int
+sos_page_map_region(pid_t pid, addrspace_t *as, region_t *reg, seL4_Word vaddr,
+                    bool write, sos_page_map_cb_t callback, void *token) {
+    dprintf(3, "sos_page_map_region, vaddr = 0x%08x\n", vaddr);
+    if (as == NULL || reg == NULL) {
+        return EINVAL;
+    }
+
+    seL4_Word vpage = PAGE_ALIGN(vaddr);
+
+    /* Anonymous memory, a zero filled page will do */
+    if (reg->fh == NULL) {
+        /* and until it's written, everyone can use the same one */
+        if (!write && (reg->rights & seL4_CanRead)) {
+            return sos_page_map_zero(pid, as, vpage, reg->rights, callback, token);
+        }
+        return sos_page_map(pid, as, vpage, reg->rights, callback, token, false);
+    }
+
+    /* Read only file pages are the same for everyone running this file */
+    if (!(reg->rights & seL4_CanWrite)) {
+        return shared_page_map(pid, as, reg, vpage, callback, token);
+    }
+
+    page_in_cont_t *cont = slab_alloc(&_page_in_slab);
+    if (cont == NULL) {
+        return ENOMEM;
+    }
+    cont->callback    = callback;
+    cont->token       = token;
+    cont->pid         = pid;
+    cont->as          = as;
+    cont->reg         = reg;
+    cont->vpage       = vpage;
+    cont->kvaddr      = 0;
+
+    /* The page is clean once loaded, map it read only to catch the first write */
+    uint32_t rights = reg->rights;
+    if (rights & seL4_CanRead) {
+        rights &= ~seL4_CanWrite;
+    }
+
+    int err = sos_page_map(pid, as, vpage, rights, _page_in_mapped, (void*)cont, false);
+    if (err) {
+        slab_free(&_page_in_slab, cont);
+        return err;
+    }
+    return 0;
+}
+
+static void
+_page_in_mapped(void *token, int err) {
+    dprintf(3, "_page_in_mapped\n");
+    page_in_cont_t *cont = (page_in_cont_t*)token;
+
+    if (err) {
+        _page_in_end(cont, err);
+        return;
+    }
+
+    err = sos_get_kvaddr(cont->as, cont->vpage, &cont->kvaddr);
+    if (err) {
+        _page_in_end(cont, err);
+        return;
+    }
+
+    /* Don't let the page be swapped out before the data is in */
+    err = frame_lock_frame(cont->kvaddr);
+    if (err) {
+        cont->kvaddr = 0;
+        _page_in_end(cont, err);
+        return;
+    }
+
+    seL4_Word file_offset;
+    size_t page_offset, len;
+    region_file_range(cont->reg, cont->vpage, &file_offset, &page_offset, &len);
+
+    err = sos_page_read_file(cont->reg->fh, file_offset, page_offset, len,
+                             cont->kvaddr, _page_in_read_done, (void*)cont);
+    if (err) {
+        _page_in_end(cont, err);
+        return;
+    }
+}
+
+static void
+_page_in_read_done(void *token, int err) {
+    dprintf(3, "_page_in_read_done\n");
+    page_in_cont_t *cont = (page_in_cont_t*)token;
+
+    if (!starting_first_process && !is_proc_alive(cont->pid)) {
+        dprintf(3, "_page_in_read_done: process is killed\n");
+        frame_unlock_frame(cont->kvaddr);
+        frame_free(cont->kvaddr);
+        cont->callback(cont->token, EFAULT);
+        slab_free(&_page_in_slab, cont);
+        return;
+    }
+    set_cur_proc(cont->pid);
+
+    _page_in_end(cont, err);
+}
+
+static void
+_page_in_end(page_in_cont_t *cont, int err) {
+    dprintf(3, "_page_in_end\n");
+    if (err) {
+        if (cont->kvaddr) {
+            frame_unlock_frame(cont->kvaddr);
+            sos_page_free(cont->as, cont->vpage);
+        }
+        cont->callback(cont->token, err);
+        slab_free(&_page_in_slab, cont);
+        return;
+    }
+
+    /* The page may hold code */
+    seL4_CPtr kframe_cap;
+    err = frame_get_cap(cont->kvaddr, &kframe_cap);
+    assert(!err); // frame is locked, there should be no error
+    seL4_ARM_Page_Unify_Instruction(kframe_cap, 0, PAGESIZE);
+
+    /* Same as in the file, it can be dropped instead of swapped out */
+    frame_unlock_frame(cont->kvaddr);
+    frame_set_clean(cont->kvaddr);
+
+    cont->callback(cont->token, 0);
+    slab_free(&_page_in_slab, cont);
+}
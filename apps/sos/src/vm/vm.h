@@ -6,6 +6,7 @@
 
 #include "vm/addrspace.h"
 #include "proc/proc.h"
+#include <nfs/nfs.h>
 
 /***********************************************************************
  *
@@ -65,9 +66,122 @@ pid_t frame_get_pid(seL4_Word kvaddr);
 
 seL4_Word frame_get_vaddr(seL4_Word kvaddr);
 
+/*
+ * The zero frame, a frame full of zeros that every anonymous page which has
+ * only been read so far maps read only
+ */
+seL4_Word frame_zero_kvaddr(void);
+
 int frame_set_referenced(seL4_Word kvaddr);
+int frame_set_unreferenced(seL4_Word kvaddr);
 bool is_frame_referenced(seL4_Word kvaddr);
 
+/*
+ * Dirty tracking. A frame is clean while it has an identical copy elsewhere,
+ * either in its swap slot or in the file backing its region. A clean frame
+ * can be evicted without writing it back. New frames are dirty.
+ *
+ * frame_set_dirty     - Mark the frame as modified
+ * frame_set_clean     - Mark the frame as having a copy in swap or in a file
+ * frame_is_dirty      - Check if the frame has to be written to swap on eviction
+ * frame_set_swap_slot - Record the swap slot holding a copy of the frame, or
+ *                       -1 to forget it (the slot is not freed in that case)
+ * frame_get_swap_slot - Get the swap slot recorded for the frame, or -1
+ */
+int frame_set_dirty(seL4_Word kvaddr);
+int frame_set_clean(seL4_Word kvaddr);
+bool frame_is_dirty(seL4_Word kvaddr);
+int frame_set_swap_slot(seL4_Word kvaddr, int slot);
+int frame_get_swap_slot(seL4_Word kvaddr);
+
+/*
+ * Shared frames, used by the shared page cache (sharedpage.c).
+ *
+ * frame_set_shared    - Turn an allocated frame into a shared one. It loses its
+ *                       owner and becomes evictable, see shared_page_evict
+ * frame_is_shared     - Check if the frame is shared
+ * frame_inc_refcount  - Count one more mapping of the frame, returns the new count
+ * frame_dec_refcount  - Count one less mapping of the frame, returns the new count
+ */
+int frame_set_shared(seL4_Word kvaddr);
+bool frame_is_shared(seL4_Word kvaddr);
+int frame_inc_refcount(seL4_Word kvaddr);
+int frame_dec_refcount(seL4_Word kvaddr);
+
+/*
+ * Frames of the file page cache (pagecache.c).
+ *
+ * frame_set_cached    - Hand an allocated frame to the page cache. It loses its
+ *                       owner and becomes evictable, see page_cache_evict
+ * frame_is_cached     - Check if the frame is in the page cache
+ */
+int frame_set_cached(seL4_Word kvaddr);
+bool frame_is_cached(seL4_Word kvaddr);
+
+/*
+ * Copy on write frames, mapped read only by address spaces cloned from each
+ * other (see as_clone). The frame keeps a list of the pages mapping it so
+ * that eviction can find them, the refcount is the length of that list.
+ *
+ * frame_set_cow       - Start sharing a private frame, its owner is the first
+ *                       mapping. ENOMEM if the mapping can't be recorded
+ * frame_cow_map       - Record that page *vaddr* of *as* (process *pid*) maps
+ *                       the frame too
+ * frame_cow_unmap     - Forget that page *vaddr* of *as* maps the frame,
+ *                       returns the # of mappings left or -1
+ * frame_cow_mappings  - Get the list of pages mapping the frame
+ * frame_clear_cow     - Hand the frame to the last page mapping it, *as*, *vaddr*
+ *                       and *pid* become its owner again
+ * frame_is_cow        - Check if the frame is copy on write
+ * frame_get_refcount  - Get the # of mappings of a shared or copy on write frame
+ */
+typedef struct frame_mapping frame_mapping_t;
+struct frame_mapping {
+    pid_t pid;
+    addrspace_t *as;
+    seL4_Word vpage;
+    frame_mapping_t *next;
+};
+
+int frame_set_cow(seL4_Word kvaddr);
+int frame_cow_map(seL4_Word kvaddr, addrspace_t *as, seL4_Word vaddr, pid_t pid);
+int frame_cow_unmap(seL4_Word kvaddr, addrspace_t *as, seL4_Word vaddr);
+frame_mapping_t *frame_cow_mappings(seL4_Word kvaddr);
+int frame_clear_cow(seL4_Word kvaddr, addrspace_t *as, seL4_Word vaddr, pid_t pid);
+bool frame_is_cow(seL4_Word kvaddr);
+int frame_get_refcount(seL4_Word kvaddr);
+
+/*
+ * Start the background page cleaner. It periodically swaps out frames so
+ * that frame_alloc usually finds a free frame without waiting on swap_out.
+ * Swapping must be possible when this is called (i.e. NFS is up)
+ */
+void frame_cleaner_start(void);
+
+/*
+ * Set the free frame watermarks of the page cleaner. It starts evicting
+ * when the number of free frames drops below *low* and stops at *high*
+ *
+ * Returns 0 iff successful
+ */
+int frame_set_watermarks(size_t low, size_t high);
+
+typedef struct {
+    size_t nfree;           // # of frames currently free
+    size_t low_watermark;
+    size_t high_watermark;
+    uint32_t alloc_hits;    // frame_alloc served from the free list
+    uint32_t alloc_misses;  // frame_alloc had to swap out a frame first
+    uint32_t cleaned;       // frames freed by the page cleaner
+    size_t inflight;        // evictions the page cleaner is waiting on
+    size_t ncow;            // copy on write frames
+} frame_stats_t;
+
+/*
+ * Get a snapshot of the frame table statistics
+ */
+void frame_get_stats(frame_stats_t *stats);
+
 /***********************************************************************
  *
  * Function(s) in vm.c
@@ -80,4 +194,27 @@ bool is_frame_referenced(seL4_Word kvaddr);
  */
 void sos_VMFaultHandler(seL4_CPtr reply, seL4_Word fault_addr, seL4_Word fsr, bool is_code);
 
+/*
+ * Read *len* bytes of the file *fh* at *file_offset* into the frame *kvaddr*,
+ * at *page_offset* in the frame. The frame must not go away while this is
+ * going on (lock it or make it noswap). The callback gets 0 iff successful
+ * This is an asynchronous function
+ * Returns 0 if succesfully register callback
+ */
+typedef void (*sos_page_read_cb_t)(void *token, int err);
+int sos_page_read_file(const fhandle_t *fh, seL4_Word file_offset, size_t page_offset,
+                       size_t len, seL4_Word kvaddr, sos_page_read_cb_t callback, void *token);
+
+/*
+ * Map in a page of region *reg* that has never been touched. If the region
+ * is backed by a file, the page content is read from the file, otherwise it
+ * is zero filled. Anonymous pages that are only being read (WRITE is false)
+ * get the zero frame until their first write
+ * This is an asynchronous function and will return by calling the call back
+ * function
+ * Returns 0 if succesfully register callback
+ */
+int sos_page_map_region(pid_t pid, addrspace_t *as, region_t *reg, seL4_Word vaddr,
+                        bool write, sos_page_map_cb_t callback, void *token);
+
 #endif /* _LIBOS_VM_H_ */
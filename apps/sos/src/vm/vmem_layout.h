@@ -37,6 +37,11 @@
 #define PROCESS_STACK_SIZE  (1<<24)
 
 #define PROCESS_IPC_BUFFER  (0xA0000000)
+/* The I/O buffer shared with SOS, see vm/iobuf.h */
+#define PROCESS_IO_BUFFER   (0xA0100000)
+#define PROCESS_IO_BUFFER_PAGES (16)
+/* The syscall ring shared with SOS, see syscall/ring.h */
+#define PROCESS_RING        (0xA0200000)
 #define PROCESS_VMEM_START  (0xC0000000)
 
 #define PROCESS_SCRATCH     (0xD0000000)
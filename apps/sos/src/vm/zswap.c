@@ -0,0 +1,426 @@
+#include <autoconf.h>
+
+#ifdef CONFIG_SOS_ZSWAP
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <sel4/sel4.h>
+#include <nfs/nfs.h>
+
+#include "tool/utility.h"
+#include "tool/lz.h"
+#include "vm/vm.h"
+#include "vm/swap.h"
+#include "vm/zswap.h"
+
+#define verbose 0
+#include <sys/debug.h>
+
+#ifdef CONFIG_SOS_ZSWAP_FRAMES
+#define ZSWAP_FRAMES            (CONFIG_SOS_ZSWAP_FRAMES)
+#else
+#define ZSWAP_FRAMES            (4)
+#endif
+
+/* Pool frames are handed out in units, tracked by one bit each */
+#define ZSWAP_UNIT              (64)
+#define ZSWAP_UNITS_PER_FRAME   (PAGE_SIZE / ZSWAP_UNIT)    // 64, one uint64_t
+/* Pages that don't compress better than this go straight to the swap file */
+#define ZSWAP_MAX_SIZE          (PAGE_SIZE * 3 / 4)
+#define ZSWAP_BUCKETS           (64)
+/* # of pages written back to the swap file each time the pool fills up */
+#define ZSWAP_WRITEBACK_BATCH   (8)
+#define ZSWAP_CHUNKS_PER_PAGE   ((PAGE_SIZE + NFS_SEND_SIZE - 1) / NFS_SEND_SIZE)
+
+extern fhandle_t *swap_fh;
+
+typedef struct zswap_entry zswap_entry_t;
+struct zswap_entry {
+    int slot;
+    int frame;                  // index of the pool frame holding the data
+    int unit;                   // first unit of the data in that frame
+    int nunits;
+    size_t len;                 // compressed size
+    bool writeback;             // being written to the swap file
+    bool stale;                 // dropped from the pool during its writeback
+    zswap_entry_t *next;        // hash chain
+    zswap_entry_t *lru_prev;    // most recently stored first
+    zswap_entry_t *lru_next;
+};
+
+typedef struct {
+    seL4_Word kvaddr;
+    uint64_t used;              // bit i is set iff unit i is used
+} zswap_frame_t;
+
+static zswap_frame_t _pool[ZSWAP_FRAMES];
+static int _npool;
+static zswap_entry_t *_buckets[ZSWAP_BUCKETS];
+static zswap_entry_t *_lru_head;
+static zswap_entry_t *_lru_tail;
+
+/*
+ * Compression output and writeback staging. Every use of it is synchronous
+ * (nfs_write copies the data) so one is enough
+ */
+static uint8_t _scratch[PAGE_SIZE];
+
+static uint32_t _stored;
+static uint32_t _rejected;
+static uint32_t _loaded;
+static uint32_t _written_back;
+
+/***********************************************************************
+ * Pool and index helpers
+ ***********************************************************************/
+
+static uint64_t
+_units_mask(int unit, int nunits) {
+    uint64_t mask = (nunits == 64) ? ~(uint64_t)0 : (((uint64_t)1 << nunits) - 1);
+    return mask << unit;
+}
+
+static int
+_zswap_alloc_units(int nunits, int *frame, int *unit) {
+    for (int f = 0; f < _npool; f++) {
+        for (int u = 0; u + nunits <= ZSWAP_UNITS_PER_FRAME; u++) {
+            uint64_t mask = _units_mask(u, nunits);
+            if ((_pool[f].used & mask) == 0) {
+                _pool[f].used |= mask;
+                *frame = f;
+                *unit  = u;
+                return 0;
+            }
+        }
+    }
+    return ENOSPC;
+}
+
+static void
+_zswap_grow_cb(void *token, seL4_Word kvaddr) {
+    (void)token;
+    if (kvaddr == 0 || _npool == ZSWAP_FRAMES) {
+        if (kvaddr) {
+            frame_free(kvaddr);
+        }
+        return;
+    }
+    _pool[_npool].kvaddr = kvaddr;
+    _pool[_npool].used   = 0;
+    _npool++;
+    dprintf(3, "zswap: pool grown to %d frames\n", _npool);
+}
+
+/*
+ * Add a frame to the pool if one is free. We are in the middle of an
+ * eviction here, so never make frame_alloc evict for us
+ */
+static bool
+_zswap_grow(void) {
+    if (_npool == ZSWAP_FRAMES || !frame_has_free()) {
+        return false;
+    }
+    int n = _npool;
+    if (frame_alloc(0, NULL, PROC_NULL, true, _zswap_grow_cb, NULL)) {
+        return false;
+    }
+    return _npool > n;
+}
+
+static zswap_entry_t*
+_zswap_lookup(int slot) {
+    zswap_entry_t *e = _buckets[(uint32_t)slot % ZSWAP_BUCKETS];
+    while (e != NULL && e->slot != slot) {
+        e = e->next;
+    }
+    return e;
+}
+
+/* Take the entry out of the index and the LRU list, it can't be found anymore */
+static void
+_zswap_unlink(zswap_entry_t *entry) {
+    zswap_entry_t **pp = &_buckets[(uint32_t)entry->slot % ZSWAP_BUCKETS];
+    while (*pp != entry) {
+        pp = &(*pp)->next;
+    }
+    *pp = entry->next;
+
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        _lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        _lru_tail = entry->lru_prev;
+    }
+}
+
+static void
+_zswap_free_entry(zswap_entry_t *entry) {
+    _pool[entry->frame].used &= ~_units_mask(entry->unit, entry->nunits);
+    free(entry);
+}
+
+static void*
+_zswap_data(zswap_entry_t *entry) {
+    return (void*)(_pool[entry->frame].kvaddr + entry->unit * ZSWAP_UNIT);
+}
+
+/***********************************************************************
+ * Writeback to the swap file
+ ***********************************************************************/
+
+typedef struct {
+    void *cont;
+    size_t offset;
+    size_t len;
+} zswap_chunk_t;
+
+typedef struct {
+    zswap_entry_t *entry;
+    int outstanding;
+    int err;
+    zswap_chunk_t chunks[ZSWAP_CHUNKS_PER_PAGE];
+} zswap_wb_cont_t;
+
+static void _zswap_wb_nfs_write_cb(uintptr_t token, enum nfs_stat status,
+                                   fattr_t *fattr, int count);
+static void _zswap_wb_end(zswap_wb_cont_t *cont);
+
+static int
+_zswap_wb_send_chunk(zswap_chunk_t *chunk) {
+    zswap_wb_cont_t *cont = (zswap_wb_cont_t*)chunk->cont;
+    /* Stable like the swap out writes, the entry is dropped once it's written */
+    enum rpc_stat status = nfs_write_flags(swap_fh, cont->entry->slot * PAGE_SIZE + chunk->offset,
+                                           chunk->len, _scratch + chunk->offset, 0,
+                                           _zswap_wb_nfs_write_cb, (uintptr_t)chunk);
+    return (status == RPC_OK) ? 0 : EFAULT;
+}
+
+static int
+_zswap_unpack(zswap_entry_t *entry, void *dst) {
+    int len = lz_decompress(_zswap_data(entry), entry->len, dst, PAGE_SIZE);
+    return (len == PAGE_SIZE) ? 0 : EFAULT;
+}
+
+static void
+_zswap_wb_start(zswap_entry_t *entry) {
+    zswap_wb_cont_t *cont = malloc(sizeof(zswap_wb_cont_t));
+    if (cont == NULL) {
+        return;
+    }
+    cont->entry       = entry;
+    cont->outstanding = 0;
+    cont->err         = 0;
+    entry->writeback  = true;
+
+    if (_zswap_unpack(entry, _scratch)) {
+        cont->err = EFAULT;
+        _zswap_wb_end(cont);
+        return;
+    }
+    size_t size = NFS_WRITE_SIZE;
+    for (int i = 0; i * size < PAGE_SIZE; i++) {
+        zswap_chunk_t *chunk = &cont->chunks[i];
+        chunk->cont   = cont;
+        chunk->offset = i * size;
+        chunk->len    = MIN(size, PAGE_SIZE - chunk->offset);
+        if (_zswap_wb_send_chunk(chunk)) {
+            cont->err = EFAULT;
+            break;
+        }
+        cont->outstanding++;
+    }
+
+    if (cont->outstanding == 0) {
+        cont->err = EFAULT;
+        _zswap_wb_end(cont);
+    }
+}
+
+static void
+_zswap_wb_nfs_write_cb(uintptr_t token, enum nfs_stat status, fattr_t *fattr, int count) {
+    zswap_chunk_t *chunk = (zswap_chunk_t*)token;
+    assert(chunk != NULL);
+    zswap_wb_cont_t *cont = (zswap_wb_cont_t*)chunk->cont;
+
+    if (status != NFS_OK || count <= 0 || (size_t)count > chunk->len) {
+        cont->err = EFAULT;
+    } else if (!cont->err) {
+        chunk->offset += (size_t)count;
+        chunk->len    -= (size_t)count;
+
+        /* The rest of this chunk has to come out of the pool again */
+        if (chunk->len > 0) {
+            if (_zswap_unpack(cont->entry, _scratch) == 0 &&
+                    _zswap_wb_send_chunk(chunk) == 0) {
+                return;
+            }
+            cont->err = EFAULT;
+        }
+    }
+
+    cont->outstanding--;
+    if (cont->outstanding > 0) {
+        return;
+    }
+    _zswap_wb_end(cont);
+}
+
+static void
+_zswap_wb_end(zswap_wb_cont_t *cont) {
+    zswap_entry_t *entry = cont->entry;
+    int err = cont->err;
+    free(cont);
+
+    if (entry->stale) {
+        /* The slot was freed while we were writing it, it can be reused now */
+        int slot = entry->slot;
+        _zswap_free_entry(entry);
+        swap_free_slot(slot);
+        return;
+    }
+
+    entry->writeback = false;
+    if (err) {
+        /* Still in the pool, it'll be tried again */
+        dprintf(3, "zswap: writeback of slot %d failed\n", entry->slot);
+        return;
+    }
+
+    /* The swap file has it now */
+    _zswap_unlink(entry);
+    _zswap_free_entry(entry);
+    _written_back++;
+}
+
+/* Write back the oldest pages of the pool to make room */
+static void
+_zswap_writeback(void) {
+    if (swap_fh == NULL) {
+        return;
+    }
+    int n = 0;
+    zswap_entry_t *entry = _lru_tail;
+    while (entry != NULL && n < ZSWAP_WRITEBACK_BATCH) {
+        zswap_entry_t *prev = entry->lru_prev;
+        if (!entry->writeback) {
+            _zswap_wb_start(entry);
+            n++;
+        }
+        entry = prev;
+    }
+    dprintf(3, "zswap: writing back %d pages, stored = %u, rejected = %u, "
+            "loaded = %u, written back = %u\n", n, _stored, _rejected, _loaded, _written_back);
+}
+
+/***********************************************************************
+ * Interface
+ ***********************************************************************/
+
+int
+zswap_store(int slot, seL4_Word kvaddr) {
+    /* Whatever the pool had for this slot is out of date */
+    zswap_invalidate(slot);
+
+    size_t len = lz_compress((void*)kvaddr, PAGE_SIZE, _scratch, ZSWAP_MAX_SIZE);
+    if (len == 0) {
+        _rejected++;
+        return EFBIG;
+    }
+
+    int nunits = (len + ZSWAP_UNIT - 1) / ZSWAP_UNIT;
+    int frame, unit;
+    if (_zswap_alloc_units(nunits, &frame, &unit)) {
+        if (!_zswap_grow()) {
+            /* The pool is full, make room for the next ones */
+            _zswap_writeback();
+            return ENOSPC;
+        }
+        /* Growing may have started an eviction, which used the scratch buffer */
+        len = lz_compress((void*)kvaddr, PAGE_SIZE, _scratch, ZSWAP_MAX_SIZE);
+        nunits = (len + ZSWAP_UNIT - 1) / ZSWAP_UNIT;
+        if (len == 0 || _zswap_alloc_units(nunits, &frame, &unit)) {
+            return ENOSPC;
+        }
+    }
+
+    zswap_entry_t *entry = malloc(sizeof(zswap_entry_t));
+    if (entry == NULL) {
+        _pool[frame].used &= ~_units_mask(unit, nunits);
+        return ENOMEM;
+    }
+    entry->slot      = slot;
+    entry->frame     = frame;
+    entry->unit      = unit;
+    entry->nunits    = nunits;
+    entry->len       = len;
+    entry->writeback = false;
+    entry->stale     = false;
+    memcpy(_zswap_data(entry), _scratch, len);
+
+    zswap_entry_t **bucket = &_buckets[(uint32_t)slot % ZSWAP_BUCKETS];
+    entry->next = *bucket;
+    *bucket = entry;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = _lru_head;
+    if (_lru_head != NULL) {
+        _lru_head->lru_prev = entry;
+    } else {
+        _lru_tail = entry;
+    }
+    _lru_head = entry;
+
+    _stored++;
+    dprintf(3, "zswap: stored slot %d in %u bytes\n", slot, len);
+    return 0;
+}
+
+int
+zswap_load(int slot, seL4_Word kvaddr) {
+    zswap_entry_t *entry = _zswap_lookup(slot);
+    if (entry == NULL) {
+        return ENOENT;
+    }
+    if (_zswap_unpack(entry, (void*)kvaddr)) {
+        dprintf(3, "zswap: slot %d is corrupted\n", slot);
+        return EFAULT;
+    }
+    _loaded++;
+    return 0;
+}
+
+bool
+zswap_has(int slot) {
+    return _zswap_lookup(slot) != NULL;
+}
+
+bool
+zswap_is_busy(int slot) {
+    zswap_entry_t *entry = _zswap_lookup(slot);
+    return entry != NULL && entry->writeback;
+}
+
+bool
+zswap_invalidate(int slot) {
+    zswap_entry_t *entry = _zswap_lookup(slot);
+    if (entry == NULL) {
+        return false;
+    }
+    _zswap_unlink(entry);
+    if (entry->writeback) {
+        entry->stale = true;
+        return true;
+    }
+    _zswap_free_entry(entry);
+    return false;
+}
+
+#endif /* CONFIG_SOS_ZSWAP */
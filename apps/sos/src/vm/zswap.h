@@ -0,0 +1,53 @@
+#ifndef _LIBOS_ZSWAP_H_
+#define _LIBOS_ZSWAP_H_
+
+#include <autoconf.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sel4/sel4.h>
+
+/*
+ * Compressed swap cache. Evicted pages are compressed into a small pool of
+ * frames, keyed by the swap slot they were given, and only reach the swap
+ * file when the pool fills up and its oldest pages are written back.
+ * A swapped page is therefore either in the pool or in the swap file.
+ */
+
+#ifdef CONFIG_SOS_ZSWAP
+
+/*
+ * Compress the page at KVADDR into the pool as the content of SLOT
+ * Returns 0 on success, otherwise the page has to go to the swap file
+ */
+int zswap_store(int slot, seL4_Word kvaddr);
+
+/*
+ * Decompress the content of SLOT into the page at KVADDR
+ * Returns 0 on success or ENOENT if SLOT is not in the pool
+ */
+int zswap_load(int slot, seL4_Word kvaddr);
+
+/* Is the content of SLOT in the pool? */
+bool zswap_has(int slot);
+
+/* Is SLOT being written back to the swap file at the moment? */
+bool zswap_is_busy(int slot);
+
+/*
+ * Drop the content of SLOT from the pool. Returns true if the slot is still
+ * being written back, it is then freed by the pool once that is done and
+ * must not be given out again before
+ */
+bool zswap_invalidate(int slot);
+
+#else
+
+static inline int zswap_store(int slot, seL4_Word kvaddr) { return ENOSYS; }
+static inline int zswap_load(int slot, seL4_Word kvaddr) { return ENOENT; }
+static inline bool zswap_has(int slot) { return false; }
+static inline bool zswap_is_busy(int slot) { return false; }
+static inline bool zswap_invalidate(int slot) { return false; }
+
+#endif /* CONFIG_SOS_ZSWAP */
+
+#endif /* _LIBOS_ZSWAP_H_ */
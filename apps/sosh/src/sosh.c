@@ -17,6 +17,7 @@
 #include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <time.h>
 #include <sys/time.h>
 #include <utils/time.h>
@@ -111,6 +112,105 @@ static int cp(int argc, char **argv) {
     return 0;
 }
 
+#define RING_TEST_LEN   1024
+#define RING_TEST_SLEEP 100
+
+enum { RING_TEST_READ = 1, RING_TEST_WRITE, RING_TEST_SLEEP_ID };
+
+/* Copy the start of a file with a linked read and write on the syscall
+ * ring, with a sleep running next to them */
+static int ringtest(int argc, char **argv) {
+    static char buf[RING_TEST_LEN];
+    sos_sqe_t *sqe;
+    sos_cqe_t cqe;
+    int fd, fd_out, i;
+    int read_res = 0, write_res = 0, sleep_res = 0;
+    int ret = 0;
+
+    if (argc != 3) {
+        printf("Usage: ringtest from to\n");
+        return 1;
+    }
+
+    fd = open(argv[1], O_RDONLY);
+    fd_out = open(argv[2], O_WRONLY);
+    if (fd < 0 || fd_out < 0) {
+        printf("ringtest: failed to open files\n");
+        return 1;
+    }
+    if (sos_ring_setup()) {
+        printf("ringtest: failed to set up the ring\n");
+        close(fd);
+        close(fd_out);
+        return 1;
+    }
+
+    sqe = sos_ring_get_sqe();
+    sqe->op        = SOS_RING_READ;
+    sqe->flags     = SOS_RING_LINK;
+    sqe->fd        = fd;
+    sqe->addr      = (uint32_t)buf;
+    sqe->len       = RING_TEST_LEN;
+    sqe->user_data = RING_TEST_READ;
+
+    sqe = sos_ring_get_sqe();
+    sqe->op        = SOS_RING_WRITE;
+    sqe->fd        = fd_out;
+    sqe->addr      = (uint32_t)buf;
+    sqe->len       = RING_TEST_LEN;
+    sqe->user_data = RING_TEST_WRITE;
+
+    sqe = sos_ring_get_sqe();
+    sqe->op        = SOS_RING_SLEEP;
+    sqe->len       = RING_TEST_SLEEP;
+    sqe->user_data = RING_TEST_SLEEP_ID;
+
+    if (sos_ring_submit() != 3) {
+        printf("ringtest: submit failed\n");
+        close(fd);
+        close(fd_out);
+        return 1;
+    }
+
+    for (i = 0; i < 3; i++) {
+        sos_ring_wait_cqe(&cqe);
+        printf("ringtest: completion %u, res = %d\n",
+                (unsigned)cqe.user_data, (int)cqe.res);
+        switch (cqe.user_data) {
+        case RING_TEST_READ:
+            read_res = cqe.res;
+            break;
+        case RING_TEST_WRITE:
+            write_res = cqe.res;
+            break;
+        case RING_TEST_SLEEP_ID:
+            sleep_res = cqe.res;
+            break;
+        default:
+            printf("ringtest: unexpected completion\n");
+            ret = 1;
+        }
+    }
+
+    /* The write only runs if the read filled the buffer */
+    if (read_res == RING_TEST_LEN && write_res != RING_TEST_LEN) {
+        printf("ringtest: linked write got %d\n", write_res);
+        ret = 1;
+    } else if (read_res != RING_TEST_LEN && write_res != -ECANCELED) {
+        printf("ringtest: short read but write was not cancelled\n");
+        ret = 1;
+    }
+    if (sleep_res != 0) {
+        printf("ringtest: sleep got %d\n", sleep_res);
+        ret = 1;
+    }
+
+    close(fd);
+    close(fd_out);
+    printf("ringtest %s\n", ret ? "failed" : "passed");
+    return ret;
+}
+
 #define MAX_PROCESSES 10
 
 static int ps(int argc, char **argv) {
@@ -278,6 +378,34 @@ static uint64_t getmicro_time() {
     return micros;
 }
 
+static int vmstat(int argc, char **argv) {
+    sos_vm_stat_t stat;
+
+    if (argc != 1) {
+        printf("Usage: vmstat\n");
+        return 1;
+    }
+
+    if (sos_vm_stat(&stat)) {
+        printf("vmstat: failed\n");
+        return 1;
+    }
+    printf("free frames     %u\n", stat.nfree);
+    printf("watermarks      %u %u\n", stat.low_watermark, stat.high_watermark);
+    printf("alloc hits      %u\n", stat.alloc_hits);
+    printf("alloc misses    %u\n", stat.alloc_misses);
+    printf("cleaned         %u\n", stat.cleaned);
+    printf("cleaning        %u\n", stat.inflight);
+    printf("cow frames      %u\n", stat.ncow);
+    return 0;
+}
+
+static int slabstat(int argc, char **argv) {
+    sos_slab_stat();
+    printf("slab statistics printed on the sos console\n");
+    return 0;
+}
+
 static int whoami(int argc, char **argv) {
     pid_t pid;
 
@@ -295,7 +423,8 @@ struct command commands[] = { { "dir", dir }, { "ls", dir }, { "cat", cat },
     { "cp", cp }, { "ps", ps }, { "exec", exec }, {"sleep",second_sleep},
     {"msleep",milli_sleep}, {"time", second_time}, {"mtime", micro_time},
     {"kill", kill}, {"bm", benchmark}, {"bm2", benchmark2}, {"thrash", thrash},
-    {"whoami", whoami} };
+    {"whoami", whoami}, {"ringtest", ringtest}, {"vmstat", vmstat},
+    {"slabstat", slabstat} };
 
 static void test_file_syscalls(void) {
     printf("Start file syscalls test...\n");
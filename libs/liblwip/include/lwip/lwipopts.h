@@ -32,6 +32,8 @@
 #ifndef __LWIPOPTS_H__
 #define __LWIPOPTS_H__
 
+#include <autoconf.h>
+
 /* Prevent having to link sys_arch.c (we don't test the API layers in unit tests) */
 #define NO_SYS                          1
 #ifndef NO_SYS_NO_TIMERS
@@ -44,12 +46,17 @@
 #define MEM_LIBC_MALLOC                 1
 #define MEMP_MEM_MALLOC                 1
 
-/* Minimal changes to opt.h required for tcp unit tests: */
 #define MEM_SIZE                        16000
-#define TCP_SND_QUEUELEN                40
+
+#ifdef CONFIG_SOS_NFS_TCP
+/* NFS over TCP: full size segments and windows large enough for 32k reads
+ * and writes to stream. The queue holds the pbufs of non-copy writes */
+#define TCP_MSS                         1460
+#define TCP_WND                         (40 * TCP_MSS)
+#define TCP_SND_BUF                     (32 * TCP_MSS)
+#define TCP_SND_QUEUELEN                (4 * TCP_SND_BUF / TCP_MSS)
 #define MEMP_NUM_TCP_SEG                TCP_SND_QUEUELEN
-#define TCP_SND_BUF                     (12 * TCP_MSS)
-#define TCP_WND                         (10 * TCP_MSS)
+#endif
 
 /* Minimal changes to opt.h required for etharp unit tests: */
 #define ETHARP_SUPPORT_STATIC_ENTRIES   1
@@ -14,15 +14,22 @@
  *
  * @brief  Network File System (NFS) client
  *
- * This library implements a wrapper around the NFS version 2 RPC specification.
- * The application is provided with calls to mount a file system on a remote
- * host and manipulate the files contained within.
+ * This library implements a wrapper around the NFS version 2 and version 3
+ * RPC specifications. The application is provided with calls to mount a file
+ * system on a remote host and manipulate the files contained within.
+ *
+ * Version 3 is used when the server offers it, version 2 otherwise, see
+ * @ref nfs_version. The calls are the same for both. Version 3 adds unstable
+ * writes (@ref NFS_WRITE_UNSTABLE and @ref nfs_commit) and directory listings
+ * with the handles and attributes of the entries (@ref nfs_readdirplus).
  *
  * The UDP protocol stack provided by the LWIP library is used for all network
  * traffic. Reliable transport is assured through unique transaction IDs (XIDs)
  * and selective retransmission. Transactions that are sent to the server are 
  * held in a local transaction list until a response is received. Periodic
  * calls to @ref nfs_timeout will trigger retransmissions as necessary.
+ * A mount may instead send the calls over TCP (@ref NFS_MOUNT_TCP), as RPC
+ * records on a single connection.
  *
  * This library requires that the server be hosting the UDP time protocol. The
  * time of day is used to encourage the generation of unique transaction
@@ -51,8 +58,10 @@
 #include <stdint.h>
 #include <lwip/ip_addr.h>
 
-/// The size in bytes of the opaque file handle.
+/// The size in bytes of the opaque file handle of NFS version 2.
 #define FHSIZE       32
+/// The maximum size in bytes of the opaque file handle of NFS version 3.
+#define FHSIZE3      64
 /// The maximum number of bytes in a file name argument.
 #define MAXNAMLEN   255
 /// The maximum number of bytes in a pathname argument.
@@ -113,8 +122,24 @@ typedef enum nfs_stat {
     NFSERR_STALE       = 70,
 /// The servers write cache used in the "WRITECACHE" call got flushed to disk.
     NFSERR_WFLUSH      = 99,
+/// (v3) Invalid file handle.
+    NFSERR_BADHANDLE   = 10001,
+/// (v3) The cookie of a directory listing is no longer valid.
+    NFSERR_BAD_COOKIE  = 10003,
+/// (v3) The operation is not supported.
+    NFSERR_NOTSUPP     = 10004,
+/// (v3) The buffer or request is too small.
+    NFSERR_TOOSMALL    = 10005,
+/// (v3) An error occurred on the server which does not map to any of the
+/// other errors.
+    NFSERR_SERVERFAULT = 10006,
+/// (v3) The server is busy, try again later.
+    NFSERR_JUKEBOX     = 10008,
 /// A communication error occurred at the RPC layer.
-    NFSERR_COMM       = 200 
+    NFSERR_COMM       = 200,
+/// (v3) The server restarted since unstable writes were made to the file,
+/// @ref nfs_commit could not make them stable. They have to be written again.
+    NFSERR_VERF       = 201
 } nfs_stat_t;
 
 /**
@@ -140,9 +165,12 @@ typedef enum rpc_stat {
  * client.  All file operations are done using file handles to refer
  * to a file or directory.  The file handle can contain whatever
  * information the server needs to distinguish an individual file.
+ * Version 3 handles vary in length, the library keeps the length after the
+ * handle and zeroes what's unused, so that handles can still be copied and
+ * compared as a whole.
  */
 typedef struct fhandle {
-    char data[FHSIZE];
+    char data[FHSIZE3 + sizeof(uint32_t)];
 } fhandle_t;
 
 
@@ -174,6 +202,8 @@ typedef struct timeval {
 
 /**
  * The "fattr" structure contains the attributes of a file.
+ * With NFS version 3 the server may leave the attributes out of the reply to
+ * a lookup, create, read or write, they are then all 0 (type NFNON).
  */
 typedef struct fattr {
 /// The type of the file.
@@ -324,6 +354,28 @@ typedef void (*nfs_readdir_cb_t)(uintptr_t token, enum nfs_stat status,
                                  int num_files, char* file_names[],
                                  nfscookie_t nfscookie);
 
+/**
+ * A call back function provided by the caller of @ref nfs_readdirplus,
+ * executed once a response is received. It is the same as
+ * @ref nfs_readdir_cb_t but also has the handle and the attributes of each
+ * entry. The server may leave them out for an entry in which case that
+ * entry of "fhs" or "fattrs" is NULL, they always are with NFS version 2.
+ * Their contents will be invalid once this call back returns.
+ */
+typedef void (*nfs_readdirplus_cb_t)(uintptr_t token, enum nfs_stat status,
+                                     int num_files, char* file_names[],
+                                     fhandle_t* fhs[], fattr_t* fattrs[],
+                                     nfscookie_t nfscookie);
+
+/**
+ * A call back function provided by the caller of @ref nfs_commit, executed
+ * once a response is received.
+ * @param[in] token  The unmodified token provided to the @ref nfs_commit call.
+ * @param[in] status The NFS call status. NFSERR_VERF if the server lost some
+ *                   of the unstable writes.
+ */
+typedef void (*nfs_commit_cb_t)(uintptr_t token, enum nfs_stat status);
+
 /**
  * A call back function provided by the caller of @ref nfs_read, executed
  * once a response is received.
@@ -380,10 +432,36 @@ enum rpc_stat nfs_init(const struct ip_addr *server);
  * Since this NFS library runs over the unreliable UDP protocol, it is possible
  * that packets may be dropped. To allow NFS to retransmit packets that might
  * have been dropped you must arrange for nfs_timeout to be called every 100ms.
- * This could be achieved by using a timer.
+ * This could be achieved by using a timer. Over TCP it also runs the LWIP TCP
+ * timers and connects again after the connection broke.
  */
 void nfs_timeout(void);
 
+/**
+ * Gives NFS a clock to measure the round trip times with. The retransmission
+ * timeout follows the round trip time of the server, without a clock the
+ * time only moves by 100ms every nfs_timeout and so do the measurements.
+ * Set it while there are no calls in flight, e.g. right after nfs_mount.
+ * @param[in] now_us A function returning the time in microseconds
+ */
+void nfs_set_clock(uint64_t (*now_us)(void));
+
+/**
+ * The NFS version spoken to the server, 3 if the server has it or 2.
+ * It is decided by @ref nfs_init and @ref nfs_mount.
+ */
+int nfs_version(void);
+
+/**
+ * The largest "count" the server takes in a read or write, 8192 bytes with
+ * NFS version 2. With version 3 it is what the server gives through FSINFO
+ * at mount time, up to 8192 bytes over UDP and 32768 over TCP. A read or
+ * write may transfer less than asked, e.g. to fit in a packet, the callback
+ * tells how much.
+ */
+int nfs_max_read(void);
+int nfs_max_write(void);
+
 
 
 /**
@@ -397,6 +475,26 @@ void nfs_timeout(void);
  */
 enum rpc_stat nfs_mount(const char *dir, fhandle_t *pfh);
 
+/* Talk to the server over TCP if it has it, see nfs_mount_flags */
+#define NFS_MOUNT_TCP       (1 << 0)
+
+/**
+ * As nfs_mount, with options for the calls that follow.
+ * With NFS_MOUNT_TCP the calls go over one TCP connection instead of UDP
+ * datagrams: TCP does the congestion control and retransmission, and the
+ * reads and writes may be larger. The connection is made again if it breaks.
+ * If the server has no TCP port the calls stay on UDP.
+ * The transport is global, all mounts share the one connection to the
+ * server: once a mount asks for NFS_MOUNT_TCP, the calls of every mount go
+ * over TCP.
+ * @param[in]  dir   The path that NFS should mount.
+ * @param[out] pfh   The returned file handle if the call was successful.
+ * @param[in]  flags NFS_MOUNT_* flags
+ * @return           RPC_OK if the call was successful and pfh was updated.
+ *                   Otherwise, an appropriate error code will be returned.
+ */
+enum rpc_stat nfs_mount_flags(const char *dir, fhandle_t *pfh, int flags);
+
 /**
  * Synchronous function used to print the directories exported by the server.
  * This function is primarily used for the purpose of debugging.
@@ -525,6 +623,14 @@ enum rpc_stat nfs_remove(const fhandle_t *pfh, const char *name,
 enum rpc_stat nfs_readdir(const fhandle_t *pfh, nfscookie_t cookie,
                           nfs_readdir_cb_t callback, uintptr_t token);
 
+/**
+ * Same as @ref nfs_readdir but the callback also gets the handle and the
+ * attributes of the files, with NFS version 3 (READDIRPLUS). This saves
+ * looking them up one by one.
+ */
+enum rpc_stat nfs_readdirplus(const fhandle_t *pfh, nfscookie_t cookie,
+                              nfs_readdirplus_cb_t callback, uintptr_t token);
+
 /**
  * An asynchronous function used for reading data from a file.
  * nfs_read will start at "offset" bytes within the file provided as "fh" and
@@ -550,6 +656,16 @@ enum rpc_stat nfs_readdir(const fhandle_t *pfh, nfscookie_t cookie,
 enum rpc_stat nfs_read(const fhandle_t *fh, int offset, int count,
                        nfs_read_cb_t callback, uintptr_t token);
 
+/**
+ * Same as @ref nfs_read but the file data is copied from the reply packet
+ * straight into "buf", with no copy in between. The callback is given "buf"
+ * as its data.
+ * @param[in] buf      Where the data goes, at least "count" bytes. It must
+ *                     stay valid until the callback is called.
+ */
+enum rpc_stat nfs_read_into(const fhandle_t *fh, int offset, int count,
+                            void *buf, nfs_read_cb_t callback, uintptr_t token);
+
 /**
  * Asynchronous function used for writing data to a file.
  * nfs_write will start at "offset" bytes within the file provided as "fh" and
@@ -574,6 +690,44 @@ enum rpc_stat nfs_write(const fhandle_t *fh, int offset, int count,
                         const void *data,
                         nfs_write_cb_t callback, uintptr_t token);
 
+/**
+ * Same as @ref nfs_write but "data" is not copied into the request, the
+ * packets refer to it instead, retransmissions included. "data" must not
+ * change or go away until the callback is called.
+ */
+enum rpc_stat nfs_write_ref(const fhandle_t *fh, int offset, int count,
+                            const void *data,
+                            nfs_write_cb_t callback, uintptr_t token);
+
+/// @ref nfs_write_flags: "data" is not copied, as with @ref nfs_write_ref.
+#define NFS_WRITE_REF       (1 << 0)
+/// @ref nfs_write_flags: the server may keep the data in memory until
+/// @ref nfs_commit instead of writing it to disk first (NFS version 3, the
+/// writes of version 2 are always stable).
+#define NFS_WRITE_UNSTABLE  (1 << 1)
+
+/**
+ * @ref nfs_write with options, "flags" is a combination of NFS_WRITE_*.
+ */
+enum rpc_stat nfs_write_flags(const fhandle_t *fh, int offset, int count,
+                              const void *data, int flags,
+                              nfs_write_cb_t callback, uintptr_t token);
+
+/**
+ * Asynchronous function used to make the unstable writes to a file stable.
+ * Once it succeeds, all the unstable writes to "fh" that were acknowledged
+ * are on the server's disk. With NFS version 2 there is nothing to do and the
+ * callback is called before returning.
+ * @param[in] fh       An NFS file handle (@ref fhandle_t) to the file.
+ * @param[in] callback An @ref nfs_commit_cb_t callback function to call once a
+ *                     response arrives.
+ * @param[in] token    A token to pass, unmodified, to the callback function.
+ * @return             RPC_OK if the request was successfully sent. Otherwise
+ *                     an appropriate error code will be returned.
+ */
+enum rpc_stat nfs_commit(const fhandle_t *fh,
+                         nfs_commit_cb_t callback, uintptr_t token);
+
 /**
  * Tests the NFS system using the provided path as a scratch directory
  * The tests will not begin unless the scratch directory is empty but will
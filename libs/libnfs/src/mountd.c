@@ -26,6 +26,7 @@
 
 #define MNT_NUMBER    100005
 #define MNT_VERSION   1
+#define MNT_VERSION3  3
 
 #define MNTPROC_EXPORT 5
 #define MNTPROC_MNT    1
@@ -47,9 +48,12 @@
  ******************************************/
 
 static struct udp_pcb* 
-mnt_new_udp(const struct ip_addr *server)
+mnt_new_udp(const struct ip_addr *server, int version)
 {
-    int port = portmapper_getport(server, MNT_NUMBER, MNT_VERSION);
+    int port = portmapper_getport(server, MNT_NUMBER, version);
+    if(port <= 0){
+        return NULL;
+    }
     return rpc_new_udp(server, port, PORT_ROOT);
 }
 
@@ -100,7 +104,7 @@ mountd_print_exports(const struct ip_addr *server)
     int err;
 
     /* open a port */
-    mnt_pcb = mnt_new_udp(server); 
+    mnt_pcb = mnt_new_udp(server, MNT_VERSION); 
     assert(mnt_pcb);
 
     /* construct the call */
@@ -133,6 +137,7 @@ struct mountd_mnt_token {
     enum rpc_stat stat;
     const char* dir;
     fhandle_t *pfh;
+    int version;
 };
 
 static void
@@ -151,7 +156,12 @@ mountd_mount_cb(void* callback, uintptr_t token, struct pbuf* pbuf)
         /* Read the response */
         pb_readl(pbuf, &status, &pos);
         if (status == 0) {
-            pb_read(pbuf, t->pfh, sizeof(*(t->pfh)), &pos);
+            /* Version 3 is followed by the auth flavours, we don't need them */
+            if(t->version == MNT_VERSION3){
+                pb_read_fh3(pbuf, t->pfh, &pos);
+            }else{
+                pb_read_fh2(pbuf, t->pfh, &pos);
+            }
             t->stat = RPC_OK;
         }else{
             t->stat = RPCERR_NOSUP;
@@ -161,8 +171,9 @@ mountd_mount_cb(void* callback, uintptr_t token, struct pbuf* pbuf)
     }
 }
 
-enum rpc_stat
-mountd_mount(const struct ip_addr *server, const char *dir, fhandle_t *pfh)
+static enum rpc_stat
+mountd_mount_version(const struct ip_addr *server, const char *dir,
+                     fhandle_t *pfh, int version)
 {
     struct mountd_mnt_token token;
     struct udp_pcb *mnt_pcb;
@@ -171,11 +182,14 @@ mountd_mount(const struct ip_addr *server, const char *dir, fhandle_t *pfh)
     enum rpc_stat stat;
 
     /* open a port */
-    mnt_pcb = mnt_new_udp(server); 
-    assert(mnt_pcb);
+    mnt_pcb = mnt_new_udp(server, version); 
+    if(mnt_pcb == NULL){
+        debug("mountd: no mount daemon version %d\n", version);
+        return RPCERR_NOSUP;
+    }
 
     /* Construct the call */
-    pbuf = rpcpbuf_init(MNT_NUMBER, MNT_VERSION, MNTPROC_MNT, &pos);
+    pbuf = rpcpbuf_init(MNT_NUMBER, version, MNTPROC_MNT, &pos);
     if(pbuf == NULL){
         udp_remove(mnt_pcb);
         return RPCERR_NOBUF;
@@ -186,6 +200,7 @@ mountd_mount(const struct ip_addr *server, const char *dir, fhandle_t *pfh)
     /* Make the call */
     token.pfh = pfh;
     token.stat = RPC_OK;
+    token.version = version;
     stat = rpc_call(pbuf, pos, mnt_pcb, &mountd_mount_cb, NULL, (uintptr_t)&token);
     udp_remove(mnt_pcb);
 
@@ -203,4 +218,14 @@ mountd_mount(const struct ip_addr *server, const char *dir, fhandle_t *pfh)
     }
 }
 
+enum rpc_stat
+mountd_mount(const struct ip_addr *server, const char *dir, fhandle_t *pfh)
+{
+    return mountd_mount_version(server, dir, pfh, MNT_VERSION);
+}
 
+enum rpc_stat
+mountd_mount3(const struct ip_addr *server, const char *dir, fhandle_t *pfh)
+{
+    return mountd_mount_version(server, dir, pfh, MNT_VERSION3);
+}
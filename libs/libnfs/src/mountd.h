@@ -38,6 +38,13 @@
 enum rpc_stat mountd_mount(const struct ip_addr *server, const char *dir, 
                            fhandle_t *pfh);
 
+/**
+ * Same as @ref mountd_mount with version 3 of the mount protocol, the file
+ * handle is one for NFS version 3
+ */
+enum rpc_stat mountd_mount3(const struct ip_addr *server, const char *dir,
+                            fhandle_t *pfh);
+
 /**
  * Prints the directories exported by a server
  * @param[in] server  The IP address of the server to query
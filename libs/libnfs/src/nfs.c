@@ -9,6 +9,7 @@
  */
 
 #include "nfs.h"
+#include "nfs3.h"
 #include "rpc.h"
 #include "mountd.h"
 #include "portmapper.h"
@@ -27,6 +28,8 @@
 #define debug(x...)
 #endif
 
+#define MIN(a,b) (((a)<(b))? (a) : (b))
+
 
 #define NFS_NUMBER    100003
 #define NFS_VERSION   2
@@ -79,7 +82,16 @@
  */
 #define READDIR_BUF_SIZE   1024
 
+/* The maximum number of bytes of data in a version 2 READ or WRITE */
+#define NFS2_MAXDATA       8192
+/* Version 3 over TCP, a call then fits in the TCP send buffer */
+#define NFS3_TCP_MAXDATA   32768
+
 static struct udp_pcb *_nfs_pcb = NULL;
+static int _nfs_version = NFS_VERSION;
+/* What FSINFO gave for version 3 */
+static int _rtmax = NFS2_MAXDATA;
+static int _wtmax = NFS2_MAXDATA;
 
 void 
 nfs_timeout(void)
@@ -87,11 +99,90 @@ nfs_timeout(void)
     rpc_timeout(100);
 }
 
+void
+nfs_set_clock(uint64_t (*now_us)(void))
+{
+    rpc_set_clock(now_us);
+}
+
+int
+nfs_version(void)
+{
+    return _nfs_version;
+}
+
+static int
+nfs_maxdata(int max)
+{
+    if(_nfs_version != NFS3_VERSION){
+        return NFS2_MAXDATA;
+    }
+    return MIN(max, rpc_is_tcp(_nfs_pcb)? NFS3_TCP_MAXDATA : NFS2_MAXDATA);
+}
+
+int
+nfs_max_read(void)
+{
+    return nfs_maxdata(_rtmax);
+}
+
+int
+nfs_max_write(void)
+{
+    return nfs_maxdata(_wtmax);
+}
+
+/* Move the calls to the TCP port of the server, if it has one */
+static void
+nfs_use_tcp(void)
+{
+    int port;
+    port = portmapper_getport_tcp(&_nfs_pcb->remote_ip, NFS_NUMBER,
+                                  _nfs_version);
+    if(port <= 0 || rpc_use_tcp(_nfs_pcb, port)){
+        printf("NFS: no TCP, staying on UDP\n");
+        return;
+    }
+    debug("NFS version %d TCP port number is %d\n", _nfs_version, port);
+}
+
 enum rpc_stat
-nfs_mount(const char * dir, fhandle_t *pfh)
+nfs_mount_flags(const char * dir, fhandle_t *pfh, int flags)
 {
+    enum rpc_stat stat;
+    int port;
+
     assert(_nfs_pcb);
-    return mountd_mount(&_nfs_pcb->remote_ip, dir, pfh);
+    if(_nfs_version == NFS3_VERSION){
+        stat = mountd_mount3(&_nfs_pcb->remote_ip, dir, pfh);
+        if(stat == RPC_OK){
+            if(flags & NFS_MOUNT_TCP){
+                nfs_use_tcp();
+            }
+            /* Keep the version 2 sizes if the server won't say */
+            nfs3_fsinfo(_nfs_pcb, pfh, &_rtmax, &_wtmax);
+            return RPC_OK;
+        }
+        /* Try again with version 2, on its port */
+        debug("NFS: version 3 mount failed, trying version 2\n");
+        port = portmapper_getport(&_nfs_pcb->remote_ip, NFS_NUMBER, NFS_VERSION);
+        if(port <= 0){
+            return stat;
+        }
+        udp_connect(_nfs_pcb, &_nfs_pcb->remote_ip, port);
+        _nfs_version = NFS_VERSION;
+    }
+    stat = mountd_mount(&_nfs_pcb->remote_ip, dir, pfh);
+    if(stat == RPC_OK && (flags & NFS_MOUNT_TCP)){
+        nfs_use_tcp();
+    }
+    return stat;
+}
+
+enum rpc_stat
+nfs_mount(const char * dir, fhandle_t *pfh)
+{
+    return nfs_mount_flags(dir, pfh, 0);
 }
 
 enum rpc_stat
@@ -116,8 +207,13 @@ nfs_init(const struct ip_addr *server)
         return RPCERR_NOSUP;
     }
 
-    /* make and RPC to get nfs info */
-    port = portmapper_getport(server, NFS_NUMBER, NFS_VERSION);
+    /* make and RPC to get nfs info, version 3 if the server has it */
+    _nfs_version = NFS3_VERSION;
+    port = portmapper_getport(server, NFS_NUMBER, NFS3_VERSION);
+    if(port <= 0){
+        _nfs_version = NFS_VERSION;
+        port = portmapper_getport(server, NFS_NUMBER, NFS_VERSION);
+    }
     switch(port){
     case -1:
         printf( "Communication error when acquiring NFS port from portmapper\n" );
@@ -127,7 +223,7 @@ nfs_init(const struct ip_addr *server)
         printf( "Error when acquiring NFS port number from portmapper: Not supported\n" );
         return RPCERR_NOSUP;
     default:
-        debug( "NFS port number is %d\n", port);
+        debug( "NFS version %d port number is %d\n", _nfs_version, port);
         _nfs_pcb = rpc_new_udp(server, port, PORT_ROOT);
         assert(_nfs_pcb);
         return RPC_OK;
@@ -170,6 +266,10 @@ nfs_getattr(const fhandle_t *fh,
     struct pbuf *pbuf;
     int pos;
 
+    if(_nfs_version == NFS3_VERSION){
+        return nfs3_getattr(_nfs_pcb, fh, func, token);
+    }
+
     /* now the user data struct is setup, do some call stuff! */
     pbuf = rpcpbuf_init(NFS_NUMBER, NFS_VERSION, NFSPROC_GETATTR, &pos);
     if(pbuf == NULL){
@@ -177,7 +277,7 @@ nfs_getattr(const fhandle_t *fh,
     }
 
     /* put in the fhandle */
-    pb_write(pbuf, fh, sizeof(*fh), &pos);
+    pb_write_fh2(pbuf, fh, &pos);
 
     /* send it! */
     return rpc_send(pbuf, pos, _nfs_pcb, &_nfs_getattr_cb, func, token);
@@ -200,7 +300,7 @@ _nfs_lookup_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
         pb_readl(pbuf, &status, &pos);
         if (status == NFS_OK) {
             /* it worked, so take out the return stuff! */
-            pb_read(pbuf, &new_fh, sizeof(new_fh), &pos);
+            pb_read_fh2(pbuf, &new_fh, &pos);
             pb_read_arrl(pbuf, (uint32_t*)&pattrs, sizeof(pattrs), &pos);
         }
     }
@@ -216,6 +316,10 @@ nfs_lookup(const fhandle_t *cwd, const char *name,
     struct pbuf *pbuf;
     int pos;
 
+    if(_nfs_version == NFS3_VERSION){
+        return nfs3_lookup(_nfs_pcb, cwd, name, func, token);
+    }
+
     /* now the user data struct is setup, do some call stuff! */
     pbuf = rpcpbuf_init(NFS_NUMBER, NFS_VERSION, NFSPROC_LOOKUP, &pos);
     if(pbuf == NULL){
@@ -223,19 +327,26 @@ nfs_lookup(const fhandle_t *cwd, const char *name,
     }
 
     /* put in the fhandle */
-    pb_write(pbuf, cwd, sizeof(*cwd), &pos);
+    pb_write_fh2(pbuf, cwd, &pos);
     /* put in the name */
     pb_write_str(pbuf, name, strlen(name), &pos);
     /* send it! */
     return rpc_send(pbuf, pos, _nfs_pcb, &_nfs_lookup_cb, func, token);
 }
 
+struct read_token_wrapper {
+    uintptr_t token;
+    void *buf;
+    int count;
+};
+
 static void
 _nfs_read_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
 {
     uint32_t status = NFSERR_COMM;
     fattr_t pattrs;
     char *data = NULL;
+    char *copy = NULL;
     uint32_t size = 0;
     struct rpc_reply_hdr hdr; 
     int pos;
@@ -252,17 +363,20 @@ _nfs_read_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
             /* it worked, so take out the return stuff! */
             pb_read_arrl(pbuf, (uint32_t*)&pattrs, sizeof(pattrs), &pos);
             pb_readl(pbuf, &size, &pos);
-            /* malloc for data since pbuf may be part of a chain */
-            data = malloc(size);
-            assert(data != NULL);
-            pb_read(pbuf, data, size, &pos);
+            /* Use the data where it is unless it is split over the chain */
+            data = pb_contiguous(pbuf, pos, size);
+            if(data == NULL){
+                copy = data = malloc(size);
+                assert(data != NULL);
+                pb_read(pbuf, data, size, &pos);
+            }
         }
     }
 
     cb(token, status, &pattrs, size, data);
 
-    if(data){
-        free(data);
+    if(copy){
+        free(copy);
     }
 }
 
@@ -273,6 +387,11 @@ nfs_read(const fhandle_t *fh, int offset, int count,
     struct pbuf *pbuf;
     int pos;
 
+    count = MIN(count, nfs_max_read());
+    if(_nfs_version == NFS3_VERSION){
+        return nfs3_read(_nfs_pcb, fh, offset, count, NULL, func, token);
+    }
+
     /* now the user data struct is setup, do some call stuff! */
     pbuf = rpcpbuf_init(NFS_NUMBER, NFS_VERSION, NFSPROC_READ, &pos);
     if(pbuf == NULL){
@@ -280,7 +399,7 @@ nfs_read(const fhandle_t *fh, int offset, int count,
     }
 
     /* Fill in the call data */
-    pb_write(pbuf, fh, sizeof(*fh), &pos);
+    pb_write_fh2(pbuf, fh, &pos);
     pb_writel(pbuf, offset, &pos);
     pb_writel(pbuf, count, &pos);
     /* total count unused as per RFC */
@@ -289,15 +408,87 @@ nfs_read(const fhandle_t *fh, int offset, int count,
     return rpc_send(pbuf, pos, _nfs_pcb, &_nfs_read_cb, func, token);
 }
 
-struct write_token_wrapper {
-    uintptr_t token;
-    int count;
-};
+static void
+_nfs_read_into_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
+{
+    struct read_token_wrapper *t = (struct read_token_wrapper*)token;
+    uint32_t status = NFSERR_COMM;
+    fattr_t pattrs;
+    uint32_t size = 0;
+    struct rpc_reply_hdr hdr; 
+    int pos;
+    nfs_read_cb_t cb = callback;
+
+    assert(callback != NULL);
+
+    if (rpc_read_hdr(pbuf, &hdr, &pos) == RPCERR_OK){
+        /* get the status out */
+        pb_readl(pbuf, &status, &pos);
+
+        if (status == NFS_OK) {
+            pb_read_arrl(pbuf, (uint32_t*)&pattrs, sizeof(pattrs), &pos);
+            pb_readl(pbuf, &size, &pos);
+            /* Never more than asked for, the buffer is no bigger */
+            if(size > t->count){
+                size = t->count;
+            }
+            /* Scatter it from the packet straight to the caller */
+            pb_read(pbuf, t->buf, size, &pos);
+        }
+    }
+
+    cb(t->token, status, &pattrs, size, t->buf);
+
+    free(t);
+}
+
+enum rpc_stat
+nfs_read_into(const fhandle_t *fh, int offset, int count, void *buf,
+              nfs_read_cb_t func, uintptr_t token)
+{
+    struct pbuf *pbuf;
+    struct read_token_wrapper *t;
+    int pos;
+    int err;
+
+    count = MIN(count, nfs_max_read());
+    if(_nfs_version == NFS3_VERSION){
+        return nfs3_read(_nfs_pcb, fh, offset, count, buf, func, token);
+    }
+
+    t = (struct read_token_wrapper*)malloc(sizeof(*t));
+    if(t == NULL){
+        return RPCERR_NOMEM;
+    }
+
+    pbuf = rpcpbuf_init(NFS_NUMBER, NFS_VERSION, NFSPROC_READ, &pos);
+    if(pbuf == NULL){
+        free(t);
+        return RPCERR_NOBUF;
+    }
+
+    /* Fill in the call data */
+    pb_write_fh2(pbuf, fh, &pos);
+    pb_writel(pbuf, offset, &pos);
+    pb_writel(pbuf, count, &pos);
+    /* total count unused as per RFC */
+    pb_writel(pbuf, 0, &pos);
+
+    /* Wrap the token up ready for the call back */
+    t->token = token;
+    t->buf = buf;
+    t->count = count;
+    err = rpc_send(pbuf, pos, _nfs_pcb, &_nfs_read_into_cb, func, (uintptr_t)t);
+    if(err){
+        free(t);
+    }
+    return err;
+}
 
 static void
 _nfs_write_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
 {
-    struct write_token_wrapper *t = (struct write_token_wrapper*)token;
+    struct nfs_write_token *t = (struct nfs_write_token*)token;
     struct rpc_reply_hdr hdr;
     uint32_t status = NFSERR_COMM;
     fattr_t pattrs;
@@ -320,51 +511,135 @@ _nfs_write_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
     free(t);
 }
 
-enum rpc_stat
-nfs_write(const fhandle_t *fh, int offset, int count, const void *data,
-          nfs_write_cb_t func, uintptr_t token)
+/*
+ * Start a write call, up to the count field. With "fit" the count is cut to
+ * what fits in the pbuf after the header
+ */
+static struct pbuf *
+nfs_write_hdr(const fhandle_t *fh, int offset, int *count, int fit, int *pos)
 {
     struct pbuf *pbuf;
-    struct write_token_wrapper *t;
     int limit;
+
+    /* now the user data struct is setup, do some call stuff! */
+    pbuf = rpcpbuf_init(NFS_NUMBER, NFS_VERSION, NFSPROC_WRITE, pos);
+    if(pbuf == NULL){
+        return NULL;
+    }
+
+    /* Create our call arg */
+    pb_write_fh2(pbuf, fh, pos);
+    pb_writel(pbuf, 0 /* Unused: see RFC */, pos); 
+    pb_writel(pbuf, offset, pos);
+    pb_writel(pbuf, 0 /* Unused: see RFC */, pos);
+    /* Limit the number of bytes to send to fit the packet */
+    limit = pbuf->tot_len - *pos - sizeof(*count);
+    if(fit && *count > limit){
+        *count = limit;
+    }
+    pb_writel(pbuf, *count, pos);
+    return pbuf;
+}
+
+enum rpc_stat
+nfs_write_flags(const fhandle_t *fh, int offset, int count, const void *data,
+                int flags, nfs_write_cb_t func, uintptr_t token)
+{
+    static const char zeros[sizeof(uint32_t)];
+    struct pbuf *pbuf, *ref;
+    struct nfs_write_token *t;
+    rpc_cb_fn write_cb;
     int pos;
+    int pad;
+    int fit;
     int err;
 
-    t = (struct write_token_wrapper*)malloc(sizeof(*t));
+    t = (struct nfs_write_token*)malloc(sizeof(*t));
     if(t == NULL){
         return RPCERR_NOMEM;
     }
 
-    /* now the user data struct is setup, do some call stuff! */
-    pbuf = rpcpbuf_init(NFS_NUMBER, NFS_VERSION, NFSPROC_WRITE, &pos);
+    count = MIN(count, nfs_max_write());
+    /* Data by reference isn't limited by the pbuf but a datagram is */
+    fit = !(flags & NFS_WRITE_REF) || !rpc_is_tcp(_nfs_pcb);
+    if(_nfs_version == NFS3_VERSION){
+        pbuf = nfs3_write_hdr(fh, offset, &count, flags, fit, &pos);
+        write_cb = &nfs3_write_cb;
+    }else{
+        pbuf = nfs_write_hdr(fh, offset, &count, fit, &pos);
+        write_cb = &_nfs_write_cb;
+    }
     if(pbuf == NULL){
         free(t);
         return RPCERR_NOBUF;
     }
 
-    /* Create our call arg */
-    pb_write(pbuf, fh, sizeof(*fh), &pos);
-    pb_writel(pbuf, 0 /* Unused: see RFC */, &pos); 
-    pb_writel(pbuf, offset, &pos);
-    pb_writel(pbuf, 0 /* Unused: see RFC */, &pos);
-    /* Limit the number of bytes to send to fit the packet */
-    limit = pbuf->tot_len - pos - sizeof(count);
-    if(count > limit){
-        count = limit;
+    if(flags & NFS_WRITE_REF){
+        /* The data and its padding follow the header where they are */
+        pbuf_realloc(pbuf, pos);
+        pad = (sizeof(uint32_t) - count % sizeof(uint32_t)) % sizeof(uint32_t);
+        if(count > 0){
+            ref = pbuf_alloc(PBUF_RAW, count, PBUF_REF);
+            if(ref == NULL){
+                goto nobuf;
+            }
+            ref->payload = (void*)data;
+            pbuf_cat(pbuf, ref);
+        }
+        if(pad > 0){
+            ref = pbuf_alloc(PBUF_RAW, pad, PBUF_ROM);
+            if(ref == NULL){
+                goto nobuf;
+            }
+            ref->payload = (void*)zeros;
+            pbuf_cat(pbuf, ref);
+        }
+        pos = pbuf->tot_len;
+    }else{
+        /* put the data in */
+        pb_write(pbuf, data, count, &pos);
+        pb_alignl(&pos);
     }
-    /* put the data in */
-    pb_writel(pbuf, count, &pos);
-    pb_write(pbuf, data, count, &pos);
-    pb_alignl(&pos);
 
     /* Wrap the token up ready for the call back */
     t->token = token;
     t->count = count;
-    err = rpc_send(pbuf, pos, _nfs_pcb, &_nfs_write_cb, func, (uintptr_t)t);
+    t->fh = *fh;
+    err = rpc_send(pbuf, pos, _nfs_pcb, write_cb, func, (uintptr_t)t);
     if(err){
         free(t);
     }
     return err;
+
+nobuf:
+    pbuf_free(pbuf);
+    free(t);
+    return RPCERR_NOBUF;
+}
+
+enum rpc_stat
+nfs_write(const fhandle_t *fh, int offset, int count, const void *data,
+          nfs_write_cb_t func, uintptr_t token)
+{
+    return nfs_write_flags(fh, offset, count, data, 0, func, token);
+}
+
+enum rpc_stat
+nfs_write_ref(const fhandle_t *fh, int offset, int count, const void *data,
+              nfs_write_cb_t func, uintptr_t token)
+{
+    return nfs_write_flags(fh, offset, count, data, NFS_WRITE_REF, func, token);
+}
+
+enum rpc_stat
+nfs_commit(const fhandle_t *fh, nfs_commit_cb_t func, uintptr_t token)
+{
+    if(_nfs_version == NFS3_VERSION){
+        return nfs3_commit(_nfs_pcb, fh, func, token);
+    }
+    /* Version 2 writes are always stable */
+    func(token, NFS_OK);
+    return RPC_OK;
 }
 
 static void
@@ -385,7 +660,7 @@ _nfs_create_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
 
         if (status == NFS_OK) {
             /* it worked, so take out the return stuff! */
-            pb_read(pbuf, &new_fh, sizeof(new_fh), &pos);
+            pb_read_fh2(pbuf, &new_fh, &pos);
             pb_read_arrl(pbuf, (uint32_t*)&pattrs, sizeof(pattrs), &pos);
         }
     }
@@ -401,6 +676,10 @@ nfs_create(const fhandle_t *fh, const char *name, const sattr_t *sat,
     struct pbuf *pbuf;
     int pos;
 
+    if(_nfs_version == NFS3_VERSION){
+        return nfs3_create(_nfs_pcb, fh, name, sat, func, token);
+    }
+
     /* now the user data struct is setup, do some call stuff! */
     pbuf = rpcpbuf_init(NFS_NUMBER, NFS_VERSION, NFSPROC_CREATE, &pos);
     if(pbuf == NULL){
@@ -408,7 +687,7 @@ nfs_create(const fhandle_t *fh, const char *name, const sattr_t *sat,
     }
 
     /* put in the fhandle */
-    pb_write(pbuf, fh, sizeof(*fh), &pos);
+    pb_write_fh2(pbuf, fh, &pos);
     /* put in the name */
     pb_write_str(pbuf, name, strlen(name), &pos);
     /* put in the attributes */
@@ -443,6 +722,10 @@ nfs_remove(const fhandle_t *fh, const char *name,
     struct pbuf *pbuf;
     int pos;
 
+    if(_nfs_version == NFS3_VERSION){
+        return nfs3_remove(_nfs_pcb, fh, name, func, token);
+    }
+
     /* now the user data struct is setup, do some call stuff! */
     pbuf = rpcpbuf_init(NFS_NUMBER, NFS_VERSION, NFSPROC_REMOVE, &pos);
     if(pbuf == NULL){
@@ -450,7 +733,7 @@ nfs_remove(const fhandle_t *fh, const char *name,
     }
 
     /* put in the fhandle */
-    pb_write(pbuf, fh, sizeof(*fh), &pos);
+    pb_write_fh2(pbuf, fh, &pos);
     /* put in the name */
     pb_write_str(pbuf, name, strlen(name), &pos);
 
@@ -542,17 +825,68 @@ nfs_readdir(const fhandle_t *pfh, nfscookie_t cookie,
 {
     struct pbuf *pbuf;
     int pos;
+
+    if(_nfs_version == NFS3_VERSION){
+        return nfs3_readdir(_nfs_pcb, pfh, cookie, func, token);
+    }
+
     /* Initialise the request packet */
     pbuf = rpcpbuf_init(NFS_NUMBER, NFS_VERSION, NFSPROC_READDIR, &pos);
     if(pbuf == NULL){
         return RPCERR_NOBUF;
     }
     /* Create the call */
-    pb_write(pbuf, pfh, sizeof(*pfh), &pos);
+    pb_write_fh2(pbuf, pfh, &pos);
     pb_writel(pbuf, cookie, &pos);
     pb_writel(pbuf, READDIR_BUF_SIZE, &pos); 
     /* make the call! */
     return rpc_send(pbuf, pos, _nfs_pcb, &_nfs_readdir_cb, func, token);
 }
 
+/* Version 2 has no READDIRPLUS, a plain listing without handles and attributes */
+struct readdirplus_token_wrapper {
+    nfs_readdirplus_cb_t func;
+    uintptr_t token;
+};
+
+static void
+_nfs_readdirplus_cb(uintptr_t token, enum nfs_stat status, int num_files,
+                    char* file_names[], nfscookie_t nfscookie)
+{
+    struct readdirplus_token_wrapper *t = (struct readdirplus_token_wrapper*)token;
+    void **none = NULL;
+
+    if(num_files > 0){
+        none = (void**)calloc(num_files, sizeof(void*));
+        assert(none);
+    }
+    t->func(t->token, status, num_files, file_names,
+            (fhandle_t**)none, (fattr_t**)none, nfscookie);
+
+    free(none);
+    free(t);
+}
+
+enum rpc_stat
+nfs_readdirplus(const fhandle_t *pfh, nfscookie_t cookie,
+                nfs_readdirplus_cb_t func, uintptr_t token)
+{
+    struct readdirplus_token_wrapper *t;
+    int err;
 
+    if(_nfs_version == NFS3_VERSION){
+        return nfs3_readdirplus(_nfs_pcb, pfh, cookie, func, token);
+    }
+
+    t = (struct readdirplus_token_wrapper*)malloc(sizeof(*t));
+    if(t == NULL){
+        return RPCERR_NOMEM;
+    }
+    t->func = func;
+    t->token = token;
+    err = nfs_readdir(pfh, cookie, &_nfs_readdirplus_cb, (uintptr_t)t);
+    if(err){
+        free(t);
+    }
+    return err;
+}
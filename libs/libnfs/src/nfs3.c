@@ -0,0 +1,980 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "nfs3.h"
+#include "rpc.h"
+#include "pbuf_helpers.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+
+
+//#define DEBUG_NFS3 1
+#ifdef DEBUG_NFS3
+#define debug(x...) printf(x)
+#else
+#define debug(x...)
+#endif
+
+
+#define NFS_NUMBER    100003
+
+#define       NFS3PROC_GETATTR              1
+#define       NFS3PROC_LOOKUP               3
+#define       NFS3PROC_READ                 6
+#define       NFS3PROC_WRITE                7
+#define       NFS3PROC_CREATE               8
+#define       NFS3PROC_REMOVE               12
+#define       NFS3PROC_READDIR              16
+#define       NFS3PROC_READDIRPLUS          17
+#define       NFS3PROC_FSINFO               19
+#define       NFS3PROC_COMMIT               21
+
+/* stable_how */
+#define UNSTABLE      0
+#define DATA_SYNC     1
+#define FILE_SYNC     2
+
+/* createmode3 */
+#define UNCHECKED     0
+
+/* time_how */
+#define DONT_CHANGE         0
+#define SET_TO_CLIENT_TIME  2
+
+/* The size in bytes of the cookie and write verifiers */
+#define NFS3_VERFSIZE 8
+
+/* The number of words in a fattr3 */
+#define FATTR3_WORDS  21
+
+/*
+ * The most reply bytes asked for in a directory listing. READDIRPLUS entries
+ * carry attributes and a handle, about 200 bytes each, the whole reply still
+ * has to fit in a packet.
+ */
+#define READDIR_BUF_SIZE        1024
+#define READDIRPLUS_DIRCOUNT    512
+#define READDIRPLUS_MAXCOUNT    1280
+
+/*
+ * Cookies of version 3 are 64 bits and come with a verifier, the callers
+ * get a 32 bit id for them instead. Only the last few are kept, a listing
+ * is normally read through before the next one starts.
+ */
+#define COOKIE_SLOTS  16
+
+struct cookie_slot {
+    nfscookie_t id;
+    uint64_t cookie;
+    char verf[NFS3_VERFSIZE];
+};
+
+static struct cookie_slot _cookies[COOKIE_SLOTS];
+static nfscookie_t _last_cookie_id;
+
+/*
+ * Files with unstable writes since the last commit, with the verifier the
+ * server gave. A different verifier means the server restarted and the
+ * earlier unstable writes may be gone.
+ */
+struct unstable_file {
+    fhandle_t fh;
+    char verf[NFS3_VERFSIZE];
+    int lost;
+    struct unstable_file *next;
+};
+
+static struct unstable_file *_unstable = NULL;
+
+/******************************************
+ *** Helpers
+ ******************************************/
+
+/* 64 bit values that don't fit in the 32 bit fields of fattr_t saturate */
+static uint32_t
+clamp64(uint64_t v)
+{
+    return (v > 0xffffffffULL)? 0xffffffff : (uint32_t)v;
+}
+
+/* The file type bits of the version 2 mode, version 3 only has the type */
+static uint32_t
+type_mode(uint32_t type)
+{
+    switch(type){
+    case NFREG: return 0100000;
+    case NFDIR: return 0040000;
+    case NFBLK: return 0060000;
+    case NFCHR: return 0020000;
+    case NFLNK: return 0120000;
+    default:    return 0;
+    }
+}
+
+static void
+read_fattr3(struct pbuf *pbuf, fattr_t *fattr, int *pos)
+{
+    uint32_t a[FATTR3_WORDS];
+    pb_read_arrl(pbuf, a, sizeof(a), pos);
+
+    /* The types up to NF3LNK are numbered as in version 2 */
+    fattr->type       = (a[0] <= NFLNK)? a[0] : NFNON;
+    fattr->mode       = type_mode(fattr->type) | (a[1] & 07777);
+    fattr->nlink      = a[2];
+    fattr->uid        = a[3];
+    fattr->gid        = a[4];
+    fattr->size       = clamp64(((uint64_t)a[5] << 32) | a[6]);
+    fattr->block_size = 512;
+    fattr->blocks     = clamp64((((uint64_t)a[7] << 32) | a[8]) / 512);
+    fattr->rdev       = (a[9] << 8) | (a[10] & 0xff);
+    fattr->fsid       = a[12];
+    fattr->fileid     = a[14];
+    fattr->atime.seconds  = a[15];
+    fattr->atime.useconds = a[16] / 1000;
+    fattr->mtime.seconds  = a[17];
+    fattr->mtime.useconds = a[18] / 1000;
+    fattr->ctime.seconds  = a[19];
+    fattr->ctime.useconds = a[20] / 1000;
+}
+
+/* Returns whether the attributes were there, they are all 0 otherwise */
+static int
+read_post_op_attr(struct pbuf *pbuf, fattr_t *fattr, int *pos)
+{
+    uint32_t follows;
+    pb_readl(pbuf, &follows, pos);
+    if(follows){
+        read_fattr3(pbuf, fattr, pos);
+    }else{
+        memset(fattr, 0, sizeof(*fattr));
+    }
+    return follows;
+}
+
+/* Skip the attributes before the change, read the ones after */
+static void
+read_wcc_data(struct pbuf *pbuf, fattr_t *after, int *pos)
+{
+    uint32_t follows;
+    pb_readl(pbuf, &follows, pos);
+    if(follows){
+        /* size, mtime and ctime */
+        *pos += 6 * sizeof(uint32_t);
+    }
+    read_post_op_attr(pbuf, after, pos);
+}
+
+static void
+write_set32(struct pbuf *pbuf, uint32_t v, int *pos)
+{
+    if(v == (uint32_t)-1){
+        pb_writel(pbuf, 0, pos);
+    }else{
+        pb_writel(pbuf, 1, pos);
+        pb_writel(pbuf, v, pos);
+    }
+}
+
+static void
+write_settime(struct pbuf *pbuf, const timeval_t *tv, int *pos)
+{
+    if(tv->seconds == (uint32_t)-1){
+        pb_writel(pbuf, DONT_CHANGE, pos);
+    }else{
+        pb_writel(pbuf, SET_TO_CLIENT_TIME, pos);
+        pb_writel(pbuf, tv->seconds, pos);
+        pb_writel(pbuf, tv->useconds * 1000, pos);
+    }
+}
+
+/* The version 2 attributes as a sattr3, -1 still means not to set it */
+static void
+write_sattr3(struct pbuf *pbuf, const sattr_t *sat, int *pos)
+{
+    write_set32(pbuf, sat->mode, pos);
+    write_set32(pbuf, sat->uid, pos);
+    write_set32(pbuf, sat->gid, pos);
+    if(sat->size == (uint32_t)-1){
+        pb_writel(pbuf, 0, pos);
+    }else{
+        pb_writel(pbuf, 1, pos);
+        pb_writell(pbuf, sat->size, pos);
+    }
+    write_settime(pbuf, &sat->atime, pos);
+    write_settime(pbuf, &sat->mtime, pos);
+}
+
+static nfscookie_t
+cookie_save(uint64_t cookie, const char *verf)
+{
+    struct cookie_slot *slot;
+    if(++_last_cookie_id == 0){
+        _last_cookie_id++;
+    }
+    slot = &_cookies[_last_cookie_id % COOKIE_SLOTS];
+    slot->id = _last_cookie_id;
+    slot->cookie = cookie;
+    memcpy(slot->verf, verf, NFS3_VERFSIZE);
+    return slot->id;
+}
+
+/* Returns 0 if the cookie id is known */
+static int
+cookie_find(nfscookie_t id, uint64_t *cookie, char *verf)
+{
+    struct cookie_slot *slot;
+    if(id == 0){
+        *cookie = 0;
+        memset(verf, 0, NFS3_VERFSIZE);
+        return 0;
+    }
+    slot = &_cookies[id % COOKIE_SLOTS];
+    if(slot->id != id){
+        return -1;
+    }
+    *cookie = slot->cookie;
+    memcpy(verf, slot->verf, NFS3_VERFSIZE);
+    return 0;
+}
+
+static struct unstable_file **
+unstable_find(const fhandle_t *fh)
+{
+    struct unstable_file **pp;
+    for(pp = &_unstable; *pp != NULL; pp = &(*pp)->next){
+        if(memcmp((*pp)->fh.data, fh->data, sizeof(fh->data)) == 0){
+            return pp;
+        }
+    }
+    return NULL;
+}
+
+/* A write reply for FH came with VERF */
+static void
+unstable_written(const fhandle_t *fh, const char *verf, int unstable)
+{
+    struct unstable_file **pp = unstable_find(fh);
+    struct unstable_file *u;
+    if(pp != NULL){
+        u = *pp;
+        if(memcmp(u->verf, verf, NFS3_VERFSIZE) != 0){
+            debug("NFS3: write verifier changed, unstable writes lost\n");
+            u->lost = 1;
+            memcpy(u->verf, verf, NFS3_VERFSIZE);
+        }
+    }else if(unstable){
+        u = (struct unstable_file*)malloc(sizeof(*u));
+        assert(u != NULL);
+        u->fh = *fh;
+        memcpy(u->verf, verf, NFS3_VERFSIZE);
+        u->lost = 0;
+        u->next = _unstable;
+        _unstable = u;
+    }
+}
+
+/******************************************
+ *** FSINFO
+ ******************************************/
+
+struct fsinfo_token {
+    enum rpc_stat stat;
+    uint32_t rtmax;
+    uint32_t wtmax;
+};
+
+static void
+_nfs3_fsinfo_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
+{
+    struct fsinfo_token *t = (struct fsinfo_token*)token;
+    struct rpc_reply_hdr hdr;
+    uint32_t status;
+    fattr_t pattrs;
+    uint32_t pref_mult;
+    int pos;
+
+    (void)callback;
+    t->stat = RPCERR_NOSUP;
+    if (rpc_read_hdr(pbuf, &hdr, &pos) == RPCERR_OK){
+        pb_readl(pbuf, &status, &pos);
+        if (status == NFS_OK) {
+            read_post_op_attr(pbuf, &pattrs, &pos);
+            pb_readl(pbuf, &t->rtmax, &pos);
+            /* rtpref and rtmult */
+            pb_readl(pbuf, &pref_mult, &pos);
+            pb_readl(pbuf, &pref_mult, &pos);
+            pb_readl(pbuf, &t->wtmax, &pos);
+            t->stat = RPC_OK;
+        }
+    }
+}
+
+enum rpc_stat
+nfs3_fsinfo(struct udp_pcb *pcb, const fhandle_t *fh, int *rtmax, int *wtmax)
+{
+    struct fsinfo_token t;
+    struct pbuf *pbuf;
+    int pos;
+    enum rpc_stat stat;
+
+    pbuf = rpcpbuf_init(NFS_NUMBER, NFS3_VERSION, NFS3PROC_FSINFO, &pos);
+    if(pbuf == NULL){
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, fh, &pos);
+
+    t.stat = RPCERR_NOSUP;
+    stat = rpc_call(pbuf, pos, pcb, &_nfs3_fsinfo_cb, NULL, (uintptr_t)&t);
+    if(stat != RPC_OK){
+        return stat;
+    }else if(t.stat != RPC_OK){
+        return t.stat;
+    }
+    debug("NFS3: rtmax %u wtmax %u\n", t.rtmax, t.wtmax);
+    if(t.rtmax > 0){
+        *rtmax = (t.rtmax > 0x7fffffff)? 0x7fffffff : t.rtmax;
+    }
+    if(t.wtmax > 0){
+        *wtmax = (t.wtmax > 0x7fffffff)? 0x7fffffff : t.wtmax;
+    }
+    return RPC_OK;
+}
+
+/******************************************
+ *** Async functions
+ ******************************************/
+
+static void
+_nfs3_getattr_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
+{
+    uint32_t status = NFSERR_COMM;
+    fattr_t pattrs;
+    struct rpc_reply_hdr hdr;
+    int pos;
+    nfs_getattr_cb_t cb = callback;
+
+    assert(callback != NULL);
+
+    memset(&pattrs, 0, sizeof(pattrs));
+    if (rpc_read_hdr(pbuf, &hdr, &pos) == RPCERR_OK){
+        pb_readl(pbuf, &status, &pos);
+        if (status == NFS_OK) {
+            read_fattr3(pbuf, &pattrs, &pos);
+        }
+    }
+
+    cb(token, status, &pattrs);
+}
+
+enum rpc_stat
+nfs3_getattr(struct udp_pcb *pcb, const fhandle_t *fh,
+             nfs_getattr_cb_t func, uintptr_t token)
+{
+    struct pbuf *pbuf;
+    int pos;
+
+    pbuf = rpcpbuf_init(NFS_NUMBER, NFS3_VERSION, NFS3PROC_GETATTR, &pos);
+    if(pbuf == NULL){
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, fh, &pos);
+
+    return rpc_send(pbuf, pos, pcb, &_nfs3_getattr_cb, func, token);
+}
+
+static void
+_nfs3_lookup_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
+{
+    uint32_t status = NFSERR_COMM;
+    fhandle_t new_fh;
+    fattr_t pattrs;
+    struct rpc_reply_hdr hdr;
+    int pos;
+    nfs_lookup_cb_t cb = callback;
+
+    assert(callback != NULL);
+
+    memset(&new_fh, 0, sizeof(new_fh));
+    memset(&pattrs, 0, sizeof(pattrs));
+    if (rpc_read_hdr(pbuf, &hdr, &pos) == RPCERR_OK){
+        pb_readl(pbuf, &status, &pos);
+        if (status == NFS_OK) {
+            pb_read_fh3(pbuf, &new_fh, &pos);
+            read_post_op_attr(pbuf, &pattrs, &pos);
+        }
+    }
+
+    cb(token, status, &new_fh, &pattrs);
+}
+
+enum rpc_stat
+nfs3_lookup(struct udp_pcb *pcb, const fhandle_t *cwd, const char *name,
+            nfs_lookup_cb_t func, uintptr_t token)
+{
+    struct pbuf *pbuf;
+    int pos;
+
+    pbuf = rpcpbuf_init(NFS_NUMBER, NFS3_VERSION, NFS3PROC_LOOKUP, &pos);
+    if(pbuf == NULL){
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, cwd, &pos);
+    pb_write_str(pbuf, name, strlen(name), &pos);
+
+    return rpc_send(pbuf, pos, pcb, &_nfs3_lookup_cb, func, token);
+}
+
+/*
+ * The server doesn't have to give the handle and attributes of the new file,
+ * they are looked up if it didn't
+ */
+struct create_token_wrapper {
+    uintptr_t token;
+    struct udp_pcb *pcb;
+    fhandle_t dir;
+    char *name;
+};
+
+static void
+_nfs3_create_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
+{
+    struct create_token_wrapper *t = (struct create_token_wrapper*)token;
+    uint32_t status = NFSERR_COMM;
+    fhandle_t new_fh;
+    fattr_t pattrs;
+    struct rpc_reply_hdr hdr;
+    int pos;
+    uint32_t has_fh = 0;
+    int has_attr = 0;
+    nfs_create_cb_t cb = callback;
+
+    assert(callback != NULL);
+
+    memset(&new_fh, 0, sizeof(new_fh));
+    memset(&pattrs, 0, sizeof(pattrs));
+    if (rpc_read_hdr(pbuf, &hdr, &pos) == RPCERR_OK){
+        pb_readl(pbuf, &status, &pos);
+        if (status == NFS_OK) {
+            pb_readl(pbuf, &has_fh, &pos);
+            if(has_fh){
+                pb_read_fh3(pbuf, &new_fh, &pos);
+            }
+            has_attr = read_post_op_attr(pbuf, &pattrs, &pos);
+        }
+    }
+
+    debug("NFS3 CREATE CALLBACK\n");
+    if(status == NFS_OK && !(has_fh && has_attr)){
+        if(nfs3_lookup(t->pcb, &t->dir, t->name, cb, t->token) != RPC_OK){
+            cb(t->token, NFSERR_COMM, &new_fh, &pattrs);
+        }
+    }else{
+        cb(t->token, status, &new_fh, &pattrs);
+    }
+
+    free(t->name);
+    free(t);
+}
+
+enum rpc_stat
+nfs3_create(struct udp_pcb *pcb, const fhandle_t *fh, const char *name,
+            const sattr_t *sat, nfs_create_cb_t func, uintptr_t token)
+{
+    struct create_token_wrapper *t;
+    struct pbuf *pbuf;
+    int pos;
+    int err;
+
+    t = (struct create_token_wrapper*)malloc(sizeof(*t));
+    if(t == NULL){
+        return RPCERR_NOMEM;
+    }
+    t->name = (char*)malloc(strlen(name) + 1);
+    if(t->name == NULL){
+        free(t);
+        return RPCERR_NOMEM;
+    }
+
+    pbuf = rpcpbuf_init(NFS_NUMBER, NFS3_VERSION, NFS3PROC_CREATE, &pos);
+    if(pbuf == NULL){
+        free(t->name);
+        free(t);
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, fh, &pos);
+    pb_write_str(pbuf, name, strlen(name), &pos);
+    /* Like the version 2 create, an existing file is just opened */
+    pb_writel(pbuf, UNCHECKED, &pos);
+    write_sattr3(pbuf, sat, &pos);
+
+    t->token = token;
+    t->pcb = pcb;
+    t->dir = *fh;
+    strcpy(t->name, name);
+    err = rpc_send(pbuf, pos, pcb, &_nfs3_create_cb, func, (uintptr_t)t);
+    if(err){
+        free(t->name);
+        free(t);
+    }
+    return err;
+}
+
+static void
+_nfs3_remove_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
+{
+    uint32_t status = NFSERR_COMM;
+    struct rpc_reply_hdr hdr;
+    int pos;
+    nfs_remove_cb_t cb = callback;
+
+    assert(callback != NULL);
+
+    if (rpc_read_hdr(pbuf, &hdr, &pos) == RPCERR_OK){
+        pb_readl(pbuf, &status, &pos);
+    }
+
+    debug("NFS3 REMOVE CALLBACK\n");
+    cb(token, status);
+}
+
+enum rpc_stat
+nfs3_remove(struct udp_pcb *pcb, const fhandle_t *fh, const char *name,
+            nfs_remove_cb_t func, uintptr_t token)
+{
+    struct pbuf *pbuf;
+    int pos;
+
+    pbuf = rpcpbuf_init(NFS_NUMBER, NFS3_VERSION, NFS3PROC_REMOVE, &pos);
+    if(pbuf == NULL){
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, fh, &pos);
+    pb_write_str(pbuf, name, strlen(name), &pos);
+
+    return rpc_send(pbuf, pos, pcb, &_nfs3_remove_cb, func, token);
+}
+
+/******************************************
+ *** Read & write
+ ******************************************/
+
+struct read_token_wrapper {
+    uintptr_t token;
+    void *buf;
+    int count;
+};
+
+static void
+_nfs3_read_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
+{
+    struct read_token_wrapper *t = (struct read_token_wrapper*)token;
+    uint32_t status = NFSERR_COMM;
+    fattr_t pattrs;
+    char *data = t->buf;
+    char *copy = NULL;
+    uint32_t size = 0;
+    uint32_t eof;
+    struct rpc_reply_hdr hdr;
+    int pos;
+    nfs_read_cb_t cb = callback;
+
+    assert(callback != NULL);
+
+    memset(&pattrs, 0, sizeof(pattrs));
+    if (rpc_read_hdr(pbuf, &hdr, &pos) == RPCERR_OK){
+        pb_readl(pbuf, &status, &pos);
+        read_post_op_attr(pbuf, &pattrs, &pos);
+        if (status == NFS_OK) {
+            /* count and eof, then the data with its length again */
+            pb_readl(pbuf, &size, &pos);
+            pb_readl(pbuf, &eof, &pos);
+            pb_readl(pbuf, &size, &pos);
+            if(t->buf != NULL){
+                /* Never more than asked for, the buffer is no bigger */
+                if(size > t->count){
+                    size = t->count;
+                }
+                pb_read(pbuf, t->buf, size, &pos);
+            }else{
+                /* Use the data where it is unless it is split over the chain */
+                data = pb_contiguous(pbuf, pos, size);
+                if(data == NULL){
+                    copy = data = malloc(size);
+                    assert(data != NULL);
+                    pb_read(pbuf, data, size, &pos);
+                }
+            }
+        }
+    }
+
+    cb(t->token, status, &pattrs, size, data);
+
+    if(copy){
+        free(copy);
+    }
+    free(t);
+}
+
+enum rpc_stat
+nfs3_read(struct udp_pcb *pcb, const fhandle_t *fh, int offset, int count,
+          void *buf, nfs_read_cb_t func, uintptr_t token)
+{
+    struct read_token_wrapper *t;
+    struct pbuf *pbuf;
+    int pos;
+    int err;
+
+    t = (struct read_token_wrapper*)malloc(sizeof(*t));
+    if(t == NULL){
+        return RPCERR_NOMEM;
+    }
+
+    pbuf = rpcpbuf_init(NFS_NUMBER, NFS3_VERSION, NFS3PROC_READ, &pos);
+    if(pbuf == NULL){
+        free(t);
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, fh, &pos);
+    pb_writell(pbuf, (uint32_t)offset, &pos);
+    pb_writel(pbuf, count, &pos);
+
+    t->token = token;
+    t->buf = buf;
+    t->count = count;
+    err = rpc_send(pbuf, pos, pcb, &_nfs3_read_cb, func, (uintptr_t)t);
+    if(err){
+        free(t);
+    }
+    return err;
+}
+
+void
+nfs3_write_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
+{
+    struct nfs_write_token *t = (struct nfs_write_token*)token;
+    struct rpc_reply_hdr hdr;
+    uint32_t status = NFSERR_COMM;
+    fattr_t pattrs;
+    uint32_t count = t->count;
+    uint32_t committed;
+    char verf[NFS3_VERFSIZE];
+    int pos;
+    nfs_write_cb_t cb = callback;
+
+    assert(callback != NULL);
+
+    memset(&pattrs, 0, sizeof(pattrs));
+    if (rpc_read_hdr(pbuf, &hdr, &pos) == RPCERR_OK){
+        pb_readl(pbuf, &status, &pos);
+        read_wcc_data(pbuf, &pattrs, &pos);
+        if (status == NFS_OK) {
+            /* The server may write less than it was sent */
+            pb_readl(pbuf, &count, &pos);
+            pb_readl(pbuf, &committed, &pos);
+            pb_read(pbuf, verf, sizeof(verf), &pos);
+            unstable_written(&t->fh, verf, committed == UNSTABLE);
+        }
+    }
+
+    cb(t->token, status, &pattrs, count);
+
+    free(t);
+}
+
+struct pbuf *
+nfs3_write_hdr(const fhandle_t *fh, int offset, int *count, int flags, int fit,
+               int *pos)
+{
+    struct pbuf *pbuf;
+    int limit;
+
+    pbuf = rpcpbuf_init(NFS_NUMBER, NFS3_VERSION, NFS3PROC_WRITE, pos);
+    if(pbuf == NULL){
+        return NULL;
+    }
+
+    pb_write_fh3(pbuf, fh, pos);
+    pb_writell(pbuf, (uint32_t)offset, pos);
+    /* Limit the number of bytes to send to fit the packet */
+    limit = pbuf->tot_len - *pos - 3 * sizeof(uint32_t);
+    if(fit && *count > limit){
+        *count = limit;
+    }
+    pb_writel(pbuf, *count, pos);
+    pb_writel(pbuf, (flags & NFS_WRITE_UNSTABLE)? UNSTABLE : FILE_SYNC, pos);
+    /* The length of the data that follows */
+    pb_writel(pbuf, *count, pos);
+    return pbuf;
+}
+
+struct commit_token_wrapper {
+    uintptr_t token;
+    fhandle_t fh;
+};
+
+static void
+_nfs3_commit_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
+{
+    struct commit_token_wrapper *t = (struct commit_token_wrapper*)token;
+    struct rpc_reply_hdr hdr;
+    uint32_t status = NFSERR_COMM;
+    struct unstable_file **pp;
+    struct unstable_file *u;
+    fattr_t pattrs;
+    char verf[NFS3_VERFSIZE];
+    int pos;
+    nfs_commit_cb_t cb = callback;
+
+    assert(callback != NULL);
+
+    if (rpc_read_hdr(pbuf, &hdr, &pos) == RPCERR_OK){
+        pb_readl(pbuf, &status, &pos);
+        read_wcc_data(pbuf, &pattrs, &pos);
+        if (status == NFS_OK) {
+            pb_read(pbuf, verf, sizeof(verf), &pos);
+        }
+    }
+
+    /* Unless it failed, the unstable writes are either on disk now or lost */
+    pp = unstable_find(&t->fh);
+    if(pp != NULL && status == NFS_OK){
+        u = *pp;
+        if(u->lost || memcmp(u->verf, verf, NFS3_VERFSIZE) != 0){
+            status = NFSERR_VERF;
+        }
+        *pp = u->next;
+        free(u);
+    }
+
+    cb(t->token, status);
+
+    free(t);
+}
+
+enum rpc_stat
+nfs3_commit(struct udp_pcb *pcb, const fhandle_t *fh,
+            nfs_commit_cb_t func, uintptr_t token)
+{
+    struct commit_token_wrapper *t;
+    struct pbuf *pbuf;
+    int pos;
+    int err;
+
+    if(unstable_find(fh) == NULL){
+        /* Nothing was written unstable */
+        func(token, NFS_OK);
+        return RPC_OK;
+    }
+
+    t = (struct commit_token_wrapper*)malloc(sizeof(*t));
+    if(t == NULL){
+        return RPCERR_NOMEM;
+    }
+
+    pbuf = rpcpbuf_init(NFS_NUMBER, NFS3_VERSION, NFS3PROC_COMMIT, &pos);
+    if(pbuf == NULL){
+        free(t);
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, fh, &pos);
+    /* The whole file */
+    pb_writell(pbuf, 0, &pos);
+    pb_writel(pbuf, 0, &pos);
+
+    t->token = token;
+    t->fh = *fh;
+    err = rpc_send(pbuf, pos, pcb, &_nfs3_commit_cb, func, (uintptr_t)t);
+    if(err){
+        free(t);
+    }
+    return err;
+}
+
+/******************************************
+ *** Directories
+ ******************************************/
+
+struct readdir_token_wrapper {
+    uintptr_t token;
+    int plus;
+};
+
+struct dir_entry {
+    char *name;
+    fhandle_t fh;
+    fattr_t fattr;
+    int has_fh;
+    int has_fattr;
+    struct dir_entry *next;
+};
+
+static void
+_nfs3_readdir_cb(void * callback, uintptr_t token, struct pbuf *pbuf)
+{
+    struct readdir_token_wrapper *t = (struct readdir_token_wrapper*)token;
+    struct dir_entry *head = NULL;
+    struct dir_entry **tail = &head;
+    int num_entries = 0;
+    char **entries = NULL;
+    fhandle_t **fhs = NULL;
+    fattr_t **fattrs = NULL;
+    nfscookie_t next_cookie = 0;
+    uint32_t status = NFSERR_COMM;
+    struct rpc_reply_hdr hdr;
+    int pos;
+    int i;
+
+    debug("NFS3 READDIR CALLBACK\n");
+    assert(callback != NULL);
+
+    if (rpc_read_hdr(pbuf, &hdr, &pos) == RPCERR_OK){
+        pb_readl(pbuf, &status, &pos);
+        if (status == NFS_OK) {
+            fattr_t dir_attrs;
+            char verf[NFS3_VERFSIZE];
+            uint64_t cookie = 0;
+            uint32_t more, eof;
+            struct dir_entry *e;
+
+            read_post_op_attr(pbuf, &dir_attrs, &pos);
+            pb_read(pbuf, verf, sizeof(verf), &pos);
+            /* First read all of our entries into a chain */
+            while(pb_readl(pbuf, &more, &pos), more) {
+                uint64_t fileid;
+                uint32_t size, follows;
+                e = (struct dir_entry*)malloc(sizeof(*e));
+                assert(e);
+                /* File ID (ignored) */
+                pb_readll(pbuf, &fileid, &pos);
+                /* Read in the file name length and file name */
+                pb_readl(pbuf, &size, &pos);
+                e->name = (char*)malloc(size + 1);
+                assert(e->name);
+                pb_read(pbuf, e->name, size, &pos);
+                e->name[size] = '\0';
+                pb_alignl(&pos);
+                pb_readll(pbuf, &cookie, &pos);
+                e->has_fh = 0;
+                e->has_fattr = 0;
+                if(t->plus){
+                    e->has_fattr = read_post_op_attr(pbuf, &e->fattr, &pos);
+                    pb_readl(pbuf, &follows, &pos);
+                    if(follows){
+                        pb_read_fh3(pbuf, &e->fh, &pos);
+                        e->has_fh = 1;
+                    }
+                }
+                e->next = NULL;
+                *tail = e;
+                tail = &e->next;
+                num_entries++;
+            }
+            /* The last cookie is where the next call starts, none at the end */
+            pb_readl(pbuf, &eof, &pos);
+            if(!eof && num_entries > 0){
+                next_cookie = cookie_save(cookie, verf);
+            }
+
+            /* Now flatten the chain */
+            entries = (char**)malloc(sizeof(char*) * num_entries);
+            fhs = (fhandle_t**)malloc(sizeof(fhandle_t*) * num_entries);
+            fattrs = (fattr_t**)malloc(sizeof(fattr_t*) * num_entries);
+            assert(entries && fhs && fattrs);
+            for(i = 0, e = head; i < num_entries; i++, e = e->next){
+                entries[i] = e->name;
+                fhs[i] = (e->has_fh)? &e->fh : NULL;
+                fattrs[i] = (e->has_fattr)? &e->fattr : NULL;
+            }
+        }
+    }
+
+    if(t->plus){
+        nfs_readdirplus_cb_t cb = callback;
+        cb(t->token, status, num_entries, entries, fhs, fattrs, next_cookie);
+    }else{
+        nfs_readdir_cb_t cb = callback;
+        cb(t->token, status, num_entries, entries, next_cookie);
+    }
+
+    /* Clean up */
+    while(head != NULL){
+        struct dir_entry *e = head;
+        head = e->next;
+        free(e->name);
+        free(e);
+    }
+    free(entries);
+    free(fhs);
+    free(fattrs);
+    free(t);
+}
+
+static enum rpc_stat
+nfs3_readdir_send(struct udp_pcb *pcb, const fhandle_t *pfh,
+                  nfscookie_t cookie, int plus, void *func, uintptr_t token)
+{
+    struct readdir_token_wrapper *t;
+    struct pbuf *pbuf;
+    uint64_t cookie3;
+    char verf[NFS3_VERFSIZE];
+    int pos;
+    int err;
+
+    if(cookie_find(cookie, &cookie3, verf)){
+        debug("NFS3: unknown readdir cookie %u\n", cookie);
+        return RPCERR_NOSUP;
+    }
+
+    t = (struct readdir_token_wrapper*)malloc(sizeof(*t));
+    if(t == NULL){
+        return RPCERR_NOMEM;
+    }
+
+    pbuf = rpcpbuf_init(NFS_NUMBER, NFS3_VERSION,
+                        (plus)? NFS3PROC_READDIRPLUS : NFS3PROC_READDIR, &pos);
+    if(pbuf == NULL){
+        free(t);
+        return RPCERR_NOBUF;
+    }
+    pb_write_fh3(pbuf, pfh, &pos);
+    pb_writell(pbuf, cookie3, &pos);
+    pb_write(pbuf, verf, sizeof(verf), &pos);
+    if(plus){
+        pb_writel(pbuf, READDIRPLUS_DIRCOUNT, &pos);
+        pb_writel(pbuf, READDIRPLUS_MAXCOUNT, &pos);
+    }else{
+        pb_writel(pbuf, READDIR_BUF_SIZE, &pos);
+    }
+
+    t->token = token;
+    t->plus = plus;
+    err = rpc_send(pbuf, pos, pcb, &_nfs3_readdir_cb, func, (uintptr_t)t);
+    if(err){
+        free(t);
+    }
+    return err;
+}
+
+enum rpc_stat
+nfs3_readdir(struct udp_pcb *pcb, const fhandle_t *pfh, nfscookie_t cookie,
+             nfs_readdir_cb_t func, uintptr_t token)
+{
+    return nfs3_readdir_send(pcb, pfh, cookie, 0, func, token);
+}
+
+enum rpc_stat
+nfs3_readdirplus(struct udp_pcb *pcb, const fhandle_t *pfh, nfscookie_t cookie,
+                 nfs_readdirplus_cb_t func, uintptr_t token)
+{
+    return nfs3_readdir_send(pcb, pfh, cookie, 1, func, token);
+}
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2014, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/**
+ * @file   nfs3.h
+ *
+ * @brief  NFS version 3 procedures
+ *
+ * The public nfs_* calls land here when the server speaks version 3. They
+ * take the same arguments and call back the same way as the version 2 calls,
+ * the replies are converted to the version 2 structures.
+ */
+
+#ifndef __NFS3_H
+#define __NFS3_H
+
+#include <nfs/nfs.h>
+#include <lwip/udp.h>
+#include <lwip/pbuf.h>
+
+#define NFS3_VERSION  3
+
+/* Token of a write call, shared by both versions */
+struct nfs_write_token {
+    uintptr_t token;
+    int count;
+    fhandle_t fh;
+};
+
+/**
+ * Ask the server how big reads and writes may be. Waits for the answer.
+ * "rtmax" and "wtmax" are left alone if the call fails
+ */
+enum rpc_stat nfs3_fsinfo(struct udp_pcb *pcb, const fhandle_t *fh,
+                          int *rtmax, int *wtmax);
+
+enum rpc_stat nfs3_getattr(struct udp_pcb *pcb, const fhandle_t *fh,
+                           nfs_getattr_cb_t func, uintptr_t token);
+
+enum rpc_stat nfs3_lookup(struct udp_pcb *pcb, const fhandle_t *cwd,
+                          const char *name,
+                          nfs_lookup_cb_t func, uintptr_t token);
+
+enum rpc_stat nfs3_create(struct udp_pcb *pcb, const fhandle_t *fh,
+                          const char *name, const sattr_t *sat,
+                          nfs_create_cb_t func, uintptr_t token);
+
+enum rpc_stat nfs3_remove(struct udp_pcb *pcb, const fhandle_t *fh,
+                          const char *name,
+                          nfs_remove_cb_t func, uintptr_t token);
+
+enum rpc_stat nfs3_readdir(struct udp_pcb *pcb, const fhandle_t *pfh,
+                           nfscookie_t cookie,
+                           nfs_readdir_cb_t func, uintptr_t token);
+
+enum rpc_stat nfs3_readdirplus(struct udp_pcb *pcb, const fhandle_t *pfh,
+                               nfscookie_t cookie,
+                               nfs_readdirplus_cb_t func, uintptr_t token);
+
+/* "buf" is NULL for nfs_read, the data is then passed where it is */
+enum rpc_stat nfs3_read(struct udp_pcb *pcb, const fhandle_t *fh,
+                        int offset, int count, void *buf,
+                        nfs_read_cb_t func, uintptr_t token);
+
+/**
+ * Start a write call, up to the data. With "fit", returns the count that fits
+ * in the pbuf in "count".
+ * The reply is for nfs3_write_cb, with a struct nfs_write_token
+ */
+struct pbuf *nfs3_write_hdr(const fhandle_t *fh, int offset, int *count,
+                            int flags, int fit, int *pos);
+void nfs3_write_cb(void *callback, uintptr_t token, struct pbuf *pbuf);
+
+enum rpc_stat nfs3_commit(struct udp_pcb *pcb, const fhandle_t *fh,
+                          nfs_commit_cb_t func, uintptr_t token);
+
+#endif /* __NFS3_H */
@@ -144,3 +144,70 @@ pb_read_str(struct pbuf* pbuf, char* str, int maxlen, int* pos)
     pb_alignl(pos);
 }
 
+void
+pb_writell(struct pbuf* pbuf, uint64_t v, int* pos)
+{
+    pb_writel(pbuf, (uint32_t)(v >> 32), pos);
+    pb_writel(pbuf, (uint32_t)v, pos);
+}
+
+void
+pb_readll(struct pbuf* pbuf, uint64_t *v, int* pos)
+{
+    uint32_t hi, lo;
+    pb_readl(pbuf, &hi, pos);
+    pb_readl(pbuf, &lo, pos);
+    *v = ((uint64_t)hi << 32) | lo;
+}
+
+void*
+pb_contiguous(struct pbuf* pbuf, int pos, int len)
+{
+    while(pbuf != NULL && pos >= pbuf->len){
+        pos -= pbuf->len;
+        pbuf = pbuf->next;
+    }
+    if(pbuf == NULL || pos + len > pbuf->len){
+        return NULL;
+    }
+    return (char*)pbuf->payload + pos;
+}
+
+/* The length of a version 3 handle is kept after the handle */
+#define FH3_LEN_OFFSET FHSIZE3
+
+void
+pb_write_fh2(struct pbuf* pbuf, const fhandle_t* fh, int* pos)
+{
+    pb_write(pbuf, fh->data, FHSIZE, pos);
+}
+
+void
+pb_read_fh2(struct pbuf* pbuf, fhandle_t* fh, int* pos)
+{
+    memset(fh, 0, sizeof(*fh));
+    pb_read(pbuf, fh->data, FHSIZE, pos);
+}
+
+void
+pb_write_fh3(struct pbuf* pbuf, const fhandle_t* fh, int* pos)
+{
+    uint32_t len;
+    memcpy(&len, fh->data + FH3_LEN_OFFSET, sizeof(len));
+    assert(len <= FHSIZE3);
+    pb_writel(pbuf, len, pos);
+    pb_write(pbuf, fh->data, len, pos);
+    pb_alignl(pos);
+}
+
+void
+pb_read_fh3(struct pbuf* pbuf, fhandle_t* fh, int* pos)
+{
+    uint32_t len;
+    memset(fh, 0, sizeof(*fh));
+    pb_readl(pbuf, &len, pos);
+    assert(len <= FHSIZE3);
+    pb_read(pbuf, fh->data, len, pos);
+    pb_alignl(pos);
+    memcpy(fh->data + FH3_LEN_OFFSET, &len, sizeof(len));
+}
@@ -13,6 +13,7 @@
 
 #include <stdint.h>
 #include <lwip/pbuf.h>
+#include <nfs/nfs.h>
 
 /* Align pos to the start of a network long */
 void pb_alignl(int* pos);
@@ -43,5 +44,19 @@ void pb_write_arrl(struct pbuf* pbuf, const uint32_t* arr, int size, int* pos);
  * Update pos and return 0 on success */
 void pb_read_arrl(struct pbuf* pbuf, uint32_t* arr, int size, int* pos);
 
+/* Write/read a 64 bit value, host order, network order in the buf */
+void pb_writell(struct pbuf* pbuf, uint64_t v, int* pos);
+void pb_readll(struct pbuf* pbuf, uint64_t *v, int* pos);
+
+/* Where the len bytes at pos are if they are all in one pbuf of the chain,
+ * NULL otherwise */
+void* pb_contiguous(struct pbuf* pbuf, int pos, int len);
+
+/* Write/read a file handle, NFS version 2 (fixed size) and 3 (variable size) */
+void pb_write_fh2(struct pbuf* pbuf, const fhandle_t* fh, int* pos);
+void pb_read_fh2(struct pbuf* pbuf, fhandle_t* fh, int* pos);
+void pb_write_fh3(struct pbuf* pbuf, const fhandle_t* fh, int* pos);
+void pb_read_fh3(struct pbuf* pbuf, fhandle_t* fh, int* pos);
+
 
 #endif /* __PBUF_HELPERS_H */
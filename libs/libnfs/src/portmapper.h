@@ -26,4 +26,10 @@
  */
 int portmapper_getport(const ip_addr_t *server, uint32_t prog, uint32_t vers);
 
+/**
+ * As portmapper_getport, for the TCP port of the program
+ */
+int portmapper_getport_tcp(const ip_addr_t *server, uint32_t prog,
+                           uint32_t vers);
+
 #endif /* __PORTMAPPER_H */
@@ -15,6 +15,9 @@
 #include "pbuf_helpers.h"
 #include "common.h"
 
+#include <lwip/tcp.h>
+#include <lwip/tcp_impl.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -49,7 +52,34 @@
 #define UDP_PAYLOAD 1400
 //#define UDP_PAYLOAD 800
 
-#define RETRANSMIT_DELAY_MS 500
+/* Retransmission timeout, estimated from the round trip times (RFC 6298) */
+#define RTO_INIT_MS     500
+#define RTO_MIN_MS      200
+#define RTO_MAX_MS      8000
+
+/* Timer wheel of the calls waiting for a reply, a slot per tick */
+#define WHEEL_TICK_MS   10
+#define WHEEL_SLOTS     256
+
+/* xid -> call, xids are consecutive so they spread evenly */
+#define XID_BUCKETS     256
+
+/* Calls sent but not answered yet, more wait in a FIFO until there's room */
+#define MAX_OUTSTANDING 64
+
+/* Servers (pcbs) we keep round trip estimates for */
+#define MAX_RTT_PCBS    8
+
+/* TCP connections, the last fragment of a record has the top bit set */
+#define MAX_TCP_CONNS       4
+#define RECORD_LAST         0x80000000
+/* Replies are put together in a pbuf of their own */
+#define RECORD_MAX          0xffff
+/* TCP doesn't lose calls but the server may still drop one */
+#define TCP_RESEND_MS       15000
+/* Between attempts to connect again */
+#define TCP_BACKOFF_MIN_MS  100
+#define TCP_BACKOFF_MAX_MS  8000
 
 
 /************************************************************
@@ -113,17 +143,33 @@ pbuf_new(u16_t length)
     return pbuf_alloc(PBUF_TRANSPORT, length, PBUF_RAM);
 }
 
+/*
+ * LWIP puts its headers in front of the pbuf it is given, so it gets pbufs
+ * that refer to ours instead of a copy. Those can't grow, the headers go in
+ * a pbuf of their own and the data is never copied, not even when it is
+ * retransmitted
+ */
 static inline enum rpc_stat
 my_udp_send(struct udp_pcb* pcb, struct pbuf *pbuf)
 {
     int err;
-    struct pbuf *p;
-    /* LWIP does not preserve the pbuf so make a copy first */
-    p = pbuf_new(pbuf->tot_len);
-    if(p == NULL){
-        return RPCERR_NOBUF;
+    struct pbuf *p = NULL;
+    struct pbuf *q, *ref;
+    for(q = pbuf; q != NULL; q = q->next){
+        ref = pbuf_alloc(PBUF_RAW, q->len, PBUF_REF);
+        if(ref == NULL){
+            if(p != NULL){
+                pbuf_free(p);
+            }
+            return RPCERR_NOBUF;
+        }
+        ref->payload = q->payload;
+        if(p == NULL){
+            p = ref;
+        }else{
+            pbuf_cat(p, ref);
+        }
     }
-    assert(!pbuf_copy(p, pbuf));
     err = udp_send(pcb, p);
     pbuf_free(p);
     switch(err){
@@ -137,6 +183,18 @@ my_udp_send(struct udp_pcb* pcb, struct pbuf *pbuf)
     return err;
 }
 
+/* Privileged ports, the servers want root */
+static int
+next_root_port(void)
+{
+    static int root_port = -1;
+    if(root_port >= ROOT_PORT_MAX || root_port < ROOT_PORT_MIN){
+        root_port = ROOT_PORT_MIN;
+        debug("Recycling ports\n");
+    }
+    return root_port++;
+}
+
 /************************************************************
  *  Transaction ID's
  ***********************************************************/
@@ -165,22 +223,259 @@ get_xid(void)
 }
 
 
+/************************************************************
+ *  Clock
+ ***********************************************************/
+
+static uint64_t (*clock_us)(void);
+static uint32_t ticks_ms;   /* Time as told by rpc_timeout, if there's no clock */
+
+void
+rpc_set_clock(uint64_t (*now_us)(void))
+{
+    clock_us = now_us;
+}
+
+static uint32_t
+now_ms(void)
+{
+    if(clock_us != NULL){
+        return (uint32_t)(clock_us() / 1000);
+    }
+    return ticks_ms;
+}
+
+/* a is before b, handles wrap around */
+#define TIME_BEFORE(a, b) ((int32_t)((a) - (b)) < 0)
+
+/************************************************************
+ *  Round trip estimation (Jacobson/Karels)
+ ***********************************************************/
+
+struct rpc_rtt {
+    struct udp_pcb *pcb;
+    int valid;
+    int srtt;       /* smoothed rtt << 3 */
+    int rttvar;     /* rtt variance << 2 */
+    int rto;        /* ms, backed off after a timeout until the next sample */
+};
+
+static struct rpc_rtt rtts[MAX_RTT_PCBS];
+static struct rpc_rtt default_rtt = { .rto = RTO_INIT_MS };
+
+static struct rpc_rtt *
+get_rtt(struct udp_pcb *pcb)
+{
+    int i;
+    for(i = 0; i < MAX_RTT_PCBS; i++){
+        if(rtts[i].pcb == pcb){
+            return &rtts[i];
+        }
+        if(rtts[i].pcb == NULL){
+            rtts[i].pcb = pcb;
+            rtts[i].rto = RTO_INIT_MS;
+            return &rtts[i];
+        }
+    }
+    /* Out of slots, they share one estimate */
+    return &default_rtt;
+}
+
+static void
+rtt_sample(struct rpc_rtt *rtt, int m)
+{
+    if(!rtt->valid){
+        rtt->srtt = m << 3;
+        rtt->rttvar = m << 1;
+        rtt->valid = 1;
+    }else{
+        int delta = m - (rtt->srtt >> 3);
+        rtt->srtt += delta;
+        if(delta < 0){
+            delta = -delta;
+        }
+        rtt->rttvar += delta - (rtt->rttvar >> 2);
+    }
+    rtt->rto = (rtt->srtt >> 3) + rtt->rttvar;
+    if(rtt->rto < RTO_MIN_MS){
+        rtt->rto = RTO_MIN_MS;
+    }else if(rtt->rto > RTO_MAX_MS){
+        rtt->rto = RTO_MAX_MS;
+    }
+    debug("rtt sample %d ms, rto = %d ms\n", m, rtt->rto);
+}
+
 /************************************************************
  *  Mailboxes
  ***********************************************************/
 
+/* Where a call is */
+enum rpc_queue_list {
+    Q_WAITING,                  /* for room, not sent yet */
+    Q_WHEEL,                    /* sent, waiting for the reply */
+    Q_BACKLOG                   /* for its TCP connection to take it */
+};
+
 struct rpc_queue {
     struct udp_pcb *pcb;
+    struct rpc_tcp *tcp;        /* NULL for UDP */
     struct pbuf *pbuf;
     xid_t xid;
-    int timeout;
-    struct rpc_queue *next;
+    enum rpc_queue_list where;
+    uint32_t sent;              /* ms, last (re)transmission */
+    uint32_t expires;           /* ms, when to retransmit */
+    int rto;                    /* ms, doubles on every retransmission */
+    int retries;                /* no rtt sample once retransmitted (Karn) */
+    struct rpc_rtt *rtt;
+    struct rpc_queue *hnext;    /* xid hash chain */
+    struct rpc_queue *next;     /* timer wheel slot, waiting list or backlog */
+    struct rpc_queue **pprev;
+    uint32_t mark;              /* TCP record mark, sent from here */
+    uint32_t tcp_end;           /* in the TCP stream, once written */
+    uint32_t tcp_gen;           /* connection it was written on */
     void (*func) (void *, uintptr_t, struct pbuf *);
     void *callback;
     uintptr_t arg;
 };
 
-struct rpc_queue *queue = NULL;
+/* A TCP connection to a server, see "TCP transport" */
+struct rpc_tcp {
+    struct udp_pcb *pcb;        /* NULL if the slot is free */
+    struct tcp_pcb *tpcb;       /* NULL while not connected */
+    struct ip_addr server;
+    int port;
+    int connected;
+    uint32_t gen;               /* bumped every time a connection is lost */
+    uint32_t retry_at;          /* ms, when to connect again */
+    int backoff;                /* ms */
+    uint32_t written;           /* bytes given to lwip on this connection */
+    uint32_t acked;             /* bytes the server has */
+    /* Calls waiting for room on the connection */
+    struct rpc_queue *backlog;
+    struct rpc_queue **backlog_tail;
+    /* Answered calls that still have bytes in flight */
+    struct rpc_queue *done;
+    /* The record being received */
+    uint8_t mark[4];
+    int mark_len;
+    int frag_left;
+    int last_frag;
+    struct pbuf *record;
+    int record_pos;
+};
+
+static struct rpc_queue *xid_hash[XID_BUCKETS];
+static struct rpc_queue *wheel[WHEEL_SLOTS];
+static uint32_t wheel_tick;     /* next tick of the wheel to run */
+static int outstanding;
+
+/* Calls waiting for room, sent in order */
+static struct rpc_queue *waiting;
+static struct rpc_queue **waiting_tail = &waiting;
+
+static void
+fifo_put(struct rpc_queue ***tail, struct rpc_queue *q_item)
+{
+    q_item->next = NULL;
+    **tail = q_item;
+    *tail = &q_item->next;
+}
+
+static struct rpc_queue *
+fifo_get(struct rpc_queue **head, struct rpc_queue ***tail)
+{
+    struct rpc_queue *q_item = *head;
+    if(q_item != NULL){
+        *head = q_item->next;
+        if(*head == NULL){
+            *tail = head;
+        }
+        q_item->next = NULL;
+    }
+    return q_item;
+}
+
+/* Rare (rpc_call giving up, a reply before the call left) so walk the list */
+static void
+fifo_del(struct rpc_queue **head, struct rpc_queue ***tail,
+         struct rpc_queue *q_item)
+{
+    struct rpc_queue **pp;
+    for(pp = head; *pp != q_item; pp = &(*pp)->next)
+        ;
+    *pp = q_item->next;
+    if(*tail == &q_item->next){
+        *tail = pp;
+    }
+    q_item->next = NULL;
+}
+
+static void
+list_add(struct rpc_queue **head, struct rpc_queue *q_item)
+{
+    q_item->next = *head;
+    q_item->pprev = head;
+    if(*head != NULL){
+        (*head)->pprev = &q_item->next;
+    }
+    *head = q_item;
+}
+
+static void
+list_del(struct rpc_queue *q_item)
+{
+    *q_item->pprev = q_item->next;
+    if(q_item->next != NULL){
+        q_item->next->pprev = q_item->pprev;
+    }
+    q_item->next = NULL;
+    q_item->pprev = NULL;
+}
+
+static void
+wheel_add(struct rpc_queue *q_item)
+{
+    uint32_t tick = q_item->expires / WHEEL_TICK_MS;
+    /* Never behind the wheel, it would wait for a full turn */
+    if(TIME_BEFORE(tick, wheel_tick)){
+        tick = wheel_tick;
+    }
+    q_item->where = Q_WHEEL;
+    list_add(&wheel[tick % WHEEL_SLOTS], q_item);
+}
+
+static struct rpc_tcp *tcp_find(struct udp_pcb *pcb);
+static void tcp_queue(struct rpc_queue *q_item);
+static void tcp_unqueue(struct rpc_queue *q_item);
+static void tcp_timeout(uint32_t now);
+
+/* Send a call that is in the xid hash and schedule its retransmission */
+static enum rpc_stat
+transmit(struct rpc_queue *q_item)
+{
+    enum rpc_stat stat;
+    if(q_item->tcp != NULL){
+        /* Its connection sends it when it can */
+        tcp_queue(q_item);
+        return RPC_OK;
+    }
+    stat = my_udp_send(q_item->pcb, q_item->pbuf);
+    q_item->sent = now_ms();
+    /* If it failed, the retransmission is the next try */
+    q_item->expires = q_item->sent + q_item->rto;
+    wheel_add(q_item);
+    return stat;
+}
+
+static void
+send_waiting(void)
+{
+    while(waiting != NULL && outstanding < MAX_OUTSTANDING){
+        struct rpc_queue *q_item = fifo_get(&waiting, &waiting_tail);
+        outstanding++;
+        transmit(q_item);
+    }
+}
 
 /* 
  * Poll to see if packets should be resent.
@@ -193,18 +488,49 @@ struct rpc_queue *queue = NULL;
 void
 rpc_timeout(int ms)
 {
-    struct rpc_queue *q_item;
-    for (q_item = queue; q_item != NULL; q_item = q_item->next) {
-        q_item->timeout += ms;
-        if (q_item->timeout > RETRANSMIT_DELAY_MS) {
+    uint32_t now, end;
+    int n;
+    ticks_ms += ms;
+    now = now_ms();
+    end = now / WHEEL_TICK_MS;
+
+    /* Run the ticks that passed, a full turn at most */
+    for(n = 0; !TIME_BEFORE(end, wheel_tick) && n < WHEEL_SLOTS; n++, wheel_tick++){
+        struct rpc_queue *expired = NULL;
+        struct rpc_queue *q_item, *next;
+        struct rpc_queue **slot = &wheel[wheel_tick % WHEEL_SLOTS];
+
+        for(q_item = *slot; q_item != NULL; q_item = next){
+            next = q_item->next;
+            if(!TIME_BEFORE(now, q_item->expires)){
+                list_del(q_item);
+                list_add(&expired, q_item);
+            }
+        }
+        for(q_item = expired; q_item != NULL; q_item = next){
+            next = q_item->next;
+            list_del(q_item);
             debug("rpc_timeout: Retransmission of 0x%08x\n", q_item->xid);
-            if(my_udp_send(q_item->pcb, q_item->pbuf)){
-                /* Try again later */
-            }else{
-                q_item->timeout = 0;
+            q_item->retries++;
+            /* TCP does its own backing off, the round trip includes the
+             * time spent queued behind other calls */
+            if(q_item->tcp == NULL){
+                q_item->rto *= 2;
+                if(q_item->rto > RTO_MAX_MS){
+                    q_item->rto = RTO_MAX_MS;
+                }
+                /* Keep the backed off timeout until the next good sample */
+                if(q_item->rtt->rto < q_item->rto){
+                    q_item->rtt->rto = q_item->rto;
+                }
             }
+            transmit(q_item);
         }
     }
+    if(n == WHEEL_SLOTS){
+        wheel_tick = end + 1;
+    }
+    tcp_timeout(now);
 }
 
 
@@ -215,62 +541,491 @@ add_to_queue(struct pbuf *pbuf, struct udp_pcb* pcb,
 {
     /* Need a lock here */
     struct rpc_queue *q_item;
-    struct rpc_queue *tmp;
     q_item = malloc(sizeof(struct rpc_queue));
     assert(q_item != NULL);
 
     q_item->next = NULL;
+    q_item->pprev = NULL;
     q_item->pbuf = pbuf;
     q_item->xid = extract_xid(pbuf);
     q_item->pcb = pcb;
-    q_item->timeout = 0;
+    q_item->tcp = tcp_find(pcb);
+    q_item->where = Q_WAITING;
+    q_item->tcp_end = 0;
+    /* Not written on any connection yet */
+    q_item->tcp_gen = (q_item->tcp != NULL)? q_item->tcp->gen - 1 : 0;
+    q_item->rtt = get_rtt(pcb);
+    q_item->rto = q_item->rtt->rto;
+    q_item->retries = 0;
+    q_item->sent = 0;
+    q_item->expires = 0;
     q_item->func = func;
     q_item->arg = arg;
     q_item->callback = callback;
 
-    if (queue == NULL) {
-        /* Add at start of the linked list */
-        queue = q_item;
-    } else {
-        /* Add to end of the linked list */
-        for(tmp = queue; tmp->next != NULL; tmp = tmp->next)
-            ;
-        tmp->next = q_item;
-    }
+    q_item->hnext = xid_hash[q_item->xid % XID_BUCKETS];
+    xid_hash[q_item->xid % XID_BUCKETS] = q_item;
+
+    /* Wait in line if the server has enough to do */
+    fifo_put(&waiting_tail, q_item);
+    send_waiting();
 }
 
 /* Remove item from the queue -- doesn't free the memory */
 static struct rpc_queue *
 get_from_queue(xid_t xid)
 {
-    struct rpc_queue *tmp, *last = NULL;
+    struct rpc_queue **pp, *tmp;
 
-    for (tmp = queue; tmp != NULL && tmp->xid != xid; tmp = tmp->next) {
-        last = tmp;
-        ;
+    for(pp = &xid_hash[xid % XID_BUCKETS]; *pp != NULL; pp = &(*pp)->hnext){
+        if((*pp)->xid == xid){
+            break;
+        }
     }
-    if (tmp == NULL) {
+    tmp = *pp;
+    if(tmp == NULL){
         return NULL;
-    } else if (last == NULL) {
-        queue = tmp->next;
-    } else {
-        last->next = tmp->next;
     }
-
+    *pp = tmp->hnext;
+
+    switch(tmp->where){
+    case Q_WHEEL:
+        list_del(tmp);
+        outstanding--;
+        break;
+    case Q_BACKLOG:
+        tcp_unqueue(tmp);
+        outstanding--;
+        break;
+    case Q_WAITING:
+        fifo_del(&waiting, &waiting_tail, tmp);
+        break;
+    }
     return tmp;
 }
 
+/************************************************************
+ *  TCP transport
+ *
+ * Calls go out as RFC 1831 records, a 4 byte mark with the length in front
+ * of each, and as many as there are room for are in flight on the one
+ * connection. They are written where they are (no copy) so a call is kept
+ * until the server acknowledged its bytes, even once it is answered. When
+ * the connection breaks, the calls that were not answered are written
+ * again on the next one. The udp pcb stays the handle of the server
+ ***********************************************************/
+
+/* a is before b in the byte stream, handles wrap around */
+#define SEQ_BEFORE(a, b) ((int32_t)((a) - (b)) < 0)
+
+static struct rpc_tcp tcp_conns[MAX_TCP_CONNS];
+static uint32_t tcp_tmr_at;     /* ms, when to run the lwip tcp timers */
+
+static void handle_reply(struct pbuf *p);
+static void tcp_start(struct rpc_tcp *conn);
+static void tcp_push_backlog(struct rpc_tcp *conn);
+
+static struct rpc_tcp *
+tcp_find(struct udp_pcb *pcb)
+{
+    int i;
+    for(i = 0; i < MAX_TCP_CONNS; i++){
+        if(tcp_conns[i].pcb == pcb){
+            return &tcp_conns[i];
+        }
+    }
+    return NULL;
+}
+
+/* Free a call that is out of the xid hash */
+static void
+release(struct rpc_queue *q_item)
+{
+    struct rpc_tcp *conn = q_item->tcp;
+    if(conn != NULL && conn->connected && q_item->tcp_gen == conn->gen &&
+            SEQ_BEFORE(conn->acked, q_item->tcp_end)){
+        /* lwip still refers to it */
+        list_add(&conn->done, q_item);
+        return;
+    }
+    pbuf_free(q_item->pbuf);
+    free(q_item);
+}
+
+static void
+free_done(struct rpc_tcp *conn, int all)
+{
+    struct rpc_queue *q_item, *next;
+    for(q_item = conn->done; q_item != NULL; q_item = next){
+        next = q_item->next;
+        if(all || !SEQ_BEFORE(conn->acked, q_item->tcp_end)){
+            list_del(q_item);
+            pbuf_free(q_item->pbuf);
+            free(q_item);
+        }
+    }
+}
+
+static void
+tcp_queue(struct rpc_queue *q_item)
+{
+    struct rpc_tcp *conn = q_item->tcp;
+    q_item->where = Q_BACKLOG;
+    fifo_put(&conn->backlog_tail, q_item);
+    if(conn->tpcb == NULL){
+        if(!TIME_BEFORE(now_ms(), conn->retry_at)){
+            tcp_start(conn);
+        }
+    }else{
+        tcp_push_backlog(conn);
+    }
+}
+
+static void
+tcp_unqueue(struct rpc_queue *q_item)
+{
+    fifo_del(&q_item->tcp->backlog, &q_item->tcp->backlog_tail, q_item);
+}
+
+/* The connection is gone, lwip has freed it and let go of our data */
+static void
+tcp_lost(struct rpc_tcp *conn)
+{
+    int i;
+    debug("rpc: lost the TCP connection to port %d\n", conn->port);
+    conn->tpcb = NULL;
+    conn->connected = 0;
+    conn->gen++;
+    free_done(conn, 1);
+    if(conn->record != NULL){
+        pbuf_free(conn->record);
+        conn->record = NULL;
+    }
+    conn->mark_len = 0;
+    conn->frag_left = 0;
+
+    /* Whatever was not answered goes again */
+    for(i = 0; i < XID_BUCKETS; i++){
+        struct rpc_queue *q_item;
+        for(q_item = xid_hash[i]; q_item != NULL; q_item = q_item->hnext){
+            if(q_item->tcp == conn && q_item->where == Q_WHEEL){
+                list_del(q_item);
+                q_item->where = Q_BACKLOG;
+                fifo_put(&conn->backlog_tail, q_item);
+            }
+        }
+    }
+
+    conn->retry_at = now_ms() + conn->backoff;
+    conn->backoff *= 2;
+    if(conn->backoff > TCP_BACKOFF_MAX_MS){
+        conn->backoff = TCP_BACKOFF_MAX_MS;
+    }
+}
+
+/* Drop the connection, we connect again later */
+static void
+tcp_reset(struct rpc_tcp *conn)
+{
+    struct tcp_pcb *tpcb = conn->tpcb;
+    if(tpcb != NULL){
+        tcp_arg(tpcb, NULL);
+        tcp_recv(tpcb, NULL);
+        tcp_sent(tpcb, NULL);
+        tcp_err(tpcb, NULL);
+        tcp_abort(tpcb);
+    }
+    tcp_lost(conn);
+}
+
+/* Segments a write may take, lwip adds a pbuf of its own for each */
+static int
+tcp_segs(int len)
+{
+    return 2 * (len / TCP_MSS + 2);
+}
+
+/* Write as many calls as there's room for */
+static void
+tcp_push_backlog(struct rpc_tcp *conn)
+{
+    struct tcp_pcb *tpcb = conn->tpcb;
+    int pushed = 0;
+    if(!conn->connected){
+        return;
+    }
+    while(conn->backlog != NULL){
+        struct rpc_queue *q_item = conn->backlog;
+        struct pbuf *q;
+        int segs = tcp_segs(sizeof(q_item->mark));
+        err_t err;
+        for(q = q_item->pbuf; q != NULL; q = q->next){
+            segs += tcp_segs(q->len);
+        }
+        /* Check first, then a failed write is a broken connection */
+        if(tcp_sndbuf(tpcb) < sizeof(q_item->mark) + q_item->pbuf->tot_len ||
+                tcp_sndqueuelen(tpcb) + segs > TCP_SND_QUEUELEN){
+            break;
+        }
+        fifo_get(&conn->backlog, &conn->backlog_tail);
+
+        q_item->mark = htonl(RECORD_LAST | q_item->pbuf->tot_len);
+        err = tcp_write(tpcb, &q_item->mark, sizeof(q_item->mark),
+                        TCP_WRITE_FLAG_MORE);
+        for(q = q_item->pbuf; q != NULL && err == ERR_OK; q = q->next){
+            if(q->len > 0){
+                err = tcp_write(tpcb, q->payload, q->len,
+                                (q->next != NULL)? TCP_WRITE_FLAG_MORE : 0);
+            }
+        }
+        conn->written += sizeof(q_item->mark) + q_item->pbuf->tot_len;
+        q_item->tcp_end = conn->written;
+        q_item->tcp_gen = conn->gen;
+        q_item->sent = now_ms();
+        q_item->expires = q_item->sent + TCP_RESEND_MS;
+        wheel_add(q_item);
+        if(err != ERR_OK){
+            debug("rpc: TCP write failed (%d)\n", err);
+            /* Part of the record may be out, start over */
+            tcp_reset(conn);
+            return;
+        }
+        pushed = 1;
+    }
+    if(pushed){
+        tcp_output(tpcb);
+    }
+}
+
+static err_t
+tcp_connected_cb(void *arg, struct tcp_pcb *tpcb, err_t err)
+{
+    struct rpc_tcp *conn = (struct rpc_tcp*)arg;
+    (void)err;
+    debug("rpc: TCP connected to port %d\n", conn->port);
+    conn->connected = 1;
+    conn->written = 0;
+    conn->acked = 0;
+    conn->backoff = TCP_BACKOFF_MIN_MS;
+    tcp_push_backlog(conn);
+    return (conn->tpcb == tpcb)? ERR_OK : ERR_ABRT;
+}
+
+static err_t
+tcp_sent_cb(void *arg, struct tcp_pcb *tpcb, u16_t len)
+{
+    struct rpc_tcp *conn = (struct rpc_tcp*)arg;
+    conn->acked += len;
+    free_done(conn, 0);
+    tcp_push_backlog(conn);
+    return (conn->tpcb == tpcb)? ERR_OK : ERR_ABRT;
+}
+
+static void
+tcp_err_cb(void *arg, err_t err)
+{
+    struct rpc_tcp *conn = (struct rpc_tcp*)arg;
+    (void)err;
+    debug("rpc: TCP error %d\n", err);
+    if(conn != NULL){
+        tcp_lost(conn);
+    }
+}
+
+/* Start a fragment, the record grows if it has more than one */
+static int
+tcp_record_frag(struct rpc_tcp *conn)
+{
+    uint32_t mark;
+    int len;
+    memcpy(&mark, conn->mark, sizeof(mark));
+    mark = ntohl(mark);
+    conn->mark_len = 0;
+    conn->last_frag = (mark & RECORD_LAST) != 0;
+    conn->frag_left = mark & ~RECORD_LAST;
+    len = conn->record_pos + conn->frag_left;
+    if(len > RECORD_MAX){
+        debug("rpc: TCP record too big (%d)\n", len);
+        return -1;
+    }
+    if(conn->record == NULL || conn->record->len < len){
+        struct pbuf *record = pbuf_alloc(PBUF_RAW, len, PBUF_RAM);
+        if(record == NULL){
+            return -1;
+        }
+        if(conn->record != NULL){
+            memcpy(record->payload, conn->record->payload, conn->record_pos);
+            pbuf_free(conn->record);
+        }
+        conn->record = record;
+    }
+    return 0;
+}
+
+static err_t
+tcp_recv_cb(void *arg, struct tcp_pcb *tpcb, struct pbuf *p, err_t err)
+{
+    struct rpc_tcp *conn = (struct rpc_tcp*)arg;
+    int pos = 0;
+    (void)err;
+    if(p == NULL){
+        /* The server closed it */
+        tcp_reset(conn);
+        return ERR_ABRT;
+    }
+    tcp_recved(tpcb, p->tot_len);
+
+    while(pos < p->tot_len){
+        int n;
+        if(conn->mark_len < sizeof(conn->mark)){
+            n = sizeof(conn->mark) - conn->mark_len;
+            n = pbuf_copy_partial(p, conn->mark + conn->mark_len, n, pos);
+            conn->mark_len += n;
+            pos += n;
+            if(conn->mark_len < sizeof(conn->mark)){
+                continue;
+            }
+            if(tcp_record_frag(conn)){
+                pbuf_free(p);
+                tcp_reset(conn);
+                return ERR_ABRT;
+            }
+        }
+        n = p->tot_len - pos;
+        if(n > conn->frag_left){
+            n = conn->frag_left;
+        }
+        pbuf_copy_partial(p, (uint8_t*)conn->record->payload + conn->record_pos,
+                          n, pos);
+        conn->record_pos += n;
+        conn->frag_left -= n;
+        pos += n;
+        if(conn->frag_left > 0){
+            continue;
+        }
+        if(!conn->last_frag){
+            /* Next fragment */
+            conn->mark_len = 0;
+            continue;
+        }
+        /* A whole reply */
+        {
+            struct pbuf *record = conn->record;
+            pbuf_realloc(record, conn->record_pos);
+            conn->record = NULL;
+            conn->record_pos = 0;
+            conn->mark_len = 0;
+            if(record->tot_len >= sizeof(xid_t)){
+                handle_reply(record);
+            }
+            pbuf_free(record);
+        }
+        if(conn->tpcb != tpcb){
+            /* Reset while handling the reply */
+            pbuf_free(p);
+            return ERR_ABRT;
+        }
+    }
+    pbuf_free(p);
+    return ERR_OK;
+}
+
+/* Connect, on a privileged port like the udp pcbs */
+static void
+tcp_start(struct rpc_tcp *conn)
+{
+    struct tcp_pcb *tpcb;
+    err_t err = ERR_USE;
+    int i;
+
+    tpcb = tcp_new();
+    if(tpcb == NULL){
+        tcp_lost(conn);
+        return;
+    }
+    conn->tpcb = tpcb;
+    tcp_arg(tpcb, conn);
+    tcp_err(tpcb, tcp_err_cb);
+    tcp_recv(tpcb, tcp_recv_cb);
+    tcp_sent(tpcb, tcp_sent_cb);
+    /* Calls are written whole, don't hold them back */
+    tcp_nagle_disable(tpcb);
+    /* Ports in TIME_WAIT can't be had */
+    for(i = 0; i < ROOT_PORT_MAX - ROOT_PORT_MIN && err == ERR_USE; i++){
+        err = tcp_bind(tpcb, IP_ADDR_ANY, next_root_port());
+    }
+    if(err == ERR_OK){
+        err = tcp_connect(tpcb, &conn->server, conn->port, tcp_connected_cb);
+    }
+    if(err != ERR_OK){
+        debug("rpc: TCP connect failed (%d)\n", err);
+        /* Not connecting, lwip only frees it with a close */
+        tcp_arg(tpcb, NULL);
+        tcp_err(tpcb, NULL);
+        tcp_close(tpcb);
+        tcp_lost(conn);
+    }
+}
+
+/* Run the lwip timers and connect again when it's time */
+static void
+tcp_timeout(uint32_t now)
+{
+    int i, used = 0;
+    for(i = 0; i < MAX_TCP_CONNS; i++){
+        struct rpc_tcp *conn = &tcp_conns[i];
+        if(conn->pcb == NULL){
+            continue;
+        }
+        used = 1;
+        if(conn->tpcb == NULL && conn->backlog != NULL &&
+                !TIME_BEFORE(now, conn->retry_at)){
+            tcp_start(conn);
+        }
+    }
+    if(used && !TIME_BEFORE(now, tcp_tmr_at)){
+        tcp_tmr();
+        tcp_tmr_at = now + TCP_TMR_INTERVAL;
+    }
+}
+
+int
+rpc_use_tcp(struct udp_pcb *pcb, int port)
+{
+    struct rpc_tcp *conn;
+    if(tcp_find(pcb) != NULL){
+        return 0;
+    }
+    conn = tcp_find(NULL);
+    if(conn == NULL){
+        return -1;
+    }
+    memset(conn, 0, sizeof(*conn));
+    conn->pcb = pcb;
+    conn->server = pcb->remote_ip;
+    conn->port = port;
+    conn->backoff = TCP_BACKOFF_MIN_MS;
+    conn->retry_at = now_ms();
+    conn->backlog_tail = &conn->backlog;
+    return 0;
+}
+
+int
+rpc_is_tcp(struct udp_pcb *pcb)
+{
+    return pcb != NULL && tcp_find(pcb) != NULL;
+}
+
 /**********************************
  *** RPC transport
  **********************************/
 
+/* A reply came in, over either transport. The caller frees it */
 static void
-my_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
-    struct ip_addr *addr, u16_t port)
+handle_reply(struct pbuf *p)
 {
     xid_t xid;
     struct rpc_queue *q_item;
-    (void)port;
 
     xid = extract_xid(p);
 
@@ -279,11 +1034,23 @@ my_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
     debug("Recieved a reply for xid: %u (%d) %p\n", xid, p->len, q_item);
     if (q_item != NULL){
         assert(q_item->func);
+        if(q_item->retries == 0 && q_item->tcp == NULL){
+            rtt_sample(q_item->rtt, (int)(now_ms() - q_item->sent));
+        }
         q_item->func(q_item->callback, q_item->arg, p);
         /* Clean up the queue item */
-        pbuf_free(q_item->pbuf);
-        free(q_item);
+        release(q_item);
+        /* There's room for one more */
+        send_waiting();
     }
+}
+
+static void
+my_recv(void *arg, struct udp_pcb *upcb, struct pbuf *p,
+    struct ip_addr *addr, u16_t port)
+{
+    (void)port;
+    handle_reply(p);
     /* Done with the incoming packet so free it */
     pbuf_free(p);
 }
@@ -296,9 +1063,10 @@ rpc_send(struct pbuf *pbuf, int len, struct udp_pcb *pcb,
 {
     assert(pcb);
     pbuf_realloc(pbuf, len);
-    /* Add to a queue */
+    /* Add to a queue, from there it is sent (again) until a reply comes so
+     * a failed send is not an error for the caller */
     add_to_queue(pbuf, pcb, func, callback, token);
-    return my_udp_send(pcb, pbuf);
+    return RPC_OK;
 }
 
 struct rpc_call_arg {
@@ -352,7 +1120,7 @@ rpc_call(struct pbuf *pbuf, int len, struct udp_pcb *pcb,
     }
 
     /* Wait for the response */
-    time_out = RETRANSMIT_DELAY_MS * (CALL_RETRIES + 1);
+    time_out = RTO_INIT_MS * (CALL_RETRIES + 1);
     while(time_out >= 0){
         _usleep(CALL_TIMEOUT_MS * 1000);
         if(call_arg.complete) {
@@ -367,8 +1135,8 @@ rpc_call(struct pbuf *pbuf, int len, struct udp_pcb *pcb,
      * we remove references from the queue */
     q_item = get_from_queue(xid);
     assert(q_item);
-    pbuf_free(q_item->pbuf);
-    free(q_item);
+    release(q_item);
+    send_waiting();
     return RPCERR_COMM;
 }
 
@@ -391,17 +1159,12 @@ rpc_new_udp(const struct ip_addr *server, int remote_port,
             enum port_type local_port)
 {
     struct udp_pcb* ret;
-    static int root_port = -1;
     struct ip_addr s = *server;
     ret = udp_new();
     assert(ret);
     udp_recv(ret, my_recv, NULL);
     if(local_port == PORT_ROOT){
-        if(root_port >= ROOT_PORT_MAX || root_port < ROOT_PORT_MIN){
-            root_port = ROOT_PORT_MIN;
-            debug("Recycling ports\n");
-        }
-        udp_bind(ret, IP_ADDR_ANY, root_port++);
+        udp_bind(ret, IP_ADDR_ANY, next_root_port());
     }else{
         /* let lwip decide for itself */
     }
@@ -71,9 +71,25 @@ int init_rpc(const struct ip_addr *server);
  * @return On success; return a reference to the newly created udp pcb
  *         Otherwise; NULL.
  */
-struct udp_pcb* rpc_new_udp(const struct ip_addr* server, int remote_port, 
+struct udp_pcb* rpc_new_udp(const struct ip_addr* server, int remote_port,
                             enum port_type local_port);
 
+/**
+ * Send the calls made on a pcb over TCP from now on, with record marking.
+ * The pcb stays the handle for rpc_send and rpc_call. The connection is made
+ * when it is first needed and made again if it breaks, calls that were not
+ * answered are then sent again.
+ * @param[in] pcb  A pcb from rpc_new_udp
+ * @param[in] port The TCP port of the server
+ * @return         0 on success, -1 if there are too many connections
+ */
+int rpc_use_tcp(struct udp_pcb *pcb, int port);
+
+/**
+ * @return 1 if the calls on the pcb go over TCP, otherwise 0
+ */
+int rpc_is_tcp(struct udp_pcb *pcb);
+
 /**
  * Allocates a pbuf and writes the rpc header 
  * @param[in] prog The program number
@@ -138,4 +154,10 @@ enum rpc_stat rpc_call(struct pbuf *pbuf, int len, struct udp_pcb *pcb,
  */
 void rpc_timeout(int ms);
 
+/**
+ * Use a clock to time the calls instead of the time given to rpc_timeout
+ * @param now_us  Returns the time in microseconds
+ */
+void rpc_set_clock(uint64_t (*now_us)(void));
+
 #endif /* __RPC_H */
@@ -87,6 +87,16 @@ int sos_sys_write(fildes_t file, const char *buf, size_t nbyte);
 /* Write to an open file, from "buf", max "nbyte" bytes.
  * Returns the number of bytes written. <nbyte disk is full.
  * Returns -1 on error (invalid file).
+ *
+ * sos_sys_read and sos_sys_write go through the I/O buffer sos shares with
+ * the process when "buf" is inside it, and small writes are copied into it.
+ * Anything else is handed to sos where it is, in one call.
+ */
+
+void *sos_io_buf(size_t *size);
+/* Returns the I/O buffer sos shares with the process and its size through
+ * "size", or NULL if there is none. Reading into or writing from it saves
+ * sos a copy.
  */
 
 size_t sos_write(void *vData, size_t count);
@@ -111,6 +121,12 @@ pid_t sos_process_create(const char *path);
  * file).
  */
 
+pid_t sos_process_clone(void);
+/* Create a copy of the calling process, sharing its memory copy on write
+ * and its open files. Both return from this call: the caller gets the ID of
+ * the new process, the new process gets 0. Returns -1 if error.
+ */
+
 int sos_process_delete(pid_t pid);
 /* Delete process (and close all its file descriptors).
  * Returns 0 if successful, -1 otherwise (invalid process).
@@ -137,6 +153,101 @@ void sos_sys_usleep(int msec);
 /* Sleeps for the specified number of milliseconds.
  */
 
+/* Virtual memory statistics */
+
+typedef struct {
+  unsigned nfree;           /* free frames */
+  unsigned low_watermark;   /* the page cleaner starts evicting below this */
+  unsigned high_watermark;  /* and stops again here */
+  unsigned alloc_hits;      /* frame allocations served from free frames */
+  unsigned alloc_misses;    /* frame allocations that had to evict first */
+  unsigned cleaned;         /* frames evicted by the page cleaner */
+  unsigned inflight;        /* evictions the page cleaner is waiting on */
+  unsigned ncow;            /* frames shared copy on write */
+} sos_vm_stat_t;
+
+int sos_vm_stat(sos_vm_stat_t *stat);
+/* Returns the frame table statistics through "stat".
+ * Returns 0 if successful, -1 otherwise.
+ */
+
+void sos_slab_stat(void);
+/* Prints the statistics of sos's slab caches on the sos console.
+ */
+
+/* Syscall ring */
+
+/* Operations. "res" in the completion is negative errno on failure */
+#define SOS_RING_NOP        0   /* res 0 */
+#define SOS_RING_READ       1   /* read "len" bytes of "fd" into "addr", res bytes read */
+#define SOS_RING_WRITE      2   /* write "len" bytes of "addr" to "fd", res bytes written */
+#define SOS_RING_SLEEP      3   /* sleep "len" milliseconds, res 0 */
+#define SOS_RING_TIMESTAMP  4   /* res 0, "value" is sos_sys_time_stamp() */
+#define SOS_RING_WAIT       5   /* sos_process_wait("fd"), res the pid */
+
+/* Submission flags */
+#define SOS_RING_LINK       (1 << 0)    /* start the next entry when this one
+                                           is done, if it got all it asked for.
+                                           Otherwise the rest of the chain
+                                           completes with -ECANCELED */
+
+#define SOS_RING_SQ_ENTRIES 64
+#define SOS_RING_CQ_ENTRIES 128
+
+typedef struct {
+  uint8_t   op;
+  uint8_t   flags;
+  uint16_t  pad;
+  int32_t   fd;
+  uint32_t  addr;
+  uint32_t  len;
+  uint32_t  user_data;  /* handed back in the completion */
+} sos_sqe_t;
+
+typedef struct {
+  uint32_t  user_data;
+  int32_t   res;
+  uint64_t  value;
+} sos_cqe_t;
+
+/* One page mapped in both sos and the process. The process only moves
+ * sq_tail and cq_head, sos only sq_head and cq_tail */
+typedef struct {
+  volatile uint32_t sq_head;
+  volatile uint32_t sq_tail;
+  volatile uint32_t cq_head;
+  volatile uint32_t cq_tail;
+  volatile uint32_t cq_overflow;    /* completions dropped, the queue was full */
+  sos_sqe_t sq[SOS_RING_SQ_ENTRIES];
+  sos_cqe_t cq[SOS_RING_CQ_ENTRIES];
+} sos_ring_t;
+
+int sos_ring_setup(void);
+/* Set up the syscall ring of the process, nothing happens if it is there
+ * already. Returns 0 if successful, -1 otherwise.
+ * A clone starts with an empty ring of its own.
+ */
+
+sos_sqe_t *sos_ring_get_sqe(void);
+/* Returns a cleared submission entry to fill in, NULL if the ring is full.
+ * It goes to sos with the next sos_ring_submit.
+ */
+
+int sos_ring_submit(void);
+/* Hand all entries filled in since the last call to sos with one syscall.
+ * Returns how many sos took, -1 on error. sos doesn't take more than the
+ * completion queue has room for, the rest stays for the next call.
+ */
+
+int sos_ring_peek_cqe(sos_cqe_t *cqe);
+/* Take the oldest completion into "cqe". Returns 0 if there was one, -1 if
+ * there wasn't.
+ */
+
+int sos_ring_wait_cqe(sos_cqe_t *cqe);
+/* As sos_ring_peek_cqe, but blocks until there is a completion.
+ * sos notifies the process through an async endpoint.
+ */
 
 /*************************************************************************/
 /*                                   */
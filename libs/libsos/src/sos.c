@@ -19,6 +19,7 @@
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define FAIL_TOLERANCE  10
+#define IO_BUF_SMALL    0x1000  // writes up to this are copied into the I/O buffer
 
 #define SOS_SYSCALL_PRINT              0
 #define SOS_SYSCALL_SYSBRK             1
@@ -35,6 +36,18 @@
 #define SOS_SYSCALL_PROC_GET_ID       12
 #define SOS_SYSCALL_PROC_WAIT         13
 #define SOS_SYSCALL_PROC_STATUS       14
+#define SOS_SYSCALL_PROC_CLONE        15
+#define SOS_SYSCALL_IO_BUFFER         16
+#define SOS_SYSCALL_READ_BUF          17
+#define SOS_SYSCALL_WRITE_BUF         18
+#define SOS_SYSCALL_RING_SETUP        19
+#define SOS_SYSCALL_RING_ENTER        20
+#define SOS_SYSCALL_PRINT_BUF         21
+#define SOS_SYSCALL_VM_STAT           22
+#define SOS_SYSCALL_SLAB_STAT         23
+
+/* Bytes in one print syscall, four to a message register */
+#define SOS_PRINT_MAX           ((seL4_MsgMaxLength - 2) * sizeof(seL4_Word))
 
 #define MAXNAMLEN               255
 fildes_t sos_sys_open(const char *path, int flags) {
@@ -73,10 +86,80 @@ int sos_sys_close(fildes_t fd) {
     if(err) return -1;
     return 0;
 }
+/*
+ * The I/O buffer sos shares with us. Reads and writes go through it so
+ * that sos doesn't have to copy them in and out of our pages, the calls
+ * only carry an offset into it
+ */
+static char *_io_buf;
+static size_t _io_buf_size;
+static int _io_buf_state;       // 0 not asked for yet, 1 there, -1 not available
+
+static int _io_buf_get(void) {
+    if (_io_buf_state == 0) {
+        seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 1);
+        seL4_SetTag(tag);
+        seL4_SetMR(0, SOS_SYSCALL_IO_BUFFER);
+
+        seL4_MessageInfo_t message = seL4_Call(SOS_IPC_EP_CAP, tag);
+        int err = seL4_MessageInfo_get_label(message);
+        if (!err && seL4_GetMR(1) > 0) {
+            _io_buf      = (char*)seL4_GetMR(0);
+            _io_buf_size = (size_t)seL4_GetMR(1);
+            _io_buf_state = 1;
+        } else {
+            _io_buf_state = -1;
+        }
+    }
+    return _io_buf_state > 0;
+}
+
+/* Read or write through the I/O buffer, returns -1 on error like the rest */
+static int _io_buf_call(int syscall, fildes_t file, size_t offset, size_t nbyte) {
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 4);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, syscall);
+    seL4_SetMR(1, (seL4_Word)file);
+    seL4_SetMR(2, (seL4_Word)offset);
+    seL4_SetMR(3, (seL4_Word)nbyte);
+
+    seL4_MessageInfo_t message = seL4_Call(SOS_IPC_EP_CAP, tag);
+    int err = seL4_MessageInfo_get_label(message);
+    if (err) {
+        return -1;
+    }
+    return seL4_GetMR(0);
+}
+
+/* Is [buf, buf + nbyte) inside the I/O buffer? */
+static int _io_buf_holds(const char *buf, size_t nbyte) {
+    return _io_buf_get() && buf >= _io_buf &&
+           (size_t)(buf - _io_buf) <= _io_buf_size &&
+           nbyte <= _io_buf_size - (size_t)(buf - _io_buf);
+}
+
+void *sos_io_buf(size_t *size) {
+    if (!_io_buf_get()) {
+        return NULL;
+    }
+    if (size != NULL) {
+        *size = _io_buf_size;
+    }
+    return _io_buf;
+}
+
 int sos_sys_read(fildes_t file, char *buf, size_t nbyte) {
     int err;
     seL4_MessageInfo_t tag, message;
 
+    /*
+     * Going through the buffer only saves anything when the data is wanted
+     * there, otherwise sos may as well copy it out to buf itself
+     */
+    if (_io_buf_holds(buf, nbyte)) {
+        return _io_buf_call(SOS_SYSCALL_READ_BUF, file, buf - _io_buf, nbyte);
+    }
+
     tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 4);
     seL4_SetTag(tag);
     seL4_SetMR(0, SOS_SYSCALL_READ);
@@ -99,6 +182,18 @@ int sos_sys_write(fildes_t file, const char *buf, size_t nbyte) {
     int err;
     seL4_MessageInfo_t tag, message;
 
+    if (_io_buf_holds(buf, nbyte)) {
+        return _io_buf_call(SOS_SYSCALL_WRITE_BUF, file, buf - _io_buf, nbyte);
+    }
+    /*
+     * A small write is cheaper to copy into the buffer here than to have
+     * sos copy it in, anything bigger goes in one call from where it is
+     */
+    if (_io_buf_get() && nbyte <= min(IO_BUF_SMALL, _io_buf_size)) {
+        memcpy(_io_buf, buf, nbyte);
+        return _io_buf_call(SOS_SYSCALL_WRITE_BUF, file, 0, nbyte);
+    }
+
     tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 4);
     seL4_SetTag(tag);
     seL4_SetMR(0, SOS_SYSCALL_WRITE);
@@ -116,32 +211,152 @@ int sos_sys_write(fildes_t file, const char *buf, size_t nbyte) {
     return len;
 }
 
+/*
+ * The syscall ring. Only the indices in the ring page say where we are, a
+ * clone starts with a fresh page and takes up from there
+ */
+#define RING_BARRIER()  asm volatile("" ::: "memory")
+
+static sos_ring_t *_ring;
+static seL4_CPtr _ring_aep;
+static uint32_t _ring_unsubmitted;  // entries handed out since the last submit
+
+int sos_ring_setup(void) {
+    if (_ring != NULL) {
+        return 0;
+    }
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 1);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, SOS_SYSCALL_RING_SETUP);
+
+    seL4_MessageInfo_t message = seL4_Call(SOS_IPC_EP_CAP, tag);
+    int err = seL4_MessageInfo_get_label(message);
+    if (err) {
+        return -1;
+    }
+    _ring     = (sos_ring_t*)seL4_GetMR(0);
+    _ring_aep = (seL4_CPtr)seL4_GetMR(1);
+    _ring_unsubmitted = 0;
+    return 0;
+}
+
+sos_sqe_t *sos_ring_get_sqe(void) {
+    if (_ring == NULL) {
+        return NULL;
+    }
+    uint32_t tail = _ring->sq_tail + _ring_unsubmitted;
+    if (tail - _ring->sq_head >= SOS_RING_SQ_ENTRIES) {
+        return NULL;
+    }
+    sos_sqe_t *sqe = &_ring->sq[tail % SOS_RING_SQ_ENTRIES];
+    memset(sqe, 0, sizeof(sos_sqe_t));
+    _ring_unsubmitted++;
+    return sqe;
+}
+
+int sos_ring_submit(void) {
+    if (_ring == NULL) {
+        return -1;
+    }
+    RING_BARRIER();
+    _ring->sq_tail += _ring_unsubmitted;
+    _ring_unsubmitted = 0;
+
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 1);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, SOS_SYSCALL_RING_ENTER);
+
+    seL4_MessageInfo_t message = seL4_Call(SOS_IPC_EP_CAP, tag);
+    int err = seL4_MessageInfo_get_label(message);
+    if (err) {
+        return -1;
+    }
+    return seL4_GetMR(0);
+}
+
+int sos_ring_peek_cqe(sos_cqe_t *cqe) {
+    if (_ring == NULL) {
+        return -1;
+    }
+    uint32_t head = _ring->cq_head;
+    if (head == _ring->cq_tail) {
+        return -1;
+    }
+    RING_BARRIER();
+    *cqe = _ring->cq[head % SOS_RING_CQ_ENTRIES];
+    RING_BARRIER();
+    _ring->cq_head = head + 1;
+    return 0;
+}
+
+int sos_ring_wait_cqe(sos_cqe_t *cqe) {
+    if (_ring == NULL) {
+        return -1;
+    }
+    /* A notification sent before we wait is kept by the endpoint */
+    while (sos_ring_peek_cqe(cqe) != 0) {
+        seL4_Wait(_ring_aep, NULL);
+    }
+    return 0;
+}
+
+static int _print_packed(const char *data, size_t len) {
+    size_t nwords = (len + sizeof(seL4_Word) - 1) / sizeof(seL4_Word);
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 2 + nwords);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, SOS_SYSCALL_PRINT);
+    seL4_SetMR(1, len);
+    for (size_t i = 0; i < nwords; i++) {
+        seL4_Word word = 0;
+        memcpy(&word, data + i * sizeof(seL4_Word),
+               min(sizeof(seL4_Word), len - i * sizeof(seL4_Word)));
+        seL4_SetMR(i + 2, word);
+    }
+
+    seL4_MessageInfo_t message = seL4_Call(SOS_IPC_EP_CAP, tag);
+    if (seL4_MessageInfo_get_label(message)) {
+        return -1;
+    }
+    return seL4_GetMR(0);
+}
+
+static int _print_buf(const char *data, size_t len) {
+    memcpy(_io_buf, data, len);
+
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 3);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, SOS_SYSCALL_PRINT_BUF);
+    seL4_SetMR(1, 0);
+    seL4_SetMR(2, len);
+
+    seL4_MessageInfo_t message = seL4_Call(SOS_IPC_EP_CAP, tag);
+    if (seL4_MessageInfo_get_label(message)) {
+        return -1;
+    }
+    return seL4_GetMR(0);
+}
+
 size_t sos_write(void *vData, size_t count) {
     const char *realdata = vData;
-    int tot_sent = 0;
+    size_t tot_sent = 0;
 
     /*
-     * We break the data into messages of size maximum seL4_MsgMaxLength-1
-     * The first slot is used to indicate syscall number
+     * What fits goes packed in the message registers, anything bigger goes
+     * through the I/O buffer a buffer's worth at a time
      */
     int tries = 0;
-    int expected_sending = count / (seL4_MsgMaxLength-1) + 1;
+    int expected_sending = count / SOS_PRINT_MAX + 1;
     while (tot_sent < count && tries < expected_sending*FAIL_TOLERANCE) {
-        int len = min(count - tot_sent, seL4_MsgMaxLength-1);
-        seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 1+len);
-        seL4_SetTag(tag);
-        seL4_SetMR(0, SOS_SYSCALL_PRINT);
-
-        for (int i=0; i<len; i++) {
-            seL4_SetMR(i+1, realdata[i+tot_sent]);
+        size_t left = count - tot_sent;
+        int sent;
+        if (left > SOS_PRINT_MAX && _io_buf_get()) {
+            sent = _print_buf(realdata + tot_sent, min(left, _io_buf_size));
+        } else {
+            sent = _print_packed(realdata + tot_sent, min(left, SOS_PRINT_MAX));
         }
-        seL4_MessageInfo_t message = seL4_Call(SOS_IPC_EP_CAP, tag);
-        int err = (int)seL4_MessageInfo_get_label(message);
-        if (err) {
+        if (sent < 0) {
             break;
         }
-        int sent = (int)seL4_GetMR(0);
-        if (sent < len) { /* some error handling? */ }
         tot_sent += sent;
         tries++;
     }
@@ -186,6 +401,39 @@ int64_t sos_sys_time_stamp(void) {
     return timestamp;
 }
 
+int sos_vm_stat(sos_vm_stat_t *stat) {
+    seL4_MessageInfo_t send_tag, receive_tag;
+    int err;
+
+    send_tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 1);
+    seL4_SetTag(send_tag);
+    seL4_SetMR(0, SOS_SYSCALL_VM_STAT);
+
+    receive_tag = seL4_Call(SOS_IPC_EP_CAP, send_tag);
+    err = (int)seL4_MessageInfo_get_label(receive_tag);
+
+    stat->nfree          = seL4_GetMR(0);
+    stat->low_watermark  = seL4_GetMR(1);
+    stat->high_watermark = seL4_GetMR(2);
+    stat->alloc_hits     = seL4_GetMR(3);
+    stat->alloc_misses   = seL4_GetMR(4);
+    stat->cleaned        = seL4_GetMR(5);
+    stat->inflight       = seL4_GetMR(6);
+    stat->ncow           = seL4_GetMR(7);
+
+    return err ? -1 : 0;
+}
+
+void sos_slab_stat(void) {
+    seL4_MessageInfo_t send_tag;
+
+    send_tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 1);
+    seL4_SetTag(send_tag);
+    seL4_SetMR(0, SOS_SYSCALL_SLAB_STAT);
+
+    seL4_Call(SOS_IPC_EP_CAP, send_tag);
+}
+
 int sos_getdirent(int pos, char *name, size_t nbyte) {
     int err;
     seL4_MessageInfo_t tag, message;
@@ -256,6 +504,21 @@ pid_t sos_process_create(const char *path) {
     }
     return pid;
 }
+pid_t sos_process_clone(void) {
+    seL4_MessageInfo_t tag = seL4_MessageInfo_new(seL4_NoFault, 0, 0, 1);
+    seL4_SetTag(tag);
+    seL4_SetMR(0, SOS_SYSCALL_PROC_CLONE);
+
+    /* The clone comes back from this call too, sos makes it return 0 there */
+    seL4_MessageInfo_t message = seL4_Call(SOS_IPC_EP_CAP, tag);
+    int err = seL4_MessageInfo_get_label(message);
+    if(!err){
+        return seL4_GetMR(0);
+    } else {
+        return -1;
+    }
+}
+
 int sos_process_delete(pid_t pid) {
     //printf("sos_process_delete called\n");
 